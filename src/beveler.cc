@@ -27,9 +27,13 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <cassert>
+#include <vector>
+#include <algorithm>
 
 #include "common.h"
 #include "polygon.h"
+#include "beveler.h"
+#include "threads.h"
 
 namespace dangdal {
 
@@ -88,25 +92,331 @@ private:
 	const Mpoly *mp;
 };
 
-static inline double sgn(double v) {
-	return v<0 ? -1 : v>0 ? 1 : 0;
+// A touching vertex along with its lattice key, for putting touching pairs
+// next to each other.
+struct KeyedVertRef {
+	KeyedVertRef(uint64_t _key, VertRef _ref) : key(_key), ref(_ref) { }
+
+	bool operator<(const KeyedVertRef &other) const {
+		return key < other.key;
+	}
+
+	uint64_t key;
+	VertRef ref;
+};
+
+// Coordinates that are too big for this are handled by the slower sort-based
+// code.
+static const double MAX_LATTICE_COORD = 1 << 30;
+
+// Vertices are found by global index (counting across all rings) so that work
+// can be divided into equal-sized chunks.  This converts a global index to a
+// ring/vertex pair.
+static VertRef global_to_vertref(const std::vector<size_t> &ring_offsets, size_t global_idx) {
+	size_t ring_idx = std::upper_bound(ring_offsets.begin(), ring_offsets.end(),
+		global_idx) - ring_offsets.begin() - 1;
+	return VertRef(ring_idx, global_idx - ring_offsets[ring_idx]);
 }
 
-// This function is only meant to be called on polygons
-// that have orthogonal sides on an integer lattice.
-void bevel_self_intersections(Mpoly &mp, double amount) {
-	if(VERBOSE) {
-		printf("Beveling\n");
-	} else {
-		printf("Beveling: ");
-		GDALTermProgress(0, NULL, NULL);
+// Steps a VertRef to the next vertex, skipping empty rings.
+static inline void next_vertref(const Mpoly &mp, VertRef &ref) {
+	ref.vert_idx++;
+	while(ref.ring_idx < mp.rings.size() && ref.vert_idx == mp.rings[ref.ring_idx].pts.size()) {
+		ref.ring_idx++;
+		ref.vert_idx = 0;
 	}
+}
 
-	size_t total_pts = 0;
-	for(size_t i=0; i<mp.rings.size(); i++) {
-		total_pts += mp.rings[i].pts.size();
+// Rather than sorting the vertices themselves, which would mean chasing
+// VertRef's back into the rings for every comparison, each vertex is reduced
+// to a 64-bit key.  This works for vertices on the integer or half-integer
+// lattice (the tracer output, optionally smoothed).
+class LatticeKeys {
+public:
+	LatticeKeys() : min_x(0), min_y(0), span_y(0) { }
+
+	uint64_t key(const Vertex &v) const {
+		uint64_t xi = uint64_t(int64_t(v.x * 2) - min_x);
+		uint64_t yi = uint64_t(int64_t(v.y * 2) - min_y);
+		return xi * span_y + yi;
 	}
 
+	int64_t min_x, min_y;
+	uint64_t span_y;
+};
+
+static inline bool on_lattice(const Vertex &v) {
+	double x2 = v.x * 2;
+	double y2 = v.y * 2;
+	return
+		fabs(v.x) < MAX_LATTICE_COORD && fabs(v.y) < MAX_LATTICE_COORD &&
+		x2 == floor(x2) && y2 == floor(y2);
+}
+
+class LatticeBoundsTask : public ParallelTask {
+public:
+	LatticeBoundsTask(
+		const Mpoly &_mp, const std::vector<size_t> &_ring_offsets,
+		size_t _total_pts, size_t _num_jobs
+	) :
+		mp(_mp), ring_offsets(_ring_offsets),
+		total_pts(_total_pts), num_jobs(_num_jobs),
+		ok(_num_jobs, true), bboxes(_num_jobs)
+	{ }
+
+	virtual void run(size_t job_idx, size_t) {
+		size_t begin = total_pts * job_idx / num_jobs;
+		size_t end = total_pts * (job_idx+1) / num_jobs;
+		if(begin == end) return;
+		VertRef ref = global_to_vertref(ring_offsets, begin);
+		for(size_t i=begin; i<end; i++) {
+			const Vertex &v = ref.getVert(mp);
+			if(!on_lattice(v)) {
+				ok[job_idx] = false;
+				return;
+			}
+			bboxes[job_idx].expand(Vertex(v.x * 2, v.y * 2));
+			next_vertref(mp, ref);
+		}
+	}
+
+	const Mpoly &mp;
+	const std::vector<size_t> &ring_offsets;
+	const size_t total_pts;
+	const size_t num_jobs;
+	// one byte per job - vector<bool> would pack neighbouring jobs into one word
+	std::vector<uint8_t> ok;
+	std::vector<Bbox> bboxes;
+};
+
+class LatticeKeysTask : public ParallelTask {
+public:
+	LatticeKeysTask(
+		const Mpoly &_mp, const std::vector<size_t> &_ring_offsets,
+		size_t _total_pts, size_t _num_jobs,
+		const LatticeKeys &_lk, std::vector<uint64_t> &_keys
+	) :
+		mp(_mp), ring_offsets(_ring_offsets),
+		total_pts(_total_pts), num_jobs(_num_jobs),
+		lk(_lk), keys(_keys)
+	{ }
+
+	virtual void run(size_t job_idx, size_t) {
+		size_t begin = total_pts * job_idx / num_jobs;
+		size_t end = total_pts * (job_idx+1) / num_jobs;
+		if(begin == end) return;
+		VertRef ref = global_to_vertref(ring_offsets, begin);
+		for(size_t i=begin; i<end; i++) {
+			keys[i] = lk.key(ref.getVert(mp));
+			next_vertref(mp, ref);
+		}
+	}
+
+private:
+	const Mpoly &mp;
+	const std::vector<size_t> &ring_offsets;
+	const size_t total_pts;
+	const size_t num_jobs;
+	const LatticeKeys &lk;
+	std::vector<uint64_t> &keys;
+};
+
+// Collects the vertices whose keys are in the (sorted) list of duplicate keys.
+class FindDupsTask : public ParallelTask {
+public:
+	FindDupsTask(
+		const Mpoly &_mp, const std::vector<size_t> &_ring_offsets,
+		size_t _total_pts, size_t _num_jobs,
+		const LatticeKeys &_lk, const std::vector<uint64_t> &_dup_keys
+	) :
+		mp(_mp), ring_offsets(_ring_offsets),
+		total_pts(_total_pts), num_jobs(_num_jobs),
+		lk(_lk), dup_keys(_dup_keys), found(_num_jobs)
+	{ }
+
+	virtual void run(size_t job_idx, size_t) {
+		size_t begin = total_pts * job_idx / num_jobs;
+		size_t end = total_pts * (job_idx+1) / num_jobs;
+		if(begin == end) return;
+		VertRef ref = global_to_vertref(ring_offsets, begin);
+		for(size_t i=begin; i<end; i++) {
+			uint64_t key = lk.key(ref.getVert(mp));
+			if(std::binary_search(dup_keys.begin(), dup_keys.end(), key)) {
+				found[job_idx].push_back(KeyedVertRef(key, ref));
+			}
+			next_vertref(mp, ref);
+		}
+	}
+
+private:
+	const Mpoly &mp;
+	const std::vector<size_t> &ring_offsets;
+	const size_t total_pts;
+	const size_t num_jobs;
+	const LatticeKeys &lk;
+	const std::vector<uint64_t> &dup_keys;
+
+public:
+	std::vector<std::vector<KeyedVertRef> > found;
+};
+
+static const int RADIX_BITS = 16;
+static const size_t RADIX_SIZE = size_t(1) << RADIX_BITS;
+
+class RadixCountTask : public ParallelTask {
+public:
+	RadixCountTask(
+		const std::vector<uint64_t> &_src, int _shift, size_t _num_jobs,
+		std::vector<std::vector<size_t> > &_counts
+	) :
+		src(_src), shift(_shift), num_jobs(_num_jobs), counts(_counts)
+	{ }
+
+	virtual void run(size_t job_idx, size_t) {
+		size_t begin = src.size() * job_idx / num_jobs;
+		size_t end = src.size() * (job_idx+1) / num_jobs;
+		std::vector<size_t> &c = counts[job_idx];
+		std::fill(c.begin(), c.end(), 0);
+		for(size_t i=begin; i<end; i++) {
+			c[(src[i] >> shift) & (RADIX_SIZE-1)]++;
+		}
+	}
+
+private:
+	const std::vector<uint64_t> &src;
+	const int shift;
+	const size_t num_jobs;
+	std::vector<std::vector<size_t> > &counts;
+};
+
+class RadixScatterTask : public ParallelTask {
+public:
+	RadixScatterTask(
+		const std::vector<uint64_t> &_src, std::vector<uint64_t> &_dst,
+		int _shift, size_t _num_jobs,
+		std::vector<std::vector<size_t> > &_offsets
+	) :
+		src(_src), dst(_dst), shift(_shift), num_jobs(_num_jobs), offsets(_offsets)
+	{ }
+
+	virtual void run(size_t job_idx, size_t) {
+		size_t begin = src.size() * job_idx / num_jobs;
+		size_t end = src.size() * (job_idx+1) / num_jobs;
+		std::vector<size_t> &pos = offsets[job_idx];
+		for(size_t i=begin; i<end; i++) {
+			dst[pos[(src[i] >> shift) & (RADIX_SIZE-1)]++] = src[i];
+		}
+	}
+
+private:
+	const std::vector<uint64_t> &src;
+	std::vector<uint64_t> &dst;
+	const int shift;
+	const size_t num_jobs;
+	std::vector<std::vector<size_t> > &offsets;
+};
+
+// LSD radix sort, each pass split across threads.  Only as many passes as are
+// needed for max_key are done.
+static void radix_sort(std::vector<uint64_t> &keys, uint64_t max_key, size_t num_threads) {
+	if(keys.size() < RADIX_SIZE) {
+		std::sort(keys.begin(), keys.end());
+		return;
+	}
+
+	const size_t num_jobs = num_threads;
+	std::vector<uint64_t> tmp(keys.size());
+	std::vector<std::vector<size_t> > counts(num_jobs, std::vector<size_t>(RADIX_SIZE));
+	for(int shift=0; shift<64 && (max_key >> shift); shift+=RADIX_BITS) {
+		RadixCountTask count_task(keys, shift, num_jobs, counts);
+		run_parallel(count_task, num_jobs, num_threads);
+
+		// turn counts into starting offsets for each job and digit
+		size_t accum = 0;
+		for(size_t d=0; d<RADIX_SIZE; d++) {
+			for(size_t j=0; j<num_jobs; j++) {
+				size_t c = counts[j][d];
+				counts[j][d] = accum;
+				accum += c;
+			}
+		}
+
+		RadixScatterTask scatter_task(keys, tmp, shift, num_jobs, counts);
+		run_parallel(scatter_task, num_jobs, num_threads);
+		keys.swap(tmp);
+	}
+}
+
+// Finds touching vertices, for polygons on the half-integer lattice.  Returns
+// false if the polygon isn't on the lattice.
+static bool find_touches_lattice(
+	const Mpoly &mp, size_t total_pts, size_t num_threads,
+	std::vector<VertRef> &touches
+) {
+	std::vector<size_t> ring_offsets(mp.rings.size());
+	size_t accum = 0;
+	for(size_t r_idx=0; r_idx<mp.rings.size(); r_idx++) {
+		ring_offsets[r_idx] = accum;
+		accum += mp.rings[r_idx].pts.size();
+	}
+
+	// a few chunks per thread, for load balance
+	const size_t num_jobs = num_threads * 4;
+
+	LatticeBoundsTask bounds_task(mp, ring_offsets, total_pts, num_jobs);
+	run_parallel(bounds_task, num_jobs, num_threads);
+	Bbox bbox;
+	for(size_t j=0; j<num_jobs; j++) {
+		if(!bounds_task.ok[j]) return false;
+		if(!bounds_task.bboxes[j].empty) bbox.expand(bounds_task.bboxes[j]);
+	}
+
+	LatticeKeys lk;
+	lk.min_x = int64_t(bbox.min_x);
+	lk.min_y = int64_t(bbox.min_y);
+	lk.span_y = uint64_t(int64_t(bbox.max_y) - lk.min_y) + 1;
+	uint64_t max_key = lk.key(Vertex(bbox.max_x / 2.0, bbox.max_y / 2.0));
+
+	std::vector<uint64_t> keys(total_pts);
+	LatticeKeysTask keys_task(mp, ring_offsets, total_pts, num_jobs, lk, keys);
+	run_parallel(keys_task, num_jobs, num_threads);
+	GDALTermProgress(0.1, NULL, NULL);
+
+	radix_sort(keys, max_key, num_threads);
+	GDALTermProgress(0.7, NULL, NULL);
+
+	std::vector<uint64_t> dup_keys;
+	for(size_t i=0; i+1<total_pts; i++) {
+		if(keys[i] == keys[i+1]) {
+			if(dup_keys.size() && dup_keys.back() == keys[i]) {
+				fatal_error("should not have triple intersections in beveler");
+			}
+			dup_keys.push_back(keys[i]);
+		}
+	}
+	std::vector<uint64_t>().swap(keys); // free memory
+
+	if(dup_keys.empty()) return true;
+
+	FindDupsTask dups_task(mp, ring_offsets, total_pts, num_jobs, lk, dup_keys);
+	run_parallel(dups_task, num_jobs, num_threads);
+	std::vector<KeyedVertRef> dups;
+	for(size_t j=0; j<num_jobs; j++) {
+		dups.insert(dups.end(), dups_task.found[j].begin(), dups_task.found[j].end());
+	}
+	// The vertices were collected in ring/vertex order, so a stable sort
+	// puts each touching pair together with the same tiebreak as
+	// CoordsComparator.  The first of each pair gets shaved.
+	std::stable_sort(dups.begin(), dups.end());
+	for(size_t i=0; i<dups.size(); i+=2) {
+		touches.push_back(dups[i].ref);
+	}
+
+	return true;
+}
+
+// Finds touching vertices by sorting all vertices by their coordinates.
+static void find_touches_sorted(Mpoly &mp, size_t total_pts, std::vector<VertRef> &touches) {
 	if(VERBOSE) printf("allocating %zd megs for beveler\n",
 		(total_pts*sizeof(VertRef)) >> 20);
 	std::vector<VertRef> entries;
@@ -114,38 +424,18 @@ void bevel_self_intersections(Mpoly &mp, double amount) {
 	for(size_t r_idx=0; r_idx<mp.rings.size(); r_idx++) {
 		const Ring &ring = mp.rings[r_idx];
 		for(size_t v_idx=0; v_idx<ring.pts.size(); v_idx++) {
-			if(VERBOSE >= 2) {
-				printf("mp[%zd][%zd] = %g, %g\n", r_idx, v_idx,
-					ring.pts[v_idx].x, ring.pts[v_idx].y);
-			}
 			entries.push_back(VertRef(r_idx, v_idx));
 		}
 	}
 	assert(total_pts == entries.size());
 
-	if(VERBOSE) printf("finding self-intersections\n");
 	GDALTermProgress(0.1, NULL, NULL);
 	// sort by x,y
 	std::sort(entries.begin(), entries.end(), CoordsComparator(&mp));
-	GDALTermProgress(0.8, NULL, NULL);
+	GDALTermProgress(0.7, NULL, NULL);
 
-	if(VERBOSE >= 2) {
-		printf("\nbefore grep:\n");
-		for(size_t i=0; i<total_pts; i++) {
-			printf("entry[%zd] = %03zd, %03zd (%g, %g)\n", 
-				i, entries[i].ring_idx, entries[i].vert_idx,
-				entries[i].getVert(mp).x,
-				entries[i].getVert(mp).y
-				);
-		}
-	}
-
-	size_t total_num_touch = 0;
 	bool prev_was_same = 0;
-	for(size_t i=0; i<total_pts-1; i++) {
-		//printf("%lf %lf %zd %zd\n",
-		//	entries[i].x, entries[i].y,
-		//	entries[i].ring_idx, entries[i].vert_idx);
+	for(size_t i=0; i+1<total_pts; i++) {
 		const Vertex &va = entries[i  ].getVert(mp);
 		const Vertex &vb = entries[i+1].getVert(mp);
 		if(
@@ -155,13 +445,99 @@ void bevel_self_intersections(Mpoly &mp, double amount) {
 			if(prev_was_same) {
 				fatal_error("should not have triple intersections in beveler");
 			}
-			entries[total_num_touch++] = entries[i];
+			touches.push_back(entries[i]);
 			prev_was_same = 1;
 		} else {
 			prev_was_same = 0;
 		}
 	}
+}
+
+// Unit vector pointing from v0 towards v1.  For the orthogonal sides of a
+// traced polygon this is just the sign of the difference.
+static inline Vertex unit_toward(const Vertex &v0, const Vertex &v1) {
+	double dx = v1.x - v0.x;
+	double dy = v1.y - v0.y;
+	double len = sqrt(dx*dx + dy*dy);
+	if(len == 0) return Vertex(0, 0);
+	return Vertex(dx / len, dy / len);
+}
+
+// Replaces each of the given vertices of a ring with two vertices, a distance
+// of amount along each of the adjoining sides.  touch_vidx must be sorted.
+// The ring is expanded in place, working from the back.
+static void shave_ring_corners(Ring &ring, const std::vector<size_t> &touch_vidx, double amount) {
+	const size_t old_npts = ring.pts.size();
+	const size_t num_touch = touch_vidx.size();
+
+	std::vector<Vertex> bevel_pts(num_touch * 2);
+	for(size_t i=0; i<num_touch; i++) {
+		size_t v_idx = touch_vidx[i];
+		if(v_idx >= old_npts) fatal_error("index out of bounds");
+		if(i && v_idx <= touch_vidx[i-1]) fatal_error("verts out of sequence");
+		const Vertex &this_v = ring.pts[v_idx];
+		const Vertex &prev_v = ring.pts[(v_idx+old_npts-1) % old_npts];
+		const Vertex &next_v = ring.pts[(v_idx+1) % old_npts];
+		Vertex u_prev = unit_toward(this_v, prev_v);
+		Vertex u_next = unit_toward(this_v, next_v);
+		bevel_pts[i*2  ] = Vertex(this_v.x + u_prev.x*amount, this_v.y + u_prev.y*amount);
+		bevel_pts[i*2+1] = Vertex(this_v.x + u_next.x*amount, this_v.y + u_next.y*amount);
+	}
+
+	ring.pts.resize(old_npts + num_touch);
+	size_t vin_end = old_npts;
+	size_t vout_end = old_npts + num_touch;
+	for(size_t i=num_touch; i>0; i--) {
+		size_t v_idx = touch_vidx[i-1];
+		// move the untouched points after this vertex into place
+		vout_end = std::copy_backward(
+			ring.pts.begin() + v_idx + 1,
+			ring.pts.begin() + vin_end,
+			ring.pts.begin() + vout_end
+		) - ring.pts.begin();
+		ring.pts[--vout_end] = bevel_pts[(i-1)*2+1];
+		ring.pts[--vout_end] = bevel_pts[(i-1)*2  ];
+		vin_end = v_idx;
+	}
+	if(vout_end != vin_end) {
+		fatal_error("wrong number of points in beveled ring (%zd vs. %zd)", vout_end, vin_end);
+	}
+}
+
+// This function is only meant to be called on polygons
+// that have orthogonal sides on an integer lattice (or the smoothed versions
+// of these).
+void bevel_self_intersections(Mpoly &mp, double amount, size_t num_threads) {
+	if(VERBOSE) {
+		printf("Beveling\n");
+	} else {
+		printf("Beveling: ");
+		GDALTermProgress(0, NULL, NULL);
+	}
+
+	size_t total_pts = 0;
+	for(size_t i=0; i<mp.rings.size(); i++) {
+		total_pts += mp.rings[i].pts.size();
+	}
+
+	if(VERBOSE >= 2) {
+		for(size_t r_idx=0; r_idx<mp.rings.size(); r_idx++) {
+			const Ring &ring = mp.rings[r_idx];
+			for(size_t v_idx=0; v_idx<ring.pts.size(); v_idx++) {
+				printf("mp[%zd][%zd] = %g, %g\n", r_idx, v_idx,
+					ring.pts[v_idx].x, ring.pts[v_idx].y);
+			}
+		}
+	}
+
+	if(VERBOSE) printf("finding self-intersections\n");
+	std::vector<VertRef> touches;
+	if(!find_touches_lattice(mp, total_pts, num_threads, touches)) {
+		find_touches_sorted(mp, total_pts, touches);
+	}
+	GDALTermProgress(0.8, NULL, NULL);
 
+	const size_t total_num_touch = touches.size();
 	if(VERBOSE) printf("found %zd self-intersections\n", total_num_touch);
 	if(!total_num_touch) {
 		GDALTermProgress(1, NULL, NULL);
@@ -169,95 +545,33 @@ void bevel_self_intersections(Mpoly &mp, double amount) {
 		return;
 	}
 
-	entries.resize(total_num_touch);
 	// sort by ring_idx,vert_idx
-	std::sort(entries.begin(), entries.end(), RingsComparator(&mp));
+	std::sort(touches.begin(), touches.end(), RingsComparator(&mp));
 
 	if(VERBOSE >= 2) {
 		printf("\nafter sort:\n");
 		for(size_t i=0; i<total_num_touch; i++) {
 			printf("entry[%zd] = %zd, %zd\n", 
-				i, entries[i].ring_idx, entries[i].vert_idx);
+				i, touches[i].ring_idx, touches[i].vert_idx);
 		}
 	}
 
 	if(VERBOSE) printf("shaving corners\n");
 
+	std::vector<size_t> touch_vidx;
 	for(size_t entry_idx=0; entry_idx<total_num_touch; ) {
-		const Ring &ring = mp.rings[entries[entry_idx].ring_idx];
-		const size_t ring_idx = entries[entry_idx].ring_idx;
-		size_t ring_num_touch = 0;
+		const size_t ring_idx = touches[entry_idx].ring_idx;
+		touch_vidx.clear();
 		while(
-			entry_idx+ring_num_touch < total_num_touch &&
-			entries[entry_idx+ring_num_touch].ring_idx == ring_idx
+			entry_idx < total_num_touch &&
+			touches[entry_idx].ring_idx == ring_idx
 		) {
-			ring_num_touch++;
-		}
-
-		if(VERBOSE >= 2) printf("ring %zd: num_touch=%zd\n", ring_idx, ring_num_touch);
-
-		size_t new_numpts = ring.pts.size() + ring_num_touch;
-		Ring new_ring;
-		new_ring.pts.resize(new_numpts);
-
-		size_t vin_idx = 0;
-		size_t vout_idx = 0;
-		for(size_t subent=0; subent<ring_num_touch; subent++) {
-			size_t touch_vidx = entries[entry_idx+subent].vert_idx;
-			if(VERBOSE >= 2) printf("touch at %zd\n", touch_vidx);
-			if(touch_vidx < vin_idx) {
-				fatal_error("verts out of sequence");
-			}
-			size_t numcp = touch_vidx - vin_idx;
-			if(numcp > 0) {
-				if(vin_idx + numcp > ring.pts.size()) {
-					fatal_error("index out of bounds");
-				}
-				std::copy(
-					ring.pts.begin() + vin_idx,
-					ring.pts.begin() + vin_idx + numcp,
-					new_ring.pts.begin() + vout_idx
-				);
-				vout_idx += numcp;
-				vin_idx += numcp;
-			}
-
-			if(vin_idx != touch_vidx) {
-				fatal_error("didn't copy the right amount of points");
-			}
-
-			Vertex this_v = ring.pts[vin_idx];
-			Vertex prev_v = ring.pts[(vin_idx+ring.pts.size()-1) % ring.pts.size()];
-			Vertex next_v = ring.pts[(vin_idx+1) % ring.pts.size()];
-			double sx_prev = sgn(prev_v.x - this_v.x);
-			double sy_prev = sgn(prev_v.y - this_v.y);
-			double sx_next = sgn(next_v.x - this_v.x);
-			double sy_next = sgn(next_v.y - this_v.y);
-			new_ring.pts[vout_idx++] = Vertex(this_v.x + sx_prev*amount, this_v.y + sy_prev*amount);
-			new_ring.pts[vout_idx++] = Vertex(this_v.x + sx_next*amount, this_v.y + sy_next*amount);
-			vin_idx++;
-		}
-
-		if(vin_idx < ring.pts.size()) {
-			size_t numcp = ring.pts.size() - vin_idx;
-			std::copy(
-				ring.pts.begin() + vin_idx,
-				ring.pts.begin() + vin_idx + numcp,
-				new_ring.pts.begin() + vout_idx
-			);
-			vout_idx += numcp;
-			vin_idx += numcp;
-		}
-
-		if(vout_idx != new_numpts) {
-			fatal_error("wrong number of points in beveled ring (%zd vs. %zd)", vout_idx, new_numpts);
+			touch_vidx.push_back(touches[entry_idx++].vert_idx);
 		}
 
-		// "ring" variable was const
-		Ring &mutable_ring = mp.rings[entries[entry_idx].ring_idx];
-		mutable_ring.pts = new_ring.pts;
+		if(VERBOSE >= 2) printf("ring %zd: num_touch=%zd\n", ring_idx, touch_vidx.size());
 
-		entry_idx += ring_num_touch;
+		shave_ring_corners(mp.rings[ring_idx], touch_vidx, amount);
 	}
 
 	GDALTermProgress(1, NULL, NULL);
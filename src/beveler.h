@@ -33,7 +33,7 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 namespace dangdal {
 
-void bevel_self_intersections(Mpoly &mp, double amount);
+void bevel_self_intersections(Mpoly &mp, double amount, size_t num_threads=1);
 
 } // namespace dangdal
 
@@ -31,6 +31,8 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include "common.h"
 #include "polygon.h"
 #include "dp.h"
+#include "threads.h"
+#include "segment-index.h"
 
 namespace dangdal {
 
@@ -46,25 +48,6 @@ static inline double veclen(double x, double y) {
 	return sqrt(x*x + y*y);
 }
 
-Mpoly compute_reduced_pointset(const Mpoly &in_mpoly, double tolerance) {
-	if(VERBOSE) printf("reducing...\n");
-
-	if(!in_mpoly.rings.size()) {
-		return Mpoly();
-	}
-
-	std::vector<ReducedRing> reduced_rings(in_mpoly.rings.size());
-
-	for(size_t c_idx=0; c_idx<in_mpoly.rings.size(); c_idx++) {
-		reduced_rings[c_idx] = compute_reduced_ring(
-			in_mpoly.rings[c_idx], tolerance);
-	}
-
-	fix_topology(in_mpoly, reduced_rings);
-
-	return reduction_to_mpoly(in_mpoly, reduced_rings);
-}
-
 static inline double get_dist_to_seg(
 	double seg_vec_x, double seg_vec_y, 
 	Vertex seg_vert1, Vertex seg_vert2, Vertex test_vert
@@ -102,98 +85,282 @@ static inline double get_dist_to_seg(
 	}
 }
 
-ReducedRing compute_reduced_ring(const Ring &orig_string, double res) {
-//printf("enter dp\n");
-
-	const std::vector<Vertex> &pts_in = orig_string.pts;
-	const size_t num_in = pts_in.size();
+// Finds the vertex between begin and end that is farthest from the segment
+// joining them.  Returns begin if there are no vertices in between.
+static size_t find_farthest(
+	const std::vector<Vertex> &pts_in, size_t seg_begin, size_t seg_end,
+	double *max_dist_out
+) {
+	double max_dist = -1.0;
+	size_t idx_of_max = seg_begin;
+
+	double seg_vec_x = pts_in[seg_end].x - pts_in[seg_begin].x;
+	double seg_vec_y = pts_in[seg_end].y - pts_in[seg_begin].y;
+	double seg_vec_len = veclen(seg_vec_x, seg_vec_y);
+	if(seg_vec_len > 0.0) {
+		// normalize vector
+		seg_vec_x /= seg_vec_len;
+		seg_vec_y /= seg_vec_len;
+		for(size_t i=seg_begin+1; i<seg_end; i++) {
+			double dist_to_seg = get_dist_to_seg(seg_vec_x, seg_vec_y,
+				pts_in[seg_begin], pts_in[seg_end], pts_in[i]);
+			if(dist_to_seg < 0.0) fatal_error("dist_to_seg < 0.0");
+			if(std::isnan(dist_to_seg)) fatal_error("dist_to_seg == NaN");
+
+			if(dist_to_seg > max_dist) {
+				max_dist = dist_to_seg;
+				idx_of_max = i;
+			}
+		}
+	} else {
+		// Segment is length zero, so we can't use get_dist_to_seg.
+		// Instead, just use cartesian distance
+		for(size_t i=seg_begin+1; i<seg_end; i++) {
+			double dx = pts_in[i].x - pts_in[seg_begin].x;
+			double dy = pts_in[i].y - pts_in[seg_begin].y;
+			double dist_to_seg = veclen(dx, dy);
+
+			if(dist_to_seg > max_dist) {
+				max_dist = dist_to_seg;
+				idx_of_max = i;
+			}
+		}
+	}
 
-	double tolerance = res;
-	int i;
+	*max_dist_out = max_dist;
+	return idx_of_max;
+}
 
-	std::vector<segment_t> stack(num_in);
+// Reduces the chain of vertices from chain_begin to chain_end (inclusive),
+// appending the kept segments to keep.
+static void reduce_chain(
+	const std::vector<Vertex> &pts_in, size_t chain_begin, size_t chain_end,
+	double tolerance, std::vector<segment_t> &keep
+) {
+	const size_t max_stack = chain_end - chain_begin + 1;
+	std::vector<segment_t> stack(max_stack);
 	size_t stack_ptr = 0;
 
-	ReducedRing keep;
-	keep.segs.reserve(num_in);
-
-	// must keep closure segment
-	keep.segs.push_back(segment_t(num_in-1, 0));
-
-	stack[stack_ptr].begin = 0;
-	stack[stack_ptr].end = num_in-1;
+	stack[stack_ptr].begin = chain_begin;
+	stack[stack_ptr].end = chain_end;
 	stack_ptr++;
 	while(stack_ptr) {
 		stack_ptr--;
-		int seg_begin = stack[stack_ptr].begin;
-		int seg_end = stack[stack_ptr].end;
+		size_t seg_begin = stack[stack_ptr].begin;
+		size_t seg_end = stack[stack_ptr].end;
 //printf("stack_ptr=%d / range=[%d,%d]\n", stack_ptr, seg_begin, seg_end);
 
-		double max_dist = -1.0;
-		int idx_of_max = -1; // to prevent compiler warning
-
-		double seg_vec_x = pts_in[seg_end].x - pts_in[seg_begin].x;
-		double seg_vec_y = pts_in[seg_end].y - pts_in[seg_begin].y;
-		double seg_vec_len = veclen(seg_vec_x, seg_vec_y);
-		if(seg_vec_len > 0.0) {
-			// normalize vector
-			seg_vec_x /= seg_vec_len;
-			seg_vec_y /= seg_vec_len;
-			for(i=seg_begin+1; i<seg_end; i++) {
-				double dist_to_seg = get_dist_to_seg(seg_vec_x, seg_vec_y,
-					pts_in[seg_begin], pts_in[seg_end], pts_in[i]);
-				if(dist_to_seg < 0.0) fatal_error("dist_to_seg < 0.0");
-				if(std::isnan(dist_to_seg)) fatal_error("dist_to_seg == NaN");
-
-				if(dist_to_seg > max_dist) {
-					max_dist = dist_to_seg;
-					idx_of_max = i;
-				}
-			}
-		} else {
-			// Segment is length zero, so we can't use get_dist_to_seg.
-			// Instead, just use cartesian distance
-			for(i=seg_begin+1; i<seg_end; i++) {
-				double dx = pts_in[i].x - pts_in[seg_begin].x;
-				double dy = pts_in[i].y - pts_in[seg_begin].y;
-				double dist_to_seg = veclen(dx, dy);
-
-				if(dist_to_seg > max_dist) {
-					max_dist = dist_to_seg;
-					idx_of_max = i;
-				}
-			}
-		}
+		double max_dist;
+		size_t idx_of_max = find_farthest(pts_in, seg_begin, seg_end, &max_dist);
 
 //printf("max=%.15f, toler=%.15f, idx=%i\n", max_dist, tolerance, idx_of_max);
 		if(max_dist >= tolerance) {
-			if(idx_of_max <= 0) fatal_error(
+			if(idx_of_max <= seg_begin) fatal_error(
 				"idx_of_max out of range (perhaps it wasn't set?)");
 
 			// add point and recursively divide subsegments
 			stack[stack_ptr].begin = seg_begin;
 			stack[stack_ptr].end = idx_of_max;
 			stack_ptr++;
-			if(stack_ptr >= num_in) fatal_error("stack overflow in dp.c");
+			if(stack_ptr >= max_stack) fatal_error("stack overflow in dp.c");
 
 			stack[stack_ptr].begin = idx_of_max;
 			stack[stack_ptr].end = seg_end;
 			stack_ptr++;
-			if(stack_ptr >= num_in) fatal_error("stack overflow in dp.c");
+			if(stack_ptr >= max_stack) fatal_error("stack overflow in dp.c");
 		} else {
 			// segment doesn't need subdivision - tag
 			// endpoint for inclusion
-			if(keep.segs.size() == num_in) fatal_error("output stack overflow in dp.c");
-			keep.segs.push_back(segment_t(seg_begin, seg_end));
+			keep.push_back(segment_t(seg_begin, seg_end));
 		}
 	}
+}
+
+ReducedRing compute_reduced_ring(const Ring &orig_string, double res) {
+	const std::vector<Vertex> &pts_in = orig_string.pts;
+	const size_t num_in = pts_in.size();
 
-//printf("keeping %d of %d\n", keep.segs.size(), num_in);
-//printf("exit dp\n");
+	ReducedRing keep;
+	if(!num_in) return keep;
+	keep.segs.reserve(num_in);
+
+	// must keep closure segment
+	keep.segs.push_back(segment_t(num_in-1, 0));
+
+	reduce_chain(pts_in, 0, num_in-1, res, keep.segs);
+
+	if(keep.segs.size() > num_in) fatal_error("output stack overflow in dp.c");
 
 	return keep;
 }
 
+namespace {
+
+// Chains longer than this are split at their top DP split point, so that the
+// halves can be reduced by different threads.
+const size_t MAX_CHAIN_LEN = 1 << 16;
+
+// A piece of a ring to be reduced.  Chains that get split point to their two
+// halves.  DP outputs the segments of the second half first, and this order
+// is preserved when putting the ring back together.
+struct Chain {
+	Chain(size_t _ring, size_t _begin, size_t _end) :
+		ring(_ring), begin(_begin), end(_end),
+		split(false), left(0), right(0), split_idx(0)
+	{ }
+
+	size_t ring;
+	size_t begin, end;
+	bool split;
+	size_t left, right;
+	size_t split_idx;
+	std::vector<segment_t> segs;
+};
+
+class SplitChainsTask : public ParallelTask {
+public:
+	SplitChainsTask(
+		const Mpoly &_mpoly, double _tolerance,
+		std::vector<Chain> &_chains, const std::vector<size_t> &_todo
+	) :
+		mpoly(_mpoly), tolerance(_tolerance),
+		chains(_chains), todo(_todo)
+	{ }
+
+	// Sets split_idx to the split point, or leaves it zero if the chain
+	// needs no subdivision (in which case it reduces to a single segment).
+	virtual void run(size_t job_idx, size_t) {
+		Chain &chain = chains[todo[job_idx]];
+		const std::vector<Vertex> &pts = mpoly.rings[chain.ring].pts;
+		double max_dist;
+		size_t idx_of_max = find_farthest(pts, chain.begin, chain.end, &max_dist);
+		if(max_dist >= tolerance) {
+			if(idx_of_max <= chain.begin) fatal_error(
+				"idx_of_max out of range (perhaps it wasn't set?)");
+			chain.split_idx = idx_of_max;
+		} else {
+			chain.segs.push_back(segment_t(chain.begin, chain.end));
+		}
+	}
+
+private:
+	const Mpoly &mpoly;
+	const double tolerance;
+	std::vector<Chain> &chains;
+	const std::vector<size_t> &todo;
+};
+
+class ReduceChainsTask : public ParallelTask {
+public:
+	ReduceChainsTask(
+		const Mpoly &_mpoly, double _tolerance,
+		std::vector<Chain> &_chains, const std::vector<size_t> &_todo
+	) :
+		mpoly(_mpoly), tolerance(_tolerance),
+		chains(_chains), todo(_todo)
+	{ }
+
+	virtual void run(size_t job_idx, size_t) {
+		Chain &chain = chains[todo[job_idx]];
+		const std::vector<Vertex> &pts = mpoly.rings[chain.ring].pts;
+		reduce_chain(pts, chain.begin, chain.end, tolerance, chain.segs);
+	}
+
+private:
+	const Mpoly &mpoly;
+	const double tolerance;
+	std::vector<Chain> &chains;
+	const std::vector<size_t> &todo;
+};
+
+void collect_chain_segs(
+	const std::vector<Chain> &chains, size_t chain_idx,
+	std::vector<segment_t> &out
+) {
+	const Chain &chain = chains[chain_idx];
+	if(chain.split) {
+		collect_chain_segs(chains, chain.right, out);
+		collect_chain_segs(chains, chain.left, out);
+	} else {
+		out.insert(out.end(), chain.segs.begin(), chain.segs.end());
+	}
+}
+
+} // anonymous namespace
+
+Mpoly compute_reduced_pointset(const Mpoly &in_mpoly, double tolerance, size_t num_threads) {
+	if(VERBOSE) printf("reducing...\n");
+
+	if(!in_mpoly.rings.size()) {
+		return Mpoly();
+	}
+
+	// one root chain per ring, having the same index as the ring
+	std::vector<Chain> chains;
+	chains.reserve(in_mpoly.rings.size());
+	for(size_t r_idx=0; r_idx<in_mpoly.rings.size(); r_idx++) {
+		size_t npts = in_mpoly.rings[r_idx].pts.size();
+		chains.push_back(Chain(r_idx, 0, npts ? npts-1 : 0));
+	}
+
+	// Split long chains, a level at a time, until they are short enough.
+	std::vector<size_t> todo;
+	for(size_t c_idx=0; c_idx<chains.size(); c_idx++) {
+		if(chains[c_idx].end - chains[c_idx].begin >= MAX_CHAIN_LEN) {
+			todo.push_back(c_idx);
+		}
+	}
+	while(todo.size()) {
+		SplitChainsTask split_task(in_mpoly, tolerance, chains, todo);
+		run_parallel(split_task, todo.size(), num_threads);
+
+		std::vector<size_t> next_todo;
+		for(size_t i=0; i<todo.size(); i++) {
+			// copy, because push_back may invalidate references
+			Chain parent = chains[todo[i]];
+			if(!parent.split_idx) continue;
+			size_t left = chains.size();
+			chains.push_back(Chain(parent.ring, parent.begin, parent.split_idx));
+			chains.push_back(Chain(parent.ring, parent.split_idx, parent.end));
+			chains[todo[i]].split = true;
+			chains[todo[i]].left = left;
+			chains[todo[i]].right = left+1;
+			for(size_t c_idx=left; c_idx<left+2; c_idx++) {
+				if(chains[c_idx].end - chains[c_idx].begin >= MAX_CHAIN_LEN) {
+					next_todo.push_back(c_idx);
+				}
+			}
+		}
+		todo.swap(next_todo);
+	}
+
+	// Reduce everything that hasn't been split or already resolved to a
+	// single segment.
+	for(size_t c_idx=0; c_idx<chains.size(); c_idx++) {
+		const Chain &chain = chains[c_idx];
+		if(!chain.split && chain.segs.empty() && in_mpoly.rings[chain.ring].pts.size()) {
+			todo.push_back(c_idx);
+		}
+	}
+	ReduceChainsTask reduce_task(in_mpoly, tolerance, chains, todo);
+	run_parallel(reduce_task, todo.size(), num_threads);
+
+	std::vector<ReducedRing> reduced_rings(in_mpoly.rings.size());
+	for(size_t r_idx=0; r_idx<in_mpoly.rings.size(); r_idx++) {
+		size_t num_in = in_mpoly.rings[r_idx].pts.size();
+		if(!num_in) continue;
+		std::vector<segment_t> &segs = reduced_rings[r_idx].segs;
+		// must keep closure segment
+		segs.push_back(segment_t(num_in-1, 0));
+		collect_chain_segs(chains, r_idx, segs);
+		if(segs.size() > num_in) fatal_error("output stack overflow in dp.c");
+	}
+
+	fix_topology(in_mpoly, reduced_rings);
+
+	return reduction_to_mpoly(in_mpoly, reduced_rings);
+}
+
 static Ring make_ring_from_segs(const Ring &c_in, const ReducedRing &r_in) {
 	size_t in_npts = c_in.pts.size();
 	std::vector<uint8_t> keep_pts(in_npts, 0);
@@ -333,6 +500,18 @@ static inline int segs_cross(
 		1);
 }
 
+static inline const Vertex &seg_begin_pt(
+	const Mpoly &mpoly, const std::vector<ReducedRing> &reduced_rings, SegRef ref
+) {
+	return mpoly.rings[ref.ring].pts[reduced_rings[ref.ring].segs[ref.seg].begin];
+}
+
+static inline const Vertex &seg_end_pt(
+	const Mpoly &mpoly, const std::vector<ReducedRing> &reduced_rings, SegRef ref
+) {
+	return mpoly.rings[ref.ring].pts[reduced_rings[ref.ring].segs[ref.seg].end];
+}
+
 void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings) {
 	const double firsthalf_progress = 0.5;
 	printf("Fixing topology: ");
@@ -345,44 +524,55 @@ void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings) {
 		mp_problems[r1_idx].resize(rring.segs.size(), 0);
 	}
 
-	std::vector<Bbox> bboxes = mpoly.getRingBboxes();
+	// Segments get subdivided as topology is fixed, down to at most the
+	// original vertices, so the index is sized according to those.
+	size_t num_pts = 0;
+	for(size_t r_idx=0; r_idx<mpoly.rings.size(); r_idx++) {
+		num_pts += mpoly.rings[r_idx].pts.size();
+	}
+	SegmentIndex seg_index(mpoly.getBbox(), num_pts);
+	for(size_t r_idx=0; r_idx<mpoly.rings.size(); r_idx++) {
+		for(size_t s_idx=0; s_idx<reduced_rings[r_idx].segs.size(); s_idx++) {
+			SegRef ref(r_idx, s_idx);
+			seg_index.insert(ref,
+				seg_begin_pt(mpoly, reduced_rings, ref),
+				seg_end_pt(mpoly, reduced_rings, ref));
+		}
+	}
+	std::vector<SegRef> neighbors;
 
 	// flag segments that cross
 	int have_problems = 0;
 	for(size_t r1_idx=0; r1_idx < mpoly.rings.size(); r1_idx++) {
 		GDALTermProgress(firsthalf_progress*
-			pow((double)r1_idx / (double)mpoly.rings.size(), 2), NULL, NULL);
+			(double)r1_idx / (double)mpoly.rings.size(), NULL, NULL);
 		const Ring &c1 = mpoly.rings[r1_idx];
 		const ReducedRing &r1 = reduced_rings[r1_idx];
 		std::vector<bool> &p1 = mp_problems[r1_idx];
-		const Bbox bbox1 = bboxes[r1_idx];
-		if(bbox1.empty) continue;
-		for(size_t r2_idx=0; r2_idx < mpoly.rings.size(); r2_idx++) {
-			if(r2_idx > r1_idx) continue; // symmetry optimization
-
-			const Bbox bbox2 = bboxes[r2_idx];
-			if(is_disjoint(bbox1, bbox2)) continue;
-
-			const Ring &c2 = mpoly.rings[r2_idx];
-			const ReducedRing &r2 = reduced_rings[r2_idx];
-			std::vector<bool> &p2 = mp_problems[r2_idx];
-
-			for(size_t seg1_idx=0; seg1_idx < r1.segs.size(); seg1_idx++) {
-				for(size_t seg2_idx=0; seg2_idx < r2.segs.size(); seg2_idx++) {
-					if(r2_idx == r1_idx && seg2_idx > seg1_idx) continue; // symmetry optimization
-
-					int crosses = segs_cross(r1_idx==r2_idx, 
-						c1, r1.segs[seg1_idx], c2, r2.segs[seg2_idx]);
-					if(crosses) {
-						//printf("found a crossing: %d,%d,%d,%d\n",
-						//	r1_idx, seg1_idx, r2_idx, seg2_idx);
-						p1[seg1_idx] = 1;
-						p2[seg2_idx] = 1;
-						have_problems += 2;
-					}
-				} // seg loop
-			} // seg loop
-		} // ring loop
+		for(size_t seg1_idx=0; seg1_idx < r1.segs.size(); seg1_idx++) {
+			const SegRef ref1(r1_idx, seg1_idx);
+			seg_index.findNearSegment(
+				seg_begin_pt(mpoly, reduced_rings, ref1),
+				seg_end_pt(mpoly, reduced_rings, ref1),
+				neighbors);
+			for(size_t n_idx=0; n_idx < neighbors.size(); n_idx++) {
+				const SegRef &ref2 = neighbors[n_idx];
+				if(!(ref2 < ref1)) break; // symmetry optimization (list is sorted)
+
+				const Ring &c2 = mpoly.rings[ref2.ring];
+				const ReducedRing &r2 = reduced_rings[ref2.ring];
+
+				int crosses = segs_cross(r1_idx==ref2.ring, 
+					c1, r1.segs[seg1_idx], c2, r2.segs[ref2.seg]);
+				if(crosses) {
+					//printf("found a crossing: %d,%d,%d,%d\n",
+					//	r1_idx, seg1_idx, ref2.ring, ref2.seg);
+					p1[seg1_idx] = 1;
+					mp_problems[ref2.ring][ref2.seg] = 1;
+					have_problems += 2;
+				}
+			} // neighbor loop
+		} // seg loop
 	} // ring loop
 
 	double progress = firsthalf_progress;
@@ -410,9 +600,13 @@ void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings) {
 
 				// subdivide this segment
 				int mid = (begin + end) / 2;
+				const Vertex *pts = &mpoly.rings[r1_idx].pts[0];
+				seg_index.remove(SegRef(r1_idx, seg1_idx), pts[begin], pts[end]);
 				r1.segs[seg1_idx].end = mid;
 				r1.segs.push_back(segment_t(mid, end));
 				p1.push_back(1);
+				seg_index.insert(SegRef(r1_idx, seg1_idx), pts[begin], pts[mid]);
+				seg_index.insert(SegRef(r1_idx, r1.segs.size()-1), pts[mid], pts[end]);
 				did_something = 1;
 			} // seg loop
 		} // ring loop
@@ -428,39 +622,40 @@ void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings) {
 
 			const Ring &c1 = mpoly.rings[r1_idx];
 			const ReducedRing &r1 = reduced_rings[r1_idx];
-			const Bbox bbox1 = bboxes[r1_idx];
 			std::vector<bool> &p1 = mp_problems[r1_idx];
 			for(size_t seg1_idx=0; seg1_idx < r1.segs.size(); seg1_idx++) {
 				if(!p1[seg1_idx]) continue;
 				p1[seg1_idx] = 0;
-				for(size_t r2_idx=0; r2_idx < mpoly.rings.size(); r2_idx++) {
+				seg_index.findNearSegment(
+					c1.pts[r1.segs[seg1_idx].begin],
+					c1.pts[r1.segs[seg1_idx].end],
+					neighbors);
+				for(size_t n_idx=0; n_idx < neighbors.size(); n_idx++) {
+					const size_t r2_idx = neighbors[n_idx].ring;
+					const size_t seg2_idx = neighbors[n_idx].seg;
 					const Ring &c2 = mpoly.rings[r2_idx];
 					const ReducedRing &r2 = reduced_rings[r2_idx];
-					const Bbox bbox2 = bboxes[r2_idx];
-					if(is_disjoint(bbox1, bbox2)) continue;
-					for(size_t seg2_idx=0; seg2_idx < r2.segs.size(); seg2_idx++) {
-						int crosses = segs_cross(r1_idx==r2_idx,
-							c1, r1.segs[seg1_idx], c2, r2.segs[seg2_idx]);
-						if(crosses) {
-							if(VERBOSE) {
-								printf("found a crossing (still): %zd,%zd,%zd,%zd (%f,%f)-(%f,%f) (%f,%f)-(%f,%f)\n",
-									r1_idx, seg1_idx, r2_idx, seg2_idx,
-									c1.pts[r1.segs[seg1_idx].begin].x,
-									c1.pts[r1.segs[seg1_idx].begin].y,
-									c1.pts[r1.segs[seg1_idx].end].x,
-									c1.pts[r1.segs[seg1_idx].end].y,
-									c2.pts[r2.segs[seg2_idx].begin].x,
-									c2.pts[r2.segs[seg2_idx].begin].y,
-									c2.pts[r2.segs[seg2_idx].end].x,
-									c2.pts[r2.segs[seg2_idx].end].y);
-							}
-							p1[seg1_idx] = 1;
-							std::vector<bool> &p2 = mp_problems[r2_idx];
-							p2[seg2_idx] = 1;
-							have_problems++;
+					int crosses = segs_cross(r1_idx==r2_idx,
+						c1, r1.segs[seg1_idx], c2, r2.segs[seg2_idx]);
+					if(crosses) {
+						if(VERBOSE) {
+							printf("found a crossing (still): %zd,%zd,%zd,%zd (%f,%f)-(%f,%f) (%f,%f)-(%f,%f)\n",
+								r1_idx, seg1_idx, r2_idx, seg2_idx,
+								c1.pts[r1.segs[seg1_idx].begin].x,
+								c1.pts[r1.segs[seg1_idx].begin].y,
+								c1.pts[r1.segs[seg1_idx].end].x,
+								c1.pts[r1.segs[seg1_idx].end].y,
+								c2.pts[r2.segs[seg2_idx].begin].x,
+								c2.pts[r2.segs[seg2_idx].begin].y,
+								c2.pts[r2.segs[seg2_idx].end].x,
+								c2.pts[r2.segs[seg2_idx].end].y);
 						}
-					} // seg loop
-				} // ring loop
+						p1[seg1_idx] = 1;
+						std::vector<bool> &p2 = mp_problems[r2_idx];
+						p2[seg2_idx] = 1;
+						have_problems++;
+					}
+				} // neighbor loop
 			} // seg loop
 		} // ring loop
 
@@ -47,7 +47,7 @@ struct ReducedRing {
 	std::vector<segment_t> segs;
 };
 
-Mpoly compute_reduced_pointset(const Mpoly &in_mpoly, double tolerance);
+Mpoly compute_reduced_pointset(const Mpoly &in_mpoly, double tolerance, size_t num_threads=1);
 ReducedRing compute_reduced_ring(const Ring &orig_string, double res);
 void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings);
 Mpoly reduction_to_mpoly(const Mpoly &in_mpoly, const std::vector<ReducedRing> &reduced_rings);
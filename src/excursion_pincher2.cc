@@ -28,6 +28,8 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 #include <limits>
 #include <cassert>
+#include <algorithm>
+#include <vector>
 
 #include "common.h"
 #include "polygon.h"
@@ -51,20 +53,6 @@ static inline double seg_len(Vertex v0, Vertex v1) {
 	return sqrt(dx*dx + dy*dy);
 }
 
-static size_t find_bottom_pt(const Ring &ring) {
-	assert(ring.pts.size());
-	double min = ring.pts[0].y;
-	size_t min_idx = 0;
-	for(size_t i=1; i<ring.pts.size(); i++) {
-		double y = ring.pts[i].y;
-		if(y<min) {
-			min = y;
-			min_idx = i;
-		}
-	}
-	return min_idx;
-}
-
 struct FindNextConvexRetval {
 	FindNextConvexRetval(
 		bool _error, size_t _idx, double _ang
@@ -130,48 +118,314 @@ static FindNextConvexRetval find_next_convex(
 	}
 }
 
-static Keeps find_chull(const Ring &ring) {
-	Keeps keep(ring.pts.size(), false);
+// distance of p3 from line (p1,p2)
+static double dist_to_seg(Vertex p1, Vertex p2, Vertex p3) {
+	double d21x = p2.x - p1.x; double d21y = p2.y - p1.y;
+	double d13x = p1.x - p3.x; double d13y = p1.y - p3.y;
+	// from http://mathworld.wolfram.com/Point-LineDistance2-Dimensional.html
+	double dist_from_line = fabs(d21x*d13y - d13x*d21y) / sqrt(d21x*d21x + d21y*d21y);
+	return dist_from_line;
+}
 
-	size_t start_idx = find_bottom_pt(ring);
-	keep[start_idx] = true;
-	double ang = 0;
-	size_t idx = start_idx;
-	for(;;) {
-		FindNextConvexRetval r = find_next_convex(ring, idx, start_idx, ang);
-		if(r.error) fatal_error("could not get convex hull");
-		idx = r.idx;
-		ang = r.ang;
-		if(idx == start_idx) break;
-		keep[idx] = true;
+static inline double cross3(const Vertex &o, const Vertex &a, const Vertex &b) {
+	return (a.x-o.x)*(b.y-o.y) - (a.y-o.y)*(b.x-o.x);
+}
+
+class VertexIdxComparator {
+public:
+	explicit VertexIdxComparator(const std::vector<Vertex> &_pts) : pts(_pts) { }
+
+	bool operator()(size_t a, size_t b) const {
+		const Vertex &va = pts[a];
+		const Vertex &vb = pts[b];
+		return
+			va.x < vb.x ? true :
+			va.x > vb.x ? false :
+			va.y < vb.y ? true :
+			va.y > vb.y ? false :
+			a < b;
 	}
 
-	return keep;
+private:
+	const std::vector<Vertex> &pts;
+};
+
+// Monotone chain convex hull of the given vertices, which get sorted in place.
+// If keep_collinear is set, points along the edges of the hull are included.
+static void hull_of_indices(
+	const std::vector<Vertex> &pts, std::vector<size_t> &idx,
+	bool keep_collinear, std::vector<size_t> &hull
+) {
+	std::sort(idx.begin(), idx.end(), VertexIdxComparator(pts));
+	const size_t n = idx.size();
+	hull.clear();
+	if(n < 3) {
+		hull = idx;
+		return;
+	}
+
+	hull.resize(2*n);
+	size_t k = 0;
+	for(size_t i=0; i<n; i++) {
+		while(k >= 2) {
+			double c = cross3(pts[hull[k-2]], pts[hull[k-1]], pts[idx[i]]);
+			if(c < 0 || (c == 0 && !keep_collinear)) k--;
+			else break;
+		}
+		hull[k++] = idx[i];
+	}
+	for(size_t i=n-1, t=k+1; i>0; i--) {
+		while(k >= t) {
+			double c = cross3(pts[hull[k-2]], pts[hull[k-1]], pts[idx[i-1]]);
+			if(c < 0 || (c == 0 && !keep_collinear)) k--;
+			else break;
+		}
+		hull[k++] = idx[i-1];
+	}
+	hull.resize(k-1);
 }
 
-static double subring_area(const Ring &ring, size_t from, size_t to) {
-	size_t npts = ring.pts.size();
-	const std::vector<Vertex> &pts = ring.pts;
+static Keeps find_chull(const Ring &ring) {
+	const size_t npts = ring.pts.size();
+	Keeps keep(npts, false);
+
+	std::vector<size_t> idx(npts);
+	for(size_t i=0; i<npts; i++) idx[i] = i;
+	std::vector<size_t> hull;
+	// Collinear points are kept since the gift wrapping this replaced would
+	// step along them one at a time.
+	hull_of_indices(ring.pts, idx, true, hull);
+	for(size_t i=0; i<hull.size(); i++) {
+		keep[hull[i]] = true;
+	}
 
-	double accum = 0;
-	for(size_t i=from; ; i=(i+1)%npts) {
-		size_t i2 = i==to ? from : (i+1)%npts;
-		double x0 = pts[i].x;
-		double y0 = pts[i].y;
-		double x1 = pts[i2].x;
-		double y1 = pts[i2].y;
-		accum += x1*y0 - x0*y1;
-		if(i == to) break;
-	}
-	//if(fabs(accum - round(accum)) > 1e-9) {
-	//	fatal_error("accum not integer in subring_area (%g)", accum);
-	//}
-	if(accum < 0) {
-		fatal_error("subring_area was negative");
-	}
-	return accum / 2.0;
+	return keep;
 }
 
+// Data about a ring that is computed once and then used to answer the queries
+// that the refinement steps make over and over:
+//   * Shoelace prefix sums, giving the area of any subring in constant time.
+//   * A segment tree over the vertices.  Each node holds the convex hull of
+//     its vertices (for the farthest distance from a line) and the bounding
+//     box of its edges (for finding edges that cross a chord).
+class RingGeom {
+public:
+	explicit RingGeom(const Ring &_ring) :
+		ring(_ring),
+		npts(_ring.pts.size())
+	{
+		buildPrefixSums();
+		if(npts) buildNode(0, 0, npts);
+	}
+
+	// Area between the chain of vertices from..to and the chord closing it.
+	double subringArea(size_t from, size_t to) const {
+		size_t chain_len = (to + npts - from) % npts;
+		if(chain_len <= LEAF_SIZE) return subringAreaDirect(from, to);
+
+		const std::vector<long double> &pre = shoelace_prefix;
+		long double accum = pre[to] - pre[from];
+		if(from > to) accum += pre[npts];
+		accum += shoelaceTerm(to, from);
+		if(accum < 0) {
+			// allow for rounding in the prefix sums
+			long double slop = 1e-12 * (fabsl(pre[to]) + fabsl(pre[from]) + fabsl(pre[npts]) + 1.0);
+			if(accum < -slop) fatal_error("subring_area was negative");
+			accum = 0;
+		}
+		return double(accum / 2.0);
+	}
+
+	// True if any vertex strictly between from and to is farther than
+	// max_dist from the line through those two vertices.
+	bool hasVertexFartherThan(size_t from, size_t to, double max_dist) const {
+		Vertex p1 = ring.pts[from];
+		Vertex p2 = ring.pts[to];
+		if(from < to) {
+			return farthestQuery(0, from+1, to, p1, p2, max_dist);
+		} else {
+			return
+				farthestQuery(0, from+1, npts, p1, p2, max_dist) ||
+				farthestQuery(0, 0, to, p1, p2, max_dist);
+		}
+	}
+
+	// True if the chord pk-nk crosses any edge of the ring, not counting edges
+	// that touch pk or nk.
+	bool chordCrossesRing(size_t pk, size_t nk) const {
+		Bbox chord_bbox;
+		chord_bbox.expand(ring.pts[pk]);
+		chord_bbox.expand(ring.pts[nk]);
+		return crossingQuery(0, chord_bbox, pk, nk);
+	}
+
+	const Ring &ring;
+
+private:
+	struct Node {
+		Node() : begin(0), end(0), left(0), right(0), hull_begin(0), hull_end(0) { }
+		size_t begin, end;
+		size_t left, right; // children, or zero for a leaf
+		size_t hull_begin, hull_end;
+		Bbox edge_bbox;
+	};
+
+	static const size_t LEAF_SIZE = 16;
+
+	// The shoelace terms are taken relative to the first vertex, which
+	// keeps the prefix sums from growing much beyond the area of the ring.
+	// The sums are done in extended precision since subring areas are the
+	// difference of two of them.
+	long double shoelaceTerm(size_t i, size_t j) const {
+		const Vertex &o = ring.pts[0];
+		double x0 = ring.pts[i].x - o.x;
+		double y0 = ring.pts[i].y - o.y;
+		double x1 = ring.pts[j].x - o.x;
+		double y1 = ring.pts[j].y - o.y;
+		return (long double)x1*y0 - (long double)x0*y1;
+	}
+
+	// For short chains it is just as fast to sum directly, and the result is
+	// exactly zero for chains that lie along the chord.
+	double subringAreaDirect(size_t from, size_t to) const {
+		const std::vector<Vertex> &pts = ring.pts;
+
+		double accum = 0;
+		for(size_t i=from; ; i=(i+1)%npts) {
+			size_t i2 = i==to ? from : (i+1)%npts;
+			double x0 = pts[i].x;
+			double y0 = pts[i].y;
+			double x1 = pts[i2].x;
+			double y1 = pts[i2].y;
+			accum += x1*y0 - x0*y1;
+			if(i == to) break;
+		}
+		//if(fabs(accum - round(accum)) > 1e-9) {
+		//	fatal_error("accum not integer in subring_area (%g)", accum);
+		//}
+		if(accum < 0) {
+			fatal_error("subring_area was negative");
+		}
+		return accum / 2.0;
+	}
+
+	void buildPrefixSums() {
+		shoelace_prefix.resize(npts+1);
+		shoelace_prefix[0] = 0;
+		for(size_t i=0; i<npts; i++) {
+			size_t i2 = (i+1<npts) ? (i+1) : 0;
+			shoelace_prefix[i+1] = shoelace_prefix[i] + shoelaceTerm(i, i2);
+		}
+	}
+
+	size_t buildNode(size_t node_idx, size_t begin, size_t end) {
+		if(node_idx == nodes.size()) nodes.push_back(Node());
+		nodes[node_idx].begin = begin;
+		nodes[node_idx].end = end;
+
+		std::vector<size_t> idx;
+		if(end - begin <= LEAF_SIZE) {
+			for(size_t i=begin; i<end; i++) idx.push_back(i);
+		} else {
+			size_t mid = begin + (end - begin) / 2;
+			size_t left = nodes.size();
+			buildNode(left, begin, mid);
+			size_t right = nodes.size();
+			buildNode(right, mid, end);
+			nodes[node_idx].left = left;
+			nodes[node_idx].right = right;
+
+			const Node &l = nodes[left];
+			const Node &r = nodes[right];
+			idx.insert(idx.end(), hull_verts.begin()+l.hull_begin, hull_verts.begin()+l.hull_end);
+			idx.insert(idx.end(), hull_verts.begin()+r.hull_begin, hull_verts.begin()+r.hull_end);
+		}
+
+		std::vector<size_t> hull;
+		hull_of_indices(ring.pts, idx, false, hull);
+		nodes[node_idx].hull_begin = hull_verts.size();
+		hull_verts.insert(hull_verts.end(), hull.begin(), hull.end());
+		nodes[node_idx].hull_end = hull_verts.size();
+
+		Bbox bb;
+		for(size_t i=begin; i<end; i++) {
+			bb.expand(ring.pts[i]);
+			bb.expand(ring.pts[(i+1<npts) ? (i+1) : 0]);
+		}
+		nodes[node_idx].edge_bbox = bb;
+
+		return node_idx;
+	}
+
+	// The distance from a line is a convex function, so its maximum over a
+	// node is at one of the vertices of the node's hull.
+	bool farthestQuery(
+		size_t node_idx, size_t q_begin, size_t q_end,
+		const Vertex &p1, const Vertex &p2, double max_dist
+	) const {
+		if(q_begin >= q_end) return false;
+		const Node &node = nodes[node_idx];
+		if(q_end <= node.begin || q_begin >= node.end) return false;
+
+		if(q_begin <= node.begin && node.end <= q_end) {
+			for(size_t h=node.hull_begin; h<node.hull_end; h++) {
+				if(dist_to_seg(p1, p2, ring.pts[hull_verts[h]]) > max_dist) return true;
+			}
+			return false;
+		} else if(!node.left) {
+			size_t b = std::max(q_begin, node.begin);
+			size_t e = std::min(q_end, node.end);
+			for(size_t i=b; i<e; i++) {
+				if(dist_to_seg(p1, p2, ring.pts[i]) > max_dist) return true;
+			}
+			return false;
+		} else {
+			return
+				farthestQuery(node.left,  q_begin, q_end, p1, p2, max_dist) ||
+				farthestQuery(node.right, q_begin, q_end, p1, p2, max_dist);
+		}
+	}
+
+	bool crossingQuery(size_t node_idx, const Bbox &chord_bbox, size_t pk, size_t nk) const {
+		const Node &node = nodes[node_idx];
+		if(is_disjoint(node.edge_bbox, chord_bbox)) return false;
+
+		if(node.left) {
+			return
+				crossingQuery(node.left,  chord_bbox, pk, nk) ||
+				crossingQuery(node.right, chord_bbox, pk, nk);
+		}
+
+		const std::vector<Vertex> &pts = ring.pts;
+		for(size_t i=node.begin; i<node.end; i++) {
+			size_t i2 = i+1<npts ? i+1 : 0;
+			Vertex p1 = pts[i];
+			Vertex p2 = pts[i2];
+			// the bbox test is copied here from line_intersects_line to save
+			// the time penalty of a function call for the common case of
+			// the bbox not matching
+			if(!(
+				chord_bbox.max_x < std::min(p1.x, p2.x) ||
+				chord_bbox.min_x > std::max(p1.x, p2.x) ||
+				chord_bbox.max_y < std::min(p1.y, p2.y) ||
+				chord_bbox.min_y > std::max(p1.y, p2.y) ||
+				i==pk || i==nk || i2==pk || i2==nk
+			)) {
+				if(line_intersects_line(pts[pk], pts[nk], p1, p2, 0)) {
+					if(DEBUG) printf("line intersects line\n");
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	const size_t npts;
+	std::vector<long double> shoelace_prefix;
+	std::vector<Node> nodes;
+	std::vector<size_t> hull_verts;
+};
+
 static size_t next_keep(size_t npts, const Keeps &keep, size_t i) {
 	size_t i_plus1 = (i+1<npts) ? (i+1) : 0;
 	for(size_t j=i_plus1; j<npts; j++) {
@@ -190,7 +444,8 @@ static size_t prev_keep(size_t npts, const Keeps &keep, size_t i) {
 	return i;
 }
 
-static bool reach_point(const Ring &ring, Keeps &keep, size_t from, size_t to, double ang) {
+static bool reach_point(const RingGeom &rg, Keeps &keep, size_t from, size_t to, double ang) {
+	const Ring &ring = rg.ring;
 	size_t npts = ring.pts.size();
 	const std::vector<Vertex> &pts = ring.pts;
 
@@ -216,28 +471,8 @@ static bool reach_point(const Ring &ring, Keeps &keep, size_t from, size_t to, d
 		double min_y = std::min(pts[pk].y, pts[nk].y);
 		double max_y = std::max(pts[pk].y, pts[nk].y);
 
-		// FIXME - this is the slowest part
 		// FIXME - doesn't handle crossing across a vertex here or in dp.c
-		for(size_t i=0; i<npts; i++) {
-			size_t i2 = i+1<npts ? i+1 : 0;
-			Vertex p1 = pts[i];
-			Vertex p2 = pts[i2];
-			// the bbox test is copied here from line_intersects_line to save
-			// the time penalty of a function call for the common case of
-			// the bbox not matching
-			if(!(
-				max_x < std::min(p1.x, p2.x) ||
-				min_x > std::max(p1.x, p2.x) ||
-				max_y < std::min(p1.y, p2.y) ||
-				min_y > std::max(p1.y, p2.y) ||
-				i==pk || i==nk || i2==pk || i2==nk
-			)) {
-				if(line_intersects_line(pts[pk], pts[nk], p1, p2, 0)) {
-					if(DEBUG) printf("line intersects line\n");
-					return 1;
-				}
-			}
-		}
+		if(rg.chordCrossesRing(pk, nk)) return 1;
 		for(size_t i=nk; ; ) {
 			size_t i2 = next_keep(npts, keep, i);
 			Vertex p1 = pts[i];
@@ -267,7 +502,8 @@ static bool reach_point(const Ring &ring, Keeps &keep, size_t from, size_t to, d
 	return 0;
 }
 
-static bool add_tiepoint(const Ring &ring, Keeps &keep, size_t mid) {
+static bool add_tiepoint(const RingGeom &rg, Keeps &keep, size_t mid) {
+	const Ring &ring = rg.ring;
 	size_t npts = ring.pts.size();
 	const std::vector<Vertex> &pts = ring.pts;
 
@@ -279,13 +515,13 @@ static bool add_tiepoint(const Ring &ring, Keeps &keep, size_t mid) {
 		pts[mid].x, pts[mid].y, pts[left].x, pts[left].y, pts[right].x, pts[right].y);
 
 	double ang = seg_ang(pts[left], pts[right]);
-	bool error = reach_point(ring, keep, left, mid, ang);
+	bool error = reach_point(rg, keep, left, mid, ang);
 	if(error) return 1;
 
 	size_t pk = prev_keep(npts, keep, mid);
 	if(pk == mid) fatal_error("pk == mid");
 	ang = seg_ang(pts[mid], pts[pk]);
-	error = reach_point(ring, keep, mid, right, ang);
+	error = reach_point(rg, keep, mid, right, ang);
 	if(error) return 1;
 
 	return 0;
@@ -305,30 +541,12 @@ static bool chord_crosses_arc(const Ring &ring, size_t c0, size_t c1, size_t fro
 }
 */
 
-// distance of p3 from line (p1,p2)
-static double dist_to_seg(Vertex p1, Vertex p2, Vertex p3) {
-	double d21x = p2.x - p1.x; double d21y = p2.y - p1.y;
-	double d13x = p1.x - p3.x; double d13y = p1.y - p3.y;
-	// from http://mathworld.wolfram.com/Point-LineDistance2-Dimensional.html
-	double dist_from_line = fabs(d21x*d13y - d13x*d21y) / sqrt(d21x*d21x + d21y*d21y);
-	return dist_from_line;
+static bool is_mostly_linear(const RingGeom &rg, size_t from, size_t to) {
+	return !rg.hasVertexFartherThan(from, to, 1.0);
 }
 
-static bool is_mostly_linear(const Ring &ring, size_t from, size_t to) {
-	size_t npts = ring.pts.size();
-	const std::vector<Vertex> &pts = ring.pts;
-
-	Vertex p1 = pts[from];
-	Vertex p2 = pts[to];
-	for(size_t i=(from+1)%npts; i!=to; i=(i+1)%npts) {
-		double dist = dist_to_seg(p1, p2, pts[i]);
-		if(dist > 1.0) return 0;
-	}
-
-	return 1;
-}
-
-static bool keep_linears(const Ring &ring, Keeps &keep_orig, size_t from, size_t to, Keeps &touchpts) {
+static bool keep_linears(const RingGeom &rg, Keeps &keep_orig, size_t from, size_t to, Keeps &touchpts) {
+	const Ring &ring = rg.ring;
 	size_t npts = ring.pts.size();
 	const std::vector<Vertex> &pts = ring.pts;
 
@@ -343,7 +561,7 @@ static bool keep_linears(const Ring &ring, Keeps &keep_orig, size_t from, size_t
 		double perim = 0;
 		for(size_t r_idx=(l_idx+1)%npts; ; r_idx=(r_idx+1)%npts) {
 			perim += seg_len(pts[(r_idx+npts-1)%npts], pts[r_idx]);
-			if(perim > min_length && is_mostly_linear(ring, l_idx, r_idx)) {
+			if(perim > min_length && is_mostly_linear(rg, l_idx, r_idx)) {
 				longest = r_idx;
 			} else {
 				break;
@@ -354,11 +572,11 @@ static bool keep_linears(const Ring &ring, Keeps &keep_orig, size_t from, size_t
 			std::copy(keep_orig.begin(), keep_orig.end(), keep_new.begin());
 			bool error = 0;
 			if(l_idx != from) {
-				if(add_tiepoint(ring, keep_new, l_idx)) error = 1;
+				if(add_tiepoint(rg, keep_new, l_idx)) error = 1;
 			}
 //if(error) fatal_error("oops"); // FIXME
 			if(longest != to) {
-				if(add_tiepoint(ring, keep_new, longest)) error = 1;
+				if(add_tiepoint(rg, keep_new, longest)) error = 1;
 			}
 //if(error) fatal_error("oops"); // FIXME
 			if(!error) {
@@ -376,11 +594,12 @@ static bool keep_linears(const Ring &ring, Keeps &keep_orig, size_t from, size_t
 	return 0;
 }
 
-static std::pair<bool, size_t> refine_seg(const Ring &ring, Keeps &keep_orig, size_t from, size_t to) {
+static std::pair<bool, size_t> refine_seg(const RingGeom &rg, Keeps &keep_orig, size_t from, size_t to) {
+	const Ring &ring = rg.ring;
 	size_t npts = ring.pts.size();
 	const std::vector<Vertex> &pts = ring.pts;
 
-	double start_area = subring_area(ring, from, to);
+	double start_area = rg.subringArea(from, to);
 	double start_perim = seg_len(pts[from], pts[to]);
 
 	Keeps keep_new(npts);
@@ -392,13 +611,13 @@ static std::pair<bool, size_t> refine_seg(const Ring &ring, Keeps &keep_orig, si
 	for(size_t testpt=(from+1)%npts; testpt!=to; testpt=(testpt+1)%npts) {
 		std::copy(keep_orig.begin(), keep_orig.end(), keep_new.begin());
 
-		if(add_tiepoint(ring, keep_new, testpt)) continue;
+		if(add_tiepoint(rg, keep_new, testpt)) continue;
 
 		double left_area = 0;
 		double left_perim = 0;
 		for(size_t pk=from;;) {
 			size_t nk = next_keep(npts, keep_new, pk);
-			left_area += subring_area(ring, pk, nk);
+			left_area += rg.subringArea(pk, nk);
 			left_perim += seg_len(pts[pk], pts[nk]);
 			if(nk == testpt) break;
 			pk = nk;
@@ -407,7 +626,7 @@ static std::pair<bool, size_t> refine_seg(const Ring &ring, Keeps &keep_orig, si
 		double right_perim = 0;
 		for(size_t pk=testpt;;) {
 			size_t nk = next_keep(npts, keep_new, pk);
-			right_area += subring_area(ring, pk, nk);
+			right_area += rg.subringArea(pk, nk);
 			right_perim += seg_len(pts[pk], pts[nk]);
 			if(nk == to) break;
 			pk = nk;
@@ -459,21 +678,21 @@ static std::pair<bool, size_t> refine_seg(const Ring &ring, Keeps &keep_orig, si
 	}
 }
 
-static void refine_ring(const Ring &ring, Keeps &keep, Keeps &touchpts) {
-	size_t npts = ring.pts.size();
+static void refine_ring(const RingGeom &rg, Keeps &keep, Keeps &touchpts) {
+	size_t npts = rg.ring.pts.size();
 	for(size_t i=0; i<npts; i++) {
 		if(!keep[i]) continue;
 		for(;;) {
 		// FIXME quick loop if j==i+1
 			size_t j = next_keep(npts, keep, i);
-			double area = subring_area(ring, i, j);
+			double area = rg.subringArea(i, j);
 			if(VERBOSE) printf("area = %g, refining segment %zd,%zd\n", area, i, j);
 			if(area > 0) {
 if(VERBOSE) printf("do linear\n");
-				bool did_linear = keep_linears(ring, keep, i, j, touchpts);
+				bool did_linear = keep_linears(rg, keep, i, j, touchpts);
 				if(did_linear) continue;
 if(VERBOSE) printf("do refine\n");
-				std::pair<bool, size_t> r = refine_seg(ring, keep, i, j);
+				std::pair<bool, size_t> r = refine_seg(rg, keep, i, j);
 				bool got_touchpt = r.first;
 				size_t touchpt = r.second;
 				if(got_touchpt) {
@@ -501,7 +720,8 @@ static Ring pinch_ring_excursions(const Ring &ring_in) {
 	Keeps touchpts(ring.pts.size());
 	for(size_t i=0; i<ring.pts.size(); i++) touchpts[i] = false;
 
-	refine_ring(ring, keep, touchpts);
+	RingGeom rg(ring);
+	refine_ring(rg, keep, touchpts);
 
 	size_t nkeep = 0;
 	for(size_t i=0; i<npts; i++) {
@@ -530,26 +750,152 @@ static Ring pinch_ring_excursions(const Ring &ring_in) {
 
 static OGRGeometryH ring_to_ogrpoly(const Ring &r) {
 	OGRGeometryH ogr = OGR_G_CreateGeometry(wkbPolygon);
-	OGR_G_AddGeometry(ogr, ring_to_ogr(r));
+	OGR_G_AddGeometryDirectly(ogr, ring_to_ogr(r));
 	return ogr;
 }
 
-// rings must cross for this function
-static Ring ring_ring_union(const Ring &r1, const Ring &r2) {
-	OGRGeometryH og1 = ring_to_ogrpoly(r1);
-	OGRGeometryH og2 = ring_to_ogrpoly(r2);
-	OGRGeometryH og3 = OGR_G_Union(og1, og2);
-	if(!og3) fatal_error("OGR_G_Union failed");
-	OGRwkbGeometryType type = OGR_G_GetGeometryType(og3);
-	if(type == wkbPolygon) {
-		// only take outer ring
-		Ring r3 = ogr_to_ring(OGR_G_GetGeometryRef(og3, 0));
-		r3.is_hole = 0;
-		r3.parent_id = 0;
-		return r3;
-	} else {
+// Union of a connected group of rings (each must cross at least one of the
+// others), done in one cascaded union rather than pair by pair.
+static Ring ring_group_union(const Mpoly &mp, const std::vector<size_t> &group) {
+	OGRGeometryH og_in = OGR_G_CreateGeometry(wkbMultiPolygon);
+	for(size_t i=0; i<group.size(); i++) {
+		OGR_G_AddGeometryDirectly(og_in, ring_to_ogrpoly(mp.rings[group[i]]));
+	}
+	OGRGeometryH og_out = OGR_G_UnionCascaded(og_in);
+	if(!og_out) fatal_error("OGR_G_UnionCascaded failed");
+	OGRwkbGeometryType type = OGR_G_GetGeometryType(og_out);
+	if(type != wkbPolygon) {
 		fatal_error("result of ring union wasn't a wkbPolygon");
 	}
+	// only take outer ring
+	Ring r = ogr_to_ring(OGR_G_GetGeometryRef(og_out, 0));
+	r.is_hole = 0;
+	r.parent_id = 0;
+	OGR_G_DestroyGeometry(og_in);
+	OGR_G_DestroyGeometry(og_out);
+	return r;
+}
+
+// Finds all pairs of rings with overlapping bounding boxes, by sweeping across
+// the rings in order of min_x.  Pairs are returned as (lower, higher) index.
+static std::vector<std::pair<size_t, size_t> > find_bbox_overlaps(
+	const std::vector<Bbox> &bboxes
+) {
+	const size_t num_rings = bboxes.size();
+
+	std::vector<std::pair<double, size_t> > by_min_x;
+	by_min_x.reserve(num_rings);
+	for(size_t i=0; i<num_rings; i++) {
+		if(bboxes[i].empty) continue;
+		by_min_x.push_back(std::make_pair(bboxes[i].min_x, i));
+	}
+	std::sort(by_min_x.begin(), by_min_x.end());
+
+	std::vector<std::pair<size_t, size_t> > pairs;
+	std::vector<size_t> active;
+	for(size_t k=0; k<by_min_x.size(); k++) {
+		size_t i = by_min_x[k].second;
+		const Bbox &bb = bboxes[i];
+		size_t num_active = 0;
+		for(size_t a=0; a<active.size(); a++) {
+			size_t j = active[a];
+			if(bboxes[j].max_x < bb.min_x) continue; // done with this one
+			active[num_active++] = j;
+			if(!is_disjoint(bb, bboxes[j])) {
+				pairs.push_back(std::make_pair(std::min(i, j), std::max(i, j)));
+			}
+		}
+		active.resize(num_active);
+		active.push_back(i);
+	}
+	std::sort(pairs.begin(), pairs.end());
+	return pairs;
+}
+
+// Union-find over ring indices, used to collect groups of crossing rings.
+class RingGroups {
+public:
+	explicit RingGroups(size_t n) : parent(n) {
+		for(size_t i=0; i<n; i++) parent[i] = i;
+	}
+
+	size_t find(size_t i) {
+		while(parent[i] != i) {
+			parent[i] = parent[parent[i]];
+			i = parent[i];
+		}
+		return i;
+	}
+
+	// the lower index becomes the root, so groups end up in ring order
+	void unite(size_t i, size_t j) {
+		i = find(i);
+		j = find(j);
+		if(i < j) parent[j] = i;
+		else if(j < i) parent[i] = j;
+	}
+
+private:
+	std::vector<size_t> parent;
+};
+
+// One pass of removing rings that are contained by others and merging rings
+// that cross.  Returns true if anything was merged, in which case the merged
+// rings need to be checked again.
+static bool merge_overlapping_rings(Mpoly &mp) {
+	const size_t num_rings = mp.rings.size();
+
+	std::vector<Bbox> bboxes(num_rings);
+	for(size_t i=0; i<num_rings; i++) {
+		bboxes[i] = mp.rings[i].getBbox();
+	}
+
+	std::vector<std::pair<size_t, size_t> > pairs = find_bbox_overlaps(bboxes);
+	if(VERBOSE) printf("pincher: %zd rings, %zd overlapping bboxes\n", num_rings, pairs.size());
+
+	std::vector<bool> contained(num_rings, false);
+	RingGroups groups(num_rings);
+	bool got_merge = false;
+	for(size_t i=0; i<pairs.size(); i++) {
+		size_t r1_idx = pairs[i].first;
+		size_t r2_idx = pairs[i].second;
+		RingRelation rel = ring_ring_relation(mp.rings[r1_idx], mp.rings[r2_idx]);
+		if(rel == RINGREL_CONTAINS) {
+			contained[r2_idx] = true;
+		} else if(rel == RINGREL_CONTAINED_BY) {
+			contained[r1_idx] = true;
+		} else if(rel == RINGREL_CROSSES) {
+			groups.unite(r1_idx, r2_idx);
+			got_merge = true;
+		}
+	}
+
+	std::vector<std::vector<size_t> > members(num_rings);
+	std::vector<bool> keep_group(num_rings, false);
+	for(size_t i=0; i<num_rings; i++) {
+		size_t root = groups.find(i);
+		members[root].push_back(i);
+		// Contained rings don't change the union, but are included anyway
+		// since they may be what connects the group together.  A group is
+		// only dropped if all of its members are contained by something
+		// else.
+		if(!contained[i]) keep_group[root] = true;
+	}
+
+	Mpoly mp_out;
+	for(size_t root=0; root<num_rings; root++) {
+		if(!keep_group[root]) continue;
+		const std::vector<size_t> &group = members[root];
+		if(group.size() == 1) {
+			mp_out.rings.push_back(mp.rings[root]);
+		} else {
+			if(VERBOSE) printf("pincher: merging %zd rings\n", group.size());
+			mp_out.rings.push_back(ring_group_union(mp, group));
+		}
+	}
+	std::swap(mp.rings, mp_out.rings);
+
+	return got_merge;
 }
 
 Mpoly pinch_excursions2(const Mpoly &mp_in, DebugPlot *dbuf) {
@@ -562,46 +908,10 @@ Mpoly pinch_excursions2(const Mpoly &mp_in, DebugPlot *dbuf) {
 		if(mp_in.rings[r_idx].is_hole) fatal_error("pincher cannot be used on holes");
 		mp_out.rings[r_idx] = pinch_ring_excursions(mp_in.rings[r_idx]);
 	}
-	for(size_t r1_idx=0; r1_idx<mp_out.rings.size(); r1_idx++) {
-		REDO_R1:
-		if(r1_idx >= mp_out.rings.size()) break;
-
-		for(size_t r2_idx=r1_idx+1; r2_idx<mp_out.rings.size(); r2_idx++) {
-			REDO_R2:
-			if(r2_idx >= mp_out.rings.size()) break;
-
-			RingRelation rel = ring_ring_relation(mp_out.rings[r1_idx], mp_out.rings[r2_idx]);
-//printf("relation of %zd and %zd is %zd\n", r1_idx, r2_idx, rel);
-			if(rel == RINGREL_CONTAINS) {
-//printf("deleting %zd\n", r2_idx);
-				//if(dbuf && dbuf->mode == PLOT_PINCH) {
-				//	dbuf->debugPlotRing(mp_out.rings[r2_idx], 0, 0, 128);
-				//}
-				mp_out.deleteRing(r2_idx);
-				goto REDO_R2; // indexes shifted - reset loop
-			} else if(rel == RINGREL_CONTAINED_BY) {
-//printf("deleting %zd\n", r1_idx);
-				//if(dbuf && dbuf->mode == PLOT_PINCH) {
-				//	dbuf->debugPlotRing(mp_out.rings[r1_idx], 0, 0, 128);
-				//}
-				mp_out.deleteRing(r1_idx);
-				goto REDO_R1; // indexes shifted - reset loop
-			} else if(rel == RINGREL_CROSSES) {
-//printf("merging %zd and %zd\n", r1_idx, r2_idx);
-				Ring r3 = ring_ring_union(mp_out.rings[r1_idx], mp_out.rings[r2_idx]);
-				//if(dbuf && dbuf->mode == PLOT_PINCH) {
-				//	dbuf->debugPlotRing(mp_out.rings[r1_idx], 0, 0, 128);
-				//	dbuf->debugPlotRing(mp_out.rings[r2_idx], 0, 0, 128);
-				//}
-				mp_out.deleteRing(r2_idx);
-				mp_out.rings[r1_idx] = r3;
-				//if(dbuf && dbuf->mode == PLOT_PINCH) {
-				//	dbuf->debugPlotRing(mp_out.rings[r1_idx], 255, 128, 0);
-				//}
-				goto REDO_R1; // indexes shifted - reset loop
-			}
-		}
-	}
+
+	// A merged ring can newly contain other rings (ones that were in holes of
+	// the union), so repeat until nothing more gets merged.
+	while(merge_overlapping_rings(mp_out)) { }
 
 	if(dbuf && dbuf->mode == PLOT_PINCH) {
 		for(size_t i=0; i<mp_out.rings.size(); i++) {
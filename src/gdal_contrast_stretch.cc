@@ -27,15 +27,77 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <cassert>
+#include <cstring>
+#include <set>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/numeric/conversion/cast.hpp>
 
 #include "common.h"
 #include "ndv.h"
+#include "pipeline.h"
+#include "threads.h"
+
+#include <cpl_conv.h>
+#include <cpl_vsi.h>
 
 using namespace dangdal;
 
+// Histogram of floating point values which needs no prior knowledge of the
+// data range.  Values are bucketed by sign, exponent, and the top
+// MANTISSA_BITS bits of the mantissa, so each bucket spans about 0.1% of
+// its value.  Buckets are allocated one group (sign and exponent) at a
+// time, as values show up.
+//
+// Callers bin the distance from some data value (the anchor) rather than
+// the value itself, so the resolution follows the spread of the data
+// rather than its distance from zero.
+struct LogHistogram {
+	static const int MANTISSA_BITS = 10;
+	static const int NUM_GROUPS = 4096;
+	static const int GROUP_SIZE = 1 << MANTISSA_BITS;
+	static const int GROUP_SHIFT = 52;
+	static const int BUCKET_SHIFT = GROUP_SHIFT - MANTISSA_BITS;
+
+	LogHistogram() : groups(NUM_GROUPS) { }
+
+	// Maps a double onto an integer whose unsigned order matches the
+	// numeric order of the doubles.
+	static uint64_t key(double v) {
+		uint64_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		return (bits & SIGN_BIT) ? ~bits : (bits | SIGN_BIT);
+	}
+
+	static double from_key(uint64_t key) {
+		uint64_t bits = (key & SIGN_BIT) ? (key & ~SIGN_BIT) : ~key;
+		double v;
+		memcpy(&v, &bits, sizeof(v));
+		return v;
+	}
+
+	void add(double v) {
+		uint64_t k = key(v);
+		std::vector<size_t> &group = groups[k >> GROUP_SHIFT];
+		if(group.empty()) group.assign(GROUP_SIZE, 0);
+		group[(k >> BUCKET_SHIFT) & (GROUP_SIZE-1)]++;
+	}
+
+	void merge(const LogHistogram &other) {
+		for(int g=0; g<NUM_GROUPS; g++) {
+			const std::vector<size_t> &src = other.groups[g];
+			if(src.empty()) continue;
+			std::vector<size_t> &dst = groups[g];
+			if(dst.empty()) dst.assign(GROUP_SIZE, 0);
+			for(int i=0; i<GROUP_SIZE; i++) dst[i] += src[i];
+		}
+	}
+
+	static const uint64_t SIGN_BIT = uint64_t(1) << 63;
+
+	std::vector<std::vector<size_t> > groups;
+};
+
 struct Binning {
 	Binning() :
 		nbins(0),
@@ -44,6 +106,7 @@ struct Binning {
 	{ }
 
 	int to_bin(double v) const {
+		if(!group_base.empty()) return to_log_bin(v);
 		if(std::isinf(v) == -1) return 0;
 		if(std::isinf(v) ==  1) return nbins-1;
 		double bin_dbl = round((v-offset)/scale);
@@ -55,13 +118,29 @@ struct Binning {
 		return bin_int;
 	}
 
+	int to_log_bin(double v) const {
+		uint64_t k = LogHistogram::key(v - offset);
+		int base = group_base[k >> LogHistogram::GROUP_SHIFT];
+		// values from a group that was empty during the scan go to the
+		// nearest bin below
+		if(base < 0) return -1 - base;
+		return base + int((k >> LogHistogram::BUCKET_SHIFT) & (LogHistogram::GROUP_SIZE-1));
+	}
+
 	double from_bin(int i) const {
+		if(!bin_values.empty()) return bin_values[i];
 		return double(i) * scale + offset;
 	}
 
 	int nbins;
 	double offset;
 	double scale;
+
+	// Only for binnings built from a LogHistogram (offset is then the
+	// anchor): the first bin of each group (or -1-fallback_bin for groups
+	// having no bins), and the value represented by each bin.
+	std::vector<int> group_base;
+	std::vector<double> bin_values;
 };
 
 struct Histogram {
@@ -77,13 +156,79 @@ struct Histogram {
 	std::vector<size_t> counts;
 };
 
-std::vector<std::pair<double, double> > compute_minmax(
-	const std::vector<GDALRasterBandH> &src_bands, const NdvDef &ndv_def, 
-	size_t w, size_t h
-);
+// Which pixels the histogram is computed from.
+struct StatsSource {
+	StatsSource() : from_overview(false), sample_fraction(1) { }
+
+	// use the overview picked by choose_stats_overview, if any
+	bool from_overview;
+	double sample_fraction; // of the blocks
+};
+
+// -stats-from overview uses the coarsest overview having at least this many
+// pixels.
+static const size_t STATS_OVERVIEW_MIN_PIXELS = 1000000;
+
+// Integer types whose values map one-to-one onto histogram bins.  These are
+// read in their native type, counted directly (skipping Binning::to_bin),
+// and stretched through a table of every possible value.
+static bool is_direct_type(GDALDataType dt) {
+	return dt == GDT_Byte || dt == GDT_UInt16 || dt == GDT_Int16;
+}
+
+// The mapping from input values to 8-bit output, per band.
+struct Stretch {
+	// Output for a valid input pixel, never equal to out_ndv (for histeq
+	// the table has already been adjusted for that).
+	uint8_t apply(size_t band_idx, double v) const {
+		if(use_table) {
+			return xform_table[band_idx][binnings[band_idx].to_bin(v)];
+		}
+		double out_dbl = (v - lin_offsets[band_idx]) * lin_scales[band_idx];
+		uint8_t out =
+			(out_dbl < 0) ? 0 :
+			(out_dbl > output_range-1) ? output_range-1 :
+			uint8_t(out_dbl);
+		if(out == out_ndv) {
+			if(out_ndv < output_range/2) out++;
+			else out--;
+		}
+		return out;
+	}
+
+	bool use_table; // otherwise, use linear
+	std::vector<std::vector<uint8_t> > xform_table;
+	std::vector<Binning> binnings;
+	std::vector<double> lin_scales;
+	std::vector<double> lin_offsets;
+	int output_range;
+	uint8_t out_ndv;
+
+	// For Byte/UInt16/Int16 bands, apply() precomputed for every input
+	// value (indexed by value minus lut_offsets), and the type it is for.
+	// Empty for other bands.
+	std::vector<std::vector<uint8_t> > luts;
+	std::vector<int> lut_offsets;
+	std::vector<GDALDataType> lut_types;
+};
+
+int choose_stats_overview(GDALRasterBandH band, size_t min_pixels);
 std::vector<Histogram> compute_histogram(
-	const std::vector<GDALRasterBandH> &src_bands, const NdvDef &ndv_def, 
-	size_t w, size_t h, const std::vector<Binning> &binnings
+	const std::vector<std::string> &src_fns, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, const StatsSource &stats_source,
+	const std::vector<Binning> &binnings, size_t num_threads
+);
+std::string histogram_cache_key(
+	const std::vector<std::string> &src_fns, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, const StatsSource &stats_source
+);
+bool read_histogram_cache(
+	const std::string &cache_fn, const std::string &key,
+	std::vector<Histogram> &histograms
+);
+void write_histogram_cache(
+	const std::string &cache_fn, const std::string &key,
+	const std::vector<Histogram> &histograms
 );
 void get_scale_from_percentile(
 	const Histogram &histogram, int output_range,
@@ -92,10 +237,16 @@ void get_scale_from_percentile(
 );
 std::vector<uint8_t> invert_histogram_to_gaussian(const Histogram &histogram_in, double variance, 
 	int output_range);
+void stretch_files(
+	const std::vector<std::string> &src_fns, const std::vector<std::string> &dst_fns,
+	GDALDriverH dst_driver, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, const Stretch &stretch, size_t num_threads
+);
 void copyGeoCode(GDALDatasetH dst_ds, GDALDatasetH src_ds);
 
 void usage(const std::string &cmdname) {
-	printf("Usage: %s <options> src.tif dst.tif\n\n", cmdname.c_str());
+	printf("Usage: %s <options> src.tif dst.tif\n", cmdname.c_str());
+	printf("   or: %s <options> -outdir <dir> src1.tif src2.tif ...\n\n", cmdname.c_str());
 	NdvDef::printUsage();
 	printf(
 "  -outndv <output_nodata_val>        Output no-data value\n"
@@ -106,6 +257,27 @@ void usage(const std::string &cmdname) {
 "  -histeq <target_stddev>                           Histogram normalize to a target bell curve\n"
 "  -dump-histogram                                   Just print the histogram to console\n"
 "\n"
+"Mosaics:\n"
+"  -outdir <dir>                                     Stretch all inputs the same way, as one mosaic,\n"
+"                                                    writing each to a file of the same name in dir\n"
+"\n"
+"Statistics:\n"
+"  -stats-from <full|overview>                       Compute the histogram from the full image (default)\n"
+"                                                    or from the coarsest overview with at least 1M pixels\n"
+"  -stats-sample <fraction: 0.0-1.0>                 Compute the histogram from an evenly spread random\n"
+"                                                    subset of this fraction of the blocks\n"
+"\n"
+"  -hist-cache                                       Save the histogram to src.tif.hist (src1.tif.hist\n"
+"                                                    for a mosaic), and reuse it on later runs if the\n"
+"                                                    source files are unchanged\n"
+"\n"
+"Misc:\n"
+"  -threads <n>                                      Number of threads to use for the histogram and\n"
+"                                                    for the output.  Each output being written\n"
+"                                                    takes a reader, a writer, and at least one\n"
+"                                                    compute thread, so a mosaic writes n/3 files\n"
+"                                                    at a time\n"
+"\n"
 "Input can be any integer or floating type (but not complex).  Output is 8-bit.\n"
 );
 	exit(1);
@@ -116,8 +288,8 @@ int main(int argc, char *argv[]) {
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
 
-	std::string src_fn;
-	std::string dst_fn;
+	std::vector<std::string> inputs;
+	std::string dst_dir;
 	std::string output_format;
 
 	int mode_histeq = 0;
@@ -129,6 +301,10 @@ int main(int argc, char *argv[]) {
 	double from_percentile = -1;
 	double to_percentile = -1;
 	int out_ndv = 0, set_out_ndv = 0;
+	size_t num_threads = get_num_cpus();
+	bool stats_from_overview = false;
+	double stats_sample_fraction = 1;
+	bool use_hist_cache = false;
 
 	NdvDef ndv_def = NdvDef(arg_list);
 
@@ -164,12 +340,37 @@ int main(int argc, char *argv[]) {
 					mode_histeq = 1;
 				} else if(arg == "-dump-histogram") {
 					mode_dump_histogram = 1;
+				} else if(arg == "-outdir") {
+					if(argp == arg_list.size()) usage(cmdname);
+					dst_dir = arg_list[argp++];
 				} else if(arg == "-outndv") {
 					if(argp == arg_list.size()) usage(cmdname);
 					int64_t ndv_long = boost::lexical_cast<int64_t>(arg_list[argp++]);
 					if(ndv_long < 0 || ndv_long > 255) fatal_error("ndv must be in the range 0..255");
 					out_ndv = boost::numeric_cast<uint8_t>(ndv_long);
 					set_out_ndv++;
+				} else if(arg == "-stats-from") {
+					if(argp == arg_list.size()) usage(cmdname);
+					const std::string &from = arg_list[argp++];
+					if(from == "full") {
+						stats_from_overview = false;
+					} else if(from == "overview") {
+						stats_from_overview = true;
+					} else {
+						usage(cmdname);
+					}
+				} else if(arg == "-stats-sample") {
+					if(argp == arg_list.size()) usage(cmdname);
+					stats_sample_fraction = boost::lexical_cast<double>(arg_list[argp++]);
+					if(!(stats_sample_fraction > 0 && stats_sample_fraction <= 1)) {
+						fatal_error("-stats-sample must be greater than 0 and at most 1");
+					}
+				} else if(arg == "-hist-cache") {
+					use_hist_cache = true;
+				} else if(arg == "-threads") {
+					if(argp == arg_list.size()) usage(cmdname);
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(num_threads < 1) fatal_error("-threads must be at least 1");
 				} else {
 					usage(cmdname);
 				}
@@ -179,18 +380,26 @@ int main(int argc, char *argv[]) {
 				fatal_error("number given on command line out of range: %s", e.what());
 			}
 		} else {
-			if(src_fn.empty()) {
-				src_fn = arg;
-			} else if(dst_fn.empty()) {
-				dst_fn = arg;
-			} else {
-				usage(cmdname);
-			}
+			inputs.push_back(arg);
 		}
 	}
 
-	if(src_fn.empty()) usage(cmdname);
-	if(dst_fn.empty() != (mode_dump_histogram > 0)) usage(cmdname);
+	std::vector<std::string> src_fns;
+	std::vector<std::string> dst_fns;
+	if(!dst_dir.empty()) {
+		if(inputs.empty() || mode_dump_histogram) usage(cmdname);
+		src_fns = inputs;
+		for(size_t i=0; i<src_fns.size(); i++) {
+			dst_fns.push_back(CPLFormFilename(dst_dir.c_str(), CPLGetFilename(src_fns[i].c_str()), NULL));
+		}
+	} else if(mode_dump_histogram) {
+		if(inputs.empty()) usage(cmdname);
+		src_fns = inputs;
+	} else {
+		if(inputs.size() != 2) usage(cmdname);
+		src_fns.push_back(inputs[0]);
+		dst_fns.push_back(inputs[1]);
+	}
 	if(mode_percentile + mode_stddev + mode_histeq + mode_dump_histogram > 1) usage(cmdname);
 	if(mode_stddev && (dst_avg < 0 || dst_stddev < 0)) usage(cmdname);
 	if(mode_percentile && !(
@@ -198,20 +407,47 @@ int main(int argc, char *argv[]) {
 		from_percentile < to_percentile &&
 		to_percentile <= 1)) usage(cmdname);
 
+	if(src_fns.size() > 1) {
+		std::set<std::string> dst_seen;
+		std::set<std::pair<dev_t, ino_t> > src_files;
+		for(size_t i=0; i<src_fns.size(); i++) {
+			VSIStatBufL st;
+			if(!VSIStatL(src_fns[i].c_str(), &st)) {
+				src_files.insert(std::make_pair(st.st_dev, st.st_ino));
+			}
+		}
+		for(size_t i=0; i<dst_fns.size(); i++) {
+			if(!dst_seen.insert(dst_fns[i]).second) {
+				fatal_error("more than one input would be written to %s", dst_fns[i].c_str());
+			}
+			VSIStatBufL st;
+			if(!VSIStatL(dst_fns[i].c_str(), &st) &&
+				src_files.count(std::make_pair(st.st_dev, st.st_ino))
+			) {
+				fatal_error("writing %s would overwrite an input", dst_fns[i].c_str());
+			}
+		}
+	}
+
 	if(output_format.empty()) output_format = "GTiff";
 
 	GDALAllRegister();
 
 	//////// open source ////////
 
-	GDALDatasetH src_ds = GDALOpen(src_fn.c_str(), GA_ReadOnly);
+	// With several inputs, the first one stands for all of them here.
+	GDALDatasetH src_ds = GDALOpen(src_fns[0].c_str(), GA_ReadOnly);
 	if(!src_ds) fatal_error("open failed");
 
 	size_t w = GDALGetRasterXSize(src_ds);
 	size_t h = GDALGetRasterYSize(src_ds);
 	if(!w || !h) fatal_error("missing width/height");
 	size_t src_band_count = GDALGetRasterCount(src_ds);
-	printf("Input size is %zd, %zd, %zd\n", w, h, src_band_count);
+	if(src_fns.size() > 1) {
+		printf("Mosaic of %zd inputs with %zd bands\n", src_fns.size(), src_band_count);
+	} else {
+		printf("Input size is %zd, %zd, %zd\n", w, h, src_band_count);
+	}
 
 	std::vector<size_t> bandlist;
 	for(size_t i=0; i<src_band_count; i++) {
@@ -248,30 +484,22 @@ int main(int argc, char *argv[]) {
 
 	//////// open output ////////
 
-	printf("Output size is %zd x %zd x %zd\n", w, h, dst_band_count);
+	if(src_fns.size() == 1) {
+		printf("Output size is %zd x %zd x %zd\n", w, h, dst_band_count);
+	}
 
 	GDALDriverH dst_driver = GDALGetDriverByName(output_format.c_str());
 	if(!dst_driver) fatal_error("unrecognized output format (%s)", output_format.c_str());
 
-	//////// open bands ////////
-
-	std::vector<GDALRasterBandH> src_bands;
-	std::vector<GDALRasterBandH> dst_bands;
-
-	for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-		src_bands.push_back(GDALGetRasterBand(src_ds, bandlist[band_idx]));
-	}
-
 	//////// find optimal binning ////////
 
 	std::vector<Binning> binnings(dst_band_count);
+	std::vector<GDALDataType> src_types(dst_band_count);
 	{
-		// computed on demand
-		std::vector<std::pair<double, double> > minmax;
-
 		for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
 			Binning &binning = binnings[band_idx];
-			GDALDataType dt = GDALGetRasterDataType(src_bands[band_idx]);
+			GDALDataType dt = GDALGetRasterDataType(GDALGetRasterBand(src_ds, bandlist[band_idx]));
+			src_types[band_idx] = dt;
 			switch(dt) {
 				case GDT_Byte:
 					binning.nbins = 256;
@@ -289,28 +517,43 @@ int main(int argc, char *argv[]) {
 					binning.scale = 1;
 					break;
 				default:
-					if(minmax.empty()) {
-						printf("Computing min/max values...\n");
-						minmax = compute_minmax(src_bands, ndv_def, w, h);
-					}
-					double min = minmax[band_idx].first;
-					double max = minmax[band_idx].second;
-					// a compromise between memory usage and datavalue resolution
-					binning.nbins = 10000000;
-					binning.offset = min;
-					binning.scale = (max - min) / double(binning.nbins-1);
+					// binned adaptively while computing the histogram
+					break;
 			}
 		}
 	}
 
+	GDALClose(src_ds);
+
 	//////// compute lookup table ////////
 
-	printf("\nComputing histogram...\n");
-	std::vector<Histogram> histograms =
-		compute_histogram(src_bands, ndv_def, w, h, binnings);
+	StatsSource stats_source;
+	stats_source.from_overview = stats_from_overview;
+	stats_source.sample_fraction = stats_sample_fraction;
+
+	std::vector<Histogram> histograms;
+	std::string cache_fn, cache_key;
+	if(use_hist_cache) {
+		cache_fn = src_fns[0] + ".hist";
+		cache_key = histogram_cache_key(src_fns, bandlist, ndv_def, stats_source);
+		if(cache_key.empty()) {
+			printf("Cannot stat the input, not using the histogram cache.\n");
+		} else if(read_histogram_cache(cache_fn, cache_key, histograms)) {
+			printf("\nUsing histogram from %s\n", cache_fn.c_str());
+		}
+	}
+
+	if(histograms.empty()) {
+		printf("\nComputing histogram...\n");
+		histograms = compute_histogram(src_fns, bandlist, ndv_def, stats_source, binnings, num_threads);
+		if(!cache_key.empty()) {
+			write_histogram_cache(cache_fn, cache_key, histograms);
+		}
+	}
 
 	for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
 		Histogram &hg = histograms[band_idx];
+		binnings[band_idx] = hg.binning;
 		printf("band %zd: min=%g, max=%g, mean=%g, stddev=%g, valid_count=%zd, ndv_count=%zd\n",
 			band_idx, hg.min, hg.max, hg.mean, hg.stddev, hg.data_count, hg.ndv_count);
 		if(mode_dump_histogram) {
@@ -324,54 +567,47 @@ int main(int argc, char *argv[]) {
 		return 0;
 	}
 
-	//////// open output ////////
-
-	GDALDatasetH dst_ds = GDALCreate(dst_driver, dst_fn.c_str(), w, h, dst_band_count, GDT_Byte, NULL);
-	if(!dst_ds) fatal_error("couldn't create output");
-	copyGeoCode(dst_ds, src_ds);
-
-	for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-		dst_bands.push_back(GDALGetRasterBand(dst_ds, band_idx+1));
-	}
-
 	//////// compute tranformation parameters ////////
 
-	const int output_range = 256;
-	bool use_table; // otherwise, use linear
-	std::vector<std::vector<uint8_t> > xform_table(dst_band_count);
-	std::vector<double> lin_scales(dst_band_count);
-	std::vector<double> lin_offsets(dst_band_count);
+	Stretch stretch;
+	stretch.output_range = 256;
+	stretch.out_ndv = out_ndv;
+	stretch.binnings = binnings;
+	stretch.xform_table.resize(dst_band_count);
+	stretch.lin_scales.resize(dst_band_count);
+	stretch.lin_offsets.resize(dst_band_count);
+	const int output_range = stretch.output_range;
 
 	if(mode_histeq) {
-		use_table = true;
+		stretch.use_table = true;
 		for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-			xform_table[band_idx] = invert_histogram_to_gaussian(
+			stretch.xform_table[band_idx] = invert_histogram_to_gaussian(
 				histograms[band_idx], dst_stddev, output_range);
 		}
 	} else{
-		use_table = false;
+		stretch.use_table = false;
 		if(mode_percentile) {
 			for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
 				get_scale_from_percentile(
 					histograms[band_idx], output_range, from_percentile, to_percentile,
-					&lin_scales[band_idx], &lin_offsets[band_idx]);
+					&stretch.lin_scales[band_idx], &stretch.lin_offsets[band_idx]);
 			}
 		} else if(mode_stddev) {
 			for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
 				Histogram &hg = histograms[band_idx];
-				lin_scales[band_idx] = hg.stddev ? dst_stddev / hg.stddev : 0;
-				lin_offsets[band_idx] = hg.mean - dst_avg / lin_scales[band_idx];
+				stretch.lin_scales[band_idx] = hg.stddev ? dst_stddev / hg.stddev : 0;
+				stretch.lin_offsets[band_idx] = hg.mean - dst_avg / stretch.lin_scales[band_idx];
 			}
 		} else { // no transformation
 			for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-				lin_scales[band_idx] = 1;
-				lin_offsets[band_idx] = 0;
+				stretch.lin_scales[band_idx] = 1;
+				stretch.lin_offsets[band_idx] = 0;
 			}
 		}
 		printf("Linear stretch:\n");
 		for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-			double scale = lin_scales[band_idx];
-			double offset = lin_offsets[band_idx];
+			double scale = stretch.lin_scales[band_idx];
+			double offset = stretch.lin_offsets[band_idx];
 			printf("band %zd: scale=%f, offset=%f, src_range=[%f, %f]\n",
 				band_idx, scale, offset, offset, ((double)(output_range-1)/scale)+offset);
 		}
@@ -379,268 +615,1032 @@ int main(int argc, char *argv[]) {
 
 	histograms.clear(); // free up memory
 
-	if(use_table) {
+	if(stretch.use_table) {
 		// avoid ndv in output for good pixels
 		if(use_ndv) {
 			for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-				for(size_t i=0; i<xform_table[band_idx].size(); i++) {
-					uint8_t v = xform_table[band_idx][i];
+				std::vector<uint8_t> &xform = stretch.xform_table[band_idx];
+				for(size_t i=0; i<xform.size(); i++) {
+					uint8_t v = xform[i];
 					if(v == out_ndv) {
 						if(out_ndv < output_range/2) v++;
 						else v--;
 					}
-					xform_table[band_idx][i] = v;
+					xform[i] = v;
 				}
 			}
 		}
 	}
 
+	// Byte/UInt16/Int16 input has few enough distinct values to tabulate
+	// the whole transform, so the output pass is just a lookup per pixel.
+	stretch.luts.resize(dst_band_count);
+	stretch.lut_offsets.resize(dst_band_count);
+	stretch.lut_types = src_types;
+	for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
+		if(!is_direct_type(src_types[band_idx])) continue;
+		const Binning &binning = binnings[band_idx];
+		std::vector<uint8_t> &lut = stretch.luts[band_idx];
+		stretch.lut_offsets[band_idx] = int(binning.offset);
+		lut.resize(binning.nbins);
+		for(int i=0; i<binning.nbins; i++) {
+			lut[i] = stretch.apply(band_idx, binning.from_bin(i));
+		}
+	}
+
 	//////// do transformation ////////
 
 	printf("\nComputing output...\n");
 
-	int blocksize_x_int, blocksize_y_int;
-	GDALGetBlockSize(src_bands[0], &blocksize_x_int, &blocksize_y_int);
-	size_t blocksize_x = blocksize_x_int;
-	size_t blocksize_y = blocksize_y_int;
-	size_t block_len = blocksize_x*blocksize_y;
+	stretch_files(src_fns, dst_fns, dst_driver, bandlist, ndv_def, stretch, num_threads);
 
-	std::vector<std::vector<double> > buf_in(dst_band_count);
-	std::vector<std::vector<uint8_t> > buf_out(dst_band_count);
-	for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-		buf_in[band_idx].resize(block_len);
-		buf_out[band_idx].resize(block_len);
+	GDALTermProgress(1, NULL, NULL);
+
+	return 0;
+}
+
+template<class T>
+static void check_ndv_block(
+	const NdvDef &ndv_def, size_t band_idx, const std::vector<uint8_t> &buf,
+	uint8_t *ndv_mask, uint8_t *band_mask, size_t len
+) {
+	const T *p = reinterpret_cast<const T *>(&buf[0]);
+	if(band_idx == 0) {
+		ndv_def.arrayCheckNdv(band_idx, p, ndv_mask, len);
+	} else {
+		ndv_def.arrayCheckNdv(band_idx, p, band_mask, len);
+		ndv_def.aggregateMask(ndv_mask, band_mask, len);
 	}
-	std::vector<uint8_t> ndv_mask(block_len);
-	std::vector<uint8_t> band_mask(block_len);
+}
 
-	for(size_t boff_y=0; boff_y<h; boff_y+=blocksize_y) {
-		size_t bsize_y = blocksize_y;
-		if(bsize_y + boff_y > h) bsize_y = h - boff_y;
-		for(size_t boff_x=0; boff_x<w; boff_x+=blocksize_x) {
-			size_t bsize_x = blocksize_x;
-			if(bsize_x + boff_x > w) bsize_x = w - boff_x;
+// Output of a block of a band having a lookup table.
+template<class T>
+static void apply_lut(
+	const std::vector<uint8_t> &buf, const uint8_t *ndv_mask, size_t len,
+	const uint8_t *lut, int lut_offset, uint8_t out_ndv, uint8_t *out
+) {
+	const T *p = reinterpret_cast<const T *>(&buf[0]);
+	for(size_t i=0; i<len; i++) {
+		out[i] = ndv_mask[i] ? out_ndv : lut[int(p[i]) - lut_offset];
+	}
+}
+
+// Stretches one file, a block per job.  The input, output and NDV buffers
+// are per pipeline slot.
+class StretchBlocksTask : public PipelineTask {
+public:
+	StretchBlocksTask(
+		GDALDatasetH src_ds, GDALDatasetH dst_ds,
+		const std::vector<size_t> &bandlist,
+		const NdvDef &_ndv_def, const Stretch &_stretch,
+		size_t num_slots, bool _report_progress
+	) :
+		ndv_def(_ndv_def), stretch(_stretch),
+		band_count(bandlist.size()),
+		report_progress(_report_progress),
+		read_types(band_count),
+		slots(num_slots)
+	{
+		w = GDALGetRasterXSize(src_ds);
+		h = GDALGetRasterYSize(src_ds);
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			src_bands.push_back(GDALGetRasterBand(src_ds, bandlist[band_idx]));
+			dst_bands.push_back(GDALGetRasterBand(dst_ds, band_idx+1));
+		}
+
+		int blocksize_x_int, blocksize_y_int;
+		GDALGetBlockSize(src_bands[0], &blocksize_x_int, &blocksize_y_int);
+		blocksize_x = blocksize_x_int;
+		blocksize_y = blocksize_y_int;
+		size_t block_len = blocksize_x*blocksize_y;
+		num_blocks_x = (w + blocksize_x - 1) / blocksize_x;
+		num_jobs = num_blocks_x * ((h + blocksize_y - 1) / blocksize_y);
+
+		// Bands having a lookup table are read in their native type,
+		// everything else as Float64.
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			GDALDataType dt = GDALGetRasterDataType(src_bands[band_idx]);
+			bool use_lut = !stretch.luts[band_idx].empty() && dt == stretch.lut_types[band_idx];
+			read_types[band_idx] = use_lut ? dt : GDT_Float64;
+		}
+
+		for(size_t slot_idx=0; slot_idx<num_slots; slot_idx++) {
+			Slot &slot = slots[slot_idx];
+			slot.buf_in.resize(band_count);
+			slot.buf_out.resize(band_count);
+			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+				slot.buf_in[band_idx].resize(block_len * GDALGetDataTypeSize(read_types[band_idx]) / 8);
+				slot.buf_out[band_idx].resize(block_len);
+			}
+			slot.ndv_mask.resize(block_len);
+			slot.band_mask.resize(block_len);
+		}
+	}
+
+	void getBlock(size_t job_idx,
+		size_t *boff_x, size_t *boff_y, size_t *bsize_x, size_t *bsize_y
+	) const {
+		*boff_x = (job_idx % num_blocks_x) * blocksize_x;
+		*boff_y = (job_idx / num_blocks_x) * blocksize_y;
+		*bsize_x = std::min(blocksize_x, w - *boff_x);
+		*bsize_y = std::min(blocksize_y, h - *boff_y);
+	}
+
+	bool read(size_t job_idx, size_t slot_idx) {
+		size_t boff_x, boff_y, bsize_x, bsize_y;
+		getBlock(job_idx, &boff_x, &boff_y, &bsize_x, &bsize_y);
+		Slot &slot = slots[slot_idx];
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			GDALRasterIO(src_bands[band_idx], GF_Read, boff_x, boff_y, bsize_x, bsize_y, 
+				&slot.buf_in[band_idx][0], bsize_x, bsize_y, read_types[band_idx], 0, 0);
+		}
+		return true;
+	}
+
+	bool compute(size_t job_idx, size_t slot_idx) {
+		size_t boff_x, boff_y, bsize_x, bsize_y;
+		getBlock(job_idx, &boff_x, &boff_y, &bsize_x, &bsize_y);
+		size_t block_len = bsize_x*bsize_y;
+		Slot &slot = slots[slot_idx];
+		uint8_t *ndv_mask = &slot.ndv_mask[0];
+		uint8_t *band_mask = &slot.band_mask[0];
+		const uint8_t out_ndv = stretch.out_ndv;
+
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			const std::vector<uint8_t> &buf = slot.buf_in[band_idx];
+			switch(read_types[band_idx]) {
+				case GDT_Byte:
+					check_ndv_block<uint8_t>(ndv_def, band_idx, buf, ndv_mask, band_mask, block_len);
+					break;
+				case GDT_UInt16:
+					check_ndv_block<uint16_t>(ndv_def, band_idx, buf, ndv_mask, band_mask, block_len);
+					break;
+				case GDT_Int16:
+					check_ndv_block<int16_t>(ndv_def, band_idx, buf, ndv_mask, band_mask, block_len);
+					break;
+				default:
+					check_ndv_block<double>(ndv_def, band_idx, buf, ndv_mask, band_mask, block_len);
+			}
+		}
 
-			block_len = bsize_x*bsize_y;
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			const std::vector<uint8_t> &buf = slot.buf_in[band_idx];
+			uint8_t *p_out = &slot.buf_out[band_idx][0];
+			const uint8_t *lut = stretch.luts[band_idx].empty() ? NULL : &stretch.luts[band_idx][0];
+			int lut_offset = stretch.lut_offsets[band_idx];
 
+			switch(read_types[band_idx]) {
+				case GDT_Byte:
+					apply_lut<uint8_t>(buf, ndv_mask, block_len, lut, lut_offset, out_ndv, p_out);
+					break;
+				case GDT_UInt16:
+					apply_lut<uint16_t>(buf, ndv_mask, block_len, lut, lut_offset, out_ndv, p_out);
+					break;
+				case GDT_Int16:
+					apply_lut<int16_t>(buf, ndv_mask, block_len, lut, lut_offset, out_ndv, p_out);
+					break;
+				default: {
+					const double *p_in = reinterpret_cast<const double *>(&buf[0]);
+					for(size_t i=0; i<block_len; i++) {
+						p_out[i] = ndv_mask[i] ? out_ndv : stretch.apply(band_idx, p_in[i]);
+					}
+				}
+			}
+		}
+		return true;
+	}
+
+	bool write(size_t job_idx, size_t slot_idx) {
+		size_t boff_x, boff_y, bsize_x, bsize_y;
+		getBlock(job_idx, &boff_x, &boff_y, &bsize_x, &bsize_y);
+		Slot &slot = slots[slot_idx];
+
+		if(report_progress) {
 			double progress = 
 				((double)boff_y * (double)w +
 				(double)boff_x * (double)bsize_y) /
 				((double)w * (double)h);
 			GDALTermProgress(progress, NULL, NULL);
+		}
 
-			for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-				GDALRasterIO(src_bands[band_idx], GF_Read, boff_x, boff_y, bsize_x, bsize_y, 
-					&buf_in[band_idx][0], bsize_x, bsize_y, GDT_Float64, 0, 0);
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			GDALRasterIO(dst_bands[band_idx], GF_Write, boff_x, boff_y, bsize_x, bsize_y, 
+				&slot.buf_out[band_idx][0], bsize_x, bsize_y, GDT_Byte, 0, 0);
+		}
+		return true;
+	}
 
-				if(band_idx == 0) {
-					ndv_def.arrayCheckNdv(band_idx, &buf_in[band_idx][0], &ndv_mask[0], block_len);
-				} else {
-					ndv_def.arrayCheckNdv(band_idx, &buf_in[band_idx][0], &band_mask[0], block_len);
-					ndv_def.aggregateMask(&ndv_mask[0], &band_mask[0], block_len);
-				}
-			}
+	struct Slot {
+		std::vector<std::vector<uint8_t> > buf_in;
+		std::vector<std::vector<uint8_t> > buf_out;
+		std::vector<uint8_t> ndv_mask;
+		std::vector<uint8_t> band_mask;
+	};
+
+	const NdvDef &ndv_def;
+	const Stretch &stretch;
+	size_t band_count;
+	bool report_progress;
+	size_t w, h;
+	size_t blocksize_x, blocksize_y;
+	size_t num_blocks_x;
+	size_t num_jobs;
+	std::vector<GDALRasterBandH> src_bands;
+	std::vector<GDALRasterBandH> dst_bands;
+	std::vector<GDALDataType> read_types;
+	std::vector<Slot> slots;
+};
 
-			for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-				double *p_in = &buf_in[band_idx][0];
-				uint8_t *p_out = &buf_out[band_idx][0];
-				uint8_t *p_ndv = &ndv_mask[0];
-				if(use_table) {
-					uint8_t *xform = &xform_table[band_idx][0];
-					Binning binning = binnings[band_idx];
+// Each job is one input file.  Outputs of a mosaic are written in parallel,
+// and progress is then reported file by file rather than block by block.
+// Within each file, blocks are read, stretched, and written by a pipeline
+// with compute_threads threads of its own.  This may run on a worker thread,
+// so errors are recorded (and the remaining files skipped) rather than
+// calling fatal_error while other outputs are still being written.
+class StretchTask : public ParallelTask {
+public:
+	StretchTask(
+		const std::vector<std::string> &_src_fns, const std::vector<std::string> &_dst_fns,
+		GDALDriverH _dst_driver, const std::vector<size_t> &_bandlist,
+		const NdvDef &_ndv_def, const Stretch &_stretch, size_t _compute_threads
+	) :
+		src_fns(_src_fns), dst_fns(_dst_fns),
+		dst_driver(_dst_driver), bandlist(_bandlist),
+		ndv_def(_ndv_def), stretch(_stretch),
+		compute_threads(_compute_threads),
+		files_done(0)
+	{
+		pthread_mutex_init(&mutex, NULL);
+	}
 
-					for(size_t i=0; i<block_len; i++) {
-						if(*p_ndv) {
-							*p_out = out_ndv;
-						} else {
-							*p_out = xform[binning.to_bin(*p_in)];
-							//printf("%g %d %d\n", *p_in, binning.to_bin(*p_in), *p_out);
-						}
-						p_in++; p_out++; p_ndv++;
-					}
-				} else {
-					double scale = lin_scales[band_idx];
-					double offset = lin_offsets[band_idx];
-					for(size_t i=0; i<block_len; i++) {
-						if(*p_ndv) {
-							*p_out = out_ndv;
-						} else {
-							double out_dbl = (*p_in - offset) * scale;
-							uint8_t v =
-								(out_dbl < 0) ? 0 :
-								(out_dbl > output_range-1) ? output_range-1 :
-								uint8_t(out_dbl);
-							if(v == out_ndv) {
-								if(out_ndv < output_range/2) v++;
-								else v--;
-							}
-							*p_out = v;
-						}
-						p_in++; p_out++; p_ndv++;
-					}
-				}
+	~StretchTask() {
+		pthread_mutex_destroy(&mutex);
+	}
 
-				GDALRasterIO(dst_bands[band_idx], GF_Write, boff_x, boff_y, bsize_x, bsize_y, 
-					&buf_out[band_idx][0], bsize_x, bsize_y, GDT_Byte, 0, 0);
-			} // band
-		} // block x
-	} // block y
+	void run(size_t job_idx, size_t) {
+		{
+			ScopedLock lock(mutex);
+			if(!error.empty()) return;
+		}
+		if(!stretchFile(src_fns[job_idx], dst_fns[job_idx], src_fns.size() == 1)) return;
+		if(src_fns.size() > 1) {
+			ScopedLock lock(mutex);
+			files_done++;
+			GDALTermProgress(double(files_done) / double(src_fns.size()), NULL, NULL);
+		}
+	}
 
-	GDALClose(src_ds);
-	GDALClose(dst_ds);
+	bool fail(const std::string &msg) {
+		ScopedLock lock(mutex);
+		if(error.empty()) error = msg;
+		return false;
+	}
 
-	GDALTermProgress(1, NULL, NULL);
+	bool stretchFile(const std::string &src_fn, const std::string &dst_fn, bool report_progress) {
+		size_t dst_band_count = bandlist.size();
 
-	return 0;
+		GDALDatasetH src_ds = GDALOpen(src_fn.c_str(), GA_ReadOnly);
+		if(!src_ds) return fail("open failed");
+		if(size_t(GDALGetRasterCount(src_ds)) != dst_band_count) {
+			GDALClose(src_ds);
+			return fail(src_fn+" doesn't have "+
+				boost::lexical_cast<std::string>(dst_band_count)+" bands");
+		}
+		size_t w = GDALGetRasterXSize(src_ds);
+		size_t h = GDALGetRasterYSize(src_ds);
+
+		GDALDatasetH dst_ds = GDALCreate(dst_driver, dst_fn.c_str(), w, h, dst_band_count, GDT_Byte, NULL);
+		if(!dst_ds) {
+			GDALClose(src_ds);
+			return fail("couldn't create output");
+		}
+		copyGeoCode(dst_ds, src_ds);
+
+		bool ok;
+		{
+			size_t num_slots = pipeline_slots(compute_threads);
+			StretchBlocksTask task(src_ds, dst_ds, bandlist, ndv_def, stretch,
+				num_slots, report_progress);
+			ok = run_pipeline(task, task.num_jobs, num_slots, compute_threads);
+			if(!ok) fail(dst_fn+": "+task.getError());
+		}
+
+		GDALClose(src_ds);
+		GDALClose(dst_ds);
+		return ok;
+	}
+
+	const std::vector<std::string> &src_fns;
+	const std::vector<std::string> &dst_fns;
+	GDALDriverH dst_driver;
+	const std::vector<size_t> &bandlist;
+	const NdvDef &ndv_def;
+	const Stretch &stretch;
+	size_t compute_threads;
+	pthread_mutex_t mutex;
+	size_t files_done;
+	std::string error; // the first error, if any
+};
+
+void stretch_files(
+	const std::vector<std::string> &src_fns, const std::vector<std::string> &dst_fns,
+	GDALDriverH dst_driver, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, const Stretch &stretch, size_t num_threads
+) {
+	// Each file in progress also has a reader and a writer thread, so these
+	// count against num_threads too.
+	size_t files_at_once = std::min(src_fns.size(), std::max(size_t(1), num_threads / 3));
+	size_t compute_threads = std::max(size_t(3), num_threads / files_at_once) - 2;
+	StretchTask task(src_fns, dst_fns, dst_driver, bandlist, ndv_def, stretch, compute_threads);
+	if(src_fns.size() > 1) GDALTermProgress(0, NULL, NULL);
+	run_parallel(task, src_fns.size(), files_at_once);
+	if(!task.error.empty()) fatal_error(task.error);
 }
 
-std::vector<std::pair<double, double> > compute_minmax(
-	const std::vector<GDALRasterBandH> &src_bands, const NdvDef &ndv_def, 
-	size_t w, size_t h
+// One thread's (or one file's) share of the histogram of one band.
+struct BandAccum {
+	BandAccum() :
+		got_data(false), got_finite(false),
+		min(0), max(0), finite_min(0), finite_max(0),
+		ndv_count(0)
+	{ }
+
+	void merge(const BandAccum &other) {
+		ndv_count += other.ndv_count;
+		for(size_t i=0; i<counts.size(); i++) {
+			counts[i] += other.counts[i];
+		}
+		log_hist.merge(other.log_hist);
+		if(other.got_data) {
+			if(!got_data || other.min < min) min = other.min;
+			if(!got_data || other.max > max) max = other.max;
+			got_data = true;
+		}
+		if(other.got_finite) {
+			if(!got_finite || other.finite_min < finite_min) finite_min = other.finite_min;
+			if(!got_finite || other.finite_max > finite_max) finite_max = other.finite_max;
+			got_finite = true;
+		}
+	}
+
+	bool got_data, got_finite;
+	double min, max;
+	double finite_min, finite_max;
+	size_t ndv_count;
+	// private bin counts (direct bands only)
+	std::vector<size_t> counts;
+	// floating point bands only
+	LogHistogram log_hist;
+};
+
+template<class T>
+static void count_direct(
+	const std::vector<uint8_t> &buf, const uint8_t *ndv_mask, size_t len,
+	int bin_offset, BandAccum &acc
 ) {
-	size_t band_count = src_bands.size();
-	std::vector<std::pair<double, double> > minmax(band_count);
+	const T *p = reinterpret_cast<const T *>(&buf[0]);
+	size_t *counts = &acc.counts[0];
+	for(size_t i=0; i<len; i++) {
+		if(ndv_mask[i]) {
+			acc.ndv_count++;
+		} else {
+			counts[int(p[i]) - bin_offset]++;
+		}
+	}
+}
 
-	int blocksize_x_int, blocksize_y_int;
-	GDALGetBlockSize(src_bands[0], &blocksize_x_int, &blocksize_y_int);
-	size_t blocksize_x = blocksize_x_int;
-	size_t blocksize_y = blocksize_y_int;
-	size_t block_len = blocksize_x*blocksize_y;
+template<class T>
+static void count_log(
+	const std::vector<uint8_t> &buf, const uint8_t *ndv_mask, size_t len,
+	double anchor, BandAccum &acc
+) {
+	const T *p = reinterpret_cast<const T *>(&buf[0]);
+	for(size_t i=0; i<len; i++) {
+		if(ndv_mask[i]) {
+			acc.ndv_count++;
+			continue;
+		}
+		double v = p[i];
+		acc.log_hist.add(v - anchor);
+		if(!acc.got_data) {
+			acc.min = acc.max = v;
+			acc.got_data = true;
+		}
+		if(v < acc.min) acc.min = v;
+		if(v > acc.max) acc.max = v;
+		if(std::isinf(v)) continue;
+		if(!acc.got_finite) {
+			acc.finite_min = acc.finite_max = v;
+			acc.got_finite = true;
+		}
+		if(v < acc.finite_min) acc.finite_min = v;
+		if(v > acc.finite_max) acc.finite_max = v;
+	}
+}
 
-	std::vector<std::vector<double> > buf_in(band_count);
-	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-		buf_in[band_idx].resize(block_len);
+// Sum and count of the finite valid values of a block.
+template<class T>
+static void block_sum(
+	const std::vector<uint8_t> &buf, const uint8_t *ndv_mask, size_t len,
+	double *sum_out, size_t *count_out
+) {
+	const T *p = reinterpret_cast<const T *>(&buf[0]);
+	double sum = 0;
+	size_t count = 0;
+	for(size_t i=0; i<len; i++) {
+		if(ndv_mask[i] || std::isinf(double(p[i]))) continue;
+		sum += p[i];
+		count++;
 	}
-	std::vector<uint8_t> ndv_mask(block_len);
-	std::vector<uint8_t> band_mask(block_len);
+	*sum_out = sum;
+	*count_out = count;
+}
 
-	std::vector<bool> got_data(band_count);
+// Lays out the groups of a LogHistogram that saw any data as consecutive
+// bins.  Each bin stands for the midpoint of its bucket, clamped to
+// [clamp_min, clamp_max] so that the outermost buckets (and infinities)
+// don't reach past the data.
+static void log_histogram_to_bins(
+	const LogHistogram &lh, double anchor,
+	double clamp_min, double clamp_max,
+	Histogram &hg
+) {
+	Binning &binning = hg.binning;
+	binning.offset = anchor;
+	binning.group_base.assign(LogHistogram::NUM_GROUPS, -1);
+	binning.bin_values.clear();
+	hg.counts.clear();
+
+	int fallback_bin = 0;
+	for(int g=0; g<LogHistogram::NUM_GROUPS; g++) {
+		const std::vector<size_t> &group = lh.groups[g];
+		if(group.empty()) {
+			binning.group_base[g] = -1 - fallback_bin;
+			continue;
+		}
+		int base = int(binning.bin_values.size());
+		binning.group_base[g] = base;
+		for(int i=0; i<LogHistogram::GROUP_SIZE; i++) {
+			uint64_t k0 = (uint64_t(g) << LogHistogram::GROUP_SHIFT) |
+				(uint64_t(i) << LogHistogram::BUCKET_SHIFT);
+			uint64_t k1 = k0 | ((uint64_t(1) << LogHistogram::BUCKET_SHIFT) - 1);
+			double v = LogHistogram::from_key(k0) / 2 + LogHistogram::from_key(k1) / 2;
+			// buckets holding an infinity have a NaN at their far end
+			if(std::isnan(v)) v = (k0 & LogHistogram::SIGN_BIT) ? HUGE_VAL : -HUGE_VAL;
+			v += anchor;
+			v = std::max(clamp_min, std::min(clamp_max, v));
+			binning.bin_values.push_back(v);
+			hg.counts.push_back(group[i]);
+		}
+		fallback_bin = base + LogHistogram::GROUP_SIZE - 1;
+	}
 
-	for(size_t boff_y=0; boff_y<h; boff_y+=blocksize_y) {
-		size_t bsize_y = blocksize_y;
-		if(bsize_y + boff_y > h) bsize_y = h - boff_y;
-		for(size_t boff_x=0; boff_x<w; boff_x+=blocksize_x) {
-			size_t bsize_x = blocksize_x;
-			if(bsize_x + boff_x > w) bsize_x = w - boff_x;
+	if(binning.bin_values.empty()) {
+		// no valid data
+		binning.bin_values.push_back(0);
+		hg.counts.push_back(0);
+	}
+	binning.nbins = int(binning.bin_values.size());
+}
 
-			block_len = bsize_x*bsize_y;
+// Each job is one block.  GDAL handles can't be shared between
+// threads, so every thread reads through its own copy of the dataset.
+//
+// Byte/UInt16/Int16 bands are counted into per-thread histograms of exact
+// values.  Floating point bands are counted into per-thread LogHistograms,
+// which need no min/max pass beforehand.  Either way the per-thread results
+// are merged at the end.
+//
+// The anchor of each floating point band is its first finite value, in job
+// order.  Jobs are run one at a time until every band has one, so the
+// result doesn't depend on how jobs get scheduled.  Anchors can also be
+// given by the caller through setAnchor.
+//
+// This may be constructed on a worker thread (see MosaicHistogramTask), so
+// if the input can't be opened the reason is left in error, and the task
+// has no jobs, rather than fatal_error being called.
+class HistogramTask : public ParallelTask {
+public:
+	HistogramTask(
+		const std::string &src_fn, const std::vector<size_t> &bandlist,
+		const NdvDef &_ndv_def, const StatsSource &_stats_source,
+		const std::vector<Binning> &_binnings, size_t max_threads,
+		unsigned int sample_seed
+	) :
+		ndv_def(_ndv_def),
+		stats_source(_stats_source),
+		binnings(_binnings),
+		band_count(bandlist.size()),
+		overview(-1),
+		report_progress(true),
+		w(0), h(0),
+		total_blocks(0),
+		num_jobs(0),
+		num_threads(0),
+		read_types(band_count),
+		anchors(band_count),
+		anchored(band_count),
+		first_job(0),
+		jobs_done(0)
+	{
+		pthread_mutex_init(&mutex, NULL);
 
-			double progress = 
-				((double)boff_y * (double)w +
-				(double)boff_x * (double)bsize_y) /
-				((double)w * (double)h);
-			GDALTermProgress(progress, NULL, NULL);
+		if(!openDataset(src_fn, bandlist)) return;
 
-			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-				GDALRasterIO(src_bands[band_idx], GF_Read, boff_x, boff_y, bsize_x, bsize_y, 
-					&buf_in[band_idx][0], bsize_x, bsize_y, GDT_Float64, 0, 0);
+		w = GDALGetRasterBandXSize(bands[0][0]);
+		h = GDALGetRasterBandYSize(bands[0][0]);
+		int blocksize_x_int, blocksize_y_int;
+		GDALGetBlockSize(bands[0][0], &blocksize_x_int, &blocksize_y_int);
+		blocksize_x = blocksize_x_int;
+		blocksize_y = blocksize_y_int;
+		size_t block_len = blocksize_x*blocksize_y;
 
-				if(band_idx == 0) {
-					ndv_def.arrayCheckNdv(band_idx, &buf_in[band_idx][0], &ndv_mask[0], block_len);
-				} else {
-					ndv_def.arrayCheckNdv(band_idx, &buf_in[band_idx][0], &band_mask[0], block_len);
-					ndv_def.aggregateMask(&ndv_mask[0], &band_mask[0], block_len);
-				}
+		for(size_t boff_y=0; boff_y<h; boff_y+=blocksize_y) {
+			for(size_t boff_x=0; boff_x<w; boff_x+=blocksize_x) {
+				blocks.push_back(std::pair<size_t, size_t>(boff_x, boff_y));
+			}
+		}
+		total_blocks = blocks.size();
+		if(stats_source.sample_fraction < 1) {
+			// one random block from each of num_samples equal runs of
+			// blocks, so the sample is spread over the whole image
+			size_t num_samples = std::max(size_t(1),
+				size_t(ceil(double(total_blocks) * stats_source.sample_fraction)));
+			std::vector<std::pair<size_t, size_t> > sampled;
+			for(size_t i=0; i<num_samples; i++) {
+				size_t from = total_blocks * i / num_samples;
+				size_t to = total_blocks * (i+1) / num_samples;
+				size_t pick = from + size_t(double(to-from) * rand_r(&sample_seed) / (RAND_MAX + 1.0));
+				sampled.push_back(blocks[std::min(pick, to-1)]);
+			}
+			blocks.swap(sampled);
+		}
+		num_jobs = blocks.size();
+		if(stats_source.sample_fraction < 1) {
+			block_sums.resize(num_jobs * band_count);
+			block_counts.resize(num_jobs * band_count);
+		}
+
+		num_threads = std::max(size_t(1), std::min(max_threads, num_jobs));
+		while(datasets.size() < num_threads) {
+			if(!openDataset(src_fn, bandlist)) {
+				num_jobs = 0;
+				return;
 			}
+		}
+		bufs.resize(num_threads);
+		ndv_masks.resize(num_threads);
+		band_masks.resize(num_threads);
+		accums.resize(num_threads);
+
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			GDALDataType dt = GDALGetRasterDataType(bands[0][band_idx]);
+			read_types[band_idx] =
+				(is_direct_type(dt) || dt == GDT_Float32) ? dt : GDT_Float64;
+		}
+
+		for(size_t t=0; t<num_threads; t++) {
+			bufs[t].resize(band_count);
 			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-				for(size_t i=0; i<block_len; i++) {
-					if(ndv_mask[i]) continue;
-					double v = buf_in[band_idx][i];
-					if(std::isnan(v) || std::isinf(v)) continue;
-
-					double &min = minmax[band_idx].first;
-					double &max = minmax[band_idx].second;
-					if(!got_data[band_idx]) {
-						min = v;
-						max = v;
-						got_data[band_idx] = true;
-					}
-					if(v < min) min = v;
-					if(v > max) max = v;
+				bufs[t][band_idx].resize(block_len *
+					GDALGetDataTypeSize(read_types[band_idx]) / 8);
+			}
+			ndv_masks[t].resize(block_len);
+			band_masks[t].resize(block_len);
+			accums[t].resize(band_count);
+			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+				if(isDirect(band_idx)) {
+					accums[t][band_idx].counts.assign(binnings[band_idx].nbins, 0);
 				}
 			}
 		}
 	}
-	GDALTermProgress(1, NULL, NULL);
 
-	return minmax;
-}
+	~HistogramTask() {
+		pthread_mutex_destroy(&mutex);
+		for(size_t t=0; t<datasets.size(); t++) {
+			GDALClose(datasets[t]);
+		}
+	}
 
-std::vector<Histogram> compute_histogram(
-	const std::vector<GDALRasterBandH> &src_bands, const NdvDef &ndv_def, 
-	size_t w, size_t h, const std::vector<Binning> &binnings
-) {
-	size_t band_count = src_bands.size();
-	std::vector<Histogram> histograms(band_count);
+	bool fail(const std::string &msg) {
+		if(error.empty()) error = msg;
+		return false;
+	}
 
-	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-		histograms[band_idx].binning = binnings[band_idx];
-		histograms[band_idx].counts.assign(binnings[band_idx].nbins, 0);
+	// The dataset is kept (and closed by the destructor) even on failure.
+	bool openDataset(const std::string &src_fn, const std::vector<size_t> &bandlist) {
+		GDALDatasetH ds = GDALOpen(src_fn.c_str(), GA_ReadOnly);
+		if(!ds) return fail("open failed");
+		datasets.push_back(ds);
+		bands.push_back(std::vector<GDALRasterBandH>());
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			if(bandlist[band_idx] > size_t(GDALGetRasterCount(ds))) {
+				return fail(src_fn+" doesn't have band "+
+					boost::lexical_cast<std::string>(bandlist[band_idx]));
+			}
+			GDALRasterBandH band = GDALGetRasterBand(ds, bandlist[band_idx]);
+			if(stats_source.from_overview && datasets.size() == 1 && band_idx == 0) {
+				overview = choose_stats_overview(band, STATS_OVERVIEW_MIN_PIXELS);
+			}
+			if(overview >= 0) {
+				if(overview >= GDALGetOverviewCount(band)) {
+					return fail("band "+boost::lexical_cast<std::string>(bandlist[band_idx])+
+						" doesn't have overview "+boost::lexical_cast<std::string>(overview));
+				}
+				band = GDALGetOverview(band, overview);
+				if(!bands.back().empty() && (
+					GDALGetRasterBandXSize(band) != GDALGetRasterBandXSize(bands.back()[0]) ||
+					GDALGetRasterBandYSize(band) != GDALGetRasterBandYSize(bands.back()[0])
+				)) {
+					return fail("overviews of the bands differ in size");
+				}
+			}
+			bands.back().push_back(band);
+		}
+		return true;
 	}
 
-	int blocksize_x_int, blocksize_y_int;
-	GDALGetBlockSize(src_bands[0], &blocksize_x_int, &blocksize_y_int);
-	size_t blocksize_x = blocksize_x_int;
-	size_t blocksize_y = blocksize_y_int;
-	size_t block_len = blocksize_x*blocksize_y;
+	bool isDirect(size_t band_idx) const {
+		return is_direct_type(read_types[band_idx]);
+	}
 
-	std::vector<std::vector<double> > buf_in(band_count);
-	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-		buf_in[band_idx].resize(block_len);
+	bool allAnchored() const {
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			if(!isDirect(band_idx) && !anchored[band_idx]) return false;
+		}
+		return true;
 	}
-	std::vector<uint8_t> ndv_mask(block_len);
-	std::vector<uint8_t> band_mask(block_len);
 
-	bool first_valid_pixel = true;
+	void setAnchor(size_t band_idx, double anchor) {
+		anchors[band_idx] = anchor;
+		anchored[band_idx] = true;
+	}
 
-	for(size_t boff_y=0; boff_y<h; boff_y+=blocksize_y) {
+	// Only called before the parallel part of the scan.
+	template<class T>
+	void findAnchor(size_t band_idx, const std::vector<uint8_t> &buf,
+		const uint8_t *ndv_mask, size_t len
+	) {
+		const T *p = reinterpret_cast<const T *>(&buf[0]);
+		for(size_t i=0; i<len; i++) {
+			if(!ndv_mask[i] && !std::isinf(p[i])) {
+				anchors[band_idx] = p[i];
+				anchored[band_idx] = true;
+				return;
+			}
+		}
+	}
+
+	void run(size_t job_idx, size_t thread_idx) {
+		size_t boff_x = blocks[first_job + job_idx].first;
+		size_t boff_y = blocks[first_job + job_idx].second;
+		size_t bsize_x = blocksize_x;
 		size_t bsize_y = blocksize_y;
+		if(bsize_x + boff_x > w) bsize_x = w - boff_x;
 		if(bsize_y + boff_y > h) bsize_y = h - boff_y;
-		for(size_t boff_x=0; boff_x<w; boff_x+=blocksize_x) {
-			size_t bsize_x = blocksize_x;
-			if(bsize_x + boff_x > w) bsize_x = w - boff_x;
+		size_t block_len = bsize_x*bsize_y;
 
-			block_len = bsize_x*bsize_y;
+		uint8_t *ndv_mask = &ndv_masks[thread_idx][0];
+		uint8_t *band_mask = &band_masks[thread_idx][0];
 
-			double progress = 
-				((double)boff_y * (double)w +
-				(double)boff_x * (double)bsize_y) /
-				((double)w * (double)h);
-			GDALTermProgress(progress, NULL, NULL);
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			std::vector<uint8_t> &buf = bufs[thread_idx][band_idx];
+			GDALRasterIO(bands[thread_idx][band_idx], GF_Read, boff_x, boff_y, bsize_x, bsize_y,
+				&buf[0], bsize_x, bsize_y, read_types[band_idx], 0, 0);
 
-			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-				GDALRasterIO(src_bands[band_idx], GF_Read, boff_x, boff_y, bsize_x, bsize_y, 
-					&buf_in[band_idx][0], bsize_x, bsize_y, GDT_Float64, 0, 0);
+			switch(read_types[band_idx]) {
+				case GDT_Byte:
+					check_ndv_block<uint8_t>(ndv_def, band_idx, buf, ndv_mask, band_mask, block_len);
+					break;
+				case GDT_UInt16:
+					check_ndv_block<uint16_t>(ndv_def, band_idx, buf, ndv_mask, band_mask, block_len);
+					break;
+				case GDT_Int16:
+					check_ndv_block<int16_t>(ndv_def, band_idx, buf, ndv_mask, band_mask, block_len);
+					break;
+				case GDT_Float32:
+					check_ndv_block<float>(ndv_def, band_idx, buf, ndv_mask, band_mask, block_len);
+					break;
+				default:
+					check_ndv_block<double>(ndv_def, band_idx, buf, ndv_mask, band_mask, block_len);
+			}
+		}
 
-				if(band_idx == 0) {
-					ndv_def.arrayCheckNdv(band_idx, &buf_in[band_idx][0], &ndv_mask[0], block_len);
-				} else {
-					ndv_def.arrayCheckNdv(band_idx, &buf_in[band_idx][0], &band_mask[0], block_len);
-					ndv_def.aggregateMask(&ndv_mask[0], &band_mask[0], block_len);
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			const std::vector<uint8_t> &buf = bufs[thread_idx][band_idx];
+			BandAccum &acc = accums[thread_idx][band_idx];
+			int bin_offset = int(binnings[band_idx].offset);
+
+			if(!block_sums.empty()) {
+				size_t i = (first_job + job_idx) * band_count + band_idx;
+				switch(read_types[band_idx]) {
+					case GDT_Byte:
+						block_sum<uint8_t>(buf, ndv_mask, block_len, &block_sums[i], &block_counts[i]);
+						break;
+					case GDT_UInt16:
+						block_sum<uint16_t>(buf, ndv_mask, block_len, &block_sums[i], &block_counts[i]);
+						break;
+					case GDT_Int16:
+						block_sum<int16_t>(buf, ndv_mask, block_len, &block_sums[i], &block_counts[i]);
+						break;
+					case GDT_Float32:
+						block_sum<float>(buf, ndv_mask, block_len, &block_sums[i], &block_counts[i]);
+						break;
+					default:
+						block_sum<double>(buf, ndv_mask, block_len, &block_sums[i], &block_counts[i]);
 				}
 			}
+
+			switch(read_types[band_idx]) {
+				case GDT_Byte:
+					count_direct<uint8_t>(buf, ndv_mask, block_len, bin_offset, acc);
+					break;
+				case GDT_UInt16:
+					count_direct<uint16_t>(buf, ndv_mask, block_len, bin_offset, acc);
+					break;
+				case GDT_Int16:
+					count_direct<int16_t>(buf, ndv_mask, block_len, bin_offset, acc);
+					break;
+				case GDT_Float32:
+					if(!anchored[band_idx]) findAnchor<float>(band_idx, buf, ndv_mask, block_len);
+					count_log<float>(buf, ndv_mask, block_len, anchors[band_idx], acc);
+					break;
+				default:
+					if(!anchored[band_idx]) findAnchor<double>(band_idx, buf, ndv_mask, block_len);
+					count_log<double>(buf, ndv_mask, block_len, anchors[band_idx], acc);
+			}
+		}
+
+		if(report_progress) {
+			ScopedLock lock(mutex);
+			jobs_done++;
+			GDALTermProgress(double(jobs_done) / double(num_jobs), NULL, NULL);
+		}
+	}
+
+	// Fold the per-thread results into totals.
+	void mergeInto(std::vector<BandAccum> &totals) const {
+		for(size_t t=0; t<accums.size(); t++) {
 			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-				Histogram &hg = histograms[band_idx];
-				double *p = &buf_in[band_idx][0];
-				
-				for(size_t i=0; i<block_len; i++) {
-					if(ndv_mask[i]) {
-						hg.ndv_count++;
-					} else {
-						double v = p[i];
-						hg.counts[hg.binning.to_bin(v)]++;
-						if(first_valid_pixel) {
-							hg.min = hg.max = v;
-							first_valid_pixel = false;
-						}
-						if(v < hg.min) hg.min = v;
-						if(v > hg.max) hg.max = v;
-					}
+				totals[band_idx].merge(accums[t][band_idx]);
+			}
+		}
+	}
+
+	const NdvDef &ndv_def;
+	const StatsSource &stats_source;
+	const std::vector<Binning> &binnings;
+	size_t band_count;
+	int overview; // -1 for full resolution
+	bool report_progress;
+	size_t w, h;
+	size_t blocksize_x, blocksize_y;
+	std::vector<std::pair<size_t, size_t> > blocks;
+	size_t total_blocks;
+	// per sampled block and band (only with -stats-sample)
+	std::vector<double> block_sums;
+	std::vector<size_t> block_counts;
+	size_t num_jobs;
+	size_t num_threads;
+	std::vector<GDALDataType> read_types;
+	std::vector<GDALDatasetH> datasets;
+	std::vector<std::vector<GDALRasterBandH> > bands;
+	std::vector<std::vector<std::vector<uint8_t> > > bufs;
+	std::vector<std::vector<uint8_t> > ndv_masks;
+	std::vector<std::vector<uint8_t> > band_masks;
+	std::vector<std::vector<BandAccum> > accums;
+	std::vector<double> anchors;
+	std::vector<bool> anchored;
+	size_t first_job;
+	pthread_mutex_t mutex;
+	size_t jobs_done;
+	std::string error; // why the input couldn't be opened, if it couldn't
+};
+
+// Each job is one whole input file, scanned by a single thread through a
+// HistogramTask of its own, so each worker has only one file open at a
+// time.  The anchors are fixed beforehand so that the LogHistograms of all
+// files line up and can simply be added.  As with StretchTask, errors are
+// recorded (and the remaining files skipped) for the caller to report once
+// every worker has closed its input.
+class MosaicHistogramTask : public ParallelTask {
+public:
+	MosaicHistogramTask(
+		const std::vector<std::string> &_src_fns, const std::vector<size_t> &_bandlist,
+		const NdvDef &_ndv_def, const StatsSource &_stats_source,
+		const std::vector<Binning> &_binnings,
+		const std::vector<GDALDataType> &_read_types, const std::vector<double> &_anchors,
+		std::vector<BandAccum> &_totals
+	) :
+		src_fns(_src_fns), bandlist(_bandlist),
+		ndv_def(_ndv_def), stats_source(_stats_source),
+		binnings(_binnings),
+		read_types(_read_types), anchors(_anchors),
+		totals(_totals),
+		num_sampled_blocks(0), total_blocks(0),
+		full_res_files(0), files_done(0)
+	{
+		pthread_mutex_init(&mutex, NULL);
+	}
+
+	~MosaicHistogramTask() {
+		pthread_mutex_destroy(&mutex);
+	}
+
+	void run(size_t job_idx, size_t) {
+		{
+			ScopedLock lock(mutex);
+			if(!error.empty()) return;
+		}
+		const std::string &src_fn = src_fns[job_idx];
+		HistogramTask task(src_fn, bandlist, ndv_def, stats_source, binnings, 1, job_idx+1);
+		task.report_progress = false;
+		if(!task.error.empty()) {
+			fail(task.error);
+			return;
+		}
+		if(task.read_types != read_types) {
+			fail(src_fn+": band types differ from those of "+src_fns[0]);
+			return;
+		}
+		for(size_t band_idx=0; band_idx<bandlist.size(); band_idx++) {
+			task.setAnchor(band_idx, anchors[band_idx]);
+		}
+		for(size_t i=0; i<task.num_jobs; i++) {
+			task.run(i, 0);
+		}
+
+		ScopedLock lock(mutex);
+		task.mergeInto(totals);
+		block_sums.insert(block_sums.end(), task.block_sums.begin(), task.block_sums.end());
+		block_counts.insert(block_counts.end(), task.block_counts.begin(), task.block_counts.end());
+		num_sampled_blocks += task.num_jobs;
+		total_blocks += task.total_blocks;
+		if(task.overview < 0) full_res_files++;
+		files_done++;
+		GDALTermProgress(double(files_done) / double(src_fns.size()), NULL, NULL);
+	}
+
+	void fail(const std::string &msg) {
+		ScopedLock lock(mutex);
+		if(error.empty()) error = msg;
+	}
+
+	const std::vector<std::string> &src_fns;
+	const std::vector<size_t> &bandlist;
+	const NdvDef &ndv_def;
+	const StatsSource &stats_source;
+	const std::vector<Binning> &binnings;
+	const std::vector<GDALDataType> &read_types;
+	const std::vector<double> &anchors;
+	std::vector<BandAccum> &totals;
+	std::vector<double> block_sums;
+	std::vector<size_t> block_counts;
+	size_t num_sampled_blocks;
+	size_t total_blocks;
+	size_t full_res_files;
+	pthread_mutex_t mutex;
+	size_t files_done;
+	std::string error; // the first error, if any
+};
+
+int choose_stats_overview(GDALRasterBandH band, size_t min_pixels) {
+	int best = -1;
+	size_t best_pixels = 0;
+	for(int i=0; i<GDALGetOverviewCount(band); i++) {
+		GDALRasterBandH ov = GDALGetOverview(band, i);
+		size_t pixels = size_t(GDALGetRasterBandXSize(ov)) * size_t(GDALGetRasterBandYSize(ov));
+		if(pixels >= min_pixels && (best < 0 || pixels < best_pixels)) {
+			best = i;
+			best_pixels = pixels;
+		}
+	}
+	return best;
+}
+
+// With several inputs, the histogram covers all of them as though they were
+// one mosaic.
+std::vector<Histogram> compute_histogram(
+	const std::vector<std::string> &src_fns, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, const StatsSource &stats_source,
+	const std::vector<Binning> &binnings, size_t num_threads
+) {
+	size_t band_count = bandlist.size();
+	std::vector<Histogram> histograms(band_count);
+	std::vector<BandAccum> totals(band_count);
+
+	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+		histograms[band_idx].binning = binnings[band_idx];
+		totals[band_idx].counts.assign(binnings[band_idx].nbins, 0);
+	}
+
+	bool sampled = stats_source.sample_fraction < 1;
+	bool used_overview = false;
+	std::vector<GDALDataType> read_types;
+	std::vector<double> anchors;
+	size_t num_sampled_blocks;
+	std::vector<double> block_sums;
+	std::vector<size_t> block_counts;
+	if(src_fns.size() == 1) {
+		HistogramTask task(src_fns[0], bandlist, ndv_def, stats_source, binnings, num_threads, 1);
+		if(!task.error.empty()) fatal_error(task.error);
+		used_overview = task.overview >= 0;
+		if(stats_source.from_overview) {
+			if(task.overview < 0) {
+				printf("No overview has enough pixels, using full resolution for statistics.\n");
+			} else {
+				printf("Using overview %d (%zd x %zd) for statistics.\n",
+					task.overview, task.w, task.h);
+			}
+		}
+		num_sampled_blocks = task.num_jobs;
+		if(sampled) {
+			printf("Sampling %zd of %zd blocks.\n", task.num_jobs, task.total_blocks);
+		}
+		GDALTermProgress(0, NULL, NULL);
+		while(task.first_job < task.num_jobs && !task.allAnchored()) {
+			task.run(0, 0);
+			task.first_job++;
+		}
+		run_parallel(task, task.num_jobs - task.first_job, task.num_threads);
+		task.mergeInto(totals);
+		read_types = task.read_types;
+		anchors = task.anchors;
+		block_sums.swap(task.block_sums);
+		block_counts.swap(task.block_counts);
+	} else {
+		// Take the anchors from the first inputs having finite data.  This
+		// rereads a block or so, but lets all files be scanned at once.
+		anchors.assign(band_count, 0);
+		std::vector<bool> anchored(band_count);
+		for(size_t i=0; i<src_fns.size(); i++) {
+			HistogramTask task(src_fns[i], bandlist, ndv_def, stats_source, binnings, 1, 1);
+			if(!task.error.empty()) fatal_error(task.error);
+			task.report_progress = false;
+			if(i == 0) read_types = task.read_types;
+			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+				if(anchored[band_idx]) task.setAnchor(band_idx, anchors[band_idx]);
+			}
+			while(task.first_job < task.num_jobs && !task.allAnchored()) {
+				task.run(0, 0);
+				task.first_job++;
+			}
+			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+				anchors[band_idx] = task.anchors[band_idx];
+				anchored[band_idx] = task.anchored[band_idx];
+			}
+			if(task.allAnchored()) break;
+		}
+
+		MosaicHistogramTask task(src_fns, bandlist, ndv_def, stats_source,
+			binnings, read_types, anchors, totals);
+		GDALTermProgress(0, NULL, NULL);
+		run_parallel(task, src_fns.size(), std::min(num_threads, src_fns.size()));
+		if(!task.error.empty()) fatal_error(task.error);
+		used_overview = stats_source.from_overview && task.full_res_files < src_fns.size();
+		if(stats_source.from_overview && task.full_res_files) {
+			printf("%zd of %zd inputs have no overview with enough pixels, using full resolution for those.\n",
+				task.full_res_files, src_fns.size());
+		}
+		num_sampled_blocks = task.num_sampled_blocks;
+		if(sampled) {
+			printf("Sampled %zd of %zd blocks.\n", task.num_sampled_blocks, task.total_blocks);
+		}
+		block_sums.swap(task.block_sums);
+		block_counts.swap(task.block_counts);
+	}
+
+	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+		Histogram &hg = histograms[band_idx];
+		const BandAccum &total = totals[band_idx];
+		hg.ndv_count = total.ndv_count;
+
+		if(is_direct_type(read_types[band_idx])) {
+			hg.counts = total.counts;
+			// the bins are exact, so the extremes are the outermost
+			// non-empty bins
+			bool got_data = false;
+			for(int i=0; i<hg.binning.nbins; i++) {
+				if(hg.counts[i]) {
+					if(!got_data) hg.min = hg.binning.from_bin(i);
+					hg.max = hg.binning.from_bin(i);
+					got_data = true;
 				}
 			}
+		} else {
+			hg.min = total.min;
+			hg.max = total.max;
+			if(total.got_finite) {
+				log_histogram_to_bins(total.log_hist, anchors[band_idx],
+					total.finite_min, total.finite_max, hg);
+			} else {
+				log_histogram_to_bins(total.log_hist, anchors[band_idx],
+					total.min, total.max, hg);
+			}
 		}
 	}
-	GDALTermProgress(1, NULL, NULL);
+	totals.clear(); // free up memory
 
 	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
 		Histogram &hg = histograms[band_idx];
@@ -662,9 +1662,253 @@ std::vector<Histogram> compute_histogram(
 		hg.stddev = sqrt(var_accum / hg.data_count);
 	}
 
+	// The percentile bounds are from the Dvoretzky-Kiefer-Wolfowitz
+	// inequality.  Overview pixels are taken as independent samples.  Pixels
+	// within a block are not independent, so for sampled blocks the sample
+	// size is discounted by the design effect, estimated from how much the
+	// block means vary.
+	const double dkw_95 = log(2.0 / 0.05) / 2.0;
+	if(sampled) {
+		size_t m = num_sampled_blocks;
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			const Histogram &hg = histograms[band_idx];
+			double sum = 0, count = 0;
+			for(size_t i=0; i<m; i++) {
+				sum += block_sums[i*band_count + band_idx];
+				count += block_counts[i*band_count + band_idx];
+			}
+			if(m < 2 || !count) {
+				printf("band %zd: too few blocks sampled to estimate accuracy\n", band_idx);
+				continue;
+			}
+			double mean = sum / count;
+			double ss = 0;
+			for(size_t i=0; i<m; i++) {
+				double d = block_sums[i*band_count + band_idx] -
+					mean * double(block_counts[i*band_count + band_idx]);
+				ss += d * d;
+			}
+			double mean_count = count / double(m);
+			double mean_var = ss / (double(m) * double(m-1) * mean_count * mean_count);
+			double pixel_var = hg.stddev * hg.stddev / count;
+			double design_effect = pixel_var > 0 ? std::max(1.0, mean_var / pixel_var) : 1.0;
+			double eps = sqrt(dkw_95 / (count / design_effect));
+			printf("band %zd: at 95%% confidence, mean is within +/-%g and percentiles within +/-%.2g%%\n",
+				band_idx, 1.96 * sqrt(mean_var), eps * 100.0);
+		}
+	} else if(used_overview) {
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			size_t n = histograms[band_idx].data_count;
+			if(!n) continue;
+			printf("band %zd: at 95%% confidence, percentiles are within +/-%.2g%%\n",
+				band_idx, sqrt(dkw_95 / double(n)) * 100.0);
+		}
+	}
+
 	return histograms;
 }
 
+// Identifies the source file contents and everything else that goes into the
+// histogram.  The inputs of a mosaic are also identified by name, since the
+// cache sits next to just the first of them.
+std::string histogram_cache_key(
+	const std::vector<std::string> &src_fns, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, const StatsSource &stats_source
+) {
+	std::string key;
+	char buf[1000];
+	for(size_t i=0; i<src_fns.size(); i++) {
+		VSIStatBufL st;
+		if(VSIStatL(src_fns[i].c_str(), &st)) return "";
+		if(src_fns.size() > 1) key += src_fns[i] + " ";
+		snprintf(buf, sizeof(buf), "size=%lld mtime=%lld ",
+			(long long)st.st_size, (long long)st.st_mtime);
+		key += buf;
+	}
+
+	snprintf(buf, sizeof(buf), "overview=%d sample=%.17g bands=",
+		int(stats_source.from_overview), stats_source.sample_fraction);
+	key += buf;
+	for(size_t i=0; i<bandlist.size(); i++) {
+		if(i) key += ",";
+		key += boost::lexical_cast<std::string>(bandlist[i]);
+	}
+	key += ndv_def.isInvert() ? " valid=" : " ndv=";
+	for(size_t i=0; i<ndv_def.slabs.size(); i++) {
+		const NdvSlab &slab = ndv_def.slabs[i];
+		key += i ? " " : "";
+		for(size_t j=0; j<slab.range_by_band.size(); j++) {
+			const NdvInterval &range = slab.range_by_band[j];
+			snprintf(buf, sizeof(buf), "%s%.17g..%.17g", j ? "," : "",
+				range.first, range.second);
+			key += buf;
+		}
+	}
+	return key;
+}
+
+// The cache file holds the key followed by the histogram of each band, in
+// native byte order (a cache from a machine of the other endianness is
+// simply ignored).  Counts are stored sparsely since most bins of a
+// LogHistogram, and of a 16-bit histogram, are empty.
+static const char HIST_CACHE_MAGIC[8] = { 'D','G','H','I','S','T','1','\n' };
+static const uint32_t HIST_CACHE_BYTE_ORDER = 0x01020304;
+
+template<class T>
+static void cache_write(FILE *fh, const T &v) {
+	fwrite(&v, sizeof(T), 1, fh);
+}
+
+template<class T>
+static void cache_write_vec(FILE *fh, const std::vector<T> &v) {
+	cache_write(fh, uint32_t(v.size()));
+	if(v.size()) fwrite(&v[0], sizeof(T), v.size(), fh);
+}
+
+template<class T>
+static bool cache_read(FILE *fh, T &v) {
+	return fread(&v, sizeof(T), 1, fh) == 1;
+}
+
+template<class T>
+static bool cache_read_vec(FILE *fh, std::vector<T> &v, uint32_t max_size) {
+	uint32_t size;
+	if(!cache_read(fh, size) || size > max_size) return false;
+	v.resize(size);
+	return !size || fread(&v[0], sizeof(T), size, fh) == size;
+}
+
+static bool cache_read_histogram(FILE *fh, Histogram &hg) {
+	Binning &binning = hg.binning;
+	uint64_t data_count, ndv_count;
+	int32_t nbins;
+	if(!(
+		cache_read(fh, hg.min) && cache_read(fh, hg.max) &&
+		cache_read(fh, hg.mean) && cache_read(fh, hg.stddev) &&
+		cache_read(fh, data_count) && cache_read(fh, ndv_count) &&
+		cache_read(fh, nbins) && nbins > 0 &&
+		cache_read(fh, binning.offset) && cache_read(fh, binning.scale) &&
+		cache_read_vec(fh, binning.group_base, LogHistogram::NUM_GROUPS) &&
+		cache_read_vec(fh, binning.bin_values, nbins)
+	)) return false;
+	hg.data_count = data_count;
+	hg.ndv_count = ndv_count;
+	binning.nbins = nbins;
+
+	// Binning indexes these without checking, so a truncated or corrupted
+	// table has to be caught here.
+	if(!binning.group_base.empty()) {
+		if(binning.group_base.size() != size_t(LogHistogram::NUM_GROUPS)) return false;
+		for(size_t g=0; g<binning.group_base.size(); g++) {
+			int base = binning.group_base[g];
+			if(base < 0 ? -1-base >= nbins : base > nbins - LogHistogram::GROUP_SIZE) return false;
+		}
+	}
+	if(!binning.bin_values.empty() && binning.bin_values.size() != size_t(nbins)) return false;
+
+	std::vector<uint32_t> nz_bins;
+	std::vector<uint64_t> nz_counts;
+	if(!cache_read_vec(fh, nz_bins, nbins)) return false;
+	if(!cache_read_vec(fh, nz_counts, nbins)) return false;
+	if(nz_bins.size() != nz_counts.size()) return false;
+	hg.counts.assign(nbins, 0);
+	for(size_t i=0; i<nz_bins.size(); i++) {
+		if(nz_bins[i] >= uint32_t(nbins)) return false;
+		hg.counts[nz_bins[i]] = nz_counts[i];
+	}
+	return true;
+}
+
+static bool cache_read_histograms(
+	FILE *fh, const std::string &key,
+	std::vector<Histogram> &histograms
+) {
+	char magic[sizeof(HIST_CACHE_MAGIC)];
+	uint32_t byte_order;
+	if(fread(magic, sizeof(magic), 1, fh) != 1) return false;
+	if(memcmp(magic, HIST_CACHE_MAGIC, sizeof(magic))) return false;
+	if(!cache_read(fh, byte_order) || byte_order != HIST_CACHE_BYTE_ORDER) return false;
+
+	std::vector<char> file_key;
+	if(!cache_read_vec(fh, file_key, 1<<20)) return false;
+	if(std::string(file_key.begin(), file_key.end()) != key) return false;
+
+	uint32_t band_count;
+	if(!cache_read(fh, band_count) || band_count > 1<<16) return false;
+	histograms.resize(band_count);
+	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+		if(!cache_read_histogram(fh, histograms[band_idx])) return false;
+	}
+
+	uint32_t end_mark;
+	return cache_read(fh, end_mark) && end_mark == HIST_CACHE_BYTE_ORDER;
+}
+
+// Returns false (leaving histograms alone) if the cache is missing, stale,
+// or damaged.
+bool read_histogram_cache(
+	const std::string &cache_fn, const std::string &key,
+	std::vector<Histogram> &histograms
+) {
+	FILE *fh = fopen(cache_fn.c_str(), "rb");
+	if(!fh) return false;
+	std::vector<Histogram> cached;
+	bool ok = cache_read_histograms(fh, key, cached);
+	fclose(fh);
+	if(ok) histograms.swap(cached);
+	return ok;
+}
+
+void write_histogram_cache(
+	const std::string &cache_fn, const std::string &key,
+	const std::vector<Histogram> &histograms
+) {
+	FILE *fh = fopen(cache_fn.c_str(), "wb");
+	if(!fh) {
+		printf("Warning: could not write histogram cache %s\n", cache_fn.c_str());
+		return;
+	}
+
+	fwrite(HIST_CACHE_MAGIC, sizeof(HIST_CACHE_MAGIC), 1, fh);
+	cache_write(fh, HIST_CACHE_BYTE_ORDER);
+	cache_write_vec(fh, std::vector<char>(key.begin(), key.end()));
+	cache_write(fh, uint32_t(histograms.size()));
+	for(size_t band_idx=0; band_idx<histograms.size(); band_idx++) {
+		const Histogram &hg = histograms[band_idx];
+		const Binning &binning = hg.binning;
+		cache_write(fh, hg.min);
+		cache_write(fh, hg.max);
+		cache_write(fh, hg.mean);
+		cache_write(fh, hg.stddev);
+		cache_write(fh, uint64_t(hg.data_count));
+		cache_write(fh, uint64_t(hg.ndv_count));
+		cache_write(fh, int32_t(binning.nbins));
+		cache_write(fh, binning.offset);
+		cache_write(fh, binning.scale);
+		cache_write_vec(fh, binning.group_base);
+		cache_write_vec(fh, binning.bin_values);
+
+		std::vector<uint32_t> nz_bins;
+		std::vector<uint64_t> nz_counts;
+		for(int i=0; i<binning.nbins; i++) {
+			if(hg.counts[i]) {
+				nz_bins.push_back(i);
+				nz_counts.push_back(hg.counts[i]);
+			}
+		}
+		cache_write_vec(fh, nz_bins);
+		cache_write_vec(fh, nz_counts);
+	}
+	cache_write(fh, HIST_CACHE_BYTE_ORDER);
+
+	bool failed = ferror(fh);
+	if(fclose(fh)) failed = true;
+	if(failed) {
+		printf("Warning: could not write histogram cache %s\n", cache_fn.c_str());
+		remove(cache_fn.c_str());
+	}
+}
+
 void get_scale_from_percentile(
 	const Histogram &histogram, int output_range,
 	double from_percentile, double to_percentile,
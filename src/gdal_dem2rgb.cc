@@ -27,6 +27,7 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <cassert>
+#include <algorithm>
 
 #include <boost/lexical_cast.hpp>
 
@@ -34,6 +35,8 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include "georef.h"
 #include "ndv.h"
 #include "palette.h"
+#include "pipeline.h"
+#include "threads.h"
 
 using namespace dangdal;
 
@@ -50,10 +53,307 @@ void scale_values(double *vals, size_t w, double scale, double offset);
 
 void compute_tierow_invaffine(
 	const GeoRef &georef,
-	int num_cols, int row, int grid_spacing,
+	int num_cols, int row, int grid_spacing, double approx_error,
 	double *invaffine_tierow
 );
 
+// Each job is one band of grid_spacing rows, so that it lies between two
+// rows of invaffine tie points.  Those tie points come from the GeoRef,
+// which is not thread safe, so they are computed by the reader.
+class DemTask : public PipelineTask {
+public:
+	DemTask(size_t _w, size_t _h, int _out_numbands, int _grid_spacing, size_t num_slots) :
+		w(_w), h(_h), out_numbands(_out_numbands), grid_spacing(_grid_spacing),
+		num_jobs((h + grid_spacing - 1) / grid_spacing),
+		slots(num_slots),
+		min(0), max(0), // initialized to prevent compiler warning
+		got_nan(0), got_valid(0), got_overflow(0)
+	{
+		// each slot holds the rows of the job plus one row above and below
+		size_t len = w * grid_spacing;
+		for(size_t slot_idx=0; slot_idx<num_slots; slot_idx++) {
+			Slot &slot = slots[slot_idx];
+			slot.inbuf.resize(len + w*2);
+			slot.inbuf_ndv.resize(len + w*2);
+			slot.outbuf.assign(out_numbands, std::vector<uint8_t>(len));
+			slot.pixel.resize(out_numbands);
+		}
+	}
+
+	size_t numRows(size_t job_idx) const {
+		return std::min(size_t(grid_spacing), h - job_idx * grid_spacing);
+	}
+
+	bool read(size_t job_idx, size_t slot_idx) {
+		size_t row0 = job_idx * grid_spacing;
+		size_t num_rows = numRows(job_idx);
+		Slot &slot = slots[slot_idx];
+
+		// The row above the first row and below the last row are
+		// duplicates of the edge rows.
+		size_t read_start = (row0 == 0) ? 0 : row0-1;
+		size_t read_end = std::min(row0 + num_rows + 1, h);
+		size_t read_rows = read_end - read_start;
+		double *inbuf = &slot.inbuf[0];
+		uint8_t *inbuf_ndv = &slot.inbuf_ndv[0];
+		size_t buf_rows = num_rows + 2;
+		double *read_buf = inbuf + (row0 == 0 ? w : 0);
+		GDALRasterIO(src_band, GF_Read, 0, read_start, w, read_rows, read_buf, w, read_rows, GDT_Float64, 0, 0);
+		if(row0 == 0) {
+			std::copy(inbuf + w, inbuf + w*2, inbuf);
+		}
+		if(row0 + num_rows == h) {
+			std::copy(inbuf + w*(buf_rows-2), inbuf + w*(buf_rows-1), inbuf + w*(buf_rows-1));
+		}
+		ndv_def->arrayCheckNdv(0, inbuf, inbuf_ndv, w*buf_rows);
+		scale_values(inbuf, w*buf_rows, src_scale, src_offset);
+
+		if(!tex_bands.empty()) {
+			for(int i=0; i<out_numbands; i++) {
+				GDALRasterIO(tex_bands[i], GF_Read, 0, row0, w, num_rows, &slot.outbuf[i][0], w, num_rows, GDT_Byte, 0, 0);
+			}
+		}
+
+		if(do_shade && !use_constant_invaffine) {
+			slot.invaffine_tierow_above.resize(w * 4);
+			slot.invaffine_tierow_below.resize(w * 4);
+			if(row0 == 0) {
+				compute_tierow_invaffine(*georef, w, 0, grid_spacing, approx_error,
+					&slot.invaffine_tierow_above[0]);
+			} else {
+				slot.invaffine_tierow_above = last_tierow;
+			}
+			compute_tierow_invaffine(*georef, w, row0 + num_rows, grid_spacing, approx_error,
+				&slot.invaffine_tierow_below[0]);
+			last_tierow = slot.invaffine_tierow_below;
+		}
+		return true;
+	}
+
+	bool compute(size_t job_idx, size_t slot_idx) {
+		size_t row0 = job_idx * grid_spacing;
+		size_t num_rows = numRows(job_idx);
+		Slot &slot = slots[slot_idx];
+		std::vector<uint8_t> &pixel = slot.pixel;
+
+		slot.min = slot.max = 0;
+		slot.got_nan = slot.got_valid = slot.got_overflow = 0;
+
+		for(size_t i=0; i<num_rows; i++) {
+			size_t row = row0 + i;
+			const double *inbuf_prev = &slot.inbuf[w*i];
+			const double *inbuf_this = &slot.inbuf[w*(i+1)];
+			const double *inbuf_next = &slot.inbuf[w*(i+2)];
+			const uint8_t *inbuf_ndv_prev = &slot.inbuf_ndv[w*i];
+			const uint8_t *inbuf_ndv_this = &slot.inbuf_ndv[w*(i+1)];
+			const uint8_t *inbuf_ndv_next = &slot.inbuf_ndv[w*(i+2)];
+			std::vector<uint8_t *> outbuf(out_numbands);
+			for(int j=0; j<out_numbands; j++) {
+				outbuf[j] = &slot.outbuf[j][w*i];
+			}
+
+			// the part sets up the bilinear interpolation of invaffine
+			double segment_height = num_rows;
+			double grid_fraction = (double)i / segment_height;
+
+			for(size_t col=0; col<w; col++) {
+				double val = inbuf_this[col];
+				double brite, spec;
+				if(do_shade) {
+					double dx;
+					bool mid_good = !inbuf_ndv_this[col];
+					bool left_good = col>0 && !inbuf_ndv_this[col-1];
+					bool right_good = col<w-1 && !inbuf_ndv_this[col+1];
+					bool up_good = row>0 && !inbuf_ndv_prev[col];
+					bool down_good = row<h-1 && !inbuf_ndv_next[col];
+					if(left_good && right_good) {
+						dx = (inbuf_this[col+1] - inbuf_this[col-1]) / 2.0;
+					} else if(mid_good && right_good) {
+						dx = inbuf_this[col+1] - val;
+					} else if(mid_good && left_good) {
+						dx = val - inbuf_this[col-1];
+					} else {
+						dx = 0;
+					}
+					double dy;
+					if(up_good && down_good) {
+						dy = (inbuf_next[col] - inbuf_prev[col]) / 2.0;
+					} else if(mid_good && down_good) {
+						dy = inbuf_next[col] - val;
+					} else if(mid_good && up_good) {
+						dy = val - inbuf_prev[col];
+					} else {
+						dy = 0;
+					}
+
+					// convert from elevation per pixel to elevation per meter (unitless)
+					//double dx2 = invaffine_a * dx + invaffine_b * (-dy);
+					//double dy2 = invaffine_c * dx + invaffine_d * (-dy);
+					
+					double invaffine[4];
+					if(use_constant_invaffine) {
+						for(int k=0; k<4; k++) invaffine[k] = constant_invaffine[k];
+					} else {
+						for(int k=0; k<4; k++) {
+							invaffine[k] = slot.invaffine_tierow_above[col*4 + k] * (1.0 - grid_fraction) +
+								slot.invaffine_tierow_below[col*4 + k] * grid_fraction;
+						}
+						//compute_invaffine(georef, col, row, invaffine);
+					}
+					// FIXME - why the minus signs?
+					double dx2 = invaffine[0] * (-dx) + invaffine[1] * (-dy);
+					double dy2 = invaffine[2] * (-dx) + invaffine[3] * (-dy);
+					dx2 *= slope_exageration;
+					dy2 *= slope_exageration;
+					//if(col == 0) printf("row=%zd d=[%f, %f] d2=[%f, %f]\n", row, dx, dy, dx2, dy2);
+
+					int st_col = SHADE_TABLE_SIZE + (int)(SHADE_TABLE_SCALE * dx2);
+					if(st_col < 0) st_col = 0;
+					if(st_col > SHADE_TABLE_SIZE*2) st_col = SHADE_TABLE_SIZE*2;
+					int st_row = SHADE_TABLE_SIZE + (int)(SHADE_TABLE_SCALE * dy2);
+					if(st_row < 0) st_row = 0;
+					if(st_row > SHADE_TABLE_SIZE*2) st_row = SHADE_TABLE_SIZE*2;
+					brite = (*shade_table)[st_row][st_col];
+					spec = (*spec_table)[st_row][st_col];
+				} else {
+					brite = 1.0;
+					spec = 0.0;
+				}
+				if(inbuf_ndv_this[col]) {
+					if(use_palette) {
+						outbuf[0][col] = palette->nan_color.r;
+						outbuf[1][col] = palette->nan_color.g;
+						outbuf[2][col] = palette->nan_color.b;
+					} else {
+						for(int k=0; k<out_numbands; k++) outbuf[k][col] = 0;
+					}
+					slot.got_nan=1;
+				} else {
+					if(data24bit) {
+						int ival = (int)round(val) + (1<<23);
+						if(ival >> 24) {
+							slot.got_overflow = 1;
+							ival = 0;
+						}
+						pixel[2] = (uint8_t)(ival & 0xff);
+						pixel[1] = (uint8_t)((ival >> 8) & 0xff);
+						pixel[0] = (uint8_t)((ival >> 16) & 0xff);
+					} else if(alpha_overlay) {
+						if(thresh_brite < 1.0) {
+							brite += (spec / alpha_thresh) * (1.0 - thresh_brite);
+						}
+
+						double alpha, white;
+						if(spec < alpha_thresh) {
+							alpha = 1.0 - brite;
+							white = 0;
+						} else {
+							alpha = spec - alpha_thresh;
+							white = 1;
+						}
+
+						if(alpha < 0) alpha = 0;
+						if(alpha > 1) alpha = 1;
+						if(white < 0) white = 0;
+						if(white > 1) white = 1;
+
+						pixel[0] = pixel[1] = pixel[2] = (uint8_t)(255.0 * white);
+						pixel[3] = (uint8_t)(255.0 * alpha);
+					} else {
+						if(use_palette) {
+							RGB c = palette->get(val);
+							pixel[0] = c.r;
+							pixel[1] = c.g;
+							pixel[2] = c.b;
+						} else if(!tex_bands.empty()) {
+							for(int k=0; k<out_numbands; k++) pixel[k] = outbuf[k][col];
+						} else {
+							for(int k=0; k<out_numbands; k++) pixel[k] = 128;
+						}
+
+						for(int k=0; k<out_numbands; k++) {
+							int c = pixel[k];
+							c = (int)(c * brite + 255.0 * spec);
+							if(c > 254) c = 254;
+							pixel[k] = (uint8_t)c;
+						}
+					}
+					for(int k=0; k<out_numbands; k++) outbuf[k][col] = pixel[k];
+
+					if(!slot.got_valid || val < slot.min) slot.min = val;
+					if(!slot.got_valid || val > slot.max) slot.max = val;
+					slot.got_valid=1;
+				}
+			}
+		}
+		return true;
+	}
+
+	bool write(size_t job_idx, size_t slot_idx) {
+		size_t row0 = job_idx * grid_spacing;
+		size_t num_rows = numRows(job_idx);
+		Slot &slot = slots[slot_idx];
+
+		GDALTermProgress((double)row0 / (double)h, NULL, NULL);
+
+		for(int i=0; i<out_numbands; i++) {
+			GDALRasterIO(dst_bands[i], GF_Write, 0, row0, w, num_rows, &slot.outbuf[i][0], w, num_rows, GDT_Byte, 0, 0);
+		}
+
+		if(slot.got_valid) {
+			if(!got_valid || slot.min < min) min = slot.min;
+			if(!got_valid || slot.max > max) max = slot.max;
+			got_valid = 1;
+		}
+		if(slot.got_nan) got_nan = 1;
+		if(slot.got_overflow) got_overflow = 1;
+		return true;
+	}
+
+	struct Slot {
+		std::vector<double> inbuf;
+		std::vector<uint8_t> inbuf_ndv;
+		std::vector<std::vector<uint8_t> > outbuf;
+		std::vector<uint8_t> pixel;
+		std::vector<double> invaffine_tierow_above;
+		std::vector<double> invaffine_tierow_below;
+		double min, max;
+		bool got_nan, got_valid, got_overflow;
+	};
+
+	size_t w, h;
+	int out_numbands;
+	int grid_spacing;
+	size_t num_jobs;
+	std::vector<Slot> slots;
+	std::vector<double> last_tierow;
+
+	// these are filled in by the caller
+	GDALRasterBandH src_band;
+	std::vector<GDALRasterBandH> tex_bands;
+	std::vector<GDALRasterBandH> dst_bands;
+	const NdvDef *ndv_def;
+	double src_scale, src_offset;
+	const GeoRef *georef;
+	double approx_error;
+	bool do_shade;
+	bool use_constant_invaffine;
+	std::vector<double> constant_invaffine;
+	double slope_exageration;
+	const std::vector<std::vector<double> > *shade_table;
+	const std::vector<std::vector<double> > *spec_table;
+	double alpha_thresh;
+	double thresh_brite;
+	bool use_palette;
+	const Palette *palette;
+	bool data24bit;
+	bool alpha_overlay;
+
+	// output statistics, gathered by the writer
+	double min, max;
+	bool got_nan, got_valid, got_overflow;
+};
+
 void usage(const std::string &cmdname) {
 	printf("Usage: %s <options> src_dataset dst_dataset\n\n", cmdname.c_str());
 	
@@ -64,7 +364,10 @@ void usage(const std::string &cmdname) {
 	printf("Input/Output:\n");
 	printf("  -b input_band_id\n");
 	printf("  -of output_format\n");
+	printf("  -approx-error pixels                Allowed error when computing north direction\n");
+	printf("                                      (default: 0, meaning exact computation)\n");
 	printf("  -offset X -scale X                  Multiply and add to source values\n");
+	printf("  -threads n                          Number of threads to use (default: number of CPUs)\n");
 	printf("\n");
 	printf("Texture: (choose one of these - default is gray background)\n");
 	printf("  -palette palette.pal                Palette file to map elevation values to colors\n");
@@ -109,11 +412,13 @@ int main(int argc, char *argv[]) {
 	bool use_default_palette = 0;
 	std::string output_format;
 	int grid_spacing = 20; // could be configurable...
+	double approx_error = 0;
 	int band_id = 1;
 	double src_offset = 0;
 	double src_scale = 1;
 	bool data24bit = 0;
 	bool alpha_overlay = 0;
+	size_t num_threads = get_num_cpus();
 
 	GeoOpts geo_opts = GeoOpts(arg_list);
 	NdvDef ndv_def = NdvDef(arg_list);
@@ -144,6 +449,10 @@ int main(int argc, char *argv[]) {
 				} else if(arg == "-of") {
 					if(argp == arg_list.size()) usage(cmdname);
 					output_format = arg_list[argp++];
+				} else if(arg == "-approx-error") {
+					if(argp == arg_list.size()) usage(cmdname);
+					approx_error = boost::lexical_cast<double>(arg_list[argp++]);
+					if(approx_error < 0) fatal_error("-approx-error must not be negative");
 				} else if(arg == "-exag") {
 					if(argp == arg_list.size()) usage(cmdname);
 					slope_exageration = boost::lexical_cast<double>(arg_list[argp++]);
@@ -163,6 +472,10 @@ int main(int argc, char *argv[]) {
 				} else if(arg == "-scale") {
 					if(argp == arg_list.size()) usage(cmdname);
 					src_scale = boost::lexical_cast<double>(arg_list[argp++]);
+				} else if(arg == "-threads") {
+					if(argp == arg_list.size()) usage(cmdname);
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(num_threads < 1) fatal_error("-threads must be at least 1");
 				} else {
 					usage(cmdname);
 				}
@@ -359,214 +672,40 @@ int main(int argc, char *argv[]) {
 		ndv_def = NdvDef(src_ds, ndv_bandids);
 	}
 
-	std::vector<double> inbuf_prev(w);
-	std::vector<double> inbuf_this(w);
-	std::vector<double> inbuf_next(w);
-	std::vector<uint8_t> inbuf_ndv_prev(w);
-	std::vector<uint8_t> inbuf_ndv_this(w);
-	std::vector<uint8_t> inbuf_ndv_next(w);
-
-	std::vector<std::vector<uint8_t> > outbuf(out_numbands);
-	for(int i=0; i<out_numbands; i++) {
-		outbuf[i].resize(w);
-	}
-	std::vector<uint8_t> pixel(out_numbands);
-
-	std::vector<double> invaffine_tierow_above;
-	std::vector<double> invaffine_tierow_below;
-	if(do_shade && !use_constant_invaffine) {
-		invaffine_tierow_above.resize(w * 4);
-		invaffine_tierow_below.resize(w * 4);
-	}
-
-	double min=0, max=0; // initialized to prevent compiler warning
-	bool got_nan=0, got_valid=0, got_overflow=0;
-	for(size_t row=0; row<h; row++) {
-		GDALTermProgress((double)row / (double)h, NULL, NULL);
-		if(row == 0) {
-			GDALRasterIO(src_band, GF_Read, 0, 0, w, 1, &inbuf_prev[0], w, 1, GDT_Float64, 0, 0);
-			GDALRasterIO(src_band, GF_Read, 0, 0, w, 1, &inbuf_this[0], w, 1, GDT_Float64, 0, 0);
-			GDALRasterIO(src_band, GF_Read, 0, 1, w, 1, &inbuf_next[0], w, 1, GDT_Float64, 0, 0);
-			ndv_def.arrayCheckNdv(0, &inbuf_prev[0], &inbuf_ndv_prev[0], w);
-			ndv_def.arrayCheckNdv(0, &inbuf_this[0], &inbuf_ndv_this[0], w);
-			ndv_def.arrayCheckNdv(0, &inbuf_next[0], &inbuf_ndv_next[0], w);
-			scale_values(&inbuf_prev[0], w, src_scale, src_offset);
-			scale_values(&inbuf_this[0], w, src_scale, src_offset);
-			scale_values(&inbuf_next[0], w, src_scale, src_offset);
-		} else {
-			// rotate buffers
-			std::vector<double> swapd;
-			std::swap(swapd, inbuf_prev);
-			std::swap(inbuf_prev, inbuf_this);
-			std::swap(inbuf_this, inbuf_next);
-			std::swap(inbuf_next, swapd);
-			std::vector<uint8_t> swapc;
-			std::swap(swapc, inbuf_ndv_prev);
-			std::swap(inbuf_ndv_prev, inbuf_ndv_this);
-			std::swap(inbuf_ndv_this, inbuf_ndv_next);
-			std::swap(inbuf_ndv_next, swapc);
-
-			int read_row = (row == h-1) ? row : row+1;
-			GDALRasterIO(src_band, GF_Read, 0, read_row, w, 1, &inbuf_next[0], w, 1, GDT_Float64, 0, 0);
-			ndv_def.arrayCheckNdv(0, &inbuf_next[0], &inbuf_ndv_next[0], w);
-			scale_values(&inbuf_next[0], w, src_scale, src_offset);
-		}
-		if(!tex_bands.empty()) {
-			for(int i=0; i<out_numbands; i++) {
-				GDALRasterIO(tex_bands[i], GF_Read, 0, row, w, 1, &outbuf[i][0], w, 1, GDT_Byte, 0, 0);
-			}
-		}
-
-		double grid_fraction = 0;
-		if(do_shade && !use_constant_invaffine) {
-			// the part sets up the bilinear interpolation of invaffine
-			int above_tiept = grid_spacing * (row / grid_spacing);
-			int below_tiept = above_tiept + grid_spacing;
-			if(below_tiept > (int)h) below_tiept = (int)h;
-			if(row == (size_t)above_tiept) {
-				if(row == 0) {
-					compute_tierow_invaffine(georef, w, 0, grid_spacing, &invaffine_tierow_above[0]);
-				} else {
-					std::swap(invaffine_tierow_above, invaffine_tierow_below);
-				}
-				compute_tierow_invaffine(georef, w, below_tiept, grid_spacing, &invaffine_tierow_below[0]);
-			}
-			double segment_height = below_tiept - above_tiept;
-			grid_fraction = ((double)row - (double)above_tiept) / segment_height;
-		}
-//if(!row) printf("pixel[0,0]=%f\n", inbuf_this[0]);
-		for(size_t col=0; col<w; col++) {
-			double val = inbuf_this[col];
-			double brite, spec;
-			if(do_shade) {
-				double dx;
-				bool mid_good = !inbuf_ndv_this[col];
-				bool left_good = col>0 && !inbuf_ndv_this[col-1];
-				bool right_good = col<w-1 && !inbuf_ndv_this[col+1];
-				bool up_good = row>0 && !inbuf_ndv_prev[col];
-				bool down_good = row<h-1 && !inbuf_ndv_next[col];
-				if(left_good && right_good) {
-					dx = (inbuf_this[col+1] - inbuf_this[col-1]) / 2.0;
-				} else if(mid_good && right_good) {
-					dx = inbuf_this[col+1] - val;
-				} else if(mid_good && left_good) {
-					dx = val - inbuf_this[col-1];
-				} else {
-					dx = 0;
-				}
-				double dy;
-				if(up_good && down_good) {
-					dy = (inbuf_next[col] - inbuf_prev[col]) / 2.0;
-				} else if(mid_good && down_good) {
-					dy = inbuf_next[col] - val;
-				} else if(mid_good && up_good) {
-					dy = val - inbuf_prev[col];
-				} else {
-					dy = 0;
-				}
-
-				// convert from elevation per pixel to elevation per meter (unitless)
-				//double dx2 = invaffine_a * dx + invaffine_b * (-dy);
-				//double dy2 = invaffine_c * dx + invaffine_d * (-dy);
-				
-				double invaffine[4];
-				if(use_constant_invaffine) {
-					for(int i=0; i<4; i++) invaffine[i] = constant_invaffine[i];
-				} else {
-					for(int i=0; i<4; i++) {
-						invaffine[i] = invaffine_tierow_above[col*4 + i] * (1.0 - grid_fraction) +
-							invaffine_tierow_below[col*4 + i] * grid_fraction;
-					}
-					//compute_invaffine(georef, col, row, invaffine);
-				}
-				// FIXME - why the minus signs?
-				double dx2 = invaffine[0] * (-dx) + invaffine[1] * (-dy);
-				double dy2 = invaffine[2] * (-dx) + invaffine[3] * (-dy);
-				dx2 *= slope_exageration;
-				dy2 *= slope_exageration;
-				//if(col == 0) printf("row=%zd d=[%f, %f] d2=[%f, %f]\n", row, dx, dy, dx2, dy2);
-
-				int st_col = SHADE_TABLE_SIZE + (int)(SHADE_TABLE_SCALE * dx2);
-				if(st_col < 0) st_col = 0;
-				if(st_col > SHADE_TABLE_SIZE*2) st_col = SHADE_TABLE_SIZE*2;
-				int st_row = SHADE_TABLE_SIZE + (int)(SHADE_TABLE_SCALE * dy2);
-				if(st_row < 0) st_row = 0;
-				if(st_row > SHADE_TABLE_SIZE*2) st_row = SHADE_TABLE_SIZE*2;
-				brite = shade_table[st_row][st_col];
-				spec = spec_table[st_row][st_col];
-			} else {
-				brite = 1.0;
-				spec = 0.0;
-			}
-			if(inbuf_ndv_this[col]) {
-				if(use_palette) {
-					outbuf[0][col] = palette.nan_color.r;
-					outbuf[1][col] = palette.nan_color.g;
-					outbuf[2][col] = palette.nan_color.b;
-				} else {
-					for(int i=0; i<out_numbands; i++) outbuf[i][col] = 0;
-				}
-				got_nan=1;
-			} else {
-				if(data24bit) {
-					int ival = (int)round(val) + (1<<23);
-					if(ival >> 24) {
-						got_overflow = 1;
-						ival = 0;
-					}
-					pixel[2] = (uint8_t)(ival & 0xff);
-					pixel[1] = (uint8_t)((ival >> 8) & 0xff);
-					pixel[0] = (uint8_t)((ival >> 16) & 0xff);
-				} else if(alpha_overlay) {
-					if(thresh_brite < 1.0) {
-						brite += (spec / ALPHA_THRESH) * (1.0 - thresh_brite);
-					}
-
-					double alpha, white;
-					if(spec < ALPHA_THRESH) {
-						alpha = 1.0 - brite;
-						white = 0;
-					} else {
-						alpha = spec - ALPHA_THRESH;
-						white = 1;
-					}
-
-					if(alpha < 0) alpha = 0;
-					if(alpha > 1) alpha = 1;
-					if(white < 0) white = 0;
-					if(white > 1) white = 1;
-
-					pixel[0] = pixel[1] = pixel[2] = (uint8_t)(255.0 * white);
-					pixel[3] = (uint8_t)(255.0 * alpha);
-				} else {
-					if(use_palette) {
-						RGB c = palette.get(val);
-						pixel[0] = c.r;
-						pixel[1] = c.g;
-						pixel[2] = c.b;
-					} else if(tex_ds) {
-						for(int i=0; i<out_numbands; i++) pixel[i] = outbuf[i][col];
-					} else {
-						for(int i=0; i<out_numbands; i++) pixel[i] = 128;
-					}
-
-					for(int i=0; i<out_numbands; i++) {
-						int c = pixel[i];
-						c = (int)(c * brite + 255.0 * spec);
-						if(c > 254) c = 254;
-						pixel[i] = (uint8_t)c;
-					}
-				}
-				for(int i=0; i<out_numbands; i++) outbuf[i][col] = pixel[i];
-
-				if(!got_valid || val < min) min = val;
-				if(!got_valid || val > max) max = val;
-				got_valid=1;
-			}
-		}
-		for(int i=0; i<out_numbands; i++) {
-			GDALRasterIO(dst_band[i], GF_Write, 0, row, w, 1, &outbuf[i][0], w, 1, GDT_Byte, 0, 0);
-		}
+	double min, max;
+	bool got_nan, got_valid, got_overflow;
+	std::string error;
+	{
+		size_t num_slots = pipeline_slots(num_threads);
+		DemTask task(w, h, out_numbands, grid_spacing, num_slots);
+		task.src_band = src_band;
+		task.tex_bands = tex_bands;
+		task.dst_bands = dst_band;
+		task.ndv_def = &ndv_def;
+		task.src_scale = src_scale;
+		task.src_offset = src_offset;
+		task.georef = &georef;
+		task.approx_error = approx_error;
+		task.do_shade = do_shade;
+		task.use_constant_invaffine = use_constant_invaffine;
+		task.constant_invaffine = constant_invaffine;
+		task.slope_exageration = slope_exageration;
+		task.shade_table = &shade_table;
+		task.spec_table = &spec_table;
+		task.alpha_thresh = ALPHA_THRESH;
+		task.thresh_brite = thresh_brite;
+		task.use_palette = use_palette;
+		task.palette = &palette;
+		task.data24bit = data24bit;
+		task.alpha_overlay = alpha_overlay;
+
+		if(!run_pipeline(task, task.num_jobs, num_slots, num_threads)) error = task.getError();
+
+		min = task.min;
+		max = task.max;
+		got_nan = task.got_nan;
+		got_valid = task.got_valid;
+		got_overflow = task.got_overflow;
 	}
 
 	GDALTermProgress(1, NULL, NULL);
@@ -575,6 +714,8 @@ int main(int argc, char *argv[]) {
 	GDALClose(src_ds);
 	GDALClose(dst_ds);
 
+	if(!error.empty()) fatal_error(error);
+
 	printf("got_nan=%d, got_valid=%d, min=%f, max=%f\n",
 		got_nan?1:0, got_valid?1:0, min, max);
 	if(got_overflow) {
@@ -592,35 +733,19 @@ void scale_values(double *vals, size_t w, double scale, double offset) {
 	}
 }
 
-// this function generates a 2x2 matrix that
-// can be used to convert row/column gradients
-// to easting/northing gradients
-void compute_invaffine(
-	const GeoRef &georef, double col, double row, double *invaffine
+// lon/lat of the pixel, the pixel epsilon to the right, and the pixel
+// epsilon below => invaffine
+void invaffine_from_ll(
+	const GeoRef &georef, double epsilon,
+	double lon_0, double lat_0,
+	double lon_dx, double lat_dx,
+	double lon_dy, double lat_dy,
+	double *invaffine
 ) {
 	// in case we return due to error:
 	invaffine[0] = invaffine[1] =
 		invaffine[2] = invaffine[3] = 0;
 
-	// we want to compute d{longitude}/d{easting} etc.
-	// for the given pixel (row/col)
-	double epsilon = 1;
-	double lon_0, lat_0;
-	double lon_dx, lat_dx;
-	double lon_dy, lat_dy;
-	bool error =
-		georef.xy2ll(col, row, &lon_0, &lat_0) ||
-		georef.xy2ll(col+epsilon, row, &lon_dx, &lat_dx) ||
-		georef.xy2ll(col, row+epsilon, &lon_dy, &lat_dy);
-
-	if(error) {
-		invaffine[0] = 0;
-		invaffine[1] = 0;
-		invaffine[2] = 0;
-		invaffine[3] = 0;
-		return;
-	}
-
 	//	printf("ll=[%f, %f] [%f, %f] [%f, %f]\n", 
 	//		lon_0, lat_0, lon_dx, lat_dx, lon_dy, lat_dy);
 
@@ -670,27 +795,88 @@ void compute_invaffine(
 	//printf("invaffine=[%f, %f, %f, %f]\n", invaffine_a, invaffine_b, invaffine_c, invaffine_d);
 }
 
+// this function generates a 2x2 matrix that
+// can be used to convert row/column gradients
+// to easting/northing gradients
+void compute_invaffine(
+	const GeoRef &georef, double col, double row, double *invaffine
+) {
+	// in case we return due to error:
+	invaffine[0] = invaffine[1] =
+		invaffine[2] = invaffine[3] = 0;
+
+	// we want to compute d{longitude}/d{easting} etc.
+	// for the given pixel (row/col)
+	double epsilon = 1;
+	double lon_0, lat_0;
+	double lon_dx, lat_dx;
+	double lon_dy, lat_dy;
+	bool error =
+		georef.xy2ll(col, row, &lon_0, &lat_0) ||
+		georef.xy2ll(col+epsilon, row, &lon_dx, &lat_dx) ||
+		georef.xy2ll(col, row+epsilon, &lon_dy, &lat_dy);
+
+	if(error) {
+		invaffine[0] = 0;
+		invaffine[1] = 0;
+		invaffine[2] = 0;
+		invaffine[3] = 0;
+		return;
+	}
+
+	invaffine_from_ll(georef, epsilon,
+		lon_0, lat_0, lon_dx, lat_dx, lon_dy, lat_dy, invaffine);
+}
+
 // interpolate the invaffine for an entire row
 void compute_tierow_invaffine(
 	const GeoRef &georef,
-	int num_cols, int row, int grid_spacing,
+	int num_cols, int row, int grid_spacing, double approx_error,
 	double *invaffine_tierow
 ) {
-	double tiecol_left[4];
-	double tiecol_right[4];
-
-	compute_invaffine(georef, 0, row, tiecol_right);
+	const double epsilon = 1;
+
+	std::vector<int> tiecols;
+	for(int col=0; col<num_cols; col+=grid_spacing) tiecols.push_back(col);
+	tiecols.push_back(num_cols);
+	const size_t num_tie = tiecols.size();
+
+	// Transform all the tie points for the row at once.  The points on
+	// each of the two lines are in order, so the approximate transformer
+	// can be used.
+	std::vector<double> x0(num_tie*2), y0(num_tie*2, row);
+	std::vector<double> lon0(num_tie*2), lat0(num_tie*2);
+	std::vector<int> ok0(num_tie*2);
+	std::vector<double> x1(num_tie), y1(num_tie, row+epsilon);
+	std::vector<double> lon1(num_tie), lat1(num_tie);
+	std::vector<int> ok1(num_tie);
+	for(size_t i=0; i<num_tie; i++) {
+		x0[i*2  ] = tiecols[i];
+		x0[i*2+1] = tiecols[i] + epsilon;
+		x1[i] = tiecols[i];
+	}
+	georef.xy2ll_approx(num_tie*2, &x0[0], &y0[0], &lon0[0], &lat0[0], &ok0[0], approx_error);
+	georef.xy2ll_approx(num_tie, &x1[0], &y1[0], &lon1[0], &lat1[0], &ok1[0], approx_error);
+
+	std::vector<double> tie_invaffine(num_tie*4);
+	for(size_t i=0; i<num_tie; i++) {
+		double *invaffine = &tie_invaffine[i*4];
+		if(ok0[i*2] && ok0[i*2+1] && ok1[i]) {
+			invaffine_from_ll(georef, epsilon,
+				lon0[i*2], lat0[i*2], lon0[i*2+1], lat0[i*2+1], lon1[i], lat1[i],
+				invaffine);
+		} else {
+			for(int j=0; j<4; j++) invaffine[j] = 0;
+		}
+	}
 
-	double segment_width = 0; // will be initialized on first iteration
 	for(int col=0; col<num_cols; col++) {
-		int left_tiept = grid_spacing * (col / grid_spacing);
-		if(col == left_tiept) {
-			for(int i=0; i<4; i++) tiecol_left[i] = tiecol_right[i];
-			int right_tiept = col+grid_spacing;
-			if(right_tiept > num_cols) right_tiept = num_cols;
-			segment_width = right_tiept - left_tiept;
-			compute_invaffine(georef, right_tiept, row, tiecol_right);
-		}
+		size_t tie_idx = col / grid_spacing;
+		int left_tiept = tiecols[tie_idx];
+		int right_tiept = tiecols[tie_idx+1];
+		double segment_width = right_tiept - left_tiept;
+		const double *tiecol_left = &tie_invaffine[tie_idx*4];
+		const double *tiecol_right = &tie_invaffine[(tie_idx+1)*4];
 		double grid_fraction = ((double)col - (double)left_tiept) / segment_width;
 		for(int i=0; i<4; i++) {
 			invaffine_tierow[col*4 + i] =
@@ -26,8 +26,12 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 
+#include <boost/lexical_cast.hpp>
+
 #include "common.h"
 #include "polygon.h"
+#include "geom-reader.h"
+#include "georef.h"
 #include "debugplot.h"
 
 using namespace dangdal;
@@ -60,6 +64,8 @@ void usage(const std::string &cmdname) {
 	printf("  -s_srs <srs_def>      Source SRS\n");
 	printf("  -t_srs <srs_def>      Target SRS\n");
 	printf("  -report <out.ppm>     Ouput a graphical report (optional)\n");
+	printf("  -approx-error <err>   Allowed interpolation error when projecting the grid of\n");
+	printf("                        interior points, in target SRS units (default: 0, exact)\n");
 	printf("\nOutput is the envelope of the source region projected into the target SRS.\n");
 	printf("If the -t_bounds_wkt option is given it will be used as a clip mask in the\n");
 	printf("projected space.\n");
@@ -100,6 +106,31 @@ bool picky_transform(
 	return 1;
 }
 
+// picky_transform, for use with approx_transform_line
+class PickyTransformer : public PointTransformer {
+public:
+	PickyTransformer(
+		OGRCoordinateTransformationH _fwd_xform,
+		OGRCoordinateTransformationH _inv_xform
+	) :
+		fwd_xform(_fwd_xform),
+		inv_xform(_inv_xform)
+	{ }
+
+	virtual void transform(size_t n, double *x, double *y, int *success) const {
+		for(size_t i=0; i<n; i++) {
+			Vertex v(x[i], y[i]);
+			success[i] = picky_transform(fwd_xform, inv_xform, &v);
+			x[i] = v.x;
+			y[i] = v.y;
+		}
+	}
+
+private:
+	OGRCoordinateTransformationH fwd_xform;
+	OGRCoordinateTransformationH inv_xform;
+};
+
 int main(int argc, char **argv) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
@@ -110,6 +141,7 @@ int main(int argc, char **argv) {
 	std::string s_srs;
 	std::string t_srs;
 	std::string report_fn;
+	double approx_error = 0;
 
 	size_t argp = 1;
 	while(argp < arg_list.size()) {
@@ -133,6 +165,10 @@ int main(int argc, char **argv) {
 			} else if(arg == "-report") {
 				if(argp == arg_list.size()) usage(cmdname);
 				report_fn = arg_list[argp++];
+			} else if(arg == "-approx-error") {
+				if(argp == arg_list.size()) usage(cmdname);
+				approx_error = boost::lexical_cast<double>(arg_list[argp++]);
+				if(approx_error < 0) fatal_error("-approx-error must not be negative");
 			} else {
 				usage(cmdname);
 			}
@@ -187,11 +223,18 @@ int main(int argc, char **argv) {
 	// cases where the projected border does not necessarily encircle the
 	// source region (such as would be the case for a source region that
 	// encircles the pole with a target lonlat projection).
+	// Each column of the grid is a line in the source projection, so it is
+	// projected in one go with approx_transform_line.
+	PickyTransformer grid_xform(fwd_xform, inv_xform);
 	int num_grid_steps = 100;
+	std::vector<double> col_x, col_y;
+	std::vector<int> col_ok;
 	for(int grid_xi=0; grid_xi<=num_grid_steps; grid_xi++) {
 		Vertex src_pt;
 		double alpha_x = (double)grid_xi / (double)num_grid_steps;
 		src_pt.x = src_bbox.min_x + (src_bbox.max_x - src_bbox.min_x) * alpha_x;
+		col_x.clear();
+		col_y.clear();
 		for(int grid_yi=0; grid_yi<=num_grid_steps; grid_yi++) {
 			double alpha_y = (double)grid_yi / (double)num_grid_steps;
 			src_pt.y = src_bbox.min_y + (src_bbox.max_y - src_bbox.min_y) * alpha_y;
@@ -199,13 +242,21 @@ int main(int argc, char **argv) {
 
 			ps_interior.total++;
 
-			Vertex tgt_pt = src_pt;
-			if(!picky_transform(fwd_xform, inv_xform, &tgt_pt)) {
-				continue;
-			}
+			col_x.push_back(src_pt.x);
+			col_y.push_back(src_pt.y);
+		}
+		if(col_x.empty()) continue;
+
+		col_ok.resize(col_x.size());
+		approx_transform_line(grid_xform, col_x.size(),
+			&col_x[0], &col_y[0], &col_ok[0], approx_error);
+
+		for(size_t i=0; i<col_x.size(); i++) {
+			if(!col_ok[i]) continue;
 
 			ps_interior.proj_ok++;
 
+			Vertex tgt_pt(col_x[i], col_y[i]);
 			if(!use_t_bounds || t_bounds_mp.contains(tgt_pt)) {
 				ps_interior.contained++;
 				pl.pts.push_back(tgt_pt);
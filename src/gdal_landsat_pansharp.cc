@@ -27,6 +27,8 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include "common.h"
+#include "pipeline.h"
+#include "threads.h"
 
 #include <boost/lexical_cast.hpp>
 
@@ -49,16 +51,176 @@ struct ScaledBand {
 	int line_buf_idx;
 };
 
+using namespace dangdal;
+
 void copyGeoCode(GDALDatasetH dst_ds, GDALDatasetH src_ds);
 ScaledBand getScaledBand(GDALDatasetH lores_ds, int band_id, GDALDatasetH hires_ds);
 void readLineScaled(ScaledBand &sb, int row, double *hires_buf);
 
+// Approximate size of the buffers for one block.  There are a few more
+// blocks in flight than there are threads, so this bounds the memory used.
+static const size_t SLOT_BYTES = 4 << 20;
+
+// Each job is as many rows as fit in SLOT_BYTES.  The upsampling of the lo-res bands is
+// done by the reader, since readLineScaled keeps a window of lines from one
+// row to the next.
+class PansharpTask : public PipelineTask {
+public:
+	PansharpTask(
+		GDALRasterBandH _pan_band,
+		std::vector<ScaledBand> &_lum_bands, const std::vector<double> &_lum_weights,
+		std::vector<ScaledBand> &_rgb_bands,
+		const std::vector<GDALRasterBandH> &_dst_bands,
+		size_t _w, size_t _h, bool _use_ndv, double _ndv, size_t num_slots
+	) :
+		pan_band(_pan_band),
+		lum_bands(_lum_bands), lum_weights(_lum_weights),
+		rgb_bands(_rgb_bands), dst_bands(_dst_bands),
+		w(_w), h(_h), use_ndv(_use_ndv), ndv(_ndv),
+		slots(num_slots)
+	{
+		size_t row_bytes = w * (
+			(1 + lum_bands.size() + rgb_bands.size()) * sizeof(double) +
+			rgb_bands.size() * sizeof(uint8_t));
+		rows_per_job = std::max(size_t(1), std::min(h, SLOT_BYTES / row_bytes));
+		num_jobs = (h + rows_per_job - 1) / rows_per_job;
+
+		size_t len = w * rows_per_job;
+		for(size_t slot_idx=0; slot_idx<num_slots; slot_idx++) {
+			Slot &slot = slots[slot_idx];
+			slot.pan_buf.resize(len);
+			slot.lum_buf.assign(lum_bands.size(), std::vector<double>(len));
+			slot.rgb_buf.assign(rgb_bands.size(), std::vector<double>(len));
+			slot.out_buf.assign(rgb_bands.size(), std::vector<uint8_t>(len));
+			slot.scale_buf.resize(w);
+		}
+	}
+
+	size_t numRows(size_t job_idx) const {
+		return std::min(rows_per_job, h - job_idx * rows_per_job);
+	}
+
+	bool read(size_t job_idx, size_t slot_idx) {
+		size_t row0 = job_idx * rows_per_job;
+		size_t num_rows = numRows(job_idx);
+		Slot &slot = slots[slot_idx];
+
+		GDALRasterIO(pan_band, GF_Read, 0, row0, w, num_rows, &slot.pan_buf[0], w, num_rows, GDT_Float64, 0, 0);
+		for(size_t i=0; i<num_rows; i++) {
+			for(size_t band_idx=0; band_idx<lum_bands.size(); band_idx++) {
+				readLineScaled(lum_bands[band_idx], row0+i, &slot.lum_buf[band_idx][i*w]);
+			}
+			for(size_t band_idx=0; band_idx<rgb_bands.size(); band_idx++) {
+				readLineScaled(rgb_bands[band_idx], row0+i, &slot.rgb_buf[band_idx][i*w]);
+			}
+		}
+		return true;
+	}
+
+	bool compute(size_t job_idx, size_t slot_idx) {
+		size_t num_rows = numRows(job_idx);
+		Slot &slot = slots[slot_idx];
+		size_t lum_band_count = lum_bands.size();
+		double *scale_buf = &slot.scale_buf[0];
+
+		for(size_t i=0; i<num_rows; i++) {
+			const double *pan_buf = &slot.pan_buf[i*w];
+
+			for(size_t col=0; col<w; col++) {
+				bool skip = 0;
+
+				if(use_ndv) {
+					if(pan_buf[col] == ndv) skip = 1;
+					for(size_t band_idx=0; band_idx<lum_band_count; band_idx++) {
+						if(slot.lum_buf[band_idx][i*w + col] == ndv) {
+							skip = 1;
+						}
+					}
+				}
+
+				if(skip) {
+					scale_buf[col] = 1;
+				} else {
+					double lum_out = (double)pan_buf[col];
+					double lum_in = 0;
+					for(size_t band_idx=0; band_idx<lum_band_count; band_idx++) {
+						lum_in += slot.lum_buf[band_idx][i*w + col] * lum_weights[band_idx];
+					}
+
+					scale_buf[col] = lum_in>0 ? lum_out/lum_in : 0;
+				} // skip
+			} // col
+
+			for(size_t band_idx=0; band_idx<rgb_bands.size(); band_idx++) {
+				const double *rgb_buf = &slot.rgb_buf[band_idx][i*w];
+				uint8_t *out_buf = &slot.out_buf[band_idx][i*w];
+
+				for(size_t col=0; col<w; col++) {
+					if(use_ndv && rgb_buf[col] == ndv) {
+						out_buf[col] = (uint8_t)ndv;
+					} else {
+						double dbl_val = rgb_buf[col] * scale_buf[col];
+
+						uint8_t byte_val = 
+							dbl_val < 0 ? 0 :
+							dbl_val > 255.0 ? 255 :
+							(uint8_t)dbl_val;
+
+						// avoid ndv in output
+						if(use_ndv && byte_val == ndv) {
+							if(ndv < 128) byte_val++;
+							else byte_val--;
+						}
+
+						out_buf[col] = byte_val;
+					}
+				}
+			}
+		} // row
+		return true;
+	}
+
+	bool write(size_t job_idx, size_t slot_idx) {
+		size_t row0 = job_idx * rows_per_job;
+		size_t num_rows = numRows(job_idx);
+		Slot &slot = slots[slot_idx];
+
+		GDALTermProgress((double)row0/h, NULL, NULL);
+
+		for(size_t band_idx=0; band_idx<dst_bands.size(); band_idx++) {
+			GDALRasterIO(dst_bands[band_idx], GF_Write, 0, row0, w, num_rows,
+				&slot.out_buf[band_idx][0], w, num_rows, GDT_Byte, 0, 0);
+		}
+		return true;
+	}
+
+	struct Slot {
+		std::vector<double> pan_buf;
+		std::vector<std::vector<double> > lum_buf;
+		std::vector<std::vector<double> > rgb_buf;
+		std::vector<std::vector<uint8_t> > out_buf;
+		std::vector<double> scale_buf;
+	};
+
+	GDALRasterBandH pan_band;
+	std::vector<ScaledBand> &lum_bands;
+	const std::vector<double> &lum_weights;
+	std::vector<ScaledBand> &rgb_bands;
+	const std::vector<GDALRasterBandH> &dst_bands;
+	size_t w, h;
+	bool use_ndv;
+	double ndv;
+	size_t rows_per_job;
+	size_t num_jobs;
+	std::vector<Slot> slots;
+};
+
 void usage(const std::string &cmdname) {
 	printf("Usage:\n %s\n", cmdname.c_str());
 	printf(
 "      -rgb <src_rgb.tif> [ -rgb <src.tif> ... ]\n"
 "      [ -lum <lum.tif> <weight> ... ] -pan <pan.tif>\n"
-"      [ -ndv <nodataval> ] -o <out-rgb.tif>\n"
+"      [ -ndv <nodataval> ] [ -threads <n> ] -o <out-rgb.tif>\n"
 "\nWhere:\n"
 "    rgb.tif    Source bands that are to be enhanced\n"
 "    lum.tif    Bands used to simulate lo-res pan band\n"
@@ -90,6 +252,7 @@ int main(int argc, char *argv[]) {
 	std::string output_format;
 	double ndv = 0;
 	char use_ndv = 0;
+	size_t num_threads = get_num_cpus();
 
 	GDALAllRegister();
 
@@ -108,6 +271,11 @@ int main(int argc, char *argv[]) {
 				else if(arg == "-of" ) { if(argp == arg_list.size()) usage(cmdname); output_format = arg_list[argp++]; }
 				else if(arg == "-o"  ) { if(argp == arg_list.size()) usage(cmdname); dst_fn = arg_list[argp++]; }
 				else if(arg == "-pan") { if(argp == arg_list.size()) usage(cmdname); pan_fn = arg_list[argp++]; }
+				else if(arg == "-threads") {
+					if(argp == arg_list.size()) usage(cmdname);
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(num_threads < 1) fatal_error("-threads must be at least 1");
+				}
 				else if(arg == "-rgb") {
 					if(argp == arg_list.size()) usage(cmdname);
 					std::string fn = arg_list[argp++];
@@ -210,76 +378,13 @@ int main(int argc, char *argv[]) {
 
 	//////// process data ////////
 
-	std::vector<std::vector<double> > lum_buf(lum_band_count);
-	for(size_t band_idx=0; band_idx<lum_band_count; band_idx++) {
-		lum_buf[band_idx].resize(w);
+	std::string error;
+	{
+		size_t num_slots = pipeline_slots(num_threads);
+		PansharpTask task(pan_band, lum_bands, lum_weights, rgb_bands, dst_bands,
+			w, h, use_ndv, ndv, num_slots);
+		if(!run_pipeline(task, task.num_jobs, num_slots, num_threads)) error = task.getError();
 	}
-	std::vector<double> pan_buf(w);
-	std::vector<double> rgb_buf(w);
-	std::vector<uint8_t> out_buf(w);
-	std::vector<double> scale_buf(w);
-
-	for(size_t row=0; row<h; row++) {
-		GDALTermProgress((double)row/h, NULL, NULL);
-
-		GDALRasterIO(pan_band, GF_Read, 0, row, w, 1, &pan_buf[0], w, 1, GDT_Float64, 0, 0);
-		for(size_t band_idx=0; band_idx<lum_band_count; band_idx++) {
-			readLineScaled(lum_bands[band_idx], row, &lum_buf[band_idx][0]);
-		}
-
-		for(size_t col=0; col<w; col++) {
-			bool skip = 0;
-
-			if(use_ndv) {
-				if(pan_buf[col] == ndv) skip = 1;
-				for(size_t band_idx=0; band_idx<lum_band_count; band_idx++) {
-					if(lum_buf[band_idx][col] == ndv) {
-						skip = 1;
-					}
-				}
-			}
-
-			if(skip) {
-				scale_buf[col] = 1;
-			} else {
-				double lum_out = (double)pan_buf[col];
-				double lum_in = 0;
-				for(size_t i=0; i<lum_band_count; i++) {
-					lum_in += lum_buf[i][col] * lum_weights[i];
-				}
-
-				scale_buf[col] = lum_in>0 ? lum_out/lum_in : 0;
-			} // skip
-		} // col
-
-		for(size_t band_idx=0; band_idx<rgb_band_count; band_idx++) {
-			readLineScaled(rgb_bands[band_idx], row, &rgb_buf[0]);
-
-			for(size_t col=0; col<w; col++) {
-				if(use_ndv && rgb_buf[col] == ndv) {
-					out_buf[col] = (uint8_t)ndv;
-				} else {
-					double dbl_val = rgb_buf[col] * scale_buf[col];
-
-					uint8_t byte_val = 
-						dbl_val < 0 ? 0 :
-						dbl_val > 255.0 ? 255 :
-						(uint8_t)dbl_val;
-
-					// avoid ndv in output
-					if(use_ndv && byte_val == ndv) {
-						if(ndv < 128) byte_val++;
-						else byte_val--;
-					}
-
-					out_buf[col] = byte_val;
-				}
-			}
-
-			GDALRasterIO(dst_bands[band_idx], GF_Write, 0, row, w, 1,
-				&out_buf[0], w, 1, GDT_Byte, 0, 0);
-		}
-	} // row
 
 	for(size_t i=0; i<rgb_ds.size(); i++) {
 		GDALClose(rgb_ds[i]);
@@ -290,6 +395,8 @@ int main(int argc, char *argv[]) {
 	GDALClose(pan_ds);
 	GDALClose(dst_ds);
 
+	if(!error.empty()) fatal_error(error);
+
 	GDALTermProgress(1, NULL, NULL);
 
 	return 0;
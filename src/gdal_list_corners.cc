@@ -35,7 +35,9 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include "georef.h"
 #include "ndv.h"
 #include "mask.h"
+#include "mask-writer.h"
 #include "rectangle_finder.h"
+#include "threads.h"
 
 using namespace dangdal;
 
@@ -46,6 +48,8 @@ void usage(const std::string &cmdname) {
 	GeoOpts::printUsage();
 	printf("\n");
 	NdvDef::printUsage();
+	printf("\n");
+	MaskOutOpts::printUsage();
 
 	printf(
 "\n"
@@ -53,13 +57,25 @@ void usage(const std::string &cmdname) {
 "  -inspect-rect4              Attempt to find 4-sided bounding polygon\n"
 "  -fuzzy-match                Try to exclude logos and other extraneous\n"
 "                              pixels from bounding polygon\n"
+"  -fuzzy-iterations n         Number of candidate polygons to try for\n"
+"                              -fuzzy-match (default 10000)\n"
+"  -fuzzy-perturb n            Initial size of random perturbations in\n"
+"                              pixels for -fuzzy-match (default 200)\n"
+"  -fuzzy-penalty n            Cost of each pixel a candidate polygon gets\n"
+"                              wrong (a data pixel left out or an NDV pixel\n"
+"                              taken in), relative to a score of 1 for each\n"
+"                              pixel it gets right (default 2)\n"
 "  -b band_id -b band_id ...   Bands to inspect (default is all bands)\n"
 "  -erosion                    Erode pixels that don't have two consecutive\n"
 "                              neighbors\n"
 "  -report fn.ppm              Output graphical report of bounds found\n"
-"  -mask-out fn.pbm            Output mask of bounding polygon in PBM format\n"
+"  -mask-out fn                Output mask of bounding polygon (PBM or\n"
+"                              GeoTIFF, see -mask-of)\n"
 "\n"
 "Misc:\n"
+"  -threads n                  Number of threads to use for -fuzzy-match,\n"
+"                              the only step that runs in parallel (default\n"
+"                              is number of CPUs)\n"
 "  -v                          Verbose\n"
 "\n"
 "Examples:\n"
@@ -81,6 +97,9 @@ int main(int argc, char **argv) {
 
 	bool inspect_rect4 = 0;
 	bool fuzzy_match = 0;
+	FuzzyMatchParams fuzzy_params;
+	fuzzy_params.num_threads = get_num_cpus();
+	bool fuzzy_opts_given = 0;
 	std::string debug_report;
 	std::string mask_out_fn;
 	std::vector<size_t> inspect_bandids;
@@ -96,6 +115,7 @@ int main(int argc, char **argv) {
 
 	GeoOpts geo_opts = GeoOpts(arg_list);
 	NdvDef ndv_def = NdvDef(arg_list);
+	MaskOutOpts mask_out_opts = MaskOutOpts(arg_list);
 
 	size_t argp = 1;
 	while(argp < arg_list.size()) {
@@ -109,6 +129,25 @@ int main(int argc, char **argv) {
 					inspect_rect4 = 1;
 				} else if(arg == "-fuzzy-match") {
 					fuzzy_match = 1;
+				} else if(arg == "-fuzzy-iterations") {
+					if(argp == arg_list.size()) usage(cmdname);
+					fuzzy_params.iterations = boost::lexical_cast<int>(arg_list[argp++]);
+					if(fuzzy_params.iterations < 0) fatal_error("-fuzzy-iterations must not be negative");
+					fuzzy_opts_given = 1;
+				} else if(arg == "-fuzzy-perturb") {
+					if(argp == arg_list.size()) usage(cmdname);
+					fuzzy_params.max_perturb = boost::lexical_cast<double>(arg_list[argp++]);
+					if(fuzzy_params.max_perturb < 1) fatal_error("-fuzzy-perturb must be at least 1");
+					fuzzy_opts_given = 1;
+				} else if(arg == "-fuzzy-penalty") {
+					if(argp == arg_list.size()) usage(cmdname);
+					fuzzy_params.penalty = boost::lexical_cast<int>(arg_list[argp++]);
+					if(fuzzy_params.penalty < 0) fatal_error("-fuzzy-penalty must not be negative");
+					fuzzy_opts_given = 1;
+				} else if(arg == "-threads") {
+					if(argp == arg_list.size()) usage(cmdname);
+					fuzzy_params.num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(fuzzy_params.num_threads < 1) fatal_error("-threads must be at least 1");
 				} else if(arg == "-b") {
 					if(argp == arg_list.size()) usage(cmdname);
 					int bandid = boost::lexical_cast<int>(arg_list[argp++]);
@@ -133,6 +172,10 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if(fuzzy_opts_given && !fuzzy_match) {
+		fatal_error("-fuzzy-* options can only be used with -fuzzy-match");
+	}
+
 	bool do_inspect = inspect_rect4;
 	if(do_inspect && input_raster_fn.empty()) fatal_error("must specify filename of image");
 
@@ -267,7 +310,7 @@ int main(int argc, char **argv) {
 	}
 
 	if(inspect_rect4) {
-		Ring rect4 = calc_rect4_from_mask(mask, georef.w, georef.h, dbuf, fuzzy_match);
+		Ring rect4 = calc_rect4_from_mask(mask, georef.w, georef.h, dbuf, fuzzy_match, fuzzy_params);
 
 		if(rect4.pts.size() != 4) {
 			fatal_error("could not find four-sided region");
@@ -277,7 +320,8 @@ int main(int argc, char **argv) {
 			Mpoly bpoly;
 			bpoly.rings.push_back(rect4);
 
-			mask_from_mpoly(bpoly, georef.w, georef.h, mask_out_fn);
+			MaskWriter mask_out(mask_out_fn, mask_out_opts, georef.w, georef.h, georef);
+			mask_from_mpoly(bpoly, georef.w, georef.h, mask_out);
 		}
 
 		const char *labels[] = { "upper_left", "upper_right", "lower_right", "lower_left" };
@@ -31,14 +31,17 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include "common.h"
 #include "ndv.h"
 #include "mask.h"
+#include "mask-writer.h"
 
 using namespace dangdal;
 
 void usage(const std::string &cmdname) {
-	printf("Usage:\n  %s [options] [image_name] [mask_name.pbm]\n", cmdname.c_str());
+	printf("Usage:\n  %s [options] [image_name] [mask_name]\n", cmdname.c_str());
 	printf("\n");
 	
 	NdvDef::printUsage();
+	printf("\n");
+	MaskOutOpts::printUsage();
 
 	printf(
 "\n"
@@ -64,6 +67,7 @@ int main(int argc, char **argv) {
 	std::vector<size_t> inspect_bandids;
 
 	NdvDef ndv_def = NdvDef(arg_list);
+	MaskOutOpts mask_out_opts = MaskOutOpts(arg_list);
 
 	size_t argp = 1;
 	while(argp < arg_list.size()) {
@@ -127,6 +131,10 @@ int main(int argc, char **argv) {
 
 	BitGrid mask = get_bitgrid_for_dataset(ds, inspect_bandids, ndv_def, NULL);
 
+	double affine[6];
+	bool has_affine = GDALGetGeoTransform(ds, affine) == CE_None;
+	std::string proj_wkt = GDALGetProjectionRef(ds);
+
 	GDALClose(ds);
 
 	if(do_invert) {
@@ -137,23 +145,22 @@ int main(int argc, char **argv) {
 		mask.erode();
 	}
 
-	FILE *fout = fopen(mask_out_fn.c_str(), "wb");
-	if(!fout) fatal_error("cannot open mask output");
-	fprintf(fout, "P4\n%zd %zd\n", w, h);
+	MaskWriter mask_out(mask_out_fn, mask_out_opts, w, h,
+		has_affine ? affine : NULL, proj_wkt);
 	std::vector<uint8_t> buf((w+7)/8);
 	for(size_t y=0; y<h; y++) {
 		buf.assign((w+7)/8, 0);
 		uint8_t *p = &buf[0];
 		uint8_t bitp = 128;
 		for(size_t x=0; x<w; x++) {
-			if(!mask(x, y)) *p |= bitp;
+			if(mask(x, y)) *p |= bitp;
 			bitp >>= 1;
 			if(!bitp) {
 				p++;
 				bitp = 128;
 			}
 		}
-		fwrite(&buf[0], (w+7)/8, 1, fout);
+		mask_out.writeRow(&buf[0]);
 	}
-	fclose(fout);
+	mask_out.close();
 }
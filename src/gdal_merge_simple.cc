@@ -29,9 +29,77 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include <vector>
 
 #include "common.h"
+#include "pipeline.h"
+
+using namespace dangdal;
 
 void copyGeoCode(GDALDatasetH dst_ds, GDALDatasetH src_ds);
 
+// Copies chunk_size rows per job.  There is nothing to compute, but with the
+// pipeline the writer (often the bottleneck, when compressing) no longer
+// waits on reads.
+class CopyRowsTask : public PipelineTask {
+public:
+	CopyRowsTask(
+		const std::vector<GDALRasterBandH> &_src_bands,
+		const std::vector<GDALRasterBandH> &_dst_bands,
+		size_t _w, size_t _h, size_t _chunk_size, size_t num_slots
+	) :
+		src_bands(_src_bands), dst_bands(_dst_bands),
+		w(_w), h(_h), chunk_size(_chunk_size),
+		num_jobs((h + chunk_size - 1) / chunk_size),
+		bufs(num_slots)
+	{
+		for(size_t slot_idx=0; slot_idx<num_slots; slot_idx++) {
+			bufs[slot_idx].resize(src_bands.size());
+			for(size_t band_idx=0; band_idx<src_bands.size(); band_idx++) {
+				// FIXME - handle other datatypes
+				bufs[slot_idx][band_idx].resize(w * chunk_size);
+			}
+		}
+	}
+
+	bool read(size_t job_idx, size_t slot_idx) {
+		size_t row = job_idx * chunk_size;
+		int num_lines = std::min(chunk_size, h - row);
+		for(size_t band_idx=0; band_idx<src_bands.size(); band_idx++) {
+			if(GDALRasterIO(
+				src_bands[band_idx], GF_Read,
+				0, row, w, num_lines,
+				&bufs[slot_idx][band_idx][0], w, num_lines,
+				GDT_Byte, 0, 0
+			) != CE_None) return fail("read error");
+		}
+		return true;
+	}
+
+	bool compute(size_t, size_t) { return true; }
+
+	bool write(size_t job_idx, size_t slot_idx) {
+		size_t row = job_idx * chunk_size;
+		GDALTermProgress((double)row/(double)h, NULL, NULL);
+
+		int num_lines = std::min(chunk_size, h - row);
+		for(size_t band_idx=0; band_idx<dst_bands.size(); band_idx++) {
+			if(GDALRasterIO(
+				dst_bands[band_idx], GF_Write,
+				0, row, w, num_lines,
+				&bufs[slot_idx][band_idx][0], w, num_lines,
+				GDT_Byte, 0, 0
+			) != CE_None) return fail("write error");
+		}
+		return true;
+	}
+
+	const std::vector<GDALRasterBandH> &src_bands;
+	const std::vector<GDALRasterBandH> &dst_bands;
+	size_t w, h;
+	size_t chunk_size;
+	size_t num_jobs;
+	// per slot and band
+	std::vector<std::vector<std::vector<uint8_t> > > bufs;
+};
+
 void usage(const std::string &cmdname) {
 	printf("Usage:\n");
 	printf("    %s -in <rgb.tif> -in <mask.tif> -out <out.tif>\n", cmdname.c_str());
@@ -123,30 +191,13 @@ int main(int argc, char *argv[]) {
 
 	//////// process data ////////
 
-	int chunk_size = 200;
+	size_t chunk_size = 200;
 
-	// FIXME - handle other datatypes
-	std::vector<uint8_t> buf(w * chunk_size);
-
-	for(size_t row=0; row<h; row+=chunk_size) {
-		GDALTermProgress((double)row/(double)h, NULL, NULL);
-
-		int num_lines = chunk_size;
-		if(row+num_lines > h) num_lines = h - row;
-		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-			if(GDALRasterIO(
-				src_bands[band_idx], GF_Read,
-				0, row, w, num_lines,
-				&buf[0], w, num_lines,
-				GDT_Byte, 0, 0
-			) != CE_None) fatal_error("read error");
-			if(GDALRasterIO(
-				dst_bands[band_idx], GF_Write,
-				0, row, w, num_lines,
-				&buf[0], w, num_lines,
-				GDT_Byte, 0, 0
-			) != CE_None) fatal_error("write error");
-		}
+	std::string error;
+	{
+		size_t num_slots = pipeline_slots(1);
+		CopyRowsTask task(src_bands, dst_bands, w, h, chunk_size, num_slots);
+		if(!run_pipeline(task, task.num_jobs, num_slots, 1)) error = task.getError();
 	}
 
 	//////// shutdown ////////
@@ -156,6 +207,8 @@ int main(int argc, char *argv[]) {
 	}
 	GDALClose(dst_ds);
 
+	if(!error.empty()) fatal_error(error);
+
 	GDALTermProgress(1, NULL, NULL);
 
 	return 0;
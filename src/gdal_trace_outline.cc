@@ -38,10 +38,14 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include "georef.h"
 #include "ndv.h"
 #include "mask.h"
+#include "mask-writer.h"
 #include "mask-tracer.h"
 #include "dp.h"
+#include "vw.h"
 #include "excursion_pincher.h"
 #include "beveler.h"
+#include "geom-writer.h"
+#include "threads.h"
 
 #include <ogrsf_frmts.h>
 #include <cpl_string.h>
@@ -63,6 +67,8 @@ void usage(const std::string &cmdname) {
 	GeoOpts::printUsage();
 	printf("\n");
 	NdvDef::printUsage();
+	printf("\n");
+	MaskOutOpts::printUsage();
 
 	printf(
 "\n"
@@ -89,8 +95,15 @@ void usage(const std::string &cmdname) {
 "                               This option can be specified more than once.\n"
 "                               'percent' means interpret coordinate as percent\n"
 "                               of image width/height.\n"
+"  -smooth-staircases           Replace pixel staircases with diagonal lines\n"
+"                               while tracing (error is under half a pixel)\n"
+"  -simplify [dp | vw]          Polygon simplification algorithm:\n"
+"                               Douglas-Peucker (default) or topology\n"
+"                               preserving Visvalingam-Whyatt\n"
 "  -dp-toler val                Tolerance for polygon simplification\n"
 "                               (in pixels, default is 2.0)\n"
+"  -vw-area val                 Area threshold for '-simplify vw'\n"
+"                               (in square pixels, default is 2.0)\n"
 "  -bevel-size                  How much to shave off corners at\n"
 "                               self-intersection points\n"
 "                               (in pixels, default is 0.1)\n"
@@ -102,14 +115,18 @@ void usage(const std::string &cmdname) {
 "\n"
 "Output:\n"
 "  -report fn.ppm               Output graphical report of polygons found\n"
-"  -mask-out fn.pbm             Output mask of bounding polygon in PBM format\n"
+"  -mask-out fn                 Output mask of bounding polygon (PBM or\n"
+"                               GeoTIFF, see -mask-of)\n"
 "  -out-cs [xy | en | ll]       Set coordinate system for following outputs\n"
 "                               (pixel coords, easting/northing, or lon/lat)\n"
-"                               Must be specified before -{wkt,wkb,ogr}-out options\n"
+"                               Must be specified before -{wkt,wkb,geojson,ogr}-out options\n"
 "  -llproj-toler val            Error tolerance for curved lines when\n"
 "                               using '-out-cs ll' (in pixels, default is 1.0)\n"
 "  -wkt-out fn.wkt              Output polygons in WKT format\n"
 "  -wkb-out fn.wkb              Output polygons in WKB format\n"
+"  -geojson-out fn.json         Output polygons in GeoJSON format\n"
+"  -out-precision digits        Number of significant digits for WKT and\n"
+"                               GeoJSON outputs (default is 15)\n"
 "  -ogr-out fn.shp              Output polygons using an OGR format\n"
 "  -ogr-fmt                     OGR format to use (default is 'ESRI Shapefile')\n"
 "                               Must be specified before -ogr-out option\n"
@@ -117,6 +134,10 @@ void usage(const std::string &cmdname) {
 "                               multipolygon\n"
 "\n"
 "Misc:\n"
+"  -threads n                   Number of threads to use for beveling\n"
+"                               (-bevel-size), Douglas-Peucker simplification\n"
+"                               (-dp-toler), and reprojection to ll\n"
+"                               coordinates (default is the number of CPUs)\n"
 "  -v                           Verbose\n"
 "\n"
 "Examples:\n"
@@ -137,6 +158,11 @@ void usage(const std::string &cmdname) {
 	exit(1);
 }
 
+enum SimplifyAlgorithm {
+	SIMPLIFY_DP,
+	SIMPLIFY_VW
+};
+
 enum CoordSystem {
 	CS_UNKNOWN,
 	CS_XY,
@@ -148,8 +174,7 @@ enum CoordSystem {
 struct GeomOutput {
 	explicit GeomOutput(CoordSystem _out_cs=CS_UNKNOWN) :
 		out_cs(_out_cs),
-		wkt_fh(NULL),
-		wkb_fh(NULL),
+		geom_writer(NULL),
 		ogr_ds(NULL),
 		ogr_layer(NULL),
 		class_fld_idx(-1)
@@ -160,10 +185,9 @@ struct GeomOutput {
 	CoordSystem out_cs;
 
 	std::string wkt_fn;
-	FILE *wkt_fh;
-
 	std::string wkb_fn;
-	FILE *wkb_fh;
+	std::string geojson_fn;
+	GeomWriter *geom_writer;
 
 	std::string ogr_fn;
 	std::string ogr_fmt;
@@ -205,20 +229,26 @@ int main(int argc, char **argv) {
 	std::string cur_ogr_fmt = "ESRI Shapefile";
 	std::vector<GeomOutput> geom_outputs;
 	std::string mask_out_fn;
+	int out_precision = 15;
 	bool major_ring_only = 0;
 	bool trace_no_donuts = 0;
 	bool output_no_donuts = 0;
 	int64_t min_ring_area = 0;
+	SimplifyAlgorithm simplify_algorithm = SIMPLIFY_DP;
 	double reduction_tolerance = 2;
+	double vw_min_area = 2;
 	bool do_erosion = 0;
+	bool smooth_staircases = 0;
 	bool do_invert = 0;
 	double llproj_toler = 1;
 	double bevel_size = .1;
 	bool do_pinch_excursions = 0;
+	size_t num_threads = get_num_cpus();
 	std::vector<ContainingOption> containing_options;
 
 	GeoOpts geo_opts = GeoOpts(arg_list);
 	NdvDef ndv_def = NdvDef(arg_list);
+	MaskOutOpts mask_out_opts = MaskOutOpts(arg_list);
 
 	size_t argp = 1;
 	while(argp < arg_list.size()) {
@@ -253,6 +283,16 @@ int main(int argc, char **argv) {
 					GeomOutput go(cur_out_cs);
 					go.wkb_fn = arg_list[argp++];
 					geom_outputs.push_back(go);
+				} else if(arg == "-geojson-out") {
+					if(argp == arg_list.size()) usage(cmdname);
+					GeomOutput go(cur_out_cs);
+					go.geojson_fn = arg_list[argp++];
+					geom_outputs.push_back(go);
+				} else if(arg == "-out-precision") {
+					if(argp == arg_list.size()) usage(cmdname);
+					out_precision = boost::lexical_cast<int>(arg_list[argp++]);
+					if(out_precision < 1 || out_precision > 17) fatal_error(
+						"-out-precision must be in the range 1 <= digits <= 17");
 				} else if(arg == "-ogr-out") {
 					if(argp == arg_list.size()) usage(cmdname);
 					GeomOutput go(cur_out_cs);
@@ -279,9 +319,20 @@ int main(int argc, char **argv) {
 				} else if(arg == "-min-ring-area") {
 					if(argp == arg_list.size()) usage(cmdname);
 					min_ring_area = boost::lexical_cast<int64_t>(arg_list[argp++]);
+				} else if(arg == "-smooth-staircases") {
+					smooth_staircases = 1;
+				} else if(arg == "-simplify") {
+					if(argp == arg_list.size()) usage(cmdname);
+					std::string algo = arg_list[argp++];
+					if     (algo == "dp") simplify_algorithm = SIMPLIFY_DP;
+					else if(algo == "vw") simplify_algorithm = SIMPLIFY_VW;
+					else fatal_error("unrecognized simplification algorithm (%s)", algo.c_str());
 				} else if(arg == "-dp-toler") {
 					if(argp == arg_list.size()) usage(cmdname);
 					reduction_tolerance = boost::lexical_cast<double>(arg_list[argp++]);
+				} else if(arg == "-vw-area") {
+					if(argp == arg_list.size()) usage(cmdname);
+					vw_min_area = boost::lexical_cast<double>(arg_list[argp++]);
 				} else if(arg == "-bevel-size") {
 					if(argp == arg_list.size()) usage(cmdname);
 					bevel_size = boost::lexical_cast<double>(arg_list[argp++]);
@@ -308,6 +359,10 @@ int main(int argc, char **argv) {
 					opt.y = boost::lexical_cast<double>(arg_list[argp++]);
 
 					containing_options.push_back(opt);
+				} else if(arg == "-threads") {
+					if(argp == arg_list.size()) usage(cmdname);
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(num_threads < 1) fatal_error("-threads must be at least 1");
 				} else if(arg == "-h" || arg == "--help") {
 					usage(cmdname);
 				} else {
@@ -402,12 +457,16 @@ int main(int argc, char **argv) {
 		GeomOutput &go = geom_outputs[go_idx];
 		
 		if(go.wkt_fn.size()) {
-			go.wkt_fh = fopen(go.wkt_fn.c_str(), "w");
-			if(!go.wkt_fh) fatal_error("cannot open output file for WKT");
+			go.geom_writer = new GeomWriter(go.wkt_fn, GEOM_FMT_WKT,
+				out_precision, WKB_BYTE_ORDER);
 		}
 		if(go.wkb_fn.size()) {
-			go.wkb_fh = fopen(go.wkb_fn.c_str(), "w");
-			if(!go.wkb_fh) fatal_error("cannot open output file for WKB");
+			go.geom_writer = new GeomWriter(go.wkb_fn, GEOM_FMT_WKB,
+				out_precision, WKB_BYTE_ORDER);
+		}
+		if(go.geojson_fn.size()) {
+			go.geom_writer = new GeomWriter(go.geojson_fn, GEOM_FMT_GEOJSON,
+				out_precision, WKB_BYTE_ORDER);
 		}
 
 		if(go.ogr_fn.size()) {
@@ -499,7 +558,8 @@ int main(int argc, char **argv) {
 			trace_no_donuts = 1;
 		}
 
-		Mpoly feature_poly = trace_mask(mask, georef.w, georef.h, min_ring_area, trace_no_donuts);
+		Mpoly feature_poly = trace_mask(mask, georef.w, georef.h, min_ring_area, trace_no_donuts,
+			smooth_staircases);
 		mask = BitGrid(0, 0); // free some memory
 
 		if(VERBOSE) {
@@ -531,7 +591,7 @@ int main(int argc, char **argv) {
 		if(!feature_poly.rings.empty() && bevel_size > 0) {
 			// the topology cannot be resolved by us or by geos/jump/postgis if
 			// there are self-intersections
-			bevel_self_intersections(feature_poly, bevel_size);
+			bevel_self_intersections(feature_poly, bevel_size, num_threads);
 		}
 
 		if(feature_poly.rings.size() && do_pinch_excursions) {
@@ -541,12 +601,20 @@ int main(int argc, char **argv) {
 		}
 
 		if(mask_out_fn.size()) {
-			mask_from_mpoly(feature_poly, georef.w, georef.h, mask_out_fn);
-		}
-
-		if(feature_poly.rings.size() && reduction_tolerance > 0) {
-			Mpoly reduced_poly = compute_reduced_pointset(feature_poly, reduction_tolerance);
-			feature_poly = reduced_poly;
+			MaskWriter mask_out(mask_out_fn, mask_out_opts, georef.w, georef.h, georef);
+			mask_from_mpoly(feature_poly, georef.w, georef.h, mask_out);
+		}
+
+		if(feature_poly.rings.size()) {
+			if(simplify_algorithm == SIMPLIFY_DP && reduction_tolerance > 0) {
+				Mpoly reduced_poly = compute_reduced_pointset(
+					feature_poly, reduction_tolerance, num_threads);
+				feature_poly = reduced_poly;
+			} else if(simplify_algorithm == SIMPLIFY_VW && vw_min_area > 0) {
+				Mpoly reduced_poly = compute_vw_reduced_pointset(
+					feature_poly, vw_min_area);
+				feature_poly = reduced_poly;
+			}
 		}
 
 		if(feature_poly.rings.empty()) {
@@ -587,27 +655,30 @@ int main(int argc, char **argv) {
 						} else if(go.out_cs == CS_EN) {
 							proj_poly.xy2en(georef);
 						} else if(go.out_cs == CS_LL) {
-							proj_poly.xy2ll_with_interp(georef, llproj_toler);
+							proj_poly.xy2ll_with_interp(georef, llproj_toler, num_threads);
 						} else {
 							fatal_error("bad val for out_cs");
 						}
 
-						OGRGeometryH ogr_geom = mpoly_to_ogr(proj_poly);
-
-						if(go.wkt_fh) {
-							char *wkt_out;
-							OGR_G_ExportToWkt(ogr_geom, &wkt_out);
-							fprintf(go.wkt_fh, "%s\n", wkt_out);
+						if(go.wkb_fn.size()) {
+							printf("WKB size = %zd\n", GeomWriter::wkbSize(proj_poly));
 						}
-						if(go.wkb_fh) {
-							size_t wkb_size = OGR_G_WkbSize(ogr_geom);
-							printf("WKB size = %zd\n", wkb_size);
-							std::vector<unsigned char> wkb_out(wkb_size);
-							OGR_G_ExportToWkb(ogr_geom, WKB_BYTE_ORDER, &wkb_out[0]);
-							fwrite(&wkb_out[0], wkb_size, 1, go.wkb_fh);
+						if(go.geom_writer) {
+							FeatureProps props;
+							if(classify) {
+								props.push_back(std::make_pair(std::string("value"), class_id));
+								if(color) {
+									props.push_back(std::make_pair(std::string("c1"), int(color->c1)));
+									props.push_back(std::make_pair(std::string("c2"), int(color->c2)));
+									props.push_back(std::make_pair(std::string("c3"), int(color->c3)));
+									props.push_back(std::make_pair(std::string("c4"), int(color->c4)));
+								}
+							}
+							go.geom_writer->writeMpoly(proj_poly, props);
 						}
 
 						if(go.ogr_ds) {
+							OGRGeometryH ogr_geom = mpoly_to_ogr(proj_poly);
 							OGRFeatureH ogr_feat = OGR_F_Create(OGR_L_GetLayerDefn(go.ogr_layer));
 							if(go.class_fld_idx >= 0) OGR_F_SetFieldInteger(ogr_feat, go.class_fld_idx, class_id);
 							if(color) {
@@ -623,8 +694,6 @@ int main(int argc, char **argv) {
 							OGR_F_SetGeometryDirectly(ogr_feat, ogr_geom); // assumes ownership of geom
 							OGR_L_CreateFeature(go.ogr_layer, ogr_feat);
 							OGR_F_Destroy(ogr_feat);
-						} else {
-							OGR_G_DestroyGeometry(ogr_geom);
 						}
 					}
 
@@ -638,8 +707,10 @@ int main(int argc, char **argv) {
 
 	for(size_t go_idx=0; go_idx<geom_outputs.size(); go_idx++) {
 		GeomOutput &go = geom_outputs[go_idx];
-		if(go.wkt_fh) fclose(go.wkt_fh);
-		if(go.wkb_fh) fclose(go.wkb_fh);
+		if(go.geom_writer) {
+			go.geom_writer->close();
+			delete go.geom_writer;
+		}
 		if(go.ogr_ds) OGR_DS_Destroy(go.ogr_ds);
 	}
 
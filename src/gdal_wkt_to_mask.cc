@@ -26,16 +26,25 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 
+#include <algorithm>
+#include <cmath>
+
+#include <boost/lexical_cast.hpp>
+
 #include "common.h"
 #include "polygon.h"
+#include "geom-reader.h"
 #include "polygon-rasterizer.h"
 #include "debugplot.h"
 #include "georef.h"
+#include "mask-writer.h"
+#include "threads.h"
 
 #include <ogrsf_frmts.h>
 #include <cpl_string.h>
 #include <cpl_conv.h>
 #include <cpl_port.h>
+#include <cpl_vsi.h>
 
 using namespace dangdal;
 
@@ -47,11 +56,99 @@ void usage(const std::string &cmdname) {
 	printf("  -geo-from <fn>                  Get georeference from this raster file\n");
 	printf("\nOptions:\n");
 	printf("  -wkt <fn>                       File containing WKT def in easting/northing units\n");
-	printf("  -mask-out <fn.pbm>              Filename for mask output in PBM format\n");
+	printf("  -mask-out <fn>                  Filename for mask output (PBM or GeoTIFF)\n");
+	printf("  -coverage [byte | float32]      Output the fraction of each pixel covered by\n");
+	printf("                                  the polygon (0-255 or 0-1) rather than a\n");
+	printf("                                  1-bit mask (needs a GDAL output format)\n");
+	printf("\nBatch burn (instead of -wkt):\n");
+	printf("  -burn-ogr <fn>                  Burn the polygons of an OGR datasource, in\n");
+	printf("                                  easting/northing units, into -mask-out\n");
+	printf("  -burn-layer <name>              Layer to burn (default is the first layer)\n");
+	printf("  -burn-attr <field>              Burn this integer attribute of each feature\n");
+	printf("                                  (default is the feature number, from 1)\n");
+	printf("  -burn-wkt-dir <dir>             Burn each WKT or WKB file in a directory,\n");
+	printf("                                  numbered from 1 in filename order (listed\n");
+	printf("                                  with -v)\n");
+	printf("  -burn-type [uint16 | uint32]    Output data type (default is uint32)\n");
+	printf("  -threads n                      Number of threads to use for burning\n");
+	printf("                                  (default is the number of CPUs)\n");
+	printf("\n");
+	MaskOutOpts::printUsage();
 
 	exit(1);
 }
 
+// Attributes are read as doubles so that 64-bit integer and real fields are
+// checked rather than truncated.
+static uint32_t burn_value(double v) {
+	if(!(v >= 0 && v <= double(0xffffffff)) || v != floor(v)) {
+		fatal_error("burn value %.15g is not an integer from 0 to 4294967295", v);
+	}
+	return uint32_t(v);
+}
+
+static std::vector<BurnFeature> read_ogr_features(
+	const std::string &fn, const std::string &layer_name, const std::string &attr
+) {
+	OGRRegisterAll();
+
+	OGRDataSourceH ogr_ds = OGROpen(fn.c_str(), FALSE, NULL);
+	if(!ogr_ds) fatal_error("cannot open OGR datasource [%s]", fn.c_str());
+	OGRLayerH layer = layer_name.size() ?
+		OGR_DS_GetLayerByName(ogr_ds, layer_name.c_str()) :
+		OGR_DS_GetLayer(ogr_ds, 0);
+	if(!layer) fatal_error("cannot find layer in [%s]", fn.c_str());
+
+	int field_idx = -1;
+	if(attr.size()) {
+		field_idx = OGR_FD_GetFieldIndex(OGR_L_GetLayerDefn(layer), attr.c_str());
+		if(field_idx < 0) fatal_error("layer has no field named %s", attr.c_str());
+	}
+
+	std::vector<BurnFeature> features;
+	int64_t feature_num = 0;
+	OGR_L_ResetReading(layer);
+	OGRFeatureH feature;
+	while((feature = OGR_L_GetNextFeature(layer)) != NULL) {
+		feature_num++;
+		OGRGeometryH geom = OGR_F_GetGeometryRef(feature);
+		if(geom && !OGR_G_IsEmpty(geom)) {
+			BurnFeature bf;
+			bf.mpoly = ogr_to_mpoly(geom);
+			bf.value = burn_value(field_idx < 0 ? double(feature_num) :
+				OGR_F_GetFieldAsDouble(feature, field_idx));
+			features.push_back(bf);
+		}
+		OGR_F_Destroy(feature);
+	}
+	OGR_DS_Destroy(ogr_ds);
+
+	return features;
+}
+
+static std::vector<BurnFeature> read_wkt_dir_features(const std::string &dir) {
+	char **names = VSIReadDir(dir.c_str());
+	if(!names) fatal_error("cannot read directory [%s]", dir.c_str());
+	std::vector<std::string> fns;
+	for(char **p=names; *p; p++) {
+		std::string fn = dir + "/" + *p;
+		VSIStatBufL st;
+		if(VSIStatL(fn.c_str(), &st) || !VSI_ISREG(st.st_mode)) continue;
+		fns.push_back(fn);
+	}
+	CSLDestroy(names);
+	std::sort(fns.begin(), fns.end());
+
+	std::vector<BurnFeature> features(fns.size());
+	for(size_t i=0; i<fns.size(); i++) {
+		if(VERBOSE) printf("%zd: %s\n", i+1, fns[i].c_str());
+		features[i].mpoly = mpoly_from_wktfile(fns[i]);
+		features[i].value = burn_value(i+1);
+	}
+
+	return features;
+}
+
 int main(int argc, char **argv) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
@@ -60,34 +157,82 @@ int main(int argc, char **argv) {
 	std::string wkt_fn;
 	std::string mask_fn;
 	std::string geo_fn;
+	GDALDataType coverage_type = GDT_Unknown;
+	std::string burn_ogr_fn;
+	std::string burn_layer;
+	std::string burn_attr;
+	std::string burn_wkt_dir;
+	GDALDataType burn_type = GDT_UInt32;
+	size_t num_threads = get_num_cpus();
 
 	GeoOpts geo_opts = GeoOpts(arg_list);
+	MaskOutOpts mask_opts = MaskOutOpts(arg_list);
 
 	size_t argp = 1;
 	while(argp < arg_list.size()) {
 		const std::string &arg = arg_list[argp++];
 		// FIXME - check duplicate values
 		if(arg[0] == '-') {
-			if(arg == "-v") {
-				VERBOSE++;
-			} else if(arg == "-wkt") {
-				if(argp == arg_list.size()) usage(cmdname);
-				wkt_fn = arg_list[argp++];
-			} else if(arg == "-mask-out") {
-				if(argp == arg_list.size()) usage(cmdname);
-				mask_fn = arg_list[argp++];
-			} else if(arg == "-geo-from") {
-				if(argp == arg_list.size()) usage(cmdname);
-				geo_fn = arg_list[argp++];
-			} else {
-				usage(cmdname);
+			try {
+				if(arg == "-v") {
+					VERBOSE++;
+				} else if(arg == "-wkt") {
+					if(argp == arg_list.size()) usage(cmdname);
+					wkt_fn = arg_list[argp++];
+				} else if(arg == "-mask-out") {
+					if(argp == arg_list.size()) usage(cmdname);
+					mask_fn = arg_list[argp++];
+				} else if(arg == "-coverage") {
+					if(argp == arg_list.size()) usage(cmdname);
+					std::string type = arg_list[argp++];
+					if     (type == "byte")    coverage_type = GDT_Byte;
+					else if(type == "float32") coverage_type = GDT_Float32;
+					else fatal_error("unrecognized value for -coverage option (%s)", type.c_str());
+				} else if(arg == "-geo-from") {
+					if(argp == arg_list.size()) usage(cmdname);
+					geo_fn = arg_list[argp++];
+				} else if(arg == "-burn-ogr") {
+					if(argp == arg_list.size()) usage(cmdname);
+					burn_ogr_fn = arg_list[argp++];
+				} else if(arg == "-burn-layer") {
+					if(argp == arg_list.size()) usage(cmdname);
+					burn_layer = arg_list[argp++];
+				} else if(arg == "-burn-attr") {
+					if(argp == arg_list.size()) usage(cmdname);
+					burn_attr = arg_list[argp++];
+				} else if(arg == "-burn-wkt-dir") {
+					if(argp == arg_list.size()) usage(cmdname);
+					burn_wkt_dir = arg_list[argp++];
+				} else if(arg == "-burn-type") {
+					if(argp == arg_list.size()) usage(cmdname);
+					std::string type = arg_list[argp++];
+					if     (type == "uint16") burn_type = GDT_UInt16;
+					else if(type == "uint32") burn_type = GDT_UInt32;
+					else fatal_error("unrecognized value for -burn-type option (%s)", type.c_str());
+				} else if(arg == "-threads") {
+					if(argp == arg_list.size()) usage(cmdname);
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(num_threads < 1) fatal_error("-threads must be at least 1");
+				} else {
+					usage(cmdname);
+				}
+			} catch(boost::bad_lexical_cast &e) {
+				fatal_error("cannot parse number given on command line");
 			}
 		} else {
 			usage(cmdname);
 		}
 	}
 
-	if(wkt_fn.empty() || mask_fn.empty()) usage(cmdname);
+	int num_inputs = !wkt_fn.empty() + !burn_ogr_fn.empty() + !burn_wkt_dir.empty();
+	if(num_inputs != 1 || mask_fn.empty()) usage(cmdname);
+	bool do_burn = wkt_fn.empty();
+	if(do_burn && coverage_type != GDT_Unknown) {
+		fatal_error("-coverage option cannot be used with batch burn");
+	}
+	if(burn_ogr_fn.empty() && (burn_layer.size() || burn_attr.size())) {
+		fatal_error("-burn-layer and -burn-attr options require -burn-ogr");
+	}
 
 	GDALAllRegister();
 
@@ -104,11 +249,39 @@ int main(int argc, char **argv) {
 
 	if(!georef.hasAffine()) fatal_error("missing affine transform");
 
+	if(do_burn) {
+		std::vector<BurnFeature> features;
+		if(burn_ogr_fn.size()) {
+			features = read_ogr_features(burn_ogr_fn, burn_layer, burn_attr);
+		} else {
+			features = read_wkt_dir_features(burn_wkt_dir);
+		}
+		printf("Read %zd features\n", features.size());
+
+		uint32_t max_value = burn_type == GDT_UInt16 ? 0xffff : 0xffffffff;
+		for(size_t i=0; i<features.size(); i++) {
+			if(features[i].value > max_value) fatal_error(
+				"burn value %u doesn't fit in the output type (use '-burn-type uint32')",
+				features[i].value);
+			features[i].mpoly.en2xy(georef);
+		}
+
+		MaskWriter mask_out(mask_fn, mask_opts, georef.w, georef.h, georef, burn_type);
+		burn_features(features, georef.w, georef.h, mask_out, num_threads);
+
+		return 0;
+	}
+
 	Mpoly mp = mpoly_from_wktfile(wkt_fn);
 
 	mp.en2xy(georef);
 
-	mask_from_mpoly(mp, georef.w, georef.h, mask_fn);
+	MaskWriter mask_out(mask_fn, mask_opts, georef.w, georef.h, georef, coverage_type);
+	if(coverage_type != GDT_Unknown) {
+		coverage_from_mpoly(mp, georef.w, georef.h, mask_out);
+	} else {
+		mask_from_mpoly(mp, georef.w, georef.h, mask_out);
+	}
 
 	return 0;
 }
@@ -0,0 +1,450 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "polygon.h"
+#include "geom-reader.h"
+
+#include <cpl_port.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
+namespace dangdal {
+
+// Gives read access to the contents of a file.  The file is memory mapped
+// if possible, otherwise it is read into memory.
+class InputFile {
+public:
+	explicit InputFile(const std::string &fn);
+	~InputFile();
+
+	const char *data;
+	size_t len;
+
+private:
+	// noncopyable
+	InputFile(const InputFile &);
+	InputFile &operator=(const InputFile &);
+
+	void *map_addr;
+	size_t map_len;
+	std::string contents;
+};
+
+static std::string read_whole_file(FILE *fin) {
+	size_t chunk_size = 65536;
+	std::string accum;
+	std::string chunk(chunk_size, 0);
+	size_t num_read;
+	while(0 < (num_read = fread(&chunk[0], 1, chunk_size, fin))) {
+		accum.append(chunk, 0, num_read);
+	}
+	return accum;
+}
+
+InputFile::InputFile(const std::string &fn) :
+	data(NULL), len(0), map_addr(NULL), map_len(0)
+{
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+	int fd = open(fn.c_str(), O_RDONLY);
+	if(fd < 0) fatal_error("cannot read file [%s]", fn.c_str());
+	struct stat st;
+	if(!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(addr != MAP_FAILED) {
+			map_addr = addr;
+			map_len = st.st_size;
+#ifdef MADV_SEQUENTIAL
+			madvise(map_addr, map_len, MADV_SEQUENTIAL);
+#endif
+		}
+	}
+	close(fd);
+	if(map_addr) {
+		data = static_cast<const char *>(map_addr);
+		len = map_len;
+		return;
+	}
+#endif
+
+	// fall back to reading the whole file (e.g. for pipes)
+	FILE *fh = fopen(fn.c_str(), "rb");
+	if(!fh) fatal_error("cannot read file [%s]", fn.c_str());
+	contents = read_whole_file(fh);
+	fclose(fh);
+	data = contents.data();
+	len = contents.size();
+}
+
+InputFile::~InputFile() {
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+	if(map_addr) munmap(map_addr, map_len);
+#endif
+}
+
+// Drops the closing point, since Ring doesn't store it.
+static void finish_ring(Ring &ring) {
+	const size_t npts = ring.pts.size();
+	if(!npts) fatal_error("ring has no points");
+	if(npts > 1 &&
+		ring.pts[0].x == ring.pts[npts-1].x &&
+		ring.pts[0].y == ring.pts[npts-1].y
+	) {
+		ring.pts.pop_back();
+	}
+}
+
+///////////// WKT /////////////
+
+class WktParser {
+public:
+	WktParser(const char *_begin, size_t len) :
+		begin(_begin), p(_begin), end(_begin+len) { }
+
+	void parseGeometry(Mpoly &out);
+	// Only whitespace may follow the geometry.
+	void expectEnd() {
+		skipWhitespace();
+		if(p < end) parseError("unexpected text after geometry");
+	}
+
+private:
+	void parseError(const char *what) __attribute__((noreturn)) {
+		fatal_error("WKT parse error at offset %zd: %s", size_t(p-begin), what);
+	}
+
+	void skipWhitespace() {
+		while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+	}
+
+	bool peekChar(char c) {
+		skipWhitespace();
+		return p < end && *p == c;
+	}
+
+	void expectChar(char c) {
+		if(!peekChar(c)) {
+			char msg[32];
+			snprintf(msg, sizeof(msg), "expected '%c'", c);
+			parseError(msg);
+		}
+		p++;
+	}
+
+	bool peekNumber() {
+		skipWhitespace();
+		return p < end && (
+			(*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '.');
+	}
+
+	bool peekKeyword() {
+		skipWhitespace();
+		return p < end && (
+			(*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'));
+	}
+
+	// Returns the next keyword in upper case.  Keywords are short, so the
+	// small std::string doesn't matter here (this is not called per vertex).
+	std::string readKeyword();
+	double readNumber();
+	bool readEmpty();
+	void parseRing(Ring &ring);
+	void parsePolygonText(Mpoly &out);
+
+	const char *begin;
+	const char *p;
+	const char *end;
+};
+
+std::string WktParser::readKeyword() {
+	if(!peekKeyword()) parseError("expected keyword");
+	std::string kw;
+	while(p < end && (
+		(*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') ||
+		(*p >= '0' && *p <= '9') || *p == '_' || *p == '='
+	)) {
+		char c = *p++;
+		if(c >= 'a' && c <= 'z') c += 'A' - 'a';
+		kw += c;
+	}
+	return kw;
+}
+
+double WktParser::readNumber() {
+	if(!peekNumber()) parseError("expected number");
+	// The input is not null terminated (it may be a memory mapped file), so
+	// copy the token to a local buffer for strtod.
+	char tmp[64];
+	size_t n = 0;
+	while(p < end && n < sizeof(tmp)-1 && (
+		(*p >= '0' && *p <= '9') || *p == '-' || *p == '+' ||
+		*p == '.' || *p == 'e' || *p == 'E'
+	)) {
+		tmp[n++] = *p++;
+	}
+	tmp[n] = 0;
+	char *endptr;
+	double v = strtod(tmp, &endptr);
+	if(endptr != tmp+n) parseError("malformed number");
+	return v;
+}
+
+// Consumes the EMPTY keyword, if present.
+bool WktParser::readEmpty() {
+	if(!peekKeyword()) return false;
+	const char *save = p;
+	if(readKeyword() == "EMPTY") return true;
+	p = save;
+	return false;
+}
+
+void WktParser::parseRing(Ring &ring) {
+	expectChar('(');
+	for(;;) {
+		double x = readNumber();
+		double y = readNumber();
+		// skip Z and M values
+		while(peekNumber()) readNumber();
+		ring.pts.push_back(Vertex(x, y));
+		if(peekChar(',')) {
+			p++;
+		} else {
+			expectChar(')');
+			break;
+		}
+	}
+	finish_ring(ring);
+}
+
+void WktParser::parsePolygonText(Mpoly &out) {
+	if(readEmpty()) return;
+	expectChar('(');
+	const int outer_idx = out.rings.size();
+	for(;;) {
+		out.rings.push_back(Ring());
+		Ring &ring = out.rings.back();
+		bool is_hole = int(out.rings.size()-1) > outer_idx;
+		ring.is_hole = is_hole;
+		ring.parent_id = is_hole ? outer_idx : -1;
+		parseRing(ring);
+		if(peekChar(',')) {
+			p++;
+		} else {
+			expectChar(')');
+			break;
+		}
+	}
+}
+
+void WktParser::parseGeometry(Mpoly &out) {
+	std::string type = readKeyword();
+	// PostGIS EWKT
+	if(type.compare(0, 5, "SRID=") == 0) {
+		while(p < end && *p != ';') p++;
+		expectChar(';');
+		type = readKeyword();
+	}
+	// dimension specifiers, e.g. "POLYGON Z ((...))"
+	if(peekKeyword()) {
+		const char *save = p;
+		std::string dim = readKeyword();
+		if(dim != "Z" && dim != "M" && dim != "ZM") p = save;
+	}
+
+	if(type == "POLYGON") {
+		parsePolygonText(out);
+	} else if(type == "MULTIPOLYGON") {
+		if(readEmpty()) return;
+		expectChar('(');
+		for(;;) {
+			parsePolygonText(out);
+			if(peekChar(',')) {
+				p++;
+			} else {
+				expectChar(')');
+				break;
+			}
+		}
+	} else if(type == "GEOMETRYCOLLECTION") {
+		if(readEmpty()) return;
+		expectChar('(');
+		for(;;) {
+			parseGeometry(out);
+			if(peekChar(',')) {
+				p++;
+			} else {
+				expectChar(')');
+				break;
+			}
+		}
+	} else {
+		fatal_error("not a polygon type: %s", type.c_str());
+	}
+}
+
+Mpoly mpoly_from_wkt(const char *wkt, size_t len) {
+	Mpoly mpoly;
+	WktParser parser(wkt, len);
+	parser.parseGeometry(mpoly);
+	parser.expectEnd();
+	if(mpoly.rings.empty()) fatal_error("num_rings<1 in mpoly_from_wkt");
+	return mpoly;
+}
+
+///////////// WKB /////////////
+
+class WkbParser {
+public:
+	WkbParser(const unsigned char *_begin, size_t len) :
+		begin(_begin), p(_begin), end(_begin+len) { }
+
+	void parseGeometry(Mpoly &out);
+	void expectEnd() {
+		if(p < end) {
+			fatal_error("WKB parse error at offset %zd: unexpected data after geometry",
+				size_t(p-begin));
+		}
+	}
+
+private:
+	void need(size_t n) {
+		if(size_t(end - p) < n) {
+			fatal_error("WKB parse error at offset %zd: unexpected end of data",
+				size_t(p-begin));
+		}
+	}
+
+	uint32_t readUint32(bool swap) {
+		need(4);
+		unsigned char b[4];
+		if(swap) {
+			for(int i=0; i<4; i++) b[i] = p[3-i];
+		} else {
+			for(int i=0; i<4; i++) b[i] = p[i];
+		}
+		p += 4;
+		uint32_t v;
+		memcpy(&v, b, 4);
+		return v;
+	}
+
+	double readDouble(bool swap) {
+		need(8);
+		unsigned char b[8];
+		if(swap) {
+			for(int i=0; i<8; i++) b[i] = p[7-i];
+		} else {
+			for(int i=0; i<8; i++) b[i] = p[i];
+		}
+		p += 8;
+		double v;
+		memcpy(&v, b, 8);
+		return v;
+	}
+
+	const unsigned char *begin;
+	const unsigned char *p;
+	const unsigned char *end;
+};
+
+void WkbParser::parseGeometry(Mpoly &out) {
+	need(1);
+	unsigned char order = *p++;
+	if(order > 1) fatal_error("WKB parse error at offset %zd: bad byte order",
+		size_t(p-begin-1));
+	const bool swap = (order == 1) != bool(CPL_IS_LSB);
+
+	uint32_t type = readUint32(swap);
+	// PostGIS EWKB flags
+	bool has_z = type & 0x80000000;
+	bool has_m = type & 0x40000000;
+	if(type & 0x20000000) readUint32(swap); // SRID
+	type &= 0x0fffffff;
+	// ISO WKB Z/M/ZM types
+	if(type / 1000 == 1 || type / 1000 == 3) has_z = true;
+	if(type / 1000 == 2 || type / 1000 == 3) has_m = true;
+	type %= 1000;
+	const size_t ndims = 2 + (has_z ? 1 : 0) + (has_m ? 1 : 0);
+
+	if(type == 3) { // Polygon
+		const uint32_t num_rings = readUint32(swap);
+		const int outer_idx = out.rings.size();
+		for(uint32_t r_idx=0; r_idx<num_rings; r_idx++) {
+			const uint32_t npts = readUint32(swap);
+			need(size_t(npts) * ndims * 8);
+			out.rings.push_back(Ring());
+			Ring &ring = out.rings.back();
+			ring.is_hole = r_idx > 0;
+			ring.parent_id = ring.is_hole ? outer_idx : -1;
+			ring.pts.resize(npts);
+			for(uint32_t i=0; i<npts; i++) {
+				ring.pts[i].x = readDouble(swap);
+				ring.pts[i].y = readDouble(swap);
+				p += (ndims-2) * 8;
+			}
+			finish_ring(ring);
+		}
+	} else if(type == 6 || type == 7) { // MultiPolygon, GeometryCollection
+		const uint32_t num_geom = readUint32(swap);
+		for(uint32_t i=0; i<num_geom; i++) {
+			parseGeometry(out);
+		}
+	} else {
+		fatal_error("not a polygon type: %d", int(type));
+	}
+}
+
+Mpoly mpoly_from_wkb(const unsigned char *wkb, size_t len) {
+	Mpoly mpoly;
+	WkbParser parser(wkb, len);
+	parser.parseGeometry(mpoly);
+	parser.expectEnd();
+	if(mpoly.rings.empty()) fatal_error("num_rings<1 in mpoly_from_wkb");
+	return mpoly;
+}
+
+Mpoly mpoly_from_wktfile(const std::string &fn) {
+	InputFile in(fn);
+	if(!in.len) fatal_error("file [%s] is empty", fn.c_str());
+	// WKB starts with a byte order flag of 0 or 1, WKT starts with text
+	if(in.data[0] == 0 || in.data[0] == 1) {
+		return mpoly_from_wkb(reinterpret_cast<const unsigned char *>(in.data), in.len);
+	} else {
+		return mpoly_from_wkt(in.data, in.len);
+	}
+}
+
+} // namespace dangdal
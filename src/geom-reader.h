@@ -0,0 +1,52 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+#ifndef DANGDAL_GEOM_READER_H
+#define DANGDAL_GEOM_READER_H
+
+#include <string>
+
+#include "common.h"
+#include "polygon.h"
+
+namespace dangdal {
+
+// These fill an Mpoly directly, without going through OGR.  Polygon,
+// MultiPolygon and GeometryCollection (of polygons) are accepted.  Z and M
+// values are ignored.  Anything other than whitespace after the geometry is
+// an error.
+Mpoly mpoly_from_wkt(const char *wkt, size_t len);
+Mpoly mpoly_from_wkb(const unsigned char *wkb, size_t len);
+
+// Reads either WKT or WKB (detected from the first byte).  The file is
+// memory mapped if possible.
+Mpoly mpoly_from_wktfile(const std::string &fn);
+
+} // namespace dangdal
+
+#endif // ifndef DANGDAL_GEOM_READER_H
@@ -0,0 +1,315 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "polygon.h"
+#include "geom-writer.h"
+
+#include <cpl_port.h>
+
+namespace dangdal {
+
+static const size_t GEOM_WRITER_BUFSIZE = 1 << 20;
+
+GeomWriter::GeomWriter(
+	const std::string &_fn, GeomFormat _format, int _precision,
+	OGRwkbByteOrder _byte_order
+) :
+	fn(_fn),
+	fh(NULL),
+	format(_format),
+	precision(_precision),
+	byte_order(_byte_order),
+	num_written(0),
+	buf(GEOM_WRITER_BUFSIZE),
+	buf_used(0)
+{
+	if(precision < 1 || precision > 17) fatal_error("precision must be between 1 and 17");
+
+#if CPL_IS_LSB
+	swap_bytes = (byte_order != wkbNDR);
+#else
+	swap_bytes = (byte_order != wkbXDR);
+#endif
+
+	fh = fopen(fn.c_str(), format == GEOM_FMT_WKB ? "wb" : "w");
+	if(!fh) fatal_error("cannot open output file [%s]", fn.c_str());
+
+	if(format == GEOM_FMT_GEOJSON) {
+		putStr("{\"type\":\"FeatureCollection\",\"features\":[\n");
+	}
+}
+
+GeomWriter::~GeomWriter() {
+	close();
+}
+
+void GeomWriter::close() {
+	if(!fh) return;
+	if(format == GEOM_FMT_GEOJSON) {
+		if(num_written) putChar('\n');
+		putStr("]}\n");
+	}
+	flush();
+	if(fclose(fh)) fatal_error("error closing [%s]", fn.c_str());
+	fh = NULL;
+}
+
+void GeomWriter::flush() {
+	if(buf_used && fwrite(&buf[0], buf_used, 1, fh) != 1) {
+		fatal_error("write to [%s] failed", fn.c_str());
+	}
+	buf_used = 0;
+}
+
+void GeomWriter::putBytes(const void *p, size_t len) {
+	const char *src = static_cast<const char *>(p);
+	while(len) {
+		if(buf_used == buf.size()) flush();
+		size_t n = std::min(len, buf.size() - buf_used);
+		memcpy(&buf[buf_used], src, n);
+		buf_used += n;
+		src += n;
+		len -= n;
+	}
+}
+
+void GeomWriter::putDouble(double v) {
+	char tmp[32];
+	int len = snprintf(tmp, sizeof(tmp), "%.*g", precision, v);
+	if(len < 0 || size_t(len) >= sizeof(tmp)) fatal_error("could not format coordinate");
+	putBytes(tmp, len);
+}
+
+void GeomWriter::putWkbUint32(uint32_t v) {
+	unsigned char b[4];
+	memcpy(b, &v, 4);
+	if(swap_bytes) {
+		std::swap(b[0], b[3]);
+		std::swap(b[1], b[2]);
+	}
+	putBytes(b, 4);
+}
+
+void GeomWriter::putWkbDouble(double v) {
+	unsigned char b[8];
+	memcpy(b, &v, 8);
+	if(swap_bytes) {
+		for(int i=0; i<4; i++) std::swap(b[i], b[7-i]);
+	}
+	putBytes(b, 8);
+}
+
+size_t GeomWriter::wkbSize(const Mpoly &mpoly) {
+	size_t num_outer = 0;
+	size_t total_pts = 0;
+	for(size_t r_idx=0; r_idx<mpoly.rings.size(); r_idx++) {
+		const Ring &ring = mpoly.rings[r_idx];
+		if(!ring.is_hole) num_outer++;
+		// each ring has a point count followed by the closed list of points
+		total_pts += ring.pts.size() + 1;
+	}
+	// byte order, type, and number of rings (or polygons, for a multipolygon)
+	size_t size = 1 + 4 + 4 + 4*mpoly.rings.size() + 16*total_pts;
+	// each polygon of a multipolygon has its own header
+	if(num_outer > 1) size += num_outer*(1 + 4 + 4);
+	return size;
+}
+
+// Rings are stored without the closing point, so the first point is
+// repeated at the end.  JSON has no way to write NaN or infinity, so such
+// coordinates are an error for GeoJSON.
+void GeomWriter::writeRingText(const Ring &ring, bool geojson) {
+	const size_t npts = ring.pts.size();
+	if(!npts) fatal_error("ring has no points");
+	putChar(geojson ? '[' : '(');
+	for(size_t i=0; i<npts+1; i++) {
+		const Vertex &v = ring.pts[i==npts ? 0 : i];
+		if(geojson && !(std::isfinite(v.x) && std::isfinite(v.y))) {
+			fatal_error("cannot write non-finite coordinate (%g, %g) to GeoJSON output [%s]",
+				v.x, v.y, fn.c_str());
+		}
+		if(i) putChar(',');
+		if(geojson) putChar('[');
+		putDouble(v.x);
+		putChar(geojson ? ',' : ' ');
+		putDouble(v.y);
+		if(geojson) putChar(']');
+	}
+	putChar(geojson ? ']' : ')');
+}
+
+void GeomWriter::writeRingWkb(const Ring &ring) {
+	const size_t npts = ring.pts.size();
+	if(!npts) fatal_error("ring has no points");
+	putWkbUint32(npts+1);
+	for(size_t i=0; i<npts+1; i++) {
+		const Vertex &v = ring.pts[i==npts ? 0 : i];
+		putWkbDouble(v.x);
+		putWkbDouble(v.y);
+	}
+}
+
+void GeomWriter::writeWkt(
+	const Mpoly &mpoly, const std::vector<size_t> &order,
+	const std::vector<size_t> &num_holes, size_t num_outer
+) {
+	bool use_multi = num_outer > 1;
+	putStr(use_multi ? "MULTIPOLYGON (" : "POLYGON (");
+	size_t o = 0;
+	for(size_t p_idx=0; p_idx<num_outer; p_idx++) {
+		if(p_idx) putChar(',');
+		if(use_multi) putChar('(');
+		for(size_t i=0; i<num_holes[p_idx]+1; i++) {
+			if(i) putChar(',');
+			writeRingText(mpoly.rings[order[o++]], false);
+		}
+		if(use_multi) putChar(')');
+	}
+	putStr(")\n");
+}
+
+void GeomWriter::writeWkb(
+	const Mpoly &mpoly, const std::vector<size_t> &order,
+	const std::vector<size_t> &num_holes, size_t num_outer
+) {
+	bool use_multi = num_outer > 1;
+	const unsigned char order_byte = (byte_order == wkbNDR) ? 1 : 0;
+	if(use_multi) {
+		putChar(order_byte);
+		putWkbUint32(wkbMultiPolygon);
+		putWkbUint32(num_outer);
+	}
+	size_t o = 0;
+	for(size_t p_idx=0; p_idx<num_outer; p_idx++) {
+		putChar(order_byte);
+		putWkbUint32(wkbPolygon);
+		putWkbUint32(num_holes[p_idx]+1);
+		for(size_t i=0; i<num_holes[p_idx]+1; i++) {
+			writeRingWkb(mpoly.rings[order[o++]]);
+		}
+	}
+}
+
+void GeomWriter::writeGeoJson(
+	const Mpoly &mpoly, const std::vector<size_t> &order,
+	const std::vector<size_t> &num_holes, size_t num_outer,
+	const FeatureProps &props
+) {
+	bool use_multi = num_outer > 1;
+	if(num_written) putStr(",\n");
+	putStr("{\"type\":\"Feature\",\"properties\":{");
+	for(size_t i=0; i<props.size(); i++) {
+		if(i) putChar(',');
+		putChar('"');
+		putStr(props[i].first.c_str());
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), "\":%d", props[i].second);
+		putStr(tmp);
+	}
+	putStr("},\"geometry\":{\"type\":");
+	putStr(use_multi ? "\"MultiPolygon\"" : "\"Polygon\"");
+	putStr(",\"coordinates\":[");
+	size_t o = 0;
+	for(size_t p_idx=0; p_idx<num_outer; p_idx++) {
+		if(p_idx) putChar(',');
+		if(use_multi) putChar('[');
+		for(size_t i=0; i<num_holes[p_idx]+1; i++) {
+			if(i) putChar(',');
+			writeRingText(mpoly.rings[order[o++]], true);
+		}
+		if(use_multi) putChar(']');
+	}
+	putStr("]}}");
+}
+
+void GeomWriter::writeMpoly(const Mpoly &mpoly, const FeatureProps &props) {
+	if(!fh) fatal_error("GeomWriter already closed");
+
+	const size_t num_rings = mpoly.rings.size();
+
+	// Group the holes with their parents:  order[] lists each outer ring
+	// followed by its holes, and num_holes[] gives the number of holes for
+	// each outer ring.
+	std::vector<size_t> outer_pos(num_rings);
+	std::vector<size_t> num_holes;
+	for(size_t r_idx=0; r_idx<num_rings; r_idx++) {
+		if(!mpoly.rings[r_idx].is_hole) {
+			outer_pos[r_idx] = num_holes.size();
+			num_holes.push_back(0);
+		}
+	}
+	const size_t num_outer = num_holes.size();
+	if(!num_outer) fatal_error("cannot write polygon with no outer rings");
+	for(size_t r_idx=0; r_idx<num_rings; r_idx++) {
+		const Ring &ring = mpoly.rings[r_idx];
+		if(!ring.is_hole) continue;
+		if(ring.parent_id < 0 || size_t(ring.parent_id) >= num_rings ||
+			mpoly.rings[ring.parent_id].is_hole
+		) {
+			fatal_error("could not sort out holes");
+		}
+		num_holes[outer_pos[ring.parent_id]]++;
+	}
+	std::vector<size_t> start(num_outer);
+	for(size_t p_idx=1; p_idx<num_outer; p_idx++) {
+		start[p_idx] = start[p_idx-1] + num_holes[p_idx-1] + 1;
+	}
+	std::vector<size_t> order(num_rings);
+	std::vector<size_t> fill(num_outer, 1);
+	for(size_t r_idx=0; r_idx<num_rings; r_idx++) {
+		const Ring &ring = mpoly.rings[r_idx];
+		if(ring.is_hole) {
+			size_t p_idx = outer_pos[ring.parent_id];
+			order[start[p_idx] + fill[p_idx]++] = r_idx;
+		} else {
+			order[start[outer_pos[r_idx]]] = r_idx;
+		}
+	}
+
+	switch(format) {
+		case GEOM_FMT_WKT:
+			writeWkt(mpoly, order, num_holes, num_outer);
+			break;
+		case GEOM_FMT_WKB:
+			writeWkb(mpoly, order, num_holes, num_outer);
+			break;
+		case GEOM_FMT_GEOJSON:
+			writeGeoJson(mpoly, order, num_holes, num_outer, props);
+			break;
+	}
+
+	num_written++;
+}
+
+} // namespace dangdal
@@ -0,0 +1,109 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+#ifndef DANGDAL_GEOM_WRITER_H
+#define DANGDAL_GEOM_WRITER_H
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "common.h"
+#include "polygon.h"
+
+#include <ogr_api.h>
+
+namespace dangdal {
+
+enum GeomFormat {
+	GEOM_FMT_WKT,
+	GEOM_FMT_WKB,
+	GEOM_FMT_GEOJSON
+};
+
+// Integer attributes attached to a feature.  Only used by the GeoJSON
+// format (as the "properties" member).
+typedef std::vector<std::pair<std::string, int> > FeatureProps;
+
+// Streams an Mpoly directly to WKT, WKB or GeoJSON without building an
+// intermediate OGR geometry.  Output goes through a large buffer, so writing
+// a polygon doesn't allocate anything per vertex.  As with mpoly_to_ogr, a
+// Polygon is written if there is only one outer ring, otherwise a
+// MultiPolygon.
+class GeomWriter {
+public:
+	// precision is the number of significant digits used for text formats
+	GeomWriter(const std::string &fn, GeomFormat _format, int _precision,
+		OGRwkbByteOrder _byte_order);
+	~GeomWriter();
+
+	void writeMpoly(const Mpoly &mpoly, const FeatureProps &props = FeatureProps());
+	void close();
+
+	static size_t wkbSize(const Mpoly &mpoly);
+
+private:
+	// noncopyable
+	GeomWriter(const GeomWriter &);
+	GeomWriter &operator=(const GeomWriter &);
+
+	void flush();
+	void putBytes(const void *p, size_t len);
+	void putChar(char c) {
+		if(buf_used == buf.size()) flush();
+		buf[buf_used++] = c;
+	}
+	void putStr(const char *s) { putBytes(s, strlen(s)); }
+	void putDouble(double v);
+	void putWkbUint32(uint32_t v);
+	void putWkbDouble(double v);
+
+	void writeRingText(const Ring &ring, bool geojson);
+	void writeRingWkb(const Ring &ring);
+	void writeWkt(const Mpoly &mpoly, const std::vector<size_t> &order,
+		const std::vector<size_t> &num_holes, size_t num_outer);
+	void writeWkb(const Mpoly &mpoly, const std::vector<size_t> &order,
+		const std::vector<size_t> &num_holes, size_t num_outer);
+	void writeGeoJson(const Mpoly &mpoly, const std::vector<size_t> &order,
+		const std::vector<size_t> &num_holes, size_t num_outer,
+		const FeatureProps &props);
+
+	std::string fn;
+	FILE *fh;
+	GeomFormat format;
+	int precision;
+	OGRwkbByteOrder byte_order;
+	bool swap_bytes;
+	size_t num_written;
+	std::vector<char> buf;
+	size_t buf_used;
+};
+
+} // namespace dangdal
+
+#endif // ifndef DANGDAL_GEOM_WRITER_H
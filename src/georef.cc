@@ -27,6 +27,8 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <cassert>
 
 #include <boost/lexical_cast.hpp>
@@ -311,6 +313,22 @@ GeoRef::GeoRef(GeoOpts opt, const GDALDatasetH ds) {
 	}
 }
 
+GeoRef GeoRef::threadCopy() const {
+	GeoRef ret(*this);
+	if(spatial_ref) {
+		ret.fwd_xform = OCTNewCoordinateTransformation(spatial_ref, geo_sref);
+		ret.inv_xform = OCTNewCoordinateTransformation(geo_sref, spatial_ref);
+	}
+	return ret;
+}
+
+void GeoRef::destroyXforms() {
+	if(fwd_xform) OCTDestroyCoordinateTransformation(fwd_xform);
+	if(inv_xform) OCTDestroyCoordinateTransformation(inv_xform);
+	fwd_xform = NULL;
+	inv_xform = NULL;
+}
+
 void GeoRef::xy2en(
 	double xpos, double ypos,
 	double *e_out, double *n_out
@@ -450,4 +468,175 @@ void GeoRef::ll2xy_or_die(
 	en2xy(east, north, x_out, y_out);
 }
 
+namespace {
+
+// en2ll for arrays of points, with the same checks as en2ll
+class EnToLlTransformer : public PointTransformer {
+public:
+	explicit EnToLlTransformer(OGRCoordinateTransformationH _xform) : xform(_xform) { }
+
+	virtual void transform(size_t n, double *x, double *y, int *success) const {
+		// OCTTransformEx takes an int count
+		const size_t max_chunk = 1 << 30;
+		for(size_t i=0; i<n; i+=max_chunk) {
+			int chunk = int(std::min(n-i, max_chunk));
+			OCTTransformEx(xform, chunk, x+i, y+i, NULL, success+i);
+		}
+		for(size_t i=0; i<n; i++) {
+			double lon = x[i];
+			double lat = y[i];
+			if(lat < -90.0-EPSILON || lat > 90.0+EPSILON) success[i] = 0;
+			if(lon < -360.0-EPSILON || lon > 540.0+EPSILON) success[i] = 0;
+		}
+	}
+
+private:
+	OGRCoordinateTransformationH xform;
+};
+
+} // anonymous namespace
+
+size_t GeoRef::en2ll_batch(
+	size_t n, const double *east, const double *north,
+	double *lon_out, double *lat_out
+) const {
+	if(!fwd_xform) fatal_error("missing xform");
+	if(!n) return 0;
+
+	if(lon_out != east) std::copy(east, east+n, lon_out);
+	if(lat_out != north) std::copy(north, north+n, lat_out);
+	std::vector<int> success(n);
+	EnToLlTransformer(fwd_xform).transform(n, lon_out, lat_out, &success[0]);
+
+	for(size_t i=0; i<n; i++) {
+		if(!success[i]) return i;
+	}
+	return n;
+}
+
+void GeoRef::en2ll_batch_or_die(
+	size_t n, const double *east, const double *north,
+	double *lon_out, double *lat_out
+) const {
+	// keep a copy of the input so that the error message can report it
+	std::vector<double> e_in, n_in;
+	if(lon_out == east || lat_out == north) {
+		e_in.assign(east, east+n);
+		n_in.assign(north, north+n);
+		east = &e_in[0];
+		north = &n_in[0];
+	}
+	size_t bad = en2ll_batch(n, east, north, lon_out, lat_out);
+	if(bad < n) {
+		fatal_error("en2ll transform failed [%g,%g]", east[bad], north[bad]);
+	}
+}
+
+size_t GeoRef::xy2ll_batch(
+	size_t n, const double *x, const double *y,
+	double *lon_out, double *lat_out
+) const {
+	for(size_t i=0; i<n; i++) {
+		// x and y may be the same arrays as lon_out and lat_out
+		double xi = x[i], yi = y[i];
+		xy2en(xi, yi, lon_out+i, lat_out+i);
+	}
+	return en2ll_batch(n, lon_out, lat_out, lon_out, lat_out);
+}
+
+void GeoRef::xy2ll_batch_or_die(
+	size_t n, const double *x, const double *y,
+	double *lon_out, double *lat_out
+) const {
+	for(size_t i=0; i<n; i++) {
+		double xi = x[i], yi = y[i];
+		xy2en(xi, yi, lon_out+i, lat_out+i);
+	}
+	en2ll_batch_or_die(n, lon_out, lat_out, lon_out, lat_out);
+}
+
+void GeoRef::xy2ll_approx(
+	size_t n, const double *x, const double *y,
+	double *lon_out, double *lat_out, int *success,
+	double max_error
+) const {
+	if(!fwd_xform) fatal_error("missing xform");
+
+	for(size_t i=0; i<n; i++) {
+		double xi = x[i], yi = y[i];
+		xy2en(xi, yi, lon_out+i, lat_out+i);
+	}
+
+	// convert the tolerance from pixels to degrees (conservatively, since a
+	// degree of longitude is usually smaller than a degree of latitude)
+	double pixel_size = std::min(res_meters_x, res_meters_y);
+	double max_error_deg = 0;
+	if(have_semi_major && pixel_size > 0) {
+		max_error_deg = max_error * pixel_size / (semi_major * D2R);
+	}
+
+	approx_transform_line(EnToLlTransformer(fwd_xform),
+		n, lon_out, lat_out, success, max_error_deg);
+}
+
+static void approx_transform_span(
+	const PointTransformer &xform,
+	const double *in_x, const double *in_y,
+	double *x, double *y, int *success,
+	size_t a, size_t b, double max_error
+) {
+	// points a and b have already been transformed
+	if(b - a < 2) return;
+
+	const double dx = in_x[b] - in_x[a];
+	const double dy = in_y[b] - in_y[a];
+	const double len_sq = dx*dx + dy*dy;
+
+	// not worth it for short spans, and can't interpolate from failed points
+	if(b - a < 4 || !success[a] || !success[b] || len_sq == 0) {
+		xform.transform(b-a-1, x+a+1, y+a+1, success+a+1);
+		return;
+	}
+
+	const size_t m = (a + b) / 2;
+	xform.transform(1, x+m, y+m, success+m);
+	if(success[m]) {
+		double t = ((in_x[m]-in_x[a])*dx + (in_y[m]-in_y[a])*dy) / len_sq;
+		double ex = x[a] + (x[b] - x[a]) * t - x[m];
+		double ey = y[a] + (y[b] - y[a]) * t - y[m];
+		if(ex*ex + ey*ey <= max_error*max_error) {
+			for(size_t i=a+1; i<b; i++) {
+				if(i == m) continue;
+				t = ((in_x[i]-in_x[a])*dx + (in_y[i]-in_y[a])*dy) / len_sq;
+				x[i] = x[a] + (x[b] - x[a]) * t;
+				y[i] = y[a] + (y[b] - y[a]) * t;
+				success[i] = 1;
+			}
+			return;
+		}
+	}
+
+	approx_transform_span(xform, in_x, in_y, x, y, success, a, m, max_error);
+	approx_transform_span(xform, in_x, in_y, x, y, success, m, b, max_error);
+}
+
+void approx_transform_line(
+	const PointTransformer &xform,
+	size_t n, double *x, double *y, int *success,
+	double max_error
+) {
+	if(max_error <= 0 || n < 5) {
+		xform.transform(n, x, y, success);
+		return;
+	}
+
+	const std::vector<double> in_x(x, x+n);
+	const std::vector<double> in_y(y, y+n);
+
+	xform.transform(1, x, y, success);
+	xform.transform(1, x+n-1, y+n-1, success+n-1);
+	approx_transform_span(xform, &in_x[0], &in_y[0], x, y, success,
+		0, n-1, max_error);
+}
+
 } // namespace dangdal
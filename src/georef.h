@@ -48,12 +48,38 @@ struct GeoOpts {
 	double res_x, res_y;
 };
 
+// Transforms arrays of points in place, setting success[i] to zero for
+// points that could not be transformed.
+class PointTransformer {
+public:
+	virtual ~PointTransformer() { }
+	virtual void transform(size_t n, double *x, double *y, int *success) const = 0;
+};
+
+// Transforms points that lie along a line (such as a scanline), in order,
+// using as few exact transformations as possible.  Points in between
+// exactly transformed anchor points are linearly interpolated, and spans
+// are subdivided until the interpolation error at the span midpoint is at
+// most max_error (in output units).  A max_error of zero means transform
+// every point exactly.
+void approx_transform_line(
+	const PointTransformer &xform,
+	size_t n, double *x, double *y, int *success,
+	double max_error
+);
+
 class GeoRef {
 public:
 	GeoRef(GeoOpts opt, const GDALDatasetH ds);
 
 	bool hasAffine() const { return !fwd_affine.empty(); }
 
+	// Returns a copy having its own coordinate transformations, for use by
+	// another thread (transformations are not thread safe).  The copy's
+	// transformations must be freed using destroyXforms().
+	GeoRef threadCopy() const;
+	void destroyXforms();
+
 	void xy2en(double xpos, double ypos, double *e_out, double *n_out) const;
 	void en2xy(double east, double north, double *x_out, double *y_out) const;
 	bool en2ll(double east, double north, double *lon_out, double *lat_out) const;
@@ -65,6 +91,25 @@ public:
 	void xy2ll_or_die(double x, double y, double *lon_out, double *lat_out) const;
 	void ll2xy_or_die(double lon, double lat, double *x_out, double *y_out) const;
 
+	// Transform n points with one call to the coordinate transformation.
+	// The output arrays may be the same as the input arrays.  Returns the
+	// index of the first point that failed, or n if all succeeded.
+	size_t en2ll_batch(size_t n, const double *east, const double *north,
+		double *lon_out, double *lat_out) const;
+	size_t xy2ll_batch(size_t n, const double *x, const double *y,
+		double *lon_out, double *lat_out) const;
+	void en2ll_batch_or_die(size_t n, const double *east, const double *north,
+		double *lon_out, double *lat_out) const;
+	void xy2ll_batch_or_die(size_t n, const double *x, const double *y,
+		double *lon_out, double *lat_out) const;
+
+	// Like xy2ll_batch, for points along a line, with interpolation error of
+	// at most max_error pixels (see approx_transform_line).  Sets success[i]
+	// to zero for points that failed.
+	void xy2ll_approx(size_t n, const double *x, const double *y,
+		double *lon_out, double *lat_out, int *success,
+		double max_error) const;
+
 	std::string s_srs;
 	std::string geo_srs;
 	double res_x, res_y; // zero if there is rotation
@@ -27,6 +27,8 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <vector>
+#include <map>
+#include <algorithm>
 
 #include "mask.h"
 #include "mask-tracer.h"
@@ -165,9 +167,353 @@ int initial_x, int initial_y, bool select_color) {
 	return ring;
 }
 
+// Largest distance, in pixels, that a smoothed outline may stray from the pixel
+// boundary.  It is kept under half a pixel so that rings that don't touch can't
+// be made to cross: boundary edges that don't share a vertex are at least a
+// pixel apart.
+static const double STAIRCASE_MAX_ERROR = 0.49;
+
+// Marks the pixel corners where two diagonal pixels meet.  Rings (or two parts
+// of the same ring) can touch at these points, so the smoother must keep them.
+static BitGrid find_pinch_points(const BitGrid &mask, size_t w, size_t h) {
+	BitGrid pinch_points(w+1, h+1);
+	for(size_t y=0; y<=h; y++) {
+		for(size_t x=0; x<=w; x++) {
+			pixquad_t quad = get_quad(mask, x, y, true);
+			if(quad == 5 || quad == 10) pinch_points.set(x, y, true);
+		}
+	}
+	return pinch_points;
+}
+
+// Positions along a traced ring are counted in half-edges: position 2*i is
+// vertex i and position 2*i+1 is the midpoint of the edge leaving vertex i.
+static inline Vertex half_edge_pt(const std::vector<Vertex> &pts, size_t pos) {
+	const size_t npts = pts.size();
+	const Vertex &v0 = pts[(pos/2) % npts];
+	if(pos % 2 == 0) return v0;
+	const Vertex &v1 = pts[(pos/2+1) % npts];
+	return Vertex((v0.x + v1.x) / 2.0, (v0.y + v1.y) / 2.0);
+}
+
+// direction of travel (a unit vector) along the edge at a half-edge position
+static inline Vertex half_edge_dir(const std::vector<Vertex> &pts, size_t pos) {
+	const size_t npts = pts.size();
+	const Vertex &v0 = pts[(pos/2) % npts];
+	const Vertex &v1 = pts[(pos/2+1) % npts];
+	return Vertex(
+		v1.x > v0.x ? 1 : v1.x < v0.x ? -1 : 0,
+		v1.y > v0.y ? 1 : v1.y < v0.y ? -1 : 0);
+}
+
+// True if b can be removed from the path a-b-c without changing its shape.
+// All coordinates are multiples of half a pixel, so the test is exact.
+static inline bool is_redundant(
+	const Vertex &a, const Vertex &b, const Vertex &c, const BitGrid &pinch_points
+) {
+	const double dx1 = b.x - a.x, dy1 = b.y - a.y;
+	const double dx2 = c.x - b.x, dy2 = c.y - b.y;
+	if(dx1*dy2 - dy1*dx2 != 0) return false;
+	if(dx1*dx2 + dy1*dy2 <= 0) return false;
+	const bool on_corner = (b.x == floor(b.x) && b.y == floor(b.y));
+	return !(on_corner && pinch_points((int)b.x, (int)b.y));
+}
+
+// Removes vertices that lie in the middle of a straight line, such as the
+// midpoint of a long pixel edge left between two segments that continue it.
+static void drop_collinear(std::vector<Vertex> &pts, const BitGrid &pinch_points) {
+	std::vector<Vertex> kept;
+	kept.reserve(pts.size());
+	for(size_t i=0; i<pts.size(); i++) {
+		while(kept.size() >= 2 && is_redundant(
+			kept[kept.size()-2], kept.back(), pts[i], pinch_points)
+		) {
+			kept.pop_back();
+		}
+		kept.push_back(pts[i]);
+	}
+
+	// the ring wraps around from the last vertex to the first
+	size_t first = 0;
+	for(;;) {
+		const size_t n = kept.size() - first;
+		if(n < 4) break;
+		if(is_redundant(kept[kept.size()-2], kept.back(), kept[first], pinch_points)) {
+			kept.pop_back();
+		} else if(is_redundant(kept.back(), kept[first], kept[first+1], pinch_points)) {
+			first++;
+		} else {
+			break;
+		}
+	}
+
+	pts.assign(kept.begin() + first, kept.end());
+}
+
+typedef std::map<int, std::pair<double, double> > LatticeSpans;
+
+static void extend_span(LatticeSpans &spans, int key, double lo, double hi) {
+	LatticeSpans::iterator it = spans.find(key);
+	if(it == spans.end()) {
+		spans[key] = std::make_pair(lo, hi);
+	} else {
+		it->second.first = std::min(it->second.first, lo);
+		it->second.second = std::max(it->second.second, hi);
+	}
+}
+
+// Range of t for which s + t*d is within STAIRCASE_MAX_ERROR of the
+// axis-aligned segment a-b.  Returns false if there is none.
+static bool capsule_range(
+	const Vertex &s, const Vertex &d, const Vertex &a, const Vertex &b,
+	double *t_lo, double *t_hi
+) {
+	const double E = STAIRCASE_MAX_ERROR;
+	bool found = false;
+	double lo = 0, hi = 0;
+
+	// the rectangle around the segment
+	const bool vertical = (a.x == b.x);
+	const double box_lo[2] = {
+		std::min(a.x, b.x) - (vertical ? E : 0),
+		std::min(a.y, b.y) - (vertical ? 0 : E) };
+	const double box_hi[2] = {
+		std::max(a.x, b.x) + (vertical ? E : 0),
+		std::max(a.y, b.y) + (vertical ? 0 : E) };
+	const double sv[2] = { s.x, s.y };
+	const double dv[2] = { d.x, d.y };
+	double r_lo = -HUGE_VAL, r_hi = HUGE_VAL;
+	for(int i=0; i<2; i++) {
+		if(dv[i] == 0) {
+			if(sv[i] < box_lo[i] || sv[i] > box_hi[i]) r_hi = -HUGE_VAL;
+		} else {
+			double t0 = (box_lo[i] - sv[i]) / dv[i];
+			double t1 = (box_hi[i] - sv[i]) / dv[i];
+			r_lo = std::max(r_lo, std::min(t0, t1));
+			r_hi = std::min(r_hi, std::max(t0, t1));
+		}
+	}
+	if(r_lo <= r_hi) {
+		lo = r_lo; hi = r_hi;
+		found = true;
+	}
+
+	// the discs around the ends
+	const Vertex ends[2] = { a, b };
+	for(int i=0; i<2; i++) {
+		const double ex = s.x - ends[i].x;
+		const double ey = s.y - ends[i].y;
+		const double qa = d.x*d.x + d.y*d.y;
+		const double qb = 2.0 * (d.x*ex + d.y*ey);
+		const double qc = ex*ex + ey*ey - E*E;
+		const double disc = qb*qb - 4.0*qa*qc;
+		if(disc < 0) continue;
+		const double t0 = (-qb - sqrt(disc)) / (2.0*qa);
+		const double t1 = (-qb + sqrt(disc)) / (2.0*qa);
+		if(!found || t0 < lo) lo = t0;
+		if(!found || t1 > hi) hi = t1;
+		found = true;
+	}
+
+	*t_lo = lo;
+	*t_hi = hi;
+	return found;
+}
+
+// A run of a traced ring that only goes in two directions.  Since the run is
+// monotone, its intersection with each lattice line (x=k or y=j) is a single
+// span, and since STAIRCASE_MAX_ERROR is less than half a pixel, a point can
+// only be that close to the run on the lattice lines nearest to it.  This
+// allows an exact test of whether a segment strays too far from the run.
+class StaircaseRun {
+public:
+	void addPiece(const Vertex &a, const Vertex &b) {
+		if(a.x == b.x) {
+			extend_span(cols, (int)a.x, std::min(a.y, b.y), std::max(a.y, b.y));
+			for(int j=(int)ceil(std::min(a.y, b.y)); j<=(int)floor(std::max(a.y, b.y)); j++) {
+				extend_span(rows, j, a.x, a.x);
+			}
+		} else {
+			extend_span(rows, (int)a.y, std::min(a.x, b.x), std::max(a.x, b.x));
+			for(int k=(int)ceil(std::min(a.x, b.x)); k<=(int)floor(std::max(a.x, b.x)); k++) {
+				extend_span(cols, k, a.y, a.y);
+			}
+		}
+	}
+
+	// Is every point of the segment s-p within STAIRCASE_MAX_ERROR of the run?
+	bool isNear(const Vertex &s, const Vertex &p) const {
+		const Vertex d(p.x - s.x, p.y - s.y);
+
+		// split the segment where the nearest lattice lines change
+		std::vector<double> cuts;
+		cuts.push_back(0);
+		cuts.push_back(1);
+		if(d.x != 0) {
+			for(double x=floor(std::min(s.x, p.x))+0.5; x<std::max(s.x, p.x); x+=1) {
+				if(x > std::min(s.x, p.x)) cuts.push_back((x - s.x) / d.x);
+			}
+		}
+		if(d.y != 0) {
+			for(double y=floor(std::min(s.y, p.y))+0.5; y<std::max(s.y, p.y); y+=1) {
+				if(y > std::min(s.y, p.y)) cuts.push_back((y - s.y) / d.y);
+			}
+		}
+		std::sort(cuts.begin(), cuts.end());
+
+		for(size_t i=0; i+1<cuts.size(); i++) {
+			const double t0 = cuts[i], t1 = cuts[i+1];
+			if(t1 <= t0) continue;
+			const double tm = (t0 + t1) / 2.0;
+			const int k = (int)floor(s.x + d.x*tm + 0.5);
+			const int j = (int)floor(s.y + d.y*tm + 0.5);
+
+			double lo[2], hi[2];
+			bool found[2] = { false, false };
+			LatticeSpans::const_iterator it = cols.find(k);
+			if(it != cols.end()) {
+				found[0] = capsule_range(s, d,
+					Vertex(k, it->second.first), Vertex(k, it->second.second),
+					&lo[0], &hi[0]);
+			}
+			it = rows.find(j);
+			if(it != rows.end()) {
+				found[1] = capsule_range(s, d,
+					Vertex(it->second.first, j), Vertex(it->second.second, j),
+					&lo[1], &hi[1]);
+			}
+
+			bool covered = false;
+			for(int c=0; c<2; c++) {
+				if(found[c] && lo[c] <= t0 && hi[c] >= t1) covered = true;
+			}
+			if(!covered && found[0] && found[1]) {
+				int first = lo[0] <= lo[1] ? 0 : 1;
+				int second = 1 - first;
+				covered = lo[first] <= t0 && hi[first] >= lo[second] && hi[second] >= t1;
+			}
+			if(!covered) return false;
+		}
+		return true;
+	}
+
+	LatticeSpans cols, rows;
+};
+
+// angle of the vector (dx, dy) relative to dir
+static inline double rel_angle(const Vertex &dir, double dx, double dy) {
+	return atan2(dir.x*dy - dir.y*dx, dir.x*dx + dir.y*dy);
+}
+
+// Replaces the staircases in a traced ring with diagonal lines.  Output
+// vertices are taken from the midpoints of the pixel edges (and from pinch
+// points, which are always kept).  Each output segment covers a run of the
+// ring that only goes in two directions (e.g. right and down), and no point
+// of it is farther than STAIRCASE_MAX_ERROR from that run.  Rings are traced
+// exactly and smoothed afterwards, since the exact outline is also needed as
+// the bounds for tracing holes.
+static Ring smooth_staircases(const Ring &ring, const BitGrid &pinch_points) {
+	const std::vector<Vertex> &pts = ring.pts;
+	const size_t npts = pts.size();
+	if(npts < 4) return ring;
+
+	// Start at a pinch point if there is one, otherwise at the midpoint of
+	// the first edge.
+	std::vector<bool> is_anchor(npts);
+	bool have_anchor = false;
+	size_t start_pos = 1;
+	for(size_t i=0; i<npts; i++) {
+		is_anchor[i] = pinch_points((int)pts[i].x, (int)pts[i].y);
+		if(is_anchor[i] && !have_anchor) {
+			have_anchor = true;
+			start_pos = i*2;
+		}
+	}
+
+	const size_t end_pos = start_pos + npts*2;
+	const double E = STAIRCASE_MAX_ERROR;
+
+	Ring out = ring.copyMetadata();
+	out.pts.push_back(half_edge_pt(pts, start_pos));
+
+	size_t cur = start_pos;
+	while(cur < end_pos) {
+		const Vertex s = half_edge_pt(pts, cur);
+		const Vertex dir1 = half_edge_dir(pts, cur);
+		Vertex dir2(0, 0);
+		StaircaseRun run;
+		// Range of allowed angles of the output segment, relative to dir1.
+		// Each lattice line that the run has moved past must be crossed
+		// within E of the run's span on that line.
+		double lo = -M_PI, hi = M_PI;
+		// next lattice lines to be passed, and the direction of travel
+		double next_col = 0, next_row = 0;
+		double step_x = 0, step_y = 0;
+		size_t best = cur + 1;
+
+		for(size_t pos=cur+1; pos<=end_pos; pos++) {
+			const Vertex p = half_edge_pt(pts, pos);
+			run.addPiece(half_edge_pt(pts, pos-1), p);
+
+			const Vertex d = half_edge_dir(pts, pos-1);
+			if(d.x != 0 && step_x == 0) {
+				step_x = d.x;
+				next_col = d.x > 0 ? floor(s.x) + 1 : ceil(s.x) - 1;
+			}
+			if(d.y != 0 && step_y == 0) {
+				step_y = d.y;
+				next_row = d.y > 0 ? floor(s.y) + 1 : ceil(s.y) - 1;
+			}
+			while(step_x != 0 && (p.x - next_col) * step_x > 0) {
+				const std::pair<double, double> &span = run.cols[(int)next_col];
+				double a1 = rel_angle(dir1, next_col - s.x, span.first - E - s.y);
+				double a2 = rel_angle(dir1, next_col - s.x, span.second + E - s.y);
+				lo = std::max(lo, std::min(a1, a2));
+				hi = std::min(hi, std::max(a1, a2));
+				next_col += step_x;
+			}
+			while(step_y != 0 && (p.y - next_row) * step_y > 0) {
+				const std::pair<double, double> &span = run.rows[(int)next_row];
+				double a1 = rel_angle(dir1, span.first - E - s.x, next_row - s.y);
+				double a2 = rel_angle(dir1, span.second + E - s.x, next_row - s.y);
+				lo = std::max(lo, std::min(a1, a2));
+				hi = std::min(hi, std::max(a1, a2));
+				next_row += step_y;
+			}
+			if(lo > hi) break;
+
+			const bool is_vertex = (pos % 2 == 0);
+			if(!is_vertex || pos == end_pos || is_anchor[(pos/2) % npts]) {
+				// candidate endpoint
+				const double ang = rel_angle(dir1, p.x - s.x, p.y - s.y);
+				if(ang >= lo && ang <= hi && run.isNear(s, p)) best = pos;
+				if(is_vertex) break;
+				continue;
+			}
+
+			// the run must not turn back on itself
+			const Vertex nd = half_edge_dir(pts, pos);
+			if(nd.x == dir1.x && nd.y == dir1.y) continue;
+			if(nd.x == -dir1.x && nd.y == -dir1.y) break;
+			if(dir2.x == 0 && dir2.y == 0) {
+				dir2 = nd;
+			} else if(nd.x != dir2.x || nd.y != dir2.y) {
+				break;
+			}
+		}
+
+		if(best < end_pos) out.pts.push_back(half_edge_pt(pts, best));
+		cur = best;
+	}
+
+	drop_collinear(out.pts, pinch_points);
+
+	return out;
+}
+
 static int recursive_trace(BitGrid &mask, size_t w, size_t h,
 const Ring &bounds, int depth, Mpoly &out_poly, int parent_id, 
-int64_t min_area, bool no_donuts) {
+int64_t min_area, bool no_donuts, const BitGrid *pinch_points) {
 	//printf("recursive_trace enter: depth=%d\n", depth);
 
 	bool select_color = !(depth & 1);
@@ -240,11 +586,17 @@ int64_t min_area, bool no_donuts) {
 						//r.is_hole = 0;
 
 						size_t outer_ring_id = out_poly.rings.size();
-						out_poly.rings.push_back(r);
+						// the exact outline is still needed as the bounds
+						// for the recursive call
+						if(pinch_points) {
+							out_poly.rings.push_back(smooth_staircases(r, *pinch_points));
+						} else {
+							out_poly.rings.push_back(r);
+						}
 
 						int was_skip = recursive_trace(
 							mask, w, h, r, depth+1, out_poly, outer_ring_id,
-							min_area, no_donuts);
+							min_area, no_donuts, pinch_points);
 						if(was_skip) {
 							out_poly.rings.pop_back();
 						}
@@ -279,12 +631,20 @@ int64_t min_area, bool no_donuts) {
 }
 
 // this function has the side effect of erasing the mask
-Mpoly trace_mask(BitGrid &mask, size_t w, size_t h, int64_t min_area, bool no_donuts) {
+Mpoly trace_mask(
+	BitGrid &mask, size_t w, size_t h, int64_t min_area, bool no_donuts,
+	bool smooth
+) {
 	if(VERBOSE >= 4) debug_write_mask(mask, w, h);
 
 	Mpoly out_poly;
 
-	recursive_trace(mask, w, h, make_enclosing_ring(w, h), 0, out_poly, -1, min_area, no_donuts);
+	// pinch points must be found before the mask gets erased
+	BitGrid pinch_points(0, 0);
+	if(smooth) pinch_points = find_pinch_points(mask, w, h);
+
+	recursive_trace(mask, w, h, make_enclosing_ring(w, h), 0, out_poly, -1, min_area, no_donuts,
+		smooth ? &pinch_points : NULL);
 	printf("Trace found %zd rings.\n", out_poly.rings.size());
 
 	//free(mask_8bit);
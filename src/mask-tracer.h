@@ -34,8 +34,12 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 namespace dangdal {
 
-// this function has the side effect of erasing the mask
-Mpoly trace_mask(BitGrid &mask, size_t w, size_t h, int64_t min_area, bool no_donuts);
+// This function has the side effect of erasing the mask.  If smooth is set,
+// pixel staircases in the output are replaced with diagonal lines (with error
+// less than half a pixel).
+Mpoly trace_mask(
+	BitGrid &mask, size_t w, size_t h, int64_t min_area, bool no_donuts,
+	bool smooth=false);
 
 } // namespace dangdal
 
@@ -0,0 +1,354 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "georef.h"
+#include "mask-writer.h"
+
+#include <cpl_conv.h>
+#include <cpl_string.h>
+
+void usage(const std::string &cmdname); // externally defined
+
+namespace dangdal {
+
+// Strips of GDAL output are at most this many bytes (unless a single row is
+// bigger).
+static const size_t MASK_WRITER_MAX_STRIP = 64 << 20;
+
+void MaskOutOpts::printUsage() {
+	printf(
+"Mask output:\n"
+"  -mask-of format              Format for mask output: PBM or a GDAL driver\n"
+"                               such as GTiff or COG (default is GTiff for\n"
+"                               .tif filenames, otherwise PBM)\n"
+"  -mask-co NAME=VALUE          Creation option for GDAL mask output (GTiff\n"
+"                               defaults to NBITS=1 TILED=YES COMPRESS=DEFLATE)\n"
+);
+}
+
+MaskOutOpts::MaskOutOpts(std::vector<std::string> &arg_list) {
+	std::vector<std::string> args_out;
+	const std::string cmdname = arg_list[0];
+	args_out.push_back(cmdname);
+
+	size_t argp = 1;
+	while(argp < arg_list.size()) {
+		const std::string &arg = arg_list[argp++];
+		if(arg == "-mask-of") {
+			if(argp == arg_list.size()) usage(cmdname);
+			format = arg_list[argp++];
+		} else if(arg == "-mask-co") {
+			if(argp == arg_list.size()) usage(cmdname);
+			create_options.push_back(arg_list[argp++]);
+		} else {
+			args_out.push_back(arg);
+		}
+	}
+
+	arg_list = args_out;
+}
+
+// Later options override earlier ones with the same name.
+static char **set_name_values(char **csl, const std::vector<std::string> &opts) {
+	for(size_t i=0; i<opts.size(); i++) {
+		char *key = NULL;
+		const char *val = CPLParseNameValue(opts[i].c_str(), &key);
+		if(!key || !val) fatal_error("creation option must be NAME=VALUE (%s)", opts[i].c_str());
+		csl = CSLSetNameValue(csl, key, val);
+		CPLFree(key);
+	}
+	return csl;
+}
+
+MaskWriter::MaskWriter(
+	const std::string &_fn, const MaskOutOpts &opts,
+	size_t _w, size_t _h, const GeoRef &georef,
+	GDALDataType _value_type
+) :
+	fn(_fn), w(_w), h(_h),
+	row_bytes((_w+7)/8),
+	rows_written(0),
+	value_type(_value_type),
+	fh(NULL),
+	ds(NULL), band(NULL), copy_driver(NULL),
+	datatype(GDT_Byte), pixel_size(1),
+	strip_rows(0), strip_y0(0)
+{
+	std::string proj_wkt;
+	if(georef.spatial_ref) {
+		char *wkt = NULL;
+		OSRExportToWkt(georef.spatial_ref, &wkt);
+		if(wkt) proj_wkt = wkt;
+		CPLFree(wkt);
+	}
+	open(opts, georef.hasAffine() ? &georef.fwd_affine[0] : NULL, proj_wkt);
+}
+
+MaskWriter::MaskWriter(
+	const std::string &_fn, const MaskOutOpts &opts,
+	size_t _w, size_t _h, const double *affine, const std::string &proj_wkt,
+	GDALDataType _value_type
+) :
+	fn(_fn), w(_w), h(_h),
+	row_bytes((_w+7)/8),
+	rows_written(0),
+	value_type(_value_type),
+	fh(NULL),
+	ds(NULL), band(NULL), copy_driver(NULL),
+	datatype(GDT_Byte), pixel_size(1),
+	strip_rows(0), strip_y0(0)
+{
+	open(opts, affine, proj_wkt);
+}
+
+MaskWriter::~MaskWriter() {
+	close();
+}
+
+void MaskWriter::open(
+	const MaskOutOpts &opts, const double *affine, const std::string &proj_wkt
+) {
+	if(value_type != GDT_Unknown) {
+		if(value_type != GDT_Byte && value_type != GDT_UInt16 &&
+			value_type != GDT_UInt32 && value_type != GDT_Float32
+		) {
+			fatal_error("mask output must be Byte, UInt16, UInt32 or Float32");
+		}
+		datatype = value_type;
+		pixel_size = GDALGetDataTypeSize(datatype) / 8;
+	}
+
+	std::string format = opts.format;
+	if(format.empty() && value_type != GDT_Unknown) {
+		format = "GTiff";
+	} else if(format.empty()) {
+		size_t dot = fn.rfind('.');
+		std::string ext = dot == std::string::npos ? "" : fn.substr(dot);
+		format = (EQUAL(ext.c_str(), ".tif") || EQUAL(ext.c_str(), ".tiff")) ? "GTiff" : "PBM";
+	}
+
+	if(EQUAL(format.c_str(), "PBM")) {
+		if(value_type != GDT_Unknown) {
+			fatal_error("PBM format can only hold a 1-bit mask");
+		}
+		if(!opts.create_options.empty()) {
+			fatal_error("creation options are not supported for PBM mask output");
+		}
+		fh = fopen(fn.c_str(), "wb");
+		if(!fh) fatal_error("cannot open mask output [%s]", fn.c_str());
+		fprintf(fh, "P4\n%zd %zd\n", w, h);
+		pbm_row.resize(row_bytes);
+		return;
+	}
+
+	GDALDriverH driver = GDALGetDriverByName(format.c_str());
+	if(!driver) fatal_error("unrecognized mask output format (%s)", format.c_str());
+
+	// Drivers such as COG can only copy an existing dataset, so the mask is
+	// first written to a temporary GeoTIFF.
+	GDALDriverH create_driver = driver;
+	std::string create_fn = fn;
+	if(!GDALGetMetadataItem(driver, GDAL_DCAP_CREATE, NULL)) {
+		if(!GDALGetMetadataItem(driver, GDAL_DCAP_CREATECOPY, NULL)) {
+			fatal_error("format %s cannot be used for mask output", format.c_str());
+		}
+		copy_driver = driver;
+		copy_options = opts.create_options;
+		create_driver = GDALGetDriverByName("GTiff");
+		if(!create_driver) fatal_error("GTiff driver is needed for %s mask output", format.c_str());
+		tmp_fn = fn + ".tmp.tif";
+		create_fn = tmp_fn;
+	}
+
+	char **create_opts = NULL;
+	if(EQUAL(GDALGetDriverShortName(create_driver), "GTiff")) {
+		if(value_type == GDT_Unknown) {
+			create_opts = CSLSetNameValue(create_opts, "NBITS", "1");
+		}
+		create_opts = CSLSetNameValue(create_opts, "TILED", "YES");
+		create_opts = CSLSetNameValue(create_opts, "COMPRESS", "DEFLATE");
+	}
+	if(!copy_driver) {
+		create_opts = set_name_values(create_opts, opts.create_options);
+	}
+	ds = GDALCreate(create_driver, create_fn.c_str(), w, h, 1, datatype, create_opts);
+	CSLDestroy(create_opts);
+	if(!ds) fatal_error("couldn't create mask output [%s]", create_fn.c_str());
+
+	if(affine) {
+		double affine_copy[6];
+		std::copy(affine, affine+6, affine_copy);
+		GDALSetGeoTransform(ds, affine_copy);
+	}
+	if(!proj_wkt.empty()) {
+		GDALSetProjection(ds, proj_wkt.c_str());
+	}
+
+	band = GDALGetRasterBand(ds, 1);
+
+	// Buffer a full row of blocks so that each block is written once.
+	int blocksize_x, blocksize_y;
+	GDALGetBlockSize(band, &blocksize_x, &blocksize_y);
+	strip_rows = std::min(size_t(std::max(blocksize_y, 1)), std::max(h, size_t(1)));
+	strip_rows = std::min(strip_rows,
+		std::max(MASK_WRITER_MAX_STRIP / std::max(w * pixel_size, size_t(1)), size_t(1)));
+	strip.resize(w * pixel_size * strip_rows);
+}
+
+void MaskWriter::writeRow(const uint8_t *bits) {
+	if(rows_written == h) fatal_error("too many rows written to mask output");
+	if(value_type != GDT_Unknown) fatal_error("mask output expects value rows");
+
+	if(fh) {
+		for(size_t i=0; i<row_bytes; i++) {
+			pbm_row[i] = ~bits[i];
+		}
+		// padding bits must be clear
+		if(w % 8) pbm_row[row_bytes-1] &= uint8_t(0xff << (8 - w%8));
+		if(fwrite(&pbm_row[0], row_bytes, 1, fh) != 1) {
+			fatal_error("write to [%s] failed", fn.c_str());
+		}
+		rows_written++;
+	} else {
+		uint8_t *out = stripRow();
+		size_t x = 0;
+		for(size_t i=0; i<row_bytes; i++) {
+			uint8_t b = bits[i];
+			for(int j=7; j>=0 && x<w; j--) {
+				out[x++] = (b >> j) & 1;
+			}
+		}
+		finishStripRow();
+	}
+}
+
+void MaskWriter::writeCoverageRow(const double *coverage) {
+	if(rows_written == h) fatal_error("too many rows written to mask output");
+	if(value_type == GDT_Unknown) fatal_error("mask output expects bit rows");
+	if(datatype != GDT_Byte && datatype != GDT_Float32) {
+		fatal_error("coverage output must be Byte or Float32");
+	}
+
+	uint8_t *out = stripRow();
+	if(datatype == GDT_Byte) {
+		for(size_t x=0; x<w; x++) {
+			double v = std::max(0.0, std::min(1.0, coverage[x]));
+			out[x] = uint8_t(v * 255.0 + 0.5);
+		}
+	} else {
+		float *out_f = reinterpret_cast<float *>(out);
+		for(size_t x=0; x<w; x++) {
+			out_f[x] = float(std::max(0.0, std::min(1.0, coverage[x])));
+		}
+	}
+	finishStripRow();
+}
+
+void MaskWriter::writeValueRow(const uint32_t *values) {
+	if(rows_written == h) fatal_error("too many rows written to mask output");
+	if(value_type == GDT_Unknown) fatal_error("mask output expects bit rows");
+
+	uint8_t *out = stripRow();
+	switch(datatype) {
+		case GDT_Byte:
+			for(size_t x=0; x<w; x++) out[x] = uint8_t(values[x]);
+			break;
+		case GDT_UInt16: {
+			uint16_t *out_16 = reinterpret_cast<uint16_t *>(out);
+			for(size_t x=0; x<w; x++) out_16[x] = uint16_t(values[x]);
+			break;
+		}
+		case GDT_UInt32:
+			memcpy(out, values, w * sizeof(uint32_t));
+			break;
+		default:
+			fatal_error("value output must be Byte, UInt16 or UInt32");
+	}
+	finishStripRow();
+}
+
+uint8_t *MaskWriter::stripRow() {
+	if(!ds) fatal_error("mask output is already closed");
+	return &strip[(rows_written - strip_y0) * w * pixel_size];
+}
+
+void MaskWriter::finishStripRow() {
+	rows_written++;
+	if(rows_written - strip_y0 == strip_rows || rows_written == h) flushStrip();
+}
+
+void MaskWriter::flushStrip() {
+	size_t num_rows = rows_written - strip_y0;
+	if(!num_rows) return;
+	CPLErr err = GDALRasterIO(band, GF_Write, 0, strip_y0, w, num_rows,
+		&strip[0], w, num_rows, datatype, 0, 0);
+	if(err != CE_None) fatal_error("write to [%s] failed", fn.c_str());
+	strip_y0 = rows_written;
+}
+
+void MaskWriter::close() {
+	if(fh) {
+		if(rows_written != h) fatal_error("mask output [%s] is incomplete", fn.c_str());
+		if(fclose(fh)) fatal_error("error closing [%s]", fn.c_str());
+		fh = NULL;
+	}
+
+	if(ds) {
+		if(rows_written != h) fatal_error("mask output [%s] is incomplete", fn.c_str());
+		GDALClose(ds);
+		ds = NULL;
+		band = NULL;
+		std::vector<uint8_t>().swap(strip);
+
+		if(copy_driver) {
+			GDALDatasetH tmp_ds = GDALOpen(tmp_fn.c_str(), GA_ReadOnly);
+			if(!tmp_ds) fatal_error("couldn't open temporary mask [%s]", tmp_fn.c_str());
+			char **opts = NULL;
+			if(EQUAL(GDALGetDriverShortName(copy_driver), "COG")) {
+				opts = CSLSetNameValue(opts, "COMPRESS", "DEFLATE");
+			}
+			opts = set_name_values(opts, copy_options);
+			GDALDatasetH out_ds = GDALCreateCopy(copy_driver, fn.c_str(), tmp_ds, FALSE, opts, NULL, NULL);
+			CSLDestroy(opts);
+			if(!out_ds) fatal_error("couldn't create mask output [%s]", fn.c_str());
+			GDALClose(out_ds);
+			GDALClose(tmp_ds);
+			GDALDeleteDataset(GDALGetDriverByName("GTiff"), tmp_fn.c_str());
+			copy_driver = NULL;
+		}
+	}
+}
+
+} // namespace dangdal
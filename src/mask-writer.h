@@ -0,0 +1,122 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+
+
+#ifndef DANGDAL_MASK_WRITER_H
+#define DANGDAL_MASK_WRITER_H
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "georef.h"
+
+namespace dangdal {
+
+// Mask output options, taken from the command line (like NdvDef).
+struct MaskOutOpts {
+	static void printUsage();
+	MaskOutOpts() { }
+	explicit MaskOutOpts(std::vector<std::string> &arg_list);
+
+	// "PBM" or the name of a GDAL driver.  If empty, the format is chosen
+	// based on the filename extension (GTiff for .tif, otherwise PBM).
+	std::string format;
+	std::vector<std::string> create_options;
+};
+
+// Writes a 1-bit mask one row at a time, either as PBM or through a GDAL
+// driver.  Rows are given as packed bits, most significant bit first, with
+// a set bit meaning the pixel is in the mask.  PBM output has these pixels
+// white and the rest black (as the mask outputs have always been written).
+// GDAL output has 1 for pixels in the mask and 0 otherwise.
+//
+// GeoTIFF output defaults to NBITS=1, TILED=YES and COMPRESS=DEFLATE, and is
+// written one row of tiles at a time.  Drivers that can't create datasets
+// directly (such as COG) are given a temporary GeoTIFF to copy from.
+//
+// If value_type is given, the output holds a value for each pixel rather than
+// a 1-bit mask, and a GDAL driver must be used (GTiff by default, without
+// NBITS=1).  Rows are given either to writeCoverageRow, for the fraction of
+// each pixel that is covered (Byte as 0-255 or Float32 as 0-1), or to
+// writeValueRow, for integer values (Byte, UInt16 or UInt32).
+class MaskWriter {
+public:
+	MaskWriter(const std::string &fn, const MaskOutOpts &opts,
+		size_t w, size_t h, const GeoRef &georef,
+		GDALDataType value_type=GDT_Unknown);
+	// affine may be NULL and proj_wkt may be empty
+	MaskWriter(const std::string &fn, const MaskOutOpts &opts,
+		size_t w, size_t h, const double *affine, const std::string &proj_wkt,
+		GDALDataType value_type=GDT_Unknown);
+	~MaskWriter();
+
+	void writeRow(const uint8_t *bits);
+	// coverage values are in the range 0 to 1
+	void writeCoverageRow(const double *coverage);
+	// values must fit in value_type
+	void writeValueRow(const uint32_t *values);
+	void close();
+
+private:
+	// noncopyable
+	MaskWriter(const MaskWriter &);
+	MaskWriter &operator=(const MaskWriter &);
+
+	void open(const MaskOutOpts &opts, const double *affine, const std::string &proj_wkt);
+	uint8_t *stripRow();
+	void finishStripRow();
+	void flushStrip();
+
+	std::string fn;
+	size_t w, h;
+	size_t row_bytes;
+	size_t rows_written;
+	GDALDataType value_type;
+
+	// for PBM
+	FILE *fh;
+	std::vector<uint8_t> pbm_row;
+
+	// for GDAL drivers
+	GDALDatasetH ds;
+	GDALRasterBandH band;
+	GDALDriverH copy_driver;
+	std::string tmp_fn;
+	std::vector<std::string> copy_options;
+	GDALDataType datatype;
+	size_t pixel_size;
+	size_t strip_rows;
+	size_t strip_y0;
+	std::vector<uint8_t> strip;
+};
+
+} // namespace dangdal
+
+#endif // ifndef DANGDAL_MASK_WRITER_H
@@ -27,6 +27,7 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <vector>
+#include <cstring>
 
 #include "common.h"
 #include "mask.h"
@@ -313,4 +314,46 @@ Vertex BitGrid::centroid() {
 	);
 }
 
+void BitGrid::rowExtent(int y, int *left, int *right) const {
+	assert(y>=0 && y<h);
+
+	// Rows are not aligned to bytes, so the partial bytes at each end are
+	// checked bit by bit.  In between, empty 64-bit words and bytes are
+	// skipped whole.
+	const size_t row_start = size_t(y)*w;
+	const size_t row_end = row_start + w;
+
+	size_t p = row_start;
+	while(p < row_end) {
+		if((p & 63) == 0 && p+64 <= row_end) {
+			uint64_t word;
+			memcpy(&word, &grid[p/8], sizeof(word));
+			if(!word) { p += 64; continue; }
+		}
+		if((p & 7) == 0 && p+8 <= row_end && !grid[p/8]) { p += 8; continue; }
+		if(grid[p/8] & (1 << (p&7))) break;
+		p++;
+	}
+	if(p == row_end) {
+		*left = w;
+		*right = -1;
+		return;
+	}
+	*left = int(p - row_start);
+
+	// q is one past the pixel being examined
+	size_t q = row_end;
+	while(q > p) {
+		if((q & 63) == 0 && q-64 >= p) {
+			uint64_t word;
+			memcpy(&word, &grid[q/8-8], sizeof(word));
+			if(!word) { q -= 64; continue; }
+		}
+		if((q & 7) == 0 && q-8 >= p && !grid[q/8-1]) { q -= 8; continue; }
+		if(grid[(q-1)/8] & (1 << ((q-1)&7))) break;
+		q--;
+	}
+	*right = int(q-1 - row_start);
+}
+
 } // namespace dangdal
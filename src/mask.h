@@ -90,6 +90,10 @@ public:
 
 	Vertex centroid();
 
+	// Finds the leftmost and rightmost set pixels in row y.  If the row is
+	// empty, left=w and right=-1.
+	void rowExtent(int y, int *left, int *right) const;
+
 private:
 	int w, h;
 	size_t arrlen;
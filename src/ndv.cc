@@ -214,6 +214,20 @@ void flagNaN<uint8_t>(
 	size_t nsamps __attribute__((unused))
 ) { } // no-op
 
+template<>
+void flagNaN<uint16_t>(
+	const uint16_t *in_data __attribute__((unused)),
+	uint8_t *mask_out __attribute__((unused)),
+	size_t nsamps __attribute__((unused))
+) { } // no-op
+
+template<>
+void flagNaN<int16_t>(
+	const int16_t *in_data __attribute__((unused)),
+	uint8_t *mask_out __attribute__((unused)),
+	size_t nsamps __attribute__((unused))
+) { } // no-op
+
 template<class T>
 void NdvDef::arrayCheckNdv(
 	size_t band, const T *in_data,
@@ -265,6 +279,21 @@ template void NdvDef::arrayCheckNdv<uint8_t>(
 	uint8_t *mask_out, size_t nsamps
 ) const;
 
+template void NdvDef::arrayCheckNdv<uint16_t>(
+	size_t band, const uint16_t *in_data,
+	uint8_t *mask_out, size_t nsamps
+) const;
+
+template void NdvDef::arrayCheckNdv<int16_t>(
+	size_t band, const int16_t *in_data,
+	uint8_t *mask_out, size_t nsamps
+) const;
+
+template void NdvDef::arrayCheckNdv<float>(
+	size_t band, const float *in_data,
+	uint8_t *mask_out, size_t nsamps
+) const;
+
 template void NdvDef::arrayCheckNdv<double>(
 	size_t band, const double *in_data,
 	uint8_t *mask_out, size_t nsamps
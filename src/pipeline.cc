@@ -0,0 +1,210 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+
+
+#include <vector>
+#include <deque>
+#include <map>
+
+#include "common.h"
+#include "threads.h"
+#include "pipeline.h"
+
+namespace dangdal {
+
+PipelineTask::PipelineTask() {
+	pthread_mutex_init(&error_mutex, NULL);
+}
+
+PipelineTask::~PipelineTask() {
+	pthread_mutex_destroy(&error_mutex);
+}
+
+bool PipelineTask::fail(const std::string &msg) {
+	ScopedLock lock(error_mutex);
+	if(error.empty()) error = msg;
+	return false;
+}
+
+namespace {
+
+struct Pipeline {
+	PipelineTask *task;
+	size_t num_jobs;
+	pthread_mutex_t mutex;
+	pthread_cond_t slot_freed;
+	pthread_cond_t block_read;
+	pthread_cond_t block_computed;
+	std::vector<size_t> free_slots;
+	// (job, slot) of blocks waiting to be computed
+	std::deque<std::pair<size_t, size_t> > read_blocks;
+	// job -> slot, for blocks waiting to be written
+	std::map<size_t, size_t> computed_blocks;
+	size_t jobs_taken; // by compute threads
+	bool failed; // a stage failed, so all stages should stop
+};
+
+// Must be called with the mutex held.
+void stop_pipeline(Pipeline *p) {
+	p->failed = true;
+	pthread_cond_broadcast(&p->slot_freed);
+	pthread_cond_broadcast(&p->block_read);
+	pthread_cond_broadcast(&p->block_computed);
+}
+
+void *reader_main(void *arg) {
+	Pipeline *p = static_cast<Pipeline *>(arg);
+	for(size_t job_idx=0; job_idx<p->num_jobs; job_idx++) {
+		size_t slot_idx;
+		{
+			ScopedLock lock(p->mutex);
+			while(p->free_slots.empty() && !p->failed) {
+				pthread_cond_wait(&p->slot_freed, &p->mutex);
+			}
+			if(p->failed) break;
+			slot_idx = p->free_slots.back();
+			p->free_slots.pop_back();
+		}
+		bool ok = p->task->read(job_idx, slot_idx);
+		{
+			ScopedLock lock(p->mutex);
+			if(!ok) {
+				stop_pipeline(p);
+				break;
+			}
+			p->read_blocks.push_back(std::make_pair(job_idx, slot_idx));
+			pthread_cond_signal(&p->block_read);
+		}
+	}
+	return NULL;
+}
+
+void *compute_main(void *arg) {
+	Pipeline *p = static_cast<Pipeline *>(arg);
+	for(;;) {
+		std::pair<size_t, size_t> block;
+		{
+			ScopedLock lock(p->mutex);
+			while(p->read_blocks.empty() && p->jobs_taken < p->num_jobs && !p->failed) {
+				pthread_cond_wait(&p->block_read, &p->mutex);
+			}
+			if(p->jobs_taken == p->num_jobs || p->failed) break;
+			block = p->read_blocks.front();
+			p->read_blocks.pop_front();
+			p->jobs_taken++;
+			// wake the other compute threads so they can exit
+			if(p->jobs_taken == p->num_jobs) pthread_cond_broadcast(&p->block_read);
+		}
+		bool ok = p->task->compute(block.first, block.second);
+		{
+			ScopedLock lock(p->mutex);
+			if(!ok) {
+				stop_pipeline(p);
+				break;
+			}
+			p->computed_blocks[block.first] = block.second;
+			pthread_cond_signal(&p->block_computed);
+		}
+	}
+	return NULL;
+}
+
+} // anonymous namespace
+
+size_t pipeline_slots(size_t num_threads) {
+	return num_threads + 2;
+}
+
+bool run_pipeline(PipelineTask &task, size_t num_jobs, size_t num_slots, size_t num_threads) {
+	if(!num_jobs) return true;
+	if(num_slots < 1) fatal_error("pipeline needs at least one slot");
+	if(num_threads < 1) num_threads = 1;
+
+	Pipeline p;
+	p.task = &task;
+	p.num_jobs = num_jobs;
+	pthread_mutex_init(&p.mutex, NULL);
+	pthread_cond_init(&p.slot_freed, NULL);
+	pthread_cond_init(&p.block_read, NULL);
+	pthread_cond_init(&p.block_computed, NULL);
+	for(size_t i=0; i<num_slots; i++) {
+		p.free_slots.push_back(num_slots - 1 - i);
+	}
+	p.jobs_taken = 0;
+	p.failed = false;
+
+	pthread_t reader;
+	if(pthread_create(&reader, NULL, reader_main, &p)) {
+		fatal_error("could not create thread");
+	}
+	std::vector<pthread_t> computers(num_threads);
+	for(size_t i=0; i<num_threads; i++) {
+		if(pthread_create(&computers[i], NULL, compute_main, &p)) {
+			fatal_error("could not create thread");
+		}
+	}
+
+	for(size_t job_idx=0; job_idx<num_jobs; job_idx++) {
+		size_t slot_idx;
+		{
+			ScopedLock lock(p.mutex);
+			std::map<size_t, size_t>::iterator it;
+			while((it = p.computed_blocks.find(job_idx)) == p.computed_blocks.end() && !p.failed) {
+				pthread_cond_wait(&p.block_computed, &p.mutex);
+			}
+			if(p.failed) break;
+			slot_idx = it->second;
+			p.computed_blocks.erase(it);
+		}
+		bool ok = task.write(job_idx, slot_idx);
+		{
+			ScopedLock lock(p.mutex);
+			if(!ok) {
+				stop_pipeline(&p);
+				break;
+			}
+			p.free_slots.push_back(slot_idx);
+			pthread_cond_signal(&p.slot_freed);
+		}
+	}
+
+	pthread_join(reader, NULL);
+	for(size_t i=0; i<num_threads; i++) {
+		pthread_join(computers[i], NULL);
+	}
+
+	pthread_cond_destroy(&p.block_computed);
+	pthread_cond_destroy(&p.block_read);
+	pthread_cond_destroy(&p.slot_freed);
+	pthread_mutex_destroy(&p.mutex);
+
+	return !p.failed;
+}
+
+} // namespace dangdal
@@ -0,0 +1,90 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+
+
+#ifndef DANGDAL_PIPELINE_H
+#define DANGDAL_PIPELINE_H
+
+#include <string>
+
+#include "common.h"
+#include "threads.h"
+
+namespace dangdal {
+
+// A block by block raster operation for run_pipeline.  The task keeps
+// num_slots sets of buffers, and slot_idx says which one holds a given
+// block.  A slot is reused once its block has been written, so no buffers
+// are allocated while the pipeline runs.
+//
+// read() is called in job order from a single reader thread and write() in
+// job order from a single writer thread, so these may keep state from one
+// block to the next (e.g. a sliding window of rows).  compute() is called
+// from a pool of threads, in any order.  Reading, computing, and writing of
+// different blocks all overlap.
+//
+// Since the stages run on worker threads they must not call fatal_error.
+// Instead they return fail(msg), which stops the pipeline.
+class PipelineTask {
+public:
+	PipelineTask();
+	virtual ~PipelineTask();
+	virtual bool read(size_t job_idx, size_t slot_idx) = 0;
+	virtual bool compute(size_t job_idx, size_t slot_idx) = 0;
+	virtual bool write(size_t job_idx, size_t slot_idx) = 0;
+
+	// The message of the first failure, if any.
+	const std::string &getError() const { return error; }
+
+protected:
+	// Records the error (if it is the first) and returns false.
+	bool fail(const std::string &msg);
+
+private:
+	PipelineTask(const PipelineTask &);
+	PipelineTask &operator=(const PipelineTask &);
+
+	pthread_mutex_t error_mutex;
+	std::string error;
+};
+
+// Number of slots needed to keep the reader, the writer, and num_threads
+// compute threads all busy.
+size_t pipeline_slots(size_t num_threads);
+
+// Runs jobs [0, num_jobs) through the pipeline and waits for them to
+// finish.  The writer runs in the calling thread.  Returns false if a stage
+// failed, in which case the remaining jobs are abandoned and task.getError()
+// says why.  The caller should close its datasets before reporting the
+// error.
+bool run_pipeline(PipelineTask &task, size_t num_jobs, size_t num_slots, size_t num_threads);
+
+} // namespace dangdal
+
+#endif // ifndef DANGDAL_PIPELINE_H
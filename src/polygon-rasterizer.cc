@@ -27,12 +27,14 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <algorithm>
+#include <cstring>
 #include <string>
 #include <vector>
 
 #include "common.h"
 #include "polygon.h"
 #include "polygon-rasterizer.h"
+#include "threads.h"
 
 static const double EPSILON = 1e-9;
 
@@ -40,9 +42,9 @@ namespace dangdal {
 
 typedef std::vector<double> row_crossings_dbl_t;
 
-row_crossings_t crossings_dbl_to_int(const row_crossings_dbl_t &in) {
-	row_crossings_t out;
-	for(size_t i=0; i<in.size(); i+=2) {
+static void crossings_dbl_to_int(const row_crossings_dbl_t &in, row_crossings_t &out) {
+	out.clear();
+	for(size_t i=0; i+1<in.size(); i+=2) {
 		int from = (int)ceil(in[i] - EPSILON);
 		int to = (int)floor(in[i+1] + EPSILON);
 		if(to > from) {
@@ -50,115 +52,13 @@ row_crossings_t crossings_dbl_to_int(const row_crossings_dbl_t &in) {
 			out.push_back(to);
 		}
 	}
-	return out;
 }
 
-// This function returns a list of pixel ranges for each row.  The ranges
-// consist of pixels that are entirely contained within the polygon.  The
-// results will be slightly wrong for polygons whose vertices are not integers.
-std::vector<row_crossings_t> get_row_crossings(
-	const Mpoly &mpoly, int min_y, int num_rows
+// Same as crossings_intersection, but writing into an existing vector.
+static void crossings_intersection(
+	const row_crossings_t &in1, const row_crossings_t &in2, row_crossings_t &out
 ) {
-	std::vector<row_crossings_dbl_t> rows_top(num_rows);
-	std::vector<row_crossings_dbl_t> rows_bot(num_rows);
-
-	for(size_t i=0; i<mpoly.rings.size(); i++) {
-		const Ring &c = mpoly.rings[i];
-		size_t npts = c.pts.size();
-		for(size_t j=0; j<npts; j++) {
-			size_t j_plus1 = (j==npts-1) ? 0 : (j+1);
-			double x0 = c.pts[j].x;
-			double y0 = c.pts[j].y;
-			double x1 = c.pts[j_plus1].x;
-			double y1 = c.pts[j_plus1].y;
-			if(y0 == y1) continue;
-			if(y0 > y1) {
-				double tmp;
-				tmp=x0; x0=x1; x1=tmp; 
-				tmp=y0; y0=y1; y1=tmp; 
-			}
-			double alpha = (x1-x0) / (y1-y0);
-			int y0i = (int)round(y0);
-			int y1i = (int)round(y1);
-			for(int y=y0i; y<=y1i; y++) {
-				double x = x0 + ((double)y - y0)*alpha;
-
-				int row = y - min_y - 1;
-				if(y > y0i && row >= 0 && row < num_rows) {
-					row_crossings_dbl_t &r = rows_bot[row];
-					r.push_back(x);
-				}
-
-				row = y - min_y;
-				if(y < y1i && row >= 0 && row < num_rows) {
-					row_crossings_dbl_t &r = rows_top[row];
-					r.push_back(x);
-				}
-			}
-		}
-	}
-
-	std::vector<row_crossings_t> rows_out(num_rows);
-
-	for(int row=0; row<num_rows; row++) {
-		std::sort(rows_top[row].begin(), rows_top[row].end());
-		std::sort(rows_bot[row].begin(), rows_bot[row].end());
-		row_crossings_t top = crossings_dbl_to_int(rows_top[row]);
-		row_crossings_t bot = crossings_dbl_to_int(rows_bot[row]);
-		if(top.size() && bot.size()) {
-			row_crossings_t c = crossings_intersection(top, bot);
-			std::swap(rows_out[row], c);
-		} else if(!top.empty()) {
-			std::swap(rows_out[row], top);
-		} else if(!bot.empty()) {
-			std::swap(rows_out[row], bot);
-		} else {
-			// no-op: leave rows_out[row] empty
-		}
-	}
-
-	return rows_out;
-}
-
-void mask_from_mpoly(const Mpoly &mpoly, size_t w, size_t h, const std::string &fn) {
-	printf("mask draw: begin\n");
-
-	std::vector<row_crossings_t> rows = get_row_crossings(mpoly, 0, h);
-
-	printf("mask draw: write\n");
-
-	FILE *fout = fopen(fn.c_str(), "wb");
-	if(!fout) fatal_error("cannot open mask output");
-	fprintf(fout, "P4\n%zd %zd\n", w, h);
-	std::vector<uint8_t> buf((w+7)/8);
-	for(size_t y=0; y<h; y++) {
-		buf.assign((w+7)/8, 0);
-		uint8_t *p = &buf[0];
-		uint8_t bitp = 128;
-		const row_crossings_t &r = rows[y];
-		for(size_t i=0; i<w; i++) {
-			uint8_t v = 1;
-			// not the fastest way...
-			for(size_t j=0; j<r.size(); j++) {
-				if(double(i) >= r[j]) v = !v;
-			}
-			if(v) *p |= bitp;
-			bitp >>= 1;
-			if(!bitp) {
-				p++;
-				bitp = 128;
-			}
-		}
-		fwrite(&buf[0], (w+7)/8, 1, fout);
-	}
-	fclose(fout);
-	printf("mask draw: done\n");
-}
-
-row_crossings_t crossings_intersection(
-	const row_crossings_t &in1, const row_crossings_t &in2
-) {
-	row_crossings_t out;
+	out.clear();
 	size_t n1 = in1.size();
 	size_t n2 = in2.size();
 	size_t p1=0, p2=0;
@@ -194,6 +94,399 @@ row_crossings_t crossings_intersection(
 		out.push_back(open);
 		out.push_back(close);
 	}
+}
+
+void RowCrossingsScanner::clear() {
+	edges.clear();
+	active.clear();
+	sorted = false;
+	next_edge = 0;
+	last_y = 0;
+}
+
+void RowCrossingsScanner::addRing(const Ring &ring) {
+	if(sorted) fatal_error("RowCrossingsScanner: cannot add rings after scanning has started");
+
+	size_t npts = ring.pts.size();
+	for(size_t j=0; j<npts; j++) {
+		size_t j_plus1 = (j==npts-1) ? 0 : (j+1);
+		double x0 = ring.pts[j].x;
+		double y0 = ring.pts[j].y;
+		double x1 = ring.pts[j_plus1].x;
+		double y1 = ring.pts[j_plus1].y;
+		if(y0 == y1) continue;
+		if(y0 > y1) {
+			double tmp;
+			tmp=x0; x0=x1; x1=tmp; 
+			tmp=y0; y0=y1; y1=tmp; 
+		}
+		ScanEdge e;
+		e.x0 = x0;
+		e.y0 = y0;
+		e.alpha = (x1-x0) / (y1-y0);
+		e.y0i = (int)round(y0);
+		e.y1i = (int)round(y1);
+		// This edge would only contribute to rows y0i <= y < y1i.
+		if(e.y1i > e.y0i) edges.push_back(e);
+	}
+}
+
+void RowCrossingsScanner::addMpoly(const Mpoly &mpoly) {
+	for(size_t i=0; i<mpoly.rings.size(); i++) {
+		addRing(mpoly.rings[i]);
+	}
+}
+
+// For row y (the pixels between y and y+1), the top crossings are where the
+// edges cross y and the bottom crossings are where they cross y+1.  Pixels
+// are included if they are within both.
+const row_crossings_t &RowCrossingsScanner::getRow(int y) {
+	if(!sorted) {
+		std::sort(edges.begin(), edges.end());
+		sorted = true;
+	} else if(y <= last_y) {
+		fatal_error("RowCrossingsScanner: rows must be requested in increasing order");
+	}
+	last_y = y;
+
+	while(next_edge < edges.size() && edges[next_edge].y0i <= y) {
+		if(edges[next_edge].y1i > y) active.push_back(next_edge);
+		next_edge++;
+	}
+	size_t num_active = 0;
+	for(size_t i=0; i<active.size(); i++) {
+		if(edges[active[i]].y1i > y) active[num_active++] = active[i];
+	}
+	active.resize(num_active);
+
+	top.clear();
+	bot.clear();
+	for(size_t i=0; i<active.size(); i++) {
+		const ScanEdge &e = edges[active[i]];
+		top.push_back(e.x0 + ((double)y - e.y0)*e.alpha);
+		bot.push_back(e.x0 + ((double)(y+1) - e.y0)*e.alpha);
+	}
+	std::sort(top.begin(), top.end());
+	std::sort(bot.begin(), bot.end());
+	crossings_dbl_to_int(top, top_i);
+	crossings_dbl_to_int(bot, bot_i);
+
+	if(top_i.size() && bot_i.size()) {
+		crossings_intersection(top_i, bot_i, out);
+	} else if(!top_i.empty()) {
+		std::swap(out, top_i);
+	} else {
+		std::swap(out, bot_i);
+	}
+	return out;
+}
+
+void CoverageScanner::addRing(const Ring &ring) {
+	if(sorted) fatal_error("CoverageScanner: cannot add rings after scanning has started");
+
+	// Outer rings count positive and holes negative, whatever their
+	// orientation.
+	double ring_sign = ring.orientedArea() > 0 ? -1 : 1;
+	if(ring.is_hole) ring_sign = -ring_sign;
+
+	size_t npts = ring.pts.size();
+	for(size_t j=0; j<npts; j++) {
+		size_t j_plus1 = (j==npts-1) ? 0 : (j+1);
+		double x0 = ring.pts[j].x;
+		double y0 = ring.pts[j].y;
+		double x1 = ring.pts[j_plus1].x;
+		double y1 = ring.pts[j_plus1].y;
+		if(y0 == y1) continue;
+		CoverEdge e;
+		e.dir = ring_sign;
+		if(y0 > y1) {
+			std::swap(x0, x1);
+			std::swap(y0, y1);
+			e.dir = -e.dir;
+		}
+		e.x0 = x0;
+		e.y0 = y0;
+		e.y1 = y1;
+		e.dxdy = (x1-x0) / (y1-y0);
+		e.row0 = (int)floor(y0);
+		e.row1 = (int)ceil(y1);
+		edges.push_back(e);
+	}
+}
+
+void CoverageScanner::addMpoly(const Mpoly &mpoly) {
+	for(size_t i=0; i<mpoly.rings.size(); i++) {
+		addRing(mpoly.rings[i]);
+	}
+}
+
+// Adds the signed area between the part of the edge within row y and the
+// right side of the image.  Pixels the edge passes through get the part of
+// that area falling within them, and pixels to the right get the rest
+// through the running sum.
+void CoverageScanner::drawEdge(const CoverEdge &e, int y) {
+	double ya = std::max(double(y), e.y0);
+	double yb = std::min(double(y+1), e.y1);
+	if(yb <= ya) return;
+	double xa = e.x0 + (ya - e.y0) * e.dxdy;
+	double xb = e.x0 + (yb - e.y0) * e.dxdy;
+	double d = (yb - ya) * e.dir;
+
+	double x0 = std::min(xa, xb);
+	double x1 = std::max(xa, xb);
+	if(x0 >= double(w)) return;
+	if(x1 <= 0) {
+		accumulate(0, d);
+		return;
+	}
+
+	double x0floor = floor(x0);
+	double x1ceil = ceil(x1);
+	int64_t x0i = int64_t(x0floor);
+	int64_t x1i = int64_t(x1ceil);
+	if(x1i <= x0i + 1) {
+		// the edge stays within one column
+		double xmf = 0.5 * (xa + xb) - x0floor;
+		accumulate(x0i, d - d*xmf);
+		accumulate(x0i+1, d*xmf);
+	} else {
+		double s = 1.0 / (x1 - x0);
+		double x0f = x0 - x0floor;
+		double a0 = 0.5 * s * (1.0 - x0f) * (1.0 - x0f);
+		double x1f = x1 - x1ceil + 1.0;
+		double am = 0.5 * s * x1f * x1f;
+		accumulate(x0i, d*a0);
+		if(x1i == x0i + 2) {
+			accumulate(x0i+1, d*(1.0 - a0 - am));
+		} else {
+			double a1 = s * (1.5 - x0f);
+			accumulate(x0i+1, d*(a1 - a0));
+			// each column fully crossed gets an equal share
+			int64_t from = x0i+2;
+			int64_t to = x1i-1;
+			if(from < 0) {
+				accumulate(0, d*s*double(std::min(to, int64_t(0)) - from));
+				from = 0;
+			}
+			to = std::min(to, int64_t(w));
+			for(int64_t xi=from; xi<to; xi++) {
+				acc[xi] += d*s;
+			}
+			double a2 = a1 + double(x1i - x0i - 3) * s;
+			accumulate(x1i-1, d*(1.0 - a2 - am));
+		}
+		accumulate(x1i, d*am);
+	}
+}
+
+void CoverageScanner::getRow(int y, double *coverage) {
+	if(!sorted) {
+		std::sort(edges.begin(), edges.end());
+		sorted = true;
+	} else if(y <= last_y) {
+		fatal_error("CoverageScanner: rows must be requested in increasing order");
+	}
+	last_y = y;
+
+	while(next_edge < edges.size() && edges[next_edge].row0 <= y) {
+		if(edges[next_edge].row1 > y) active.push_back(next_edge);
+		next_edge++;
+	}
+	size_t num_active = 0;
+	for(size_t i=0; i<active.size(); i++) {
+		if(edges[active[i]].row1 > y) active[num_active++] = active[i];
+	}
+	active.resize(num_active);
+
+	std::fill(acc.begin(), acc.end(), 0.0);
+	for(size_t i=0; i<active.size(); i++) {
+		drawEdge(edges[active[i]], y);
+	}
+
+	double sum = 0;
+	for(size_t x=0; x<w; x++) {
+		sum += acc[x];
+		coverage[x] = std::max(0.0, std::min(1.0, sum));
+	}
+}
+
+// This function returns a list of pixel ranges for each row.  The ranges
+// consist of pixels that are entirely contained within the polygon.  The
+// results will be slightly wrong for polygons whose vertices are not integers.
+std::vector<row_crossings_t> get_row_crossings(
+	const Mpoly &mpoly, int min_y, int num_rows
+) {
+	RowCrossingsScanner scanner;
+	scanner.addMpoly(mpoly);
+
+	std::vector<row_crossings_t> rows_out(num_rows);
+	for(int row=0; row<num_rows; row++) {
+		rows_out[row] = scanner.getRow(min_y + row);
+	}
+
+	return rows_out;
+}
+
+void mask_from_mpoly(const Mpoly &mpoly, size_t w, size_t h, MaskWriter &mask_out) {
+	printf("mask draw: begin\n");
+
+	RowCrossingsScanner scanner;
+	scanner.addMpoly(mpoly);
+
+	const size_t row_bytes = (w+7)/8;
+	std::vector<uint8_t> buf(row_bytes);
+	for(size_t y=0; y<h; y++) {
+		std::fill(buf.begin(), buf.end(), 0);
+
+		const row_crossings_t &r = scanner.getRow(y);
+		for(size_t j=0; j+1<r.size(); j+=2) {
+			size_t from = (size_t)std::max(r[j], 0);
+			size_t to = (size_t)std::max(std::min(r[j+1], (int)w), 0);
+			if(from >= to) continue;
+
+			size_t from_byte = from / 8;
+			size_t to_byte = to / 8;
+			uint8_t from_mask = uint8_t(0xff >> (from % 8)); // bits from..end of byte
+			uint8_t to_mask = uint8_t(~(0xff >> (to % 8)));  // bits start of byte..to
+			if(from_byte == to_byte) {
+				buf[from_byte] |= from_mask & to_mask;
+			} else {
+				buf[from_byte] |= from_mask;
+				if(to_byte > from_byte+1) {
+					memset(&buf[from_byte+1], 0xff, to_byte - from_byte - 1);
+				}
+				if(to % 8) buf[to_byte] |= to_mask;
+			}
+		}
+
+		mask_out.writeRow(&buf[0]);
+	}
+	mask_out.close();
+	printf("mask draw: done\n");
+}
+
+void coverage_from_mpoly(const Mpoly &mpoly, size_t w, size_t h, MaskWriter &mask_out) {
+	printf("coverage draw: begin\n");
+
+	CoverageScanner scanner(w);
+	scanner.addMpoly(mpoly);
+
+	std::vector<double> row(w);
+	for(size_t y=0; y<h; y++) {
+		scanner.getRow(y, &row[0]);
+		mask_out.writeCoverageRow(&row[0]);
+	}
+	mask_out.close();
+	printf("coverage draw: done\n");
+}
+
+// Each band of rows buffers at most this many bytes (unless a single row is
+// bigger).
+static const size_t BURN_BAND_BYTES = 16 << 20;
+
+class BurnBandsTask : public ParallelTask {
+public:
+	BurnBandsTask(
+		const std::vector<BurnFeature> &_features,
+		const std::vector<std::pair<int, int> > &_feature_rows,
+		const std::vector<std::vector<size_t> > &_band_features,
+		size_t _w, size_t _h, size_t _band_rows, size_t num_threads
+	) :
+		features(_features), feature_rows(_feature_rows),
+		band_features(_band_features),
+		w(_w), h(_h), band_rows(_band_rows),
+		first_band(0),
+		bufs(num_threads),
+		scanners(num_threads)
+	{ }
+
+	void run(size_t job_idx, size_t thread_idx) {
+		size_t band = first_band + job_idx;
+		int y0 = int(band * band_rows);
+		int y1 = int(std::min(h, (band+1) * band_rows));
+		std::vector<uint32_t> &buf = bufs[job_idx];
+		buf.assign(w * (y1-y0), 0);
+		RowCrossingsScanner &scanner = scanners[thread_idx];
+
+		const std::vector<size_t> &list = band_features[band];
+		for(size_t i=0; i<list.size(); i++) {
+			const BurnFeature &f = features[list[i]];
+			int fy0 = std::max(y0, feature_rows[list[i]].first);
+			int fy1 = std::min(y1, feature_rows[list[i]].second);
+
+			scanner.clear();
+			scanner.addMpoly(f.mpoly);
+			for(int y=fy0; y<fy1; y++) {
+				uint32_t *out = &buf[w * (y-y0)];
+				const row_crossings_t &r = scanner.getRow(y);
+				for(size_t j=0; j+1<r.size(); j+=2) {
+					int from = std::max(r[j], 0);
+					int to = std::min(r[j+1], int(w));
+					if(from < to) std::fill(out+from, out+to, f.value);
+				}
+			}
+		}
+	}
+
+	const std::vector<BurnFeature> &features;
+	const std::vector<std::pair<int, int> > &feature_rows;
+	const std::vector<std::vector<size_t> > &band_features;
+	size_t w, h, band_rows;
+	size_t first_band;
+	std::vector<std::vector<uint32_t> > bufs;
+	std::vector<RowCrossingsScanner> scanners;
+};
+
+void burn_features(
+	const std::vector<BurnFeature> &features, size_t w, size_t h,
+	MaskWriter &mask_out, size_t num_threads
+) {
+	printf("burn: begin\n");
+
+	if(num_threads < 1) num_threads = 1;
+	size_t band_rows = std::max(size_t(1), BURN_BAND_BYTES / (std::max(w, size_t(1)) * sizeof(uint32_t)));
+	// at least one band per thread, so that small rasters are split up too
+	band_rows = std::min(band_rows, std::max(size_t(1), (h + num_threads - 1) / num_threads));
+	size_t num_bands = (h + band_rows - 1) / band_rows;
+
+	// Rows that each feature could touch, and the features touching each
+	// band (in order).
+	std::vector<std::pair<int, int> > feature_rows(features.size());
+	std::vector<std::vector<size_t> > band_features(num_bands);
+	for(size_t i=0; i<features.size(); i++) {
+		Bbox bbox = features[i].mpoly.getBbox();
+		if(bbox.empty) continue;
+		int fy0 = int(std::max(0.0, floor(bbox.min_y)));
+		int fy1 = int(std::min(double(h), ceil(bbox.max_y) + 1));
+		feature_rows[i] = std::pair<int, int>(fy0, fy1);
+		if(fy0 >= fy1) continue;
+		for(size_t band=fy0/band_rows; band<=(fy1-1)/band_rows; band++) {
+			band_features[band].push_back(i);
+		}
+	}
+
+	BurnBandsTask task(features, feature_rows, band_features, w, h, band_rows, num_threads);
+	for(size_t band=0; band<num_bands; band+=num_threads) {
+		size_t num_jobs = std::min(num_threads, num_bands - band);
+		task.first_band = band;
+		run_parallel(task, num_jobs, num_threads);
+
+		for(size_t job=0; job<num_jobs; job++) {
+			const std::vector<uint32_t> &buf = task.bufs[job];
+			for(size_t p=0; p<buf.size(); p+=w) {
+				mask_out.writeValueRow(&buf[p]);
+			}
+		}
+	}
+	mask_out.close();
+	printf("burn: done\n");
+}
+
+row_crossings_t crossings_intersection(
+	const row_crossings_t &in1, const row_crossings_t &in2
+) {
+	row_crossings_t out;
+	crossings_intersection(in1, in2, out);
 	return out;
 }
 
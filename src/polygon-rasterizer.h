@@ -34,14 +34,110 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 #include "common.h"
 #include "polygon.h"
+#include "mask-writer.h"
 
 namespace dangdal {
 
 typedef std::vector<int> row_crossings_t;
 
+// Computes the same pixel ranges as get_row_crossings, but one row at a time
+// using an active edge table, so that memory use doesn't depend on the number
+// of rows and each row only costs as much as the number of edges that cross
+// it.  Rows must be requested in increasing order.
+class RowCrossingsScanner {
+public:
+	RowCrossingsScanner() : sorted(false), next_edge(0), last_y(0) { }
+
+	// Forget all edges, keeping allocated buffers for reuse.
+	void clear();
+	void addRing(const Ring &ring);
+	void addMpoly(const Mpoly &mpoly);
+
+	const row_crossings_t &getRow(int y);
+
+private:
+	struct ScanEdge {
+		double x0, y0, alpha;
+		int y0i, y1i;
+
+		bool operator<(const ScanEdge &other) const { return y0i < other.y0i; }
+	};
+
+	std::vector<ScanEdge> edges;
+	bool sorted;
+	size_t next_edge;
+	int last_y;
+	std::vector<size_t> active;
+	// scratch space, reused between rows
+	std::vector<double> top, bot;
+	row_crossings_t top_i, bot_i, out;
+};
+
+// Computes the exact fraction of each pixel's area that is covered by a
+// polygon, one row at a time (in increasing order).  Each edge adds its signed
+// area to an accumulation row, which is then summed from left to right.  Holes
+// (Ring::is_hole) are subtracted regardless of their orientation, and places
+// where outer rings overlap are clamped to full coverage.
+class CoverageScanner {
+public:
+	explicit CoverageScanner(size_t _w) :
+		w(_w), sorted(false), next_edge(0), last_y(0), acc(_w) { }
+
+	void addRing(const Ring &ring);
+	void addMpoly(const Mpoly &mpoly);
+
+	// Fills coverage[0..w-1] with values from 0 to 1.
+	void getRow(int y, double *coverage);
+
+private:
+	struct CoverEdge {
+		double x0, y0, y1, dxdy, dir;
+		int row0, row1; // rows touched are row0 <= y < row1
+
+		bool operator<(const CoverEdge &other) const { return row0 < other.row0; }
+	};
+
+	// Columns left of the image add to the first column, since only the
+	// running sum matters.  Columns right of the image have no effect.
+	void accumulate(int64_t i, double v) {
+		if(i < 0) i = 0;
+		if(i < int64_t(w)) acc[i] += v;
+	}
+	void drawEdge(const CoverEdge &e, int y);
+
+	size_t w;
+	std::vector<CoverEdge> edges;
+	bool sorted;
+	size_t next_edge;
+	int last_y;
+	std::vector<size_t> active;
+	std::vector<double> acc;
+};
+
 std::vector<row_crossings_t> get_row_crossings(const Mpoly &mpoly, int min_y, int num_rows);
 
-void mask_from_mpoly(const Mpoly &mpoly, size_t w, size_t h, const std::string &fn);
+// Draws the pixels that are entirely inside the polygon.
+void mask_from_mpoly(const Mpoly &mpoly, size_t w, size_t h, MaskWriter &mask_out);
+
+// A polygon, in pixel coordinates, to be burned into a raster.
+struct BurnFeature {
+	BurnFeature() : value(0) { }
+
+	Mpoly mpoly;
+	uint32_t value;
+};
+
+// Burns each feature's value into the pixels that it entirely contains (the
+// same pixels mask_from_mpoly would draw).  Other pixels are zero, and where
+// features overlap the later one wins.  mask_out must have been created with
+// an integer value type.  Bands of rows are rasterized in parallel and
+// written in order.
+void burn_features(const std::vector<BurnFeature> &features, size_t w, size_t h,
+	MaskWriter &mask_out, size_t num_threads);
+
+// Draws the fraction of each pixel covered by the polygon.  mask_out must have
+// been created with a coverage type.
+void coverage_from_mpoly(const Mpoly &mpoly, size_t w, size_t h, MaskWriter &mask_out);
 
 row_crossings_t crossings_intersection(
 	const row_crossings_t &in1, const row_crossings_t &in2
@@ -31,6 +31,7 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include "common.h"
 #include "polygon.h"
 #include "georef.h"
+#include "threads.h"
 
 namespace dangdal {
 
@@ -655,67 +656,118 @@ static double estimate_canvas_size_sq(const GeoRef &georef, double semi_major) {
 	return size;
 }
 
-void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler) {
-	size_t nrings = rings.size();
-	Mpoly ll_poly;
-	ll_poly.rings.resize(nrings);
-	
-	double semi_major;
-	if(georef.have_semi_major) {
-		semi_major = georef.semi_major;
-	} else {
-		semi_major = 6370997.0;
-		fprintf(stderr, "Warning: could not get globe size, assuming %lf\n", semi_major);
-	}
-	double canvas_size_sq = estimate_canvas_size_sq(georef, semi_major);
-	//printf("canvas_size_sq = %lf\n", canvas_size_sq);
+// Returns true if the left and right edges of the raster map to the same
+// place, as happens with images that span 360 degrees of longitude.
+static bool raster_wraps_around(const GeoRef &georef) {
+	const size_t nsamp = 5;
+	double x[2*nsamp], y[2*nsamp], lon[2*nsamp], lat[2*nsamp];
+	for(size_t i=0; i<nsamp; i++) {
+		x[2*i  ] = 0;
+		x[2*i+1] = georef.w;
+		y[2*i] = y[2*i+1] = double(georef.h) * i / (nsamp-1);
+	}
+	// if the edges can't be projected then play it safe
+	if(georef.xy2ll_batch(2*nsamp, x, y, lon, lat) < 2*nsamp) return true;
+	for(size_t i=0; i<nsamp; i++) {
+		double dlon = fmod(fabs(lon[2*i] - lon[2*i+1]), 360.0);
+		dlon = std::min(dlon, 360.0 - dlon);
+		double dlat = fabs(lat[2*i] - lat[2*i+1]);
+		if(dlon < 1e-6 && dlat < 1e-6) return true;
+	}
+	return false;
+}
 
-	// FIXME - now that we don't use ll2xy this is probably not needed:
-	// This is a kludge that shrinks the canvas by a millionth of a pixel
-	// to avoid problems with images that span an entire 360 degrees of
-	// longitude.  Without this the map xy -> ll -> xy is not single-valued.
-	double epsilon = 5e-7;
-	double shrink = ((double)georef.w - 2.0*epsilon) / (double)georef.w;
+namespace {
 
-	for(size_t r_idx=0; r_idx<nrings; r_idx++) {
-		// note that this is *not* a reference, since it will potentially
-		// be modified
-		Ring xy_ring = rings[r_idx];
-		// this will be the output
-		Ring &ll_ring = ll_poly.rings[r_idx];
-		ll_ring = xy_ring.copyMetadata();
-		ll_ring.pts.resize(xy_ring.pts.size());
-
-		for(size_t v_idx=0; v_idx<ll_ring.pts.size(); v_idx++) {
-			double x = xy_ring.pts[v_idx].x;
-			double y = xy_ring.pts[v_idx].y;
-			double lon, lat;
-			georef.xy2ll_or_die(x*shrink+epsilon, y, &lon, &lat);
-			ll_ring.pts[v_idx].x = lon;
-			ll_ring.pts[v_idx].y = lat;
+struct LlProjParams {
+	double toler;
+	double semi_major;
+	double canvas_size_sq;
+	double shrink;
+	double epsilon;
+};
+
+// Projects vertices [begin, end) of a ring to lon/lat, inserting midpoints
+// into the segments that start at those vertices wherever needed.  The
+// result is appended to ll_out.  Spans of a ring are independent, so a
+// large ring can be processed as several spans in parallel.
+void project_ring_span(
+	const GeoRef &georef, const Ring &xy_ring, size_t r_idx,
+	size_t begin, size_t end, const LlProjParams &par,
+	std::vector<Vertex> &ll_out
+) {
+	const double toler = par.toler;
+	const double semi_major = par.semi_major;
+	const double shrink = par.shrink;
+	const double epsilon = par.epsilon;
+
+	const size_t npts_ring = xy_ring.pts.size();
+	// includes the far end of the last segment
+	const size_t npts_in = end - begin + 1;
+
+	// Vertices are kept in a linked list (next[]) so that midpoints can
+	// be inserted while all of the pending segments are checked using
+	// one batch transform per round.
+	std::vector<Vertex> xy_pts(npts_in);
+	std::vector<Vertex> ll_pts(npts_in);
+	std::vector<size_t> next(npts_in);
+	for(size_t v_idx=0; v_idx<npts_in; v_idx++) {
+		xy_pts[v_idx] = xy_ring.pts[(begin + v_idx) % npts_ring];
+		next[v_idx] = v_idx + 1;
+	}
+
+	std::vector<double> batch_x(npts_in), batch_y(npts_in);
+	for(size_t v_idx=0; v_idx<npts_in; v_idx++) {
+		batch_x[v_idx] = xy_pts[v_idx].x*shrink+epsilon;
+		batch_y[v_idx] = xy_pts[v_idx].y;
+	}
+	georef.xy2ll_batch_or_die(npts_in,
+		&batch_x[0], &batch_y[0], &batch_x[0], &batch_y[0]);
+	for(size_t v_idx=0; v_idx<npts_in; v_idx++) {
+		ll_pts[v_idx] = Vertex(batch_x[v_idx], batch_y[v_idx]);
+	}
+
+	// segments (identified by their starting vertex) that need to be
+	// checked, and how many times each has been subdivided
+	std::vector<size_t> todo(npts_in-1);
+	std::vector<int> todo_depth(npts_in-1, 0);
+	for(size_t v_idx=0; v_idx<npts_in-1; v_idx++) todo[v_idx] = v_idx;
+	std::vector<size_t> next_todo;
+	std::vector<int> next_todo_depth;
+
+	while(!todo.empty()) {
+		const size_t nseg = todo.size();
+
+		batch_x.resize(nseg);
+		batch_y.resize(nseg);
+		for(size_t s_idx=0; s_idx<nseg; s_idx++) {
+			const Vertex &xy1 = xy_pts[todo[s_idx]];
+			const Vertex &xy2 = xy_pts[next[todo[s_idx]]];
+			batch_x[s_idx] = (xy1.x + xy2.x)/2.0*shrink+epsilon;
+			batch_y[s_idx] = (xy1.y + xy2.y)/2.0;
 		}
+		georef.xy2ll_batch_or_die(nseg,
+			&batch_x[0], &batch_y[0], &batch_x[0], &batch_y[0]);
 
-		int num_consec = 0;
+		next_todo.clear();
+		next_todo_depth.clear();
 
-		for(size_t v_idx=0; v_idx<ll_ring.pts.size(); ) {
-			if(xy_ring.pts.size() != ll_ring.pts.size()) {
-				fatal_error("xy_ring.npts != ll_ring.npts");
-			}
-			size_t npts = xy_ring.pts.size();
+		for(size_t s_idx=0; s_idx<nseg; s_idx++) {
+			const size_t v_idx = todo[s_idx];
+			const size_t v2_idx = next[v_idx];
 
-			const Vertex xy1 = xy_ring.pts[v_idx];
-			const Vertex xy2 = xy_ring.pts[(v_idx + 1) % npts];
+			const Vertex xy1 = xy_pts[v_idx];
+			const Vertex xy2 = xy_pts[v2_idx];
 			const Vertex xy_m(
 				(xy1.x + xy2.x)/2.0,
 				(xy1.y + xy2.y)/2.0);
 
-			Vertex ll_m_proj;
-			georef.xy2ll_or_die(
-				xy_m.x*shrink+epsilon, xy_m.y,
-				&ll_m_proj.x, &ll_m_proj.y);
+			const Vertex ll_m_proj(batch_x[s_idx], batch_y[s_idx]);
 
-			Vertex &ll1 = ll_ring.pts[v_idx];
-			Vertex &ll2 = ll_ring.pts[(v_idx + 1) % npts];
+			// copies, since the wraparound adjustment is only needed for
+			// the error computation
+			Vertex ll1 = ll_pts[v_idx];
+			const Vertex ll2 = ll_pts[v2_idx];
 
 			while(ll1.x - ll2.x >  180) ll1.x -= 360;
 			while(ll1.x - ll2.x < -180) ll1.x += 360;
@@ -734,7 +786,7 @@ void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler) {
 
 				if(VERBOSE && need_midpt) {
 					printf("  inserting midpoint at %zd,%zd (lon/lat difference %g > %g)\n",
-						r_idx, v_idx, sqrt(sqr_error), max_error);
+						r_idx, begin+v_idx, sqrt(sqr_error), max_error);
 				}
 			}
 
@@ -754,7 +806,7 @@ void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler) {
 				double sqr_error = dx*dx + dy*dy;
 
 				// if the midpoint is this far off then something is seriously wrong
-				if(sqr_error > canvas_size_sq) {
+				if(sqr_error > par.canvas_size_sq) {
 					fprintf(stderr, "\nInfo on bad point:\n");
 					fprintf(stderr, "xy1 = %lf,%lf\n", xy1.x, xy1.y);
 					fprintf(stderr, "xy2 = %lf,%lf\n", xy2.x, xy2.y);
@@ -763,7 +815,7 @@ void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler) {
 					fprintf(stderr, "ll2 = %lf,%lf\n", ll2.x, ll2.y);
 					fprintf(stderr, "ll_m_proj = %lf,%lf\n", ll_m_proj.x, ll_m_proj.y);
 					fprintf(stderr, "ll_m_interp = %lf,%lf\n", ll_m_interp.x, ll_m_interp.y);
-					fprintf(stderr, "error = %lf > %lf\n", sqr_error, canvas_size_sq);
+					fprintf(stderr, "error = %lf > %lf\n", sqr_error, par.canvas_size_sq);
 					fatal_error("projection error in mpoly_xy2ll_with_interp");
 				}
 
@@ -771,14 +823,15 @@ void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler) {
 
 				if(VERBOSE && need_midpt) {
 					printf("  inserting midpoint at %zd,%zd (delta=%lf,%lf > %lf)\n",
-						r_idx, v_idx, dx, dy, toler);
+						r_idx, begin+v_idx, dx, dy, toler);
 					printf("    testll=[%lf,%lf] projll=[%lf,%lf]\n", 
 						ll_m_interp.x, ll_m_interp.y, ll_m_proj.x, ll_m_proj.y);
 				}
 			}
 
 			if(need_midpt) {
-				if(num_consec++ > 10) fatal_error("convergence error in mpoly_xy2ll_with_interp");
+				int depth = todo_depth[s_idx];
+				if(depth > 10) fatal_error("convergence error in mpoly_xy2ll_with_interp");
 
 				if(VERBOSE) {
 					printf("    xy=[%lf,%lf]:[%lf,%lf]\n", xy1.x, xy1.y, xy2.x, xy2.y);
@@ -786,65 +839,159 @@ void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler) {
 					printf("    midxy=[%lf,%lf] midll=[%lf,%lf]\n", 
 						xy_m.x, xy_m.y, ll_m_proj.x, ll_m_proj.y);
 				}
-				xy_ring.pts.insert(xy_ring.pts.begin()+v_idx+1, xy_m);
-				ll_ring.pts.insert(ll_ring.pts.begin()+v_idx+1, ll_m_proj);
-			} else {
-				v_idx++;
-				num_consec = 0;
+
+				size_t m_idx = xy_pts.size();
+				xy_pts.push_back(xy_m);
+				ll_pts.push_back(ll_m_proj);
+				next.push_back(v2_idx);
+				next[v_idx] = m_idx;
+
+				// both halves need to be checked in the next round
+				next_todo.push_back(v_idx);
+				next_todo_depth.push_back(depth+1);
+				next_todo.push_back(m_idx);
+				next_todo_depth.push_back(depth+1);
 			}
 		}
 
-		// Now reproject everything again, without using the shrink
-		// kludge.  We no longer care whether the projection is
-		// single-valued and we don't want the loss of accuracy
-		// that comes from multiplying by shrink.
-		for(size_t v_idx=0; v_idx<ll_ring.pts.size(); v_idx++) {
-			double x = xy_ring.pts[v_idx].x;
-			double y = xy_ring.pts[v_idx].y;
-
-			double lon, lat;
-			georef.xy2ll_or_die(x, y, &lon, &lat);
+		todo.swap(next_todo);
+		todo_depth.swap(next_todo_depth);
+	}
 
-			ll_ring.pts[v_idx].x = lon;
-			ll_ring.pts[v_idx].y = lat;
+	// Now reproject again, without using the shrink kludge.  We no
+	// longer care whether the projection is single-valued and we don't
+	// want the loss of accuracy that comes from multiplying by shrink.
+	// Points that weren't affected by the shrink are already done.
+	std::vector<size_t> redo;
+	for(size_t v_idx=0; v_idx<xy_pts.size(); v_idx++) {
+		if(xy_pts[v_idx].x*shrink+epsilon != xy_pts[v_idx].x) redo.push_back(v_idx);
+	}
+	if(!redo.empty()) {
+		batch_x.resize(redo.size());
+		batch_y.resize(redo.size());
+		for(size_t i=0; i<redo.size(); i++) {
+			batch_x[i] = xy_pts[redo[i]].x;
+			batch_y[i] = xy_pts[redo[i]].y;
+		}
+		georef.xy2ll_batch_or_die(redo.size(),
+			&batch_x[0], &batch_y[0], &batch_x[0], &batch_y[0]);
+		for(size_t i=0; i<redo.size(); i++) {
+			ll_pts[redo[i]] = Vertex(batch_x[i], batch_y[i]);
 		}
 	}
 
-	*this = ll_poly;
+	// the far end of the last segment belongs to the next span
+	for(size_t v_idx=0; v_idx != npts_in-1; v_idx = next[v_idx]) {
+		ll_out.push_back(ll_pts[v_idx]);
+	}
 }
 
-static std::string read_whole_file(FILE *fin) {
-	size_t chunk_size = 65536;
-	std::string accum;
-	std::string chunk(chunk_size, 0);
-	size_t num_read;
-	while(0 < (num_read = fread(&chunk[0], 1, chunk_size, fin))) {
-		accum.append(chunk, 0, num_read);
+struct RingSpan {
+	size_t r_idx;
+	size_t begin, end;
+};
+
+class ProjectRingsTask : public ParallelTask {
+public:
+	ProjectRingsTask(
+		const std::vector<GeoRef> &_georefs, const Mpoly &_xy_poly,
+		const std::vector<RingSpan> &_spans, const LlProjParams &_par
+	) :
+		georefs(_georefs), xy_poly(_xy_poly), spans(_spans), par(_par),
+		outputs(_spans.size())
+	{ }
+
+	virtual void run(size_t job_idx, size_t thread_idx) {
+		const RingSpan &span = spans[job_idx];
+		project_ring_span(georefs[thread_idx], xy_poly.rings[span.r_idx],
+			span.r_idx, span.begin, span.end, par, outputs[job_idx]);
+	}
+
+	const std::vector<GeoRef> &georefs;
+	const Mpoly &xy_poly;
+	const std::vector<RingSpan> &spans;
+	const LlProjParams &par;
+	std::vector<std::vector<Vertex> > outputs;
+};
+
+} // anonymous namespace
+
+void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler, size_t num_threads) {
+	size_t nrings = rings.size();
+	
+	double semi_major;
+	if(georef.have_semi_major) {
+		semi_major = georef.semi_major;
+	} else {
+		semi_major = 6370997.0;
+		fprintf(stderr, "Warning: could not get globe size, assuming %lf\n", semi_major);
+	}
+
+	LlProjParams par;
+	par.toler = toler;
+	par.semi_major = semi_major;
+	par.canvas_size_sq = estimate_canvas_size_sq(georef, semi_major);
+	//printf("canvas_size_sq = %lf\n", canvas_size_sq);
+
+	// FIXME - now that we don't use ll2xy this is probably not needed:
+	// This is a kludge that shrinks the canvas by a millionth of a pixel
+	// to avoid problems with images that span an entire 360 degrees of
+	// longitude.  Without this the map xy -> ll -> xy is not single-valued.
+	par.epsilon = 5e-7;
+	par.shrink = ((double)georef.w - 2.0*par.epsilon) / (double)georef.w;
+	if(!raster_wraps_around(georef)) {
+		par.epsilon = 0;
+		par.shrink = 1;
 	}
-	return accum;
-}
 
-Mpoly mpoly_from_wktfile(const std::string &fn) {
-	FILE *fh = fopen(fn.c_str(), "r");
-	if(!fh) fatal_error("cannot read file [%s]", fn.c_str());
-	std::string wkt = read_whole_file(fh);
-	fclose(fh);
-	for(size_t i=0; i<wkt.size(); i++) {
-		if(wkt[i] == '\r') wkt[i] = ' ';
-		if(wkt[i] == '\n') wkt[i] = ' ';
-		if(wkt[i] == '\t') wkt[i] = ' ';
-	}
-
-	OGRGeometryH geom;
-	char *wkt_str = strdup(wkt.c_str());
-	char *wkt_str2 = wkt_str;
-	OGRErr err = OGR_G_CreateFromWkt(&wkt_str2, NULL, &geom);
-	free(wkt_str);
-	if(OGRERR_NONE != err) {
-		fatal_error("OGR_G_CreateFromWkt failed: %d", err);
+	// Large rings are split into several spans so that the work can be
+	// spread over the threads.
+	const size_t span_size = 4096;
+	std::vector<RingSpan> spans;
+	for(size_t r_idx=0; r_idx<nrings; r_idx++) {
+		const size_t npts = rings[r_idx].pts.size();
+		for(size_t begin=0; begin<npts; begin+=span_size) {
+			RingSpan span;
+			span.r_idx = r_idx;
+			span.begin = begin;
+			span.end = std::min(npts, begin+span_size);
+			spans.push_back(span);
+		}
 	}
-	
-	return ogr_to_mpoly(geom);
+
+	num_threads = std::max(size_t(1), std::min(num_threads, spans.size()));
+	// Coordinate transformations are not thread safe, so each thread
+	// gets its own.
+	std::vector<GeoRef> georefs;
+	if(num_threads == 1) {
+		georefs.push_back(georef);
+	} else {
+		for(size_t i=0; i<num_threads; i++) {
+			georefs.push_back(georef.threadCopy());
+		}
+	}
+
+	ProjectRingsTask task(georefs, *this, spans, par);
+	run_parallel(task, spans.size(), num_threads);
+
+	if(num_threads > 1) {
+		for(size_t i=0; i<num_threads; i++) {
+			georefs[i].destroyXforms();
+		}
+	}
+
+	Mpoly ll_poly;
+	ll_poly.rings.resize(nrings);
+	for(size_t r_idx=0; r_idx<nrings; r_idx++) {
+		ll_poly.rings[r_idx] = rings[r_idx].copyMetadata();
+	}
+	for(size_t s_idx=0; s_idx<spans.size(); s_idx++) {
+		std::vector<Vertex> &pts = ll_poly.rings[spans[s_idx].r_idx].pts;
+		const std::vector<Vertex> &span_pts = task.outputs[s_idx];
+		pts.insert(pts.end(), span_pts.begin(), span_pts.end());
+	}
+
+	*this = ll_poly;
 }
 
 } // namespace dangdal
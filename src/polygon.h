@@ -129,7 +129,7 @@ public:
 
 	void xy2en(const GeoRef &georef);
 	void en2xy(const GeoRef &georef);
-	void xy2ll_with_interp(const GeoRef &georef, double toler);
+	void xy2ll_with_interp(const GeoRef &georef, double toler, size_t num_threads=1);
 
 	std::vector<Ring> rings;
 };
@@ -149,7 +149,6 @@ Vertex line_line_intersection(
 	Vertex p3, Vertex p4
 );
 RingRelation ring_ring_relation(const Ring &r1, const Ring &r2);
-Mpoly mpoly_from_wktfile(const std::string &fn);
 
 } // namespace dangdal
 
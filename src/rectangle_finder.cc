@@ -26,11 +26,15 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 
+#include <algorithm>
+
 #include "common.h"
 #include "polygon.h"
 #include "polygon-rasterizer.h"
 #include "debugplot.h"
 #include "mask.h"
+#include "rectangle_finder.h"
+#include "threads.h"
 
 namespace dangdal {
 
@@ -61,80 +65,98 @@ double ang_diff(double a1, double a2) {
 	return d<=180.0 ? d : 360.0-d;
 }
 
-Ring calc_rect4_from_convex_hull(const BitGrid &mask, int w, int h, DebugPlot *dbuf) {
-	std::vector<int> chrows_left(h);
-	std::vector<int> chrows_right(h);
-	for(int j=0; j<h; j++) {
-		chrows_left[j] = w;
-		chrows_right[j] = -1;
+struct HullPoint {
+	HullPoint() : x(0), y(0) { }
+	HullPoint(int _x, int _y) : x(_x), y(_y) { }
+	int x, y;
+};
+
+// Cross product of (a-o) and (b-o), in the coordinate order in which the
+// points are sorted (y then x).
+static inline int64_t hull_cross(const HullPoint &o, const HullPoint &a, const HullPoint &b) {
+	return int64_t(a.y-o.y)*(b.x-o.x) - int64_t(a.x-o.x)*(b.y-o.y);
+}
+
+// Monotone chain convex hull of points that are already sorted by y then x.
+// Collinear points are dropped.  The returned hull runs clockwise (as seen
+// with y pointing down) starting from the rightmost point of the top row,
+// which is the order in which the previous gift-wrapping implementation
+// visited the vertices.
+static std::vector<HullPoint> monotone_chain_hull(const std::vector<HullPoint> &pts) {
+	const size_t n = pts.size();
+	if(n < 3) return pts;
+
+	std::vector<HullPoint> hull(2*n);
+	size_t k = 0;
+	for(size_t i=0; i<n; i++) {
+		while(k >= 2 && hull_cross(hull[k-2], hull[k-1], pts[i]) <= 0) k--;
+		hull[k++] = pts[i];
 	}
-	for(int j=0; j<h; j++) {
-		int left = w;
-		int right = -1;
-		for(int i=0; i<w; i++) {
-			if(mask(i, j)) {
-				if(left > i) left = i;
-				if(right < i) right = i;
-			}
-		}
-		if(chrows_left[j] > left) chrows_left[j] = left;
-		if(chrows_right[j] < right) chrows_right[j] = right;
+	for(size_t i=n-1, t=k+1; i>0; i--) {
+		while(k >= t && hull_cross(hull[k-2], hull[k-1], pts[i-1]) <= 0) k--;
+		hull[k++] = pts[i-1];
+	}
+	hull.resize(k-1);
+
+	int64_t area2 = 0;
+	for(size_t i=0; i<hull.size(); i++) {
+		const HullPoint &p0 = hull[i];
+		const HullPoint &p1 = hull[(i+1) % hull.size()];
+		area2 += int64_t(p0.x)*p1.y - int64_t(p1.x)*p0.y;
+	}
+	if(area2 < 0) std::reverse(hull.begin(), hull.end());
+
+	size_t start = 0;
+	for(size_t i=1; i<hull.size(); i++) {
+		if(hull[i].y < hull[start].y ||
+			(hull[i].y == hull[start].y && hull[i].x > hull[start].x)) start = i;
 	}
+	std::rotate(hull.begin(), hull.begin()+start, hull.end());
+
+	return hull;
+}
 
-	int fulcrum_x=-1, fulcrum_y=-1;
+Ring calc_rect4_from_convex_hull(const BitGrid &mask, int w, int h, DebugPlot *dbuf) {
+	// Only the leftmost and rightmost pixels of each row can be on the hull.
+	// These are already sorted by y then x.
+	std::vector<HullPoint> row_extremes;
 	for(int j=0; j<h; j++) {
-		if(chrows_left[j] <= chrows_right[j]) {
-			fulcrum_x = chrows_right[j];
-			fulcrum_y = j;
-			break;
-		}
+		int left, right;
+		mask.rowExtent(j, &left, &right);
+		if(left > right) continue;
+		row_extremes.push_back(HullPoint(left, j));
+		if(right != left) row_extremes.push_back(HullPoint(right, j));
 	}
-	if(fulcrum_x<0) fatal_error("image was empty");
-	//if(VERBOSE) printf("start point: %d,%d\n", fulcrum_x, fulcrum_y);
+	if(row_extremes.empty()) fatal_error("image was empty");
+
+	std::vector<HullPoint> hull = monotone_chain_hull(row_extremes);
+	// input consists of a single point or line in this case
+	// (in other words it is zero or one dimensional)
+	if(hull.size() < 3) fatal_error("convex hull has less than three sides");
 
 	std::vector<Edge> all_edges;
 
-	int chop_dx = 1, chop_dy = 0;
-	for(;;) {
-		if(dbuf && dbuf->mode == PLOT_RECT4) dbuf->plotPointBig(fulcrum_x, fulcrum_y, 0, 255, 0);
-
-		int best_dx = -chop_dx, best_dy = -chop_dy;
-		int best_x=-1, best_y=-1;
-		for(int j=0; j<h; j++) {
-			int l = chrows_left[j];
-			int r = chrows_right[j];
-			if(l > r) continue;
-			int pix_dy = j-fulcrum_y;
-
-			for(int lr=0; lr<2; lr++) {
-				int i = lr ? r : l;
-				int pix_dx = i-fulcrum_x;
-				if(pix_dx*chop_dy >= pix_dy*chop_dx) continue;
-				if(pix_dx*best_dy <  pix_dy*best_dx) continue;
-				if(pix_dx*best_dy == pix_dy*best_dx) {
-					int pdist = pix_dx*pix_dx + pix_dy*pix_dy;
-					int bdist = best_dx*best_dx + best_dy*best_dy;
-					if(pdist < bdist) continue;
-				}
-				//if(VERBOSE) printf("%d %d   %.15f\n", i, j, atan2((double)pix_dy, (double)pix_dx)*180.0/M_PI);
-				best_dx = pix_dx; best_dy = pix_dy;
-				best_x = i; best_y = j;
-			}
-		}
-		//if(VERBOSE) printf("  f=[%3d,%3d] ", best_x, best_y);
-		//if(VERBOSE) printf("  a=[% 3.1f]\n", angle);
+	// Walk around the hull, stopping once the edges have come back up to
+	// the top.  If the top of the hull is a single point, the first edge
+	// gets visited twice.
+	int chop_dy = 0;
+	for(size_t i=0; ; i++) {
+		if(i > hull.size()) fatal_error("could not find new fulcrum");
+
+		const HullPoint &p0 = hull[i % hull.size()];
+		const HullPoint &p1 = hull[(i+1) % hull.size()];
+		if(dbuf && dbuf->mode == PLOT_RECT4) dbuf->plotPointBig(p0.x, p0.y, 0, 255, 0);
 
 		Edge new_edge;
-		new_edge.p0.x = fulcrum_x;
-		new_edge.p0.y = fulcrum_y;
-		new_edge.p1.x = best_x;
-		new_edge.p1.y = best_y;
+		new_edge.p0.x = p0.x;
+		new_edge.p0.y = p0.y;
+		new_edge.p1.x = p1.x;
+		new_edge.p1.y = p1.y;
 		all_edges.push_back(new_edge);
 
-		if(best_x<0) fatal_error("could not find new fulcrum");
-		fulcrum_x = best_x; fulcrum_y = best_y;
+		int best_dy = p1.y - p0.y;
 		if(chop_dy < 0 && best_dy >= 0) break;
-		chop_dx = best_dx; chop_dy = best_dy;
+		chop_dy = best_dy;
 	}
 
 	const size_t num_edges = all_edges.size();
@@ -149,10 +171,6 @@ Ring calc_rect4_from_convex_hull(const BitGrid &mask, int w, int h, DebugPlot *d
 		all_edges[i] = e;
 	}
 
-	// input consists of a single point or line in this case
-	// (in other words it is zero or one dimensional)
-	if(num_edges < 3) fatal_error("convex hull has less than three sides");
-
 	int num_groups = 0;
 	all_edges[0].group = (num_groups++);
 	for(size_t i=0; i<num_edges; i++) {
@@ -323,33 +341,151 @@ Ring calc_rect4_from_convex_hull(const BitGrid &mask, int w, int h, DebugPlot *d
 //	return v;
 //}
 
-static int ringdiff(const Ring &r1, const Ring &r2, const BitGrid &mask) {
-	Mpoly mp1, mp2;
-	mp1.rings.push_back(r1);
-	mp2.rings.push_back(r2);
+static inline int popcount64(uint64_t v) {
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return int((v * 0x0101010101010101ULL) >> 56);
+}
 
-	Bbox bb = box_union(r1.getBbox(), r2.getBbox());
-	//int min_x = (int)floor(bb.min_x);
-	int min_y = (int)floor(bb.min_y);
-	int max_x = (int)ceil (bb.max_x);
-	int max_y = (int)ceil (bb.max_y);
+// Row-wise prefix counts of the set pixels in a mask, so that the number of
+// set pixels in any span of a row can be had in constant time.  Each row is
+// repacked into 64-bit words, and the count of set pixels before each word is
+// stored alongside.
+class MaskRowCounts {
+public:
+	MaskRowCounts(const BitGrid &mask, int _w, int _h, size_t num_threads) :
+		w(_w), h(_h),
+		words_per_row((size_t(w)+63)/64),
+		bits(words_per_row * h),
+		counts(words_per_row * h)
+	{
+		BuildTask task(*this, mask);
+		run_parallel(task, h, num_threads);
+	}
 
-	std::vector<row_crossings_t> rcs1 = get_row_crossings(mp1, min_y, max_y-min_y+1);
-	std::vector<row_crossings_t> rcs2 = get_row_crossings(mp2, min_y, max_y-min_y+1);
+	// Number of set pixels in row y with x0 <= x < x1.  Pixels outside of
+	// the mask count as unset.
+	int countSpan(int y, int x0, int x1) const {
+		if(y < 0 || y >= h) return 0;
+		x0 = std::max(0, std::min(w, x0));
+		x1 = std::max(0, std::min(w, x1));
+		if(x1 <= x0) return 0;
+		return countBefore(y, x1) - countBefore(y, x0);
+	}
+
+private:
+	int countBefore(int y, int x) const {
+		size_t word = size_t(x) / 64;
+		int bit = x & 63;
+		if(word == words_per_row) return counts[(y+1)*words_per_row - 1] +
+			popcount64(bits[(y+1)*words_per_row - 1]);
+		size_t idx = y*words_per_row + word;
+		int c = counts[idx];
+		if(bit) c += popcount64(bits[idx] & ((uint64_t(1) << bit) - 1));
+		return c;
+	}
+
+	class BuildTask : public ParallelTask {
+	public:
+		BuildTask(MaskRowCounts &_rc, const BitGrid &_mask) : rc(_rc), mask(_mask) { }
+
+		virtual void run(size_t y, size_t) {
+			uint64_t *row_bits = &rc.bits[y*rc.words_per_row];
+			int *row_counts = &rc.counts[y*rc.words_per_row];
+			int accum = 0;
+			for(size_t word=0; word<rc.words_per_row; word++) {
+				uint64_t v = 0;
+				int x0 = int(word*64);
+				int x1 = std::min(rc.w, x0+64);
+				for(int x=x0; x<x1; x++) {
+					if(mask(x, y)) v |= uint64_t(1) << (x-x0);
+				}
+				row_bits[word] = v;
+				row_counts[word] = accum;
+				accum += popcount64(v);
+			}
+		}
+
+	private:
+		MaskRowCounts &rc;
+		const BitGrid &mask;
+	};
+
+	int w, h;
+	size_t words_per_row;
+	std::vector<uint64_t> bits;
+	std::vector<int> counts;
+};
+
+// The rows of pixels that are entirely contained within a ring, as computed by
+// RowCrossingsScanner but stored flat so that no allocation is needed once the
+// buffers have grown.  The annealer computes these tens of
+// thousands of times.
+class RingSpans {
+public:
+	RingSpans() : min_y(0), num_rows(0), max_x(0) { }
+
+	void compute(const Ring &ring) {
+		Bbox bb = ring.getBbox();
+		min_y = (int)floor(bb.min_y);
+		num_rows = (int)ceil(bb.max_y) - min_y + 1;
+		max_x = (int)ceil(bb.max_x);
+
+		scanner.clear();
+		scanner.addRing(ring);
+
+		row_start.resize(num_rows+1);
+		spans.clear();
+		for(int row=0; row<num_rows; row++) {
+			row_start[row] = spans.size();
+			const row_crossings_t &r = scanner.getRow(min_y + row);
+			spans.insert(spans.end(), r.begin(), r.end());
+		}
+		row_start[num_rows] = spans.size();
+	}
+
+	// Returns the number of crossings in row y, with *row pointing to them.
+	size_t getRow(int y, const int **row) const {
+		int r = y - min_y;
+		if(r < 0 || r >= num_rows) return 0;
+		if(row_start[r+1] == row_start[r]) return 0;
+		*row = &spans[0] + row_start[r];
+		return row_start[r+1] - row_start[r];
+	}
+
+	int min_y, num_rows, max_x;
+
+private:
+	std::vector<size_t> row_start;
+	std::vector<int> spans;
+	RowCrossingsScanner scanner;
+};
+
+// Positive if r2 is a better fit to the mask than r1.
+static int ringdiff(
+	const RingSpans &rs1, const RingSpans &rs2, const MaskRowCounts &row_counts,
+	const FuzzyMatchParams &params
+) {
+	int min_y = std::min(rs1.min_y, rs2.min_y);
+	int max_y = std::max(rs1.min_y + rs1.num_rows, rs2.min_y + rs2.num_rows) - 1;
+	int max_x = std::max(rs1.max_x, rs2.max_x);
+
+	const int gain = params.gain;
+	const int penalty = params.penalty;
 
 	int tally = 0;
 	for(int y=min_y; y<=max_y; y++) {
-		const row_crossings_t &row1 = rcs1[y - min_y];
-		const row_crossings_t &row2 = rcs2[y - min_y];
+		const int *row1 = NULL;
+		const int *row2 = NULL;
+		size_t n1 = rs1.getRow(y, &row1);
+		size_t n2 = rs2.getRow(y, &row2);
 
 		bool in1=0, in2=0;
 		size_t ci1=0, ci2=0;
 		for(;;) {
-			int cx1 = ci1 < row1.size() ? row1[ci1] : max_x+1;
-			int cx2 = ci2 < row2.size() ? row2[ci2] : max_x+1;
-			// FIXME
-			//if(cx1 > max_x+1 || cx2 > max_x+1) fatal_error("cx > max_x+1 (%d,%d,%d)", cx1, cx2, max_x+1);
-			//if(cx1 == max_x+1 && cx2 == max_x+1) break;
+			int cx1 = ci1 < n1 ? row1[ci1] : max_x+1;
+			int cx2 = ci2 < n2 ? row2[ci2] : max_x+1;
 			if(cx1 >= max_x+1 && cx2 >= max_x+1) break;
 
 			int x_from = std::min(cx1, cx2);
@@ -363,27 +499,18 @@ static int ringdiff(const Ring &r1, const Ring &r2, const BitGrid &mask) {
 
 			if((in1 && in2) || (!in1 && !in2)) continue;
 
-			cx1 = ci1 < row1.size() ? row1[ci1] : max_x+1;
-			cx2 = ci2 < row2.size() ? row2[ci2] : max_x+1;
+			cx1 = ci1 < n1 ? row1[ci1] : max_x+1;
+			cx2 = ci2 < n2 ? row2[ci2] : max_x+1;
 			int x_to = std::min(cx1, cx2);
-			
-			int gain=1, penalty=2; // FIXME - arbitrary
-			for(int x=x_from; x<x_to; x++) {
-				uint8_t m = mask(x, y) ? 1 : 0;
-				if(in1) tally += m ? -penalty : gain;
-				if(in2) tally += m ? gain : -penalty;
-			}
+			if(x_to <= x_from) continue;
+
+			int num_set = row_counts.countSpan(y, x_from, x_to);
+			int num_unset = x_to - x_from - num_set;
+			// pixels only in r1 are excluded by r2, pixels only in r2 are
+			// included by r2
+			if(in1) tally += num_unset*gain - num_set*penalty;
+			if(in2) tally += num_set*gain - num_unset*penalty;
 		}
-
-		//for(int x=min_x; x<=max_x; x++) {
-		//	int in1 = is_in_crossings(row1, x);
-		//	int in2 = is_in_crossings(row2, x);
-		//	if((in1 && !in2) || (in2 && !in1)) {
-		//		uint8_t m = mask(x, y) ? 1 : 0;
-		//		if(in1) tally += m ? -1 :  1;
-		//		if(in2) tally += m ?  1 : -1;
-		//	}
-		//}
 	}
 	return tally;
 }
@@ -470,29 +597,90 @@ static ring_t anneal(ring_t *input, int recurse, const BitGrid &mask, int w, int
 }
 */
 
-static Ring anneal(const Ring &input, const BitGrid &mask) {
+class ScoreCandidatesTask : public ParallelTask {
+public:
+	ScoreCandidatesTask(
+		const RingSpans &_best_spans, const std::vector<Ring> &_candidates,
+		std::vector<RingSpans> &_candidate_spans,
+		const MaskRowCounts &_row_counts, const FuzzyMatchParams &_params
+	) :
+		best_spans(_best_spans), candidates(_candidates),
+		candidate_spans(_candidate_spans),
+		row_counts(_row_counts), params(_params),
+		scores(_candidates.size())
+	{ }
+
+	virtual void run(size_t job_idx, size_t) {
+		candidate_spans[job_idx].compute(candidates[job_idx]);
+		scores[job_idx] = ringdiff(best_spans, candidate_spans[job_idx], row_counts, params);
+	}
+
+private:
+	const RingSpans &best_spans;
+	const std::vector<Ring> &candidates;
+	std::vector<RingSpans> &candidate_spans;
+	const MaskRowCounts &row_counts;
+	const FuzzyMatchParams &params;
+
+public:
+	std::vector<int> scores;
+};
+
+// Each round generates a batch of perturbations from the current best ring and
+// scores them in parallel.  The batch size is fixed (rather than depending on
+// the number of threads) so that results are repeatable.  The perturbation
+// size decays per round (i.e. per accept/reject step) at the rate the
+// original one-candidate-per-iteration annealer used.  params.iterations
+// still counts candidates, so there are iterations/16 rounds.
+static const size_t ANNEAL_BATCH_SIZE = 16;
+
+static Ring anneal(
+	const Ring &input, const MaskRowCounts &row_counts,
+	const FuzzyMatchParams &params
+) {
 	Ring best = input;
-	Ring pert = input;
+	RingSpans best_spans;
+	best_spans.compute(best);
+	std::vector<Ring> candidates(ANNEAL_BATCH_SIZE, input);
+	std::vector<RingSpans> candidate_spans(ANNEAL_BATCH_SIZE);
+
+	int num_rounds = (params.iterations + ANNEAL_BATCH_SIZE - 1) / ANNEAL_BATCH_SIZE;
+	for(int round_idx=0; round_idx<num_rounds; round_idx++) {
+		int amt = (int)ceil(params.max_perturb * exp(-round_idx / 50.0)); // FIXME - arbitrary
+		for(size_t i=0; i<ANNEAL_BATCH_SIZE; i++) {
+			perturb(best, candidates[i], amt);
+		}
 
-	for(int iter=0; iter<10000; iter++) { // FIXME - arbitrary
-		int amt = (int)ceil(200.0 * exp(-iter / 50.0)); // FIXME - arbitrary
-		perturb(best, pert, amt);
-		int diff = ringdiff(best, pert, mask);
-		if(diff > 0) {
-			// swap best and pert
-			Ring t = best; best = pert; pert = t;
+		ScoreCandidatesTask task(best_spans, candidates, candidate_spans, row_counts, params);
+		run_parallel(task, ANNEAL_BATCH_SIZE, params.num_threads);
+
+		int best_score = 0;
+		int best_idx = -1;
+		for(size_t i=0; i<ANNEAL_BATCH_SIZE; i++) {
+			if(task.scores[i] > best_score) {
+				best_score = task.scores[i];
+				best_idx = int(i);
+			}
+		}
+		if(best_idx >= 0) {
+			best = candidates[best_idx];
+			std::swap(best_spans, candidate_spans[best_idx]);
 		}
 	}
 
 	return best;
 }
 
-Ring calc_rect4_from_mask(const BitGrid &mask, int w, int h, DebugPlot *dbuf, bool use_ai) {
+Ring calc_rect4_from_mask(
+	const BitGrid &mask, int w, int h, DebugPlot *dbuf, bool use_ai,
+	const FuzzyMatchParams &fuzzy_params
+) {
 	Ring best = calc_rect4_from_convex_hull(mask, w, h, dbuf);
 	if(best.pts.size() == 0) return best;
 
 	if(use_ai) {
-		best = anneal(best, mask);
+		MaskRowCounts row_counts(mask, w, h, fuzzy_params.num_threads);
+		best = anneal(best, row_counts, fuzzy_params);
 
 		if(dbuf && dbuf->mode == PLOT_RECT4) {
 			for(size_t i=0; i<best.pts.size(); i++) {
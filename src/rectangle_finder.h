@@ -32,7 +32,32 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 namespace dangdal {
 
-Ring calc_rect4_from_mask(const BitGrid &mask, int w, int h, DebugPlot *dbuf, bool use_ai);
+// Tuning for the fuzzy match (use_ai) mode, which anneals the convex hull
+// rectangle to trade off excluded data pixels against included NDV pixels.
+struct FuzzyMatchParams {
+	FuzzyMatchParams() :
+		iterations(10000), max_perturb(200),
+		gain(1), penalty(2), num_threads(1)
+	{ }
+
+	// number of candidate rectangles to try
+	int iterations;
+	// initial size of random perturbations, in pixels
+	double max_perturb;
+	// When comparing two candidates: score for each pixel the new one
+	// classifies correctly and the old one didn't (an NDV pixel left out
+	// or a data pixel taken in)
+	int gain;
+	// ... and cost for each pixel the new one gets wrong and the old one
+	// didn't (a data pixel left out or an NDV pixel taken in)
+	int penalty;
+	size_t num_threads;
+};
+
+Ring calc_rect4_from_mask(
+	const BitGrid &mask, int w, int h, DebugPlot *dbuf, bool use_ai,
+	const FuzzyMatchParams &fuzzy_params = FuzzyMatchParams()
+);
 
 } // namespace dangdal
 
@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "common.h"
+#include "polygon.h"
+#include "segment-index.h"
+
+namespace dangdal {
+
+SegmentIndex::SegmentIndex(const Bbox &bbox, size_t num_pts) :
+	min_x(0), min_y(0), cell_size(1),
+	num_x(1), num_y(1)
+{
+	// limit on the number of cells along each axis, to bound memory usage
+	const int max_cells_per_axis = 1024;
+
+	if(!bbox.empty) {
+		min_x = bbox.min_x;
+		min_y = bbox.min_y;
+		double w = bbox.max_x - bbox.min_x;
+		double h = bbox.max_y - bbox.min_y;
+		// aim for a couple of vertices per cell
+		double target_cells = std::max(1.0, num_pts / 2.0);
+		cell_size = std::max(
+			sqrt(w * h / target_cells),
+			std::max(w, h) / max_cells_per_axis);
+		if(cell_size <= 0) cell_size = 1;
+		num_x = std::max(1, std::min(max_cells_per_axis, 1 + (int)(w / cell_size)));
+		num_y = std::max(1, std::min(max_cells_per_axis, 1 + (int)(h / cell_size)));
+	}
+
+	cells.resize(size_t(num_x) * size_t(num_y));
+}
+
+// Cells touched by a segment.  For each row of cells, only the span of columns
+// actually crossed by the segment is taken (padded slightly for roundoff).
+void SegmentIndex::getCells(const Vertex &a, const Vertex &b, std::vector<size_t> &out) const {
+	out.clear();
+
+	const int cx0 = cellX(std::min(a.x, b.x));
+	const int cx1 = cellX(std::max(a.x, b.x));
+	const int cy0 = cellY(std::min(a.y, b.y));
+	const int cy1 = cellY(std::max(a.y, b.y));
+
+	if(cx0 == cx1 || cy0 == cy1) {
+		for(int cy=cy0; cy<=cy1; cy++) {
+			for(int cx=cx0; cx<=cx1; cx++) {
+				out.push_back(size_t(cy) * num_x + cx);
+			}
+		}
+		return;
+	}
+
+	const double pad = cell_size * 1e-6;
+	const double slope = (b.x - a.x) / (b.y - a.y);
+	const double seg_min_y = std::min(a.y, b.y);
+	const double seg_max_y = std::max(a.y, b.y);
+	for(int cy=cy0; cy<=cy1; cy++) {
+		double row_y0 = std::max(seg_min_y, min_y + cell_size * cy);
+		double row_y1 = std::min(seg_max_y, min_y + cell_size * (cy+1));
+		double x0 = a.x + (row_y0 - a.y) * slope;
+		double x1 = a.x + (row_y1 - a.y) * slope;
+		int row_cx0 = std::max(cx0, cellX(std::min(x0, x1) - pad));
+		int row_cx1 = std::min(cx1, cellX(std::max(x0, x1) + pad));
+		for(int cx=row_cx0; cx<=row_cx1; cx++) {
+			out.push_back(size_t(cy) * num_x + cx);
+		}
+	}
+}
+
+void SegmentIndex::insert(SegRef ref, const Vertex &a, const Vertex &b) {
+	getCells(a, b, cell_buf);
+	for(size_t i=0; i<cell_buf.size(); i++) {
+		cells[cell_buf[i]].push_back(ref);
+	}
+}
+
+void SegmentIndex::remove(SegRef ref, const Vertex &a, const Vertex &b) {
+	getCells(a, b, cell_buf);
+	for(size_t i=0; i<cell_buf.size(); i++) {
+		std::vector<SegRef> &cell = cells[cell_buf[i]];
+		std::vector<SegRef>::iterator it = std::find(cell.begin(), cell.end(), ref);
+		if(it == cell.end()) fatal_error("segment missing from segment index");
+		*it = cell.back();
+		cell.pop_back();
+	}
+}
+
+void SegmentIndex::collect(std::vector<SegRef> &out) const {
+	out.clear();
+	for(size_t i=0; i<cell_buf.size(); i++) {
+		const std::vector<SegRef> &cell = cells[cell_buf[i]];
+		out.insert(out.end(), cell.begin(), cell.end());
+	}
+	std::sort(out.begin(), out.end());
+	out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
+void SegmentIndex::findNearSegment(
+	const Vertex &a, const Vertex &b, std::vector<SegRef> &out
+) const {
+	getCells(a, b, cell_buf);
+	collect(out);
+}
+
+void SegmentIndex::findInBbox(const Bbox &bbox, std::vector<SegRef> &out) const {
+	cell_buf.clear();
+	if(!bbox.empty) {
+		const int cx0 = cellX(bbox.min_x);
+		const int cx1 = cellX(bbox.max_x);
+		const int cy0 = cellY(bbox.min_y);
+		const int cy1 = cellY(bbox.max_y);
+		for(int cy=cy0; cy<=cy1; cy++) {
+			for(int cx=cx0; cx<=cx1; cx++) {
+				cell_buf.push_back(size_t(cy) * num_x + cx);
+			}
+		}
+	}
+	collect(out);
+}
+
+} // namespace dangdal
@@ -0,0 +1,101 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+#ifndef DANGDAL_SEGMENT_INDEX_H
+#define DANGDAL_SEGMENT_INDEX_H
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "polygon.h"
+
+namespace dangdal {
+
+// Identifies a line segment: the ring it belongs to and its index within
+// that ring (what the index means is up to the caller).
+struct SegRef {
+	SegRef() : ring(0), seg(0) { }
+	SegRef(size_t _ring, size_t _seg) : ring(_ring), seg(_seg) { }
+
+	bool operator<(const SegRef &other) const {
+		return ring < other.ring || (ring == other.ring && seg < other.seg);
+	}
+	bool operator==(const SegRef &other) const {
+		return ring == other.ring && seg == other.seg;
+	}
+
+	size_t ring;
+	size_t seg;
+};
+
+// Uniform grid of cells, each holding the segments that pass through it.  Two
+// segments can only cross if they share a cell, so this turns all-pairs
+// crossing tests into tests against just the neighbors of a segment.
+//
+// The index doesn't store coordinates, so the caller must pass the same
+// endpoints to remove() as were passed to insert().  Lookups use a scratch
+// buffer, so an index must not be shared between threads.
+class SegmentIndex {
+public:
+	// bbox should cover everything that will be inserted.  num_pts, the
+	// number of vertices in the finest geometry that will be inserted,
+	// determines the size of the cells.
+	SegmentIndex(const Bbox &bbox, size_t num_pts);
+
+	void insert(SegRef ref, const Vertex &a, const Vertex &b);
+	void remove(SegRef ref, const Vertex &a, const Vertex &b);
+
+	// Sorted list of all segments sharing a cell with the segment a-b.
+	void findNearSegment(const Vertex &a, const Vertex &b, std::vector<SegRef> &out) const;
+	// Sorted list of all segments passing through the cells covered by bbox.
+	void findInBbox(const Bbox &bbox, std::vector<SegRef> &out) const;
+
+private:
+	void getCells(const Vertex &a, const Vertex &b, std::vector<size_t> &out) const;
+	void collect(std::vector<SegRef> &out) const;
+
+	int cellX(double x) const {
+		int cx = (int)floor((x - min_x) / cell_size);
+		return std::max(0, std::min(num_x-1, cx));
+	}
+
+	int cellY(double y) const {
+		int cy = (int)floor((y - min_y) / cell_size);
+		return std::max(0, std::min(num_y-1, cy));
+	}
+
+	double min_x, min_y, cell_size;
+	int num_x, num_y;
+	std::vector<std::vector<SegRef> > cells;
+	mutable std::vector<size_t> cell_buf;
+};
+
+} // namespace dangdal
+
+#endif // ifndef DANGDAL_SEGMENT_INDEX_H
@@ -0,0 +1,108 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+#include <vector>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "common.h"
+#include "threads.h"
+
+namespace dangdal {
+
+namespace {
+
+struct JobQueue {
+	ParallelTask *task;
+	size_t num_jobs;
+	size_t next_job;
+	pthread_mutex_t mutex;
+};
+
+struct WorkerArgs {
+	JobQueue *queue;
+	size_t thread_idx;
+};
+
+void *worker_main(void *arg) {
+	WorkerArgs *wa = static_cast<WorkerArgs *>(arg);
+	JobQueue *queue = wa->queue;
+	for(;;) {
+		size_t job_idx;
+		{
+			ScopedLock lock(queue->mutex);
+			if(queue->next_job == queue->num_jobs) break;
+			job_idx = queue->next_job++;
+		}
+		queue->task->run(job_idx, wa->thread_idx);
+	}
+	return NULL;
+}
+
+} // anonymous namespace
+
+void run_parallel(ParallelTask &task, size_t num_jobs, size_t num_threads) {
+	num_threads = std::min(num_threads, num_jobs);
+
+	if(num_threads <= 1) {
+		for(size_t i=0; i<num_jobs; i++) task.run(i, 0);
+		return;
+	}
+
+	JobQueue queue;
+	queue.task = &task;
+	queue.num_jobs = num_jobs;
+	queue.next_job = 0;
+	pthread_mutex_init(&queue.mutex, NULL);
+
+	std::vector<WorkerArgs> args(num_threads);
+	std::vector<pthread_t> threads(num_threads);
+	for(size_t i=0; i<num_threads; i++) {
+		args[i].queue = &queue;
+		args[i].thread_idx = i;
+		if(pthread_create(&threads[i], NULL, worker_main, &args[i])) {
+			fatal_error("could not create thread");
+		}
+	}
+	for(size_t i=0; i<num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&queue.mutex);
+}
+
+size_t get_num_cpus() {
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n > 0) return n;
+#endif
+	return 1;
+}
+
+} // namespace dangdal
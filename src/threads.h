@@ -0,0 +1,73 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+#ifndef DANGDAL_THREADS_H
+#define DANGDAL_THREADS_H
+
+#include <pthread.h>
+
+#include "common.h"
+
+namespace dangdal {
+
+// A unit of work for run_parallel.  run() is called once for each job, from
+// one of the worker threads.  thread_idx can be used to index per-thread
+// state (scratch buffers, coordinate transforms, etc.).
+class ParallelTask {
+public:
+	virtual ~ParallelTask() { }
+	virtual void run(size_t job_idx, size_t thread_idx) = 0;
+};
+
+// Runs jobs [0, num_jobs) over at most num_threads threads and waits for
+// them to finish.  Jobs are handed out in order, but may complete in any
+// order.  With one thread (or one job) everything runs in the calling
+// thread.
+void run_parallel(ParallelTask &task, size_t num_jobs, size_t num_threads);
+
+// Number of online processors, or 1 if this can't be determined.
+size_t get_num_cpus();
+
+class ScopedLock {
+public:
+	explicit ScopedLock(pthread_mutex_t &_mutex) : mutex(_mutex) {
+		pthread_mutex_lock(&mutex);
+	}
+	~ScopedLock() {
+		pthread_mutex_unlock(&mutex);
+	}
+private:
+	ScopedLock(const ScopedLock &);
+	ScopedLock &operator=(const ScopedLock &);
+
+	pthread_mutex_t &mutex;
+};
+
+} // namespace dangdal
+
+#endif // ifndef DANGDAL_THREADS_H
@@ -0,0 +1,275 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+#include <vector>
+#include <queue>
+
+#include "common.h"
+#include "polygon.h"
+#include "dp.h"
+#include "segment-index.h"
+#include "vw.h"
+
+namespace dangdal {
+
+namespace {
+
+struct HeapEntry {
+	HeapEntry(double _area, size_t _ring, size_t _idx, uint32_t _stamp) :
+		area(_area), ring(_ring), idx(_idx), stamp(_stamp) { }
+
+	// reversed, so that std::priority_queue gives the smallest area first
+	bool operator<(const HeapEntry &other) const {
+		return area > other.area;
+	}
+
+	double area;
+	size_t ring;
+	size_t idx;
+	// heap entries are not removed when a vertex's area changes, rather they
+	// are ignored if this doesn't match the vertex's current stamp
+	uint32_t stamp;
+};
+
+// The remaining vertices of a ring, as a doubly linked list.  Segment number i
+// of a ring (in the SegmentIndex) is the one going from vertex i to next[i].
+struct VwRing {
+	std::vector<size_t> prev;
+	std::vector<size_t> next;
+	std::vector<uint32_t> stamp;
+	std::vector<bool> removed;
+	size_t num_live;
+};
+
+inline double triangle_area(const Vertex &a, const Vertex &b, const Vertex &c) {
+	return fabs((b.x-a.x)*(c.y-a.y) - (c.x-a.x)*(b.y-a.y)) / 2.0;
+}
+
+inline double orient(const Vertex &a, const Vertex &b, const Vertex &c) {
+	return (b.x-a.x)*(c.y-a.y) - (c.x-a.x)*(b.y-a.y);
+}
+
+// true if v is inside of, or on the border of, triangle abc
+bool triangle_contains(const Vertex &a, const Vertex &b, const Vertex &c, const Vertex &v) {
+	double o1 = orient(a, b, v);
+	double o2 = orient(b, c, v);
+	double o3 = orient(c, a, v);
+	bool has_neg = o1 < 0 || o2 < 0 || o3 < 0;
+	bool has_pos = o1 > 0 || o2 > 0 || o3 > 0;
+	return !(has_neg && has_pos);
+}
+
+// true if segment a-q, which shares endpoint a with segment a-c, doubles back
+// along it
+bool overlaps_adjacent(const Vertex &a, const Vertex &c, const Vertex &q) {
+	return orient(a, c, q) == 0 &&
+		(c.x-a.x)*(q.x-a.x) + (c.y-a.y)*(q.y-a.y) > 0;
+}
+
+class VwSimplifier {
+public:
+	VwSimplifier(const Mpoly &_mpoly, double _min_area);
+	std::vector<ReducedRing> run();
+
+private:
+	const Vertex &pt(size_t r_idx, size_t v_idx) const {
+		return mpoly.rings[r_idx].pts[v_idx];
+	}
+	void pushVertex(size_t r_idx, size_t v_idx);
+	bool canRemove(size_t r_idx, size_t v_idx);
+	void removeVertex(size_t r_idx, size_t v_idx);
+
+	const Mpoly &mpoly;
+	const double min_area;
+	std::vector<VwRing> rings;
+	SegmentIndex seg_index;
+	std::priority_queue<HeapEntry> heap;
+	std::vector<SegRef> candidates;
+};
+
+size_t total_num_pts(const Mpoly &mpoly) {
+	size_t num_pts = 0;
+	for(size_t r_idx=0; r_idx<mpoly.rings.size(); r_idx++) {
+		num_pts += mpoly.rings[r_idx].pts.size();
+	}
+	return num_pts;
+}
+
+VwSimplifier::VwSimplifier(const Mpoly &_mpoly, double _min_area) :
+	mpoly(_mpoly),
+	min_area(_min_area),
+	rings(_mpoly.rings.size()),
+	seg_index(_mpoly.getBbox(), total_num_pts(_mpoly))
+{
+	for(size_t r_idx=0; r_idx<mpoly.rings.size(); r_idx++) {
+		const size_t npts = mpoly.rings[r_idx].pts.size();
+		VwRing &ring = rings[r_idx];
+		ring.prev.resize(npts);
+		ring.next.resize(npts);
+		ring.stamp.resize(npts, 0);
+		ring.removed.resize(npts, false);
+		ring.num_live = npts;
+		for(size_t v_idx=0; v_idx<npts; v_idx++) {
+			ring.prev[v_idx] = (v_idx + npts - 1) % npts;
+			ring.next[v_idx] = (v_idx + 1) % npts;
+			seg_index.insert(SegRef(r_idx, v_idx),
+				pt(r_idx, v_idx), pt(r_idx, ring.next[v_idx]));
+		}
+		// a triangle can't be simplified further
+		if(npts > 3) {
+			for(size_t v_idx=0; v_idx<npts; v_idx++) {
+				pushVertex(r_idx, v_idx);
+			}
+		}
+	}
+}
+
+void VwSimplifier::pushVertex(size_t r_idx, size_t v_idx) {
+	VwRing &ring = rings[r_idx];
+	double area = triangle_area(
+		pt(r_idx, ring.prev[v_idx]), pt(r_idx, v_idx), pt(r_idx, ring.next[v_idx]));
+	ring.stamp[v_idx]++;
+	if(area < min_area) {
+		heap.push(HeapEntry(area, r_idx, v_idx, ring.stamp[v_idx]));
+	}
+}
+
+// Removing vertex b replaces segments a-b and b-c with a-c.  This is safe as
+// long as no other vertex lies in triangle abc and no segment crosses a-c.
+bool VwSimplifier::canRemove(size_t r_idx, size_t v_idx) {
+	const VwRing &ring = rings[r_idx];
+	const size_t p_idx = ring.prev[v_idx];
+	const size_t n_idx = ring.next[v_idx];
+	const Vertex &a = pt(r_idx, p_idx);
+	const Vertex &b = pt(r_idx, v_idx);
+	const Vertex &c = pt(r_idx, n_idx);
+
+	Bbox tri_bbox;
+	tri_bbox.expand(a);
+	tri_bbox.expand(b);
+	tri_bbox.expand(c);
+	// Every live vertex is the start of a segment in the index, and is in
+	// one of the cells of that segment.
+	seg_index.findInBbox(tri_bbox, candidates);
+	for(size_t i=0; i<candidates.size(); i++) {
+		const SegRef &ref = candidates[i];
+		if(ref.ring == r_idx && (ref.seg == p_idx || ref.seg == v_idx || ref.seg == n_idx)) continue;
+		if(triangle_contains(a, b, c, pt(ref.ring, ref.seg))) return false;
+	}
+
+	seg_index.findNearSegment(a, c, candidates);
+	for(size_t i=0; i<candidates.size(); i++) {
+		const SegRef &ref = candidates[i];
+		const VwRing &ring2 = rings[ref.ring];
+		const Vertex &v1 = pt(ref.ring, ref.seg);
+		const Vertex &v2 = pt(ref.ring, ring2.next[ref.seg]);
+		if(ref.ring == r_idx) {
+			// the two segments being replaced
+			if(ref.seg == p_idx || ref.seg == v_idx) continue;
+			// neighboring segments share an endpoint with a-c
+			if(ref.seg == ring.prev[p_idx]) {
+				if(overlaps_adjacent(a, c, v1)) return false;
+				continue;
+			}
+			if(ref.seg == n_idx) {
+				if(overlaps_adjacent(c, a, v2)) return false;
+				continue;
+			}
+		}
+		if(line_intersects_line(a, c, v1, v2, false)) return false;
+	}
+
+	return true;
+}
+
+void VwSimplifier::removeVertex(size_t r_idx, size_t v_idx) {
+	VwRing &ring = rings[r_idx];
+	const size_t p_idx = ring.prev[v_idx];
+	const size_t n_idx = ring.next[v_idx];
+
+	seg_index.remove(SegRef(r_idx, p_idx), pt(r_idx, p_idx), pt(r_idx, v_idx));
+	seg_index.remove(SegRef(r_idx, v_idx), pt(r_idx, v_idx), pt(r_idx, n_idx));
+	seg_index.insert(SegRef(r_idx, p_idx), pt(r_idx, p_idx), pt(r_idx, n_idx));
+
+	ring.next[p_idx] = n_idx;
+	ring.prev[n_idx] = p_idx;
+	ring.removed[v_idx] = true;
+	ring.stamp[v_idx]++;
+	ring.num_live--;
+
+	if(ring.num_live > 3) {
+		pushVertex(r_idx, p_idx);
+		pushVertex(r_idx, n_idx);
+	}
+}
+
+std::vector<ReducedRing> VwSimplifier::run() {
+	while(!heap.empty()) {
+		HeapEntry e = heap.top();
+		heap.pop();
+
+		VwRing &ring = rings[e.ring];
+		if(ring.removed[e.idx] || ring.stamp[e.idx] != e.stamp) continue;
+		if(ring.num_live <= 3) continue;
+		// If blocked, the vertex stays unless a neighbor is removed later,
+		// which puts it back on the heap.
+		if(!canRemove(e.ring, e.idx)) continue;
+		removeVertex(e.ring, e.idx);
+	}
+
+	// express the result in the form used by the DP code
+	std::vector<ReducedRing> reduced_rings(rings.size());
+	for(size_t r_idx=0; r_idx<rings.size(); r_idx++) {
+		const VwRing &ring = rings[r_idx];
+		std::vector<segment_t> &segs = reduced_rings[r_idx].segs;
+		segs.reserve(ring.num_live);
+		for(size_t v_idx=0; v_idx<ring.removed.size(); v_idx++) {
+			if(!ring.removed[v_idx]) {
+				segs.push_back(segment_t(v_idx, ring.next[v_idx]));
+			}
+		}
+	}
+	return reduced_rings;
+}
+
+} // anonymous namespace
+
+Mpoly compute_vw_reduced_pointset(const Mpoly &in_mpoly, double min_area) {
+	if(VERBOSE) printf("reducing (Visvalingam-Whyatt)...\n");
+
+	if(!in_mpoly.rings.size()) {
+		return Mpoly();
+	}
+
+	VwSimplifier simplifier(in_mpoly, min_area);
+	std::vector<ReducedRing> reduced_rings = simplifier.run();
+
+	return reduction_to_mpoly(in_mpoly, reduced_rings);
+}
+
+} // namespace dangdal